@@ -0,0 +1,208 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_admit.h"
+#include "gc_conn.h"
+#include "gc_stats.h"
+#include "gc_util.h"
+
+#define ADMIT_BUCKET_COUNT   4096 /* A power of two */
+#define ADMIT_EWMA_WEIGHT    0.125
+#define ADMIT_PROBE_INTERVAL 8    /* 1 in N misses still goes upstream */
+
+/* Token bucket of a client, an IPv4 address or an IPv6 /64 network.
+ * Buckets are direct mapped; a colliding client simply starts over
+ * with a full bucket. */
+struct gc_admit_bucket_t {
+    sa_family_t family;
+    unsigned long long key;     /* Address, or network of an IPv6 one */
+    double tokens;
+    unsigned long long usec;
+};
+
+extern int g_is_daemon;
+
+int gc_admit_init(struct gc_admit_t **admit) {
+    not_null(admit);
+
+    *admit = malloc(sizeof(struct gc_admit_t));
+    if (*admit == NULL) {
+        gc_loge("Cannot allocate memory for admission control");
+        return -1;
+    }
+    memset(*admit, 0, sizeof(struct gc_admit_t));
+    return 0;
+}
+
+/* Key of the bucket of a client. An IPv6 client is limited by its /64
+ * network, as a host may be given any address in it. */
+static int _bucket_key(const struct sockaddr *addr,
+                       unsigned long long *key) {
+    const unsigned char *bytes = NULL;
+    register size_t i = 0;
+
+    switch (addr->sa_family) {
+        case AF_INET: {
+            *key = ntohl(((const struct sockaddr_in *) addr)->sin_addr.s_addr);
+            break;
+        }
+        case AF_INET6: {
+            bytes = ((const struct sockaddr_in6 *) addr)->sin6_addr.s6_addr;
+            *key = 0;
+            for (i = 0; i < 8; ++i) {
+                *key = (*key << 8) | bytes[i];
+            }
+            break;
+        }
+        default: {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Returns 0 if the client may go on, or the code to answer it with.
+ * Clients of a Unix domain socket are local and not limited. */
+int gc_admit_client(struct gc_admit_t *admit, int fd) {
+    not_null(admit);
+
+    struct sockaddr_storage addr;
+
+    if (admit->rate <= 0) {
+        return 0;
+    }
+    if (gc_peer_addr(fd, &addr) != 0) {
+        return 0;
+    }
+    return gc_admit_addr(admit, (struct sockaddr *) &addr);
+}
+
+/* The same for a client known by its address, as datagrams are */
+int gc_admit_addr(struct gc_admit_t *admit, const struct sockaddr *addr) {
+    not_null(admit);
+    not_null(addr);
+
+    struct gc_admit_bucket_t *bucket = NULL;
+    unsigned long long key = 0;
+    unsigned long long now = 0;
+
+    if (admit->rate <= 0 || _bucket_key(addr, &key) != 0) {
+        return 0;
+    }
+
+    if (admit->buckets == NULL) {
+        admit->buckets = calloc(ADMIT_BUCKET_COUNT,
+                                sizeof(struct gc_admit_bucket_t));
+        if (admit->buckets == NULL) {
+            gc_loge("Cannot allocate memory for rate limits");
+            admit->rate = 0;
+            return 0;
+        }
+    }
+
+    now = gc_now_usec();
+    bucket = &(admit->buckets[((key * 0x9e3779b97f4a7c15ULL) >> 32)
+                              & (ADMIT_BUCKET_COUNT - 1)]);
+    if (bucket->family != addr->sa_family || bucket->key != key
+        || !bucket->usec) {
+        bucket->family = addr->sa_family;
+        bucket->key = key;
+        bucket->tokens = admit->burst;
+    }
+    else {
+        bucket->tokens += admit->rate * (now - bucket->usec) / 1000000.0;
+        if (bucket->tokens > admit->burst) {
+            bucket->tokens = admit->burst;
+        }
+    }
+    bucket->usec = now;
+
+    if (bucket->tokens < 1) {
+        ++admit->limited;
+        gc_stat_inc(GC_STAT_RATE_LIMITED);
+        return GC_CODE_RATE_LIMITED;
+    }
+    bucket->tokens -= 1;
+    return 0;
+}
+
+/* Decide whether a cache miss may go upstream. */
+int gc_admit_miss(struct gc_admit_t *admit, size_t upstream_count) {
+    not_null(admit);
+
+    if (admit->max_upstream && upstream_count >= admit->max_upstream) {
+        ++admit->busy;
+        gc_stat_inc(GC_STAT_BUSY);
+        return GC_CODE_BUSY;
+    }
+    /* While upstream is slow, only let a few misses through. They keep
+     * the average moving, so shedding stops once upstream recovers. */
+    if (admit->shed_msec && admit->upstream_msec > admit->shed_msec
+        && admit->probe++ % ADMIT_PROBE_INTERVAL) {
+        ++admit->shed;
+        gc_stat_inc(GC_STAT_SHED);
+        return GC_CODE_BUSY;
+    }
+    return 0;
+}
+
+void gc_admit_upstream_done(struct gc_admit_t *admit, unsigned long msec) {
+    not_null_void(admit);
+
+    admit->upstream_msec += ADMIT_EWMA_WEIGHT * (msec - admit->upstream_msec);
+}
+
+/* Log what has been turned away, at most once a second. */
+void gc_admit_report(struct gc_admit_t *admit) {
+    not_null_void(admit);
+
+    unsigned long long now = 0;
+
+    if (!admit->busy && !admit->limited && !admit->shed) {
+        return;
+    }
+    now = gc_now_usec();
+    if (now - admit->report_usec < 1000000) {
+        return;
+    }
+    admit->report_usec = now;
+
+    gc_loge("Overloaded: %lu busy, %lu rate limited, %lu shed"
+            " (upstream %.0f ms)", admit->busy, admit->limited, admit->shed,
+            admit->upstream_msec);
+    admit->busy = 0;
+    admit->limited = 0;
+    admit->shed = 0;
+}
+
+int gc_admit_free(struct gc_admit_t *admit) {
+    not_null(admit);
+
+    safefree(admit->buckets);
+    safefree(admit);
+    return 0;
+}
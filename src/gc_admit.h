@@ -0,0 +1,52 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_ADMIT_H__
+#define __GC_ADMIT_H__
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+struct gc_admit_bucket_t;
+
+/* Admission control. Zero disables a limit. */
+struct gc_admit_t {
+    double rate;                /* Requests per second per client IP */
+    double burst;
+    unsigned int shed_msec;     /* Upstream latency that starts shedding */
+    size_t max_upstream;        /* Misses allowed upstream at once */
+    double upstream_msec;       /* Moving average of upstream latency */
+    unsigned long busy;         /* Counters since the last report */
+    unsigned long limited;
+    unsigned long shed;
+    unsigned long probe;
+    unsigned long long report_usec;
+    struct gc_admit_bucket_t *buckets;
+};
+
+int gc_admit_init(struct gc_admit_t **admit);
+int gc_admit_client(struct gc_admit_t *admit, int fd);
+int gc_admit_addr(struct gc_admit_t *admit, const struct sockaddr *addr);
+int gc_admit_miss(struct gc_admit_t *admit, size_t upstream_count);
+void gc_admit_upstream_done(struct gc_admit_t *admit, unsigned long msec);
+void gc_admit_report(struct gc_admit_t *admit);
+int gc_admit_free(struct gc_admit_t *admit);
+
+#endif
+
+
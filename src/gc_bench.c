@@ -0,0 +1,534 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+/* Microbenchmarks of the parts of the hot path which need no sockets.
+ * Built and run by "make bench". Each case prints one JSON object on a
+ * line of its own, so that runs of two builds can be compared. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <config.h>
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "gc_db.h"
+#include "gc_log.h"
+#include "gc_util.h"
+
+#define BENCH_MSEC          100 /* Least time of a round */
+#define BENCH_ROUNDS        5   /* The median round is reported */
+#define BENCH_KEY_MAX       512
+#define BENCH_LINE_SIZE     2048
+#define BENCH_COUNTERS      4
+
+struct bench_t;
+
+typedef void (*bench_func_t)(struct bench_t *bench, size_t ops);
+
+struct bench_t {
+    const char *name;
+    char params[128];           /* JSON members describing the case */
+    bench_func_t func;
+    size_t len;                 /* Bytes of the input */
+    char line[BENCH_LINE_SIZE];
+    struct gc_db_t *db;
+    size_t records;
+    size_t key_len;
+    size_t next;                /* Record the next operation is on */
+    struct gc_db_query_t query;
+    size_t sink;                /* Keeps results from being optimised out */
+};
+
+/* Counters of one round */
+struct bench_sample_t {
+    unsigned long long nsec;
+    size_t allocs;
+    size_t alloc_bytes;
+    unsigned long long counters[BENCH_COUNTERS];
+};
+
+int g_is_daemon = 0;
+
+static unsigned int gs_msec = BENCH_MSEC;
+static unsigned int gs_rounds = BENCH_ROUNDS;
+static const char *gs_filter = NULL;
+static int gs_perf_fd = -1;     /* Leader of the counter group, or -1 */
+static int gs_counted = 0;      /* Allocations are being counted */
+static size_t gs_allocs = 0;
+static size_t gs_alloc_bytes = 0;
+
+static const char *gs_counter_names[BENCH_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "cache_misses",
+    "branch_misses"
+};
+
+#ifdef __GLIBC__
+/* Allocations are counted by standing in for the allocator of glibc,
+ * which the database library and stdio go through as well. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    ++gs_allocs;
+    gs_alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    ++gs_allocs;
+    gs_alloc_bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    ++gs_allocs;
+    gs_alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+static void _count_allocs(void) {
+    gs_counted = 1;
+}
+#else
+static void _count_allocs(void) {
+}
+#endif
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+static int _perf_open(unsigned long long config, int group_fd) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(struct perf_event_attr));
+    attr.size = sizeof(struct perf_event_attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group_fd < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/* One group, so that the counters cover the same instructions. Left
+ * out if the kernel or perf_event_paranoid does not allow it. */
+static int _perf_init(void) {
+    static const unsigned long long configs[BENCH_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int i = 0;
+
+    gs_perf_fd = _perf_open(configs[0], -1);
+    if (gs_perf_fd < 0) {
+        fprintf(stderr, "Cannot open hardware counters: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    for (i = 1; i < BENCH_COUNTERS; ++i) {
+        if (_perf_open(configs[i], gs_perf_fd) < 0) {
+            fprintf(stderr, "Cannot open hardware counters: %s\n",
+                    strerror(errno));
+            close(gs_perf_fd);
+            gs_perf_fd = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void _perf_start(void) {
+    ioctl(gs_perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(gs_perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void _perf_stop(unsigned long long *counters) {
+    unsigned long long values[BENCH_COUNTERS + 1];
+
+    ioctl(gs_perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(gs_perf_fd, values, sizeof(values)) == sizeof(values)) {
+        memcpy(counters, values + 1, sizeof(values) - sizeof(values[0]));
+    }
+}
+#else
+static int _perf_init(void) {
+    fprintf(stderr, "Hardware counters are not supported\n");
+    return -1;
+}
+
+static void _perf_start(void) {
+}
+
+static void _perf_stop(unsigned long long *counters) {
+}
+#endif
+
+static void _round(struct bench_t *bench, size_t ops,
+                   struct bench_sample_t *sample) {
+    unsigned long long start = 0;
+
+    memset(sample, 0, sizeof(struct bench_sample_t));
+    gs_allocs = 0;
+    gs_alloc_bytes = 0;
+    if (gs_perf_fd >= 0) {
+        _perf_start();
+    }
+    start = gc_now_usec();
+    bench->func(bench, ops);
+    sample->nsec = (gc_now_usec() - start) * 1000;
+    if (gs_perf_fd >= 0) {
+        _perf_stop(sample->counters);
+    }
+    sample->allocs = gs_allocs;
+    sample->alloc_bytes = gs_alloc_bytes;
+}
+
+static int _by_nsec(const void *a, const void *b) {
+    const struct bench_sample_t *x = a;
+    const struct bench_sample_t *y = b;
+
+    return x->nsec < y->nsec ? -1 : x->nsec > y->nsec;
+}
+
+/* Find how many operations take gs_msec, then report the median of
+ * gs_rounds rounds of them. */
+static void _run(struct bench_t *bench) {
+    struct bench_sample_t samples[BENCH_ROUNDS * 4];
+    struct bench_sample_t *median = NULL;
+    size_t ops = 1;
+    unsigned int i = 0;
+
+    if (gs_filter && strstr(bench->name, gs_filter) == NULL) {
+        return;
+    }
+    for (;;) {
+        _round(bench, ops, &(samples[0]));
+        if (samples[0].nsec >= gs_msec * 1000000ULL) {
+            break;
+        }
+        ops = samples[0].nsec < gs_msec * 10000ULL
+              ? ops * 100 : ops * 2;
+    }
+    for (i = 0; i < gs_rounds; ++i) {
+        _round(bench, ops, &(samples[i]));
+    }
+    qsort(samples, gs_rounds, sizeof(struct bench_sample_t), _by_nsec);
+    median = &(samples[gs_rounds / 2]);
+
+    printf("{\"bench\":\"%s\",%s\"ops\":%lu,\"ns_per_op\":%.2f,"
+           "\"ns_per_op_min\":%.2f,\"ns_per_op_max\":%.2f",
+           bench->name, bench->params, (unsigned long) ops,
+           (double) median->nsec / ops, (double) samples[0].nsec / ops,
+           (double) samples[gs_rounds - 1].nsec / ops);
+    if (gs_counted) {
+        printf(",\"allocs_per_op\":%.3f,\"alloc_bytes_per_op\":%.1f",
+               (double) median->allocs / ops,
+               (double) median->alloc_bytes / ops);
+    }
+    if (gs_perf_fd >= 0) {
+        for (i = 0; i < BENCH_COUNTERS; ++i) {
+            printf(",\"%s_per_op\":%.2f", gs_counter_names[i],
+                   (double) median->counters[i] / ops);
+        }
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+/* A query of len URL-safe bytes, as clients send them */
+static void _make_query(char *buf, size_t len, size_t seed) {
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789.-";
+    size_t i = 0;
+
+    for (i = 0; i < len; ++i) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = chars[(seed >> 16) % (sizeof(chars) - 1)];
+    }
+    buf[len] = '\0';
+}
+
+static void _check_query(struct bench_t *bench, size_t ops) {
+    size_t i = 0;
+
+    for (i = 0; i < ops; ++i) {
+        bench->sink += gc_check_query(bench->line, bench->len);
+    }
+}
+
+/* The line ending is put back each time, as gc_chomp() takes it off */
+static void _chomp(struct bench_t *bench, size_t ops) {
+    size_t i = 0;
+
+    for (i = 0; i < ops; ++i) {
+        bench->line[bench->len] = '\r';
+        bench->sink += gc_chomp(bench->line, bench->len + 3);
+    }
+}
+
+static void _format_result(struct bench_t *bench, size_t ops) {
+    size_t i = 0;
+
+    for (i = 0; i < ops; ++i) {
+        bench->query.latitude += 0.000001;
+        bench->sink += gc_db_format_result(&(bench->query), bench->line,
+                                           BENCH_LINE_SIZE);
+    }
+}
+
+static void _parse_result(struct bench_t *bench, size_t ops) {
+    size_t i = 0;
+
+    for (i = 0; i < ops; ++i) {
+        bench->sink += gc_db_parse_result(bench->line, &(bench->query));
+    }
+}
+
+/* Keys of the records of a database case, which are all of key_len */
+static void _make_key(struct bench_t *bench, size_t n, char *buf) {
+    int len = snprintf(buf, BENCH_KEY_MAX, "%lu-", (unsigned long) n);
+
+    _make_query(buf + len, bench->key_len - len, n);
+}
+
+/* The next record in a pseudo-random walk over all of them */
+static size_t _next_record(struct bench_t *bench) {
+    bench->next = (bench->next * 1103515245 + 12345) & 0x7fffffff;
+    return bench->next % bench->records;
+}
+
+static void _db_get(struct bench_t *bench, size_t ops) {
+    char key[BENCH_KEY_MAX + 1];
+    struct gc_db_query_t query;
+    size_t i = 0;
+
+    for (i = 0; i < ops; ++i) {
+        _make_key(bench, _next_record(bench), key);
+        bench->sink += gc_db_get(bench->db, key, &query) == 0;
+    }
+}
+
+/* Overwrites records with new results, as refreshes do */
+static void _db_put(struct bench_t *bench, size_t ops) {
+    char key[BENCH_KEY_MAX + 1];
+    size_t i = 0;
+
+    for (i = 0; i < ops; ++i) {
+        _make_key(bench, _next_record(bench), key);
+        bench->query.latitude += 0.000001;
+        bench->sink += gc_db_put(bench->db, key, &(bench->query)) == 0;
+    }
+}
+
+/* Key generation alone, to be taken off the database cases */
+static void _db_keys(struct bench_t *bench, size_t ops) {
+    char key[BENCH_KEY_MAX + 1];
+    size_t i = 0;
+
+    for (i = 0; i < ops; ++i) {
+        _make_key(bench, _next_record(bench), key);
+        bench->sink += key[0];
+    }
+}
+
+static void _run_strings(void) {
+    static const size_t lens[] = { 16, 64, 256, 1024 };
+    struct bench_t bench;
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i) {
+        memset(&bench, 0, sizeof(struct bench_t));
+        bench.len = lens[i];
+        snprintf(bench.params, sizeof(bench.params), "\"len\":%lu,",
+                 (unsigned long) lens[i]);
+        _make_query(bench.line, bench.len, i);
+
+        bench.name = "check_query";
+        bench.func = _check_query;
+        _run(&bench);
+
+        memcpy(bench.line + bench.len, "\r\n", 3);
+        bench.name = "chomp";
+        bench.func = _chomp;
+        _run(&bench);
+    }
+
+    memset(&bench, 0, sizeof(struct bench_t));
+    bench.query.code = 200;
+    bench.query.accuracy = '8';
+    bench.query.latitude = 25.033964;
+    bench.query.longitude = 121.564468;
+    bench.name = "format_result";
+    bench.func = _format_result;
+    _run(&bench);
+
+    snprintf(bench.line, BENCH_LINE_SIZE, "200,8,25.033964,121.564468\r\n");
+    bench.name = "parse_result";
+    bench.func = _parse_result;
+    _run(&bench);
+}
+
+static int _run_db(const char *dir, size_t records, size_t key_len) {
+    char filename[512];
+    char key[BENCH_KEY_MAX + 1];
+    struct bench_t bench;
+    size_t i = 0;
+
+    memset(&bench, 0, sizeof(struct bench_t));
+    bench.records = records;
+    bench.key_len = key_len;
+    snprintf(bench.params, sizeof(bench.params),
+             "\"records\":%lu,\"key_len\":%lu,",
+             (unsigned long) records, (unsigned long) key_len);
+    if (gs_filter && strstr("db_get db_put db_keys", gs_filter) == NULL) {
+        return 0;
+    }
+
+    snprintf(filename, sizeof(filename), "%s/bench-%lu-%lu.db", dir,
+             (unsigned long) records, (unsigned long) key_len);
+    unlink(filename);
+    if (gc_db_init(&(bench.db)) != 0 || gc_db_load(bench.db, filename) != 0) {
+        fprintf(stderr, "Cannot open database '%s'\n", filename);
+        return -1;
+    }
+    /* Every record has a result of its own */
+    bench.query.code = 200;
+    bench.query.accuracy = '8';
+    bench.query.longitude = 121.564468;
+    for (i = 0; i < records; ++i) {
+        _make_key(&bench, i, key);
+        bench.query.latitude = 25.0 + i * 0.0001;
+        if (gc_db_put(bench.db, key, &(bench.query)) != 0) {
+            fprintf(stderr, "Cannot fill database '%s'\n", filename);
+            gc_db_free(bench.db);
+            unlink(filename);
+            return -1;
+        }
+    }
+
+    bench.name = "db_get";
+    bench.func = _db_get;
+    _run(&bench);
+    bench.name = "db_put";
+    bench.func = _db_put;
+    _run(&bench);
+    bench.name = "db_keys";
+    bench.func = _db_keys;
+    _run(&bench);
+
+    gc_db_free(bench.db);
+    unlink(filename);
+    return 0;
+}
+
+static void _usage(void) {
+    fprintf(stderr,
+            "gc_bench\n"
+            "\n"
+            "    -t msec least time of a round (Default: 100)\n"
+            "    -r rounds, of which the median is reported (Default: 5)\n"
+            "    -f name run only the cases whose name has it\n"
+            "    -d directory for the databases (Default: /tmp)\n"
+            "    -s records[,records...] database sizes\n"
+            "       (Default: 1000,10000,100000)\n"
+            "    -c (read hardware counters with perf_event_open)\n"
+            "    -h (show help)\n"
+            "\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t key_lens[] = { 16, 64, 256 };
+    size_t sizes[8] = { 1000, 10000, 100000 };
+    size_t size_count = 3;
+    const char *dir = "/tmp";
+    char *next = NULL;
+    size_t i = 0;
+    size_t j = 0;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "t:r:f:d:s:ch")) != -1) {
+        switch (opt) {
+            case 't': {
+                gs_msec = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 'r': {
+                gs_rounds = strtoul(optarg, NULL, 10);
+                if (!gs_rounds || gs_rounds > BENCH_ROUNDS * 4) {
+                    fprintf(stderr, "Bad number of rounds '%s'\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'f': {
+                gs_filter = optarg;
+                break;
+            }
+            case 'd': {
+                dir = optarg;
+                break;
+            }
+            case 's': {
+                size_count = 0;
+                next = optarg;
+                while (*next && size_count < 8) {
+                    sizes[size_count++] = strtoul(next, &next, 10);
+                    if (*next == ',') {
+                        ++next;
+                    }
+                }
+                break;
+            }
+            case 'c': {
+                _perf_init();
+                break;
+            }
+            default: {
+                _usage();
+                exit(opt == 'h' ? 0 : -1);
+            }
+        }
+    }
+
+    _count_allocs();
+    _run_strings();
+    for (i = 0; i < size_count; ++i) {
+        for (j = 0; j < sizeof(key_lens) / sizeof(key_lens[0]); ++j) {
+            if (sizes[i] && _run_db(dir, sizes[i], key_lens[j]) != 0) {
+                exit(-1);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_bloom.h"
+#include "gc_util.h"
+
+/* About 1% false positives at capacity */
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES       7
+
+extern int g_is_daemon;
+
+/* 64-bit FNV-1a with a final mix, split into the two hashes the bit
+ * positions are derived from. */
+static unsigned long long _hash(const char *key, size_t key_len) {
+    register unsigned long long h = 14695981039346656037ULL;
+    register size_t i = 0;
+
+    for (i = 0; i < key_len; ++i) {
+        h ^= (unsigned char) key[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+int gc_bloom_init(struct gc_bloom_t **bloom, size_t capacity) {
+    not_null(bloom);
+
+    size_t bits = 64;
+
+    while (bits < capacity * BLOOM_BITS_PER_KEY) {
+        bits <<= 1;
+    }
+
+    *bloom = malloc(sizeof(struct gc_bloom_t));
+    if (*bloom == NULL) {
+        gc_loge("Cannot allocate memory for filter");
+        return -1;
+    }
+    (*bloom)->map = calloc(bits / 8, 1);
+    if ((*bloom)->map == NULL) {
+        gc_loge("Cannot allocate memory for filter");
+        safefree(*bloom);
+        return -1;
+    }
+    (*bloom)->bits = bits;
+    (*bloom)->capacity = capacity;
+    (*bloom)->count = 0;
+    return 0;
+}
+
+/* A key all of whose bits are set already is not counted again. */
+void gc_bloom_add(struct gc_bloom_t *bloom, const char *key, size_t key_len) {
+    not_null_void(bloom);
+    not_null_void(key);
+
+    unsigned long long h = _hash(key, key_len);
+    unsigned int h1 = (unsigned int) h;
+    unsigned int h2 = (unsigned int) (h >> 32) | 1;
+    size_t bit = 0;
+    int is_new = 0;
+    register int i = 0;
+
+    for (i = 0; i < BLOOM_HASHES; ++i) {
+        bit = (h1 + (size_t) i * h2) & (bloom->bits - 1);
+        if (!(bloom->map[bit >> 3] & (1 << (bit & 7)))) {
+            bloom->map[bit >> 3] |= 1 << (bit & 7);
+            is_new = 1;
+        }
+    }
+    if (is_new) {
+        ++bloom->count;
+    }
+}
+
+/* 0 if the key has surely not been added. */
+int gc_bloom_check(struct gc_bloom_t *bloom, const char *key,
+                   size_t key_len) {
+    not_null(bloom);
+    not_null(key);
+
+    unsigned long long h = _hash(key, key_len);
+    unsigned int h1 = (unsigned int) h;
+    unsigned int h2 = (unsigned int) (h >> 32) | 1;
+    size_t bit = 0;
+    register int i = 0;
+
+    for (i = 0; i < BLOOM_HASHES; ++i) {
+        bit = (h1 + (size_t) i * h2) & (bloom->bits - 1);
+        if (!(bloom->map[bit >> 3] & (1 << (bit & 7)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int gc_bloom_free(struct gc_bloom_t *bloom) {
+    not_null(bloom);
+
+    safefree(bloom->map);
+    safefree(bloom);
+    return 0;
+}
@@ -0,0 +1,39 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_BLOOM_H__
+#define __GC_BLOOM_H__
+
+#include <stddef.h>
+
+/* Bloom filter over byte strings. A key which has been added is always
+ * reported as maybe present; others are too with a small probability. */
+struct gc_bloom_t {
+    size_t bits;                /* Size of the map, a power of two */
+    size_t capacity;            /* Keys the map is sized for */
+    size_t count;               /* Keys added */
+    unsigned char *map;
+};
+
+int gc_bloom_init(struct gc_bloom_t **bloom, size_t capacity);
+void gc_bloom_add(struct gc_bloom_t *bloom, const char *key, size_t key_len);
+int gc_bloom_check(struct gc_bloom_t *bloom, const char *key,
+                   size_t key_len);
+int gc_bloom_free(struct gc_bloom_t *bloom);
+
+#endif
@@ -0,0 +1,230 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_cache.h"
+#include "gc_util.h"
+
+struct gc_cache_t {
+    size_t size;                /* Maximum number of entries */
+    size_t count;
+    size_t mask;
+    struct gc_cache_entry_t **buckets;
+    struct gc_cache_entry_t *head; /* Most recently used */
+    struct gc_cache_entry_t *tail; /* Least recently used */
+};
+
+extern int g_is_daemon;
+
+static void _lru_remove(struct gc_cache_t *cache,
+                        struct gc_cache_entry_t *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    }
+    else {
+        cache->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    }
+    else {
+        cache->tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void _lru_push(struct gc_cache_t *cache,
+                      struct gc_cache_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = entry;
+    }
+    cache->head = entry;
+    if (!cache->tail) {
+        cache->tail = entry;
+    }
+}
+
+/* Take an entry out of the table. It is freed once the last holder
+ * releases it. */
+static void _unlink(struct gc_cache_t *cache, struct gc_cache_entry_t *entry) {
+    struct gc_cache_entry_t **pp = &(cache->buckets[entry->hash & cache->mask]);
+
+    while (*pp && *pp != entry) {
+        pp = &((*pp)->hnext);
+    }
+    if (*pp) {
+        *pp = entry->hnext;
+    }
+    entry->hnext = NULL;
+    _lru_remove(cache, entry);
+    entry->is_linked = 0;
+    --cache->count;
+
+    if (!entry->refcount) {
+        free(entry);
+    }
+}
+
+int gc_cache_init(struct gc_cache_t **cache, size_t size) {
+    not_null(cache);
+
+    size_t nbuckets = 16;
+
+    if (!size) {
+        return -1;
+    }
+    while (nbuckets < size) {
+        nbuckets <<= 1;
+    }
+
+    *cache = malloc(sizeof(struct gc_cache_t));
+    if (*cache == NULL) {
+        gc_loge("Cannot allocate memory for cache");
+        return -1;
+    }
+    memset(*cache, 0, sizeof(struct gc_cache_t));
+
+    (*cache)->buckets = calloc(nbuckets, sizeof(struct gc_cache_entry_t *));
+    if ((*cache)->buckets == NULL) {
+        gc_loge("Cannot allocate memory for cache buckets");
+        safefree(*cache);
+        return -1;
+    }
+    (*cache)->size = size;
+    (*cache)->mask = nbuckets - 1;
+
+    return 0;
+}
+
+int gc_cache_get(struct gc_cache_t *cache, const char *location,
+                 struct gc_cache_entry_t **entry) {
+    not_null(cache);
+    not_null(location);
+    not_null(entry);
+
+    unsigned int hash = gc_hash(location);
+    struct gc_cache_entry_t *p = cache->buckets[hash & cache->mask];
+
+    for (; p; p = p->hnext) {
+        if (p->hash == hash && strcmp(p->location, location) == 0) {
+            if (p != cache->head) {
+                _lru_remove(cache, p);
+                _lru_push(cache, p);
+            }
+            ++p->refcount;
+            *entry = p;
+            return 0;
+        }
+    }
+
+    *entry = NULL;
+    return -1;
+}
+
+int gc_cache_put(struct gc_cache_t *cache, const char *location,
+                 const struct gc_db_query_t *query,
+                 const char *wire, size_t wire_len,
+                 struct gc_cache_entry_t **entry) {
+    not_null(cache);
+    not_null(location);
+    not_null(query);
+    not_null(wire);
+
+    size_t location_len = strlen(location);
+    unsigned int hash = gc_hash(location);
+    struct gc_cache_entry_t *p = NULL;
+    struct gc_cache_entry_t **bucket = &(cache->buckets[hash & cache->mask]);
+
+    for (p = *bucket; p; p = p->hnext) {
+        if (p->hash == hash && strcmp(p->location, location) == 0) {
+            _unlink(cache, p);
+            break;
+        }
+    }
+
+    /* Location and wire bytes share the allocation with the entry. */
+    p = malloc(sizeof(struct gc_cache_entry_t) + location_len + wire_len + 1);
+    if (p == NULL) {
+        gc_loge("Cannot allocate memory for cache entry");
+        return -1;
+    }
+    memset(p, 0, sizeof(struct gc_cache_entry_t));
+    memcpy(p->location, location, location_len + 1);
+    memcpy(p->location + location_len + 1, wire, wire_len);
+    p->wire = p->location + location_len + 1;
+    p->wire_len = wire_len;
+    p->query = *query;
+    p->hash = hash;
+    p->is_linked = 1;
+
+    p->hnext = *bucket;
+    *bucket = p;
+    _lru_push(cache, p);
+    ++cache->count;
+
+    while (cache->count > cache->size && cache->tail) {
+        _unlink(cache, cache->tail);
+    }
+
+    if (entry) {
+        ++p->refcount;
+        *entry = p;
+    }
+    return 0;
+}
+
+void gc_cache_release(struct gc_cache_t *cache,
+                      struct gc_cache_entry_t *entry) {
+    not_null_void(cache);
+    not_null_void(entry);
+
+    if (entry->refcount) {
+        --entry->refcount;
+    }
+    if (!entry->refcount && !entry->is_linked) {
+        free(entry);
+    }
+}
+
+size_t gc_cache_count(struct gc_cache_t *cache) {
+    return cache ? cache->count : 0;
+}
+
+int gc_cache_free(struct gc_cache_t *cache) {
+    not_null(cache);
+
+    struct gc_cache_entry_t *p = NULL;
+
+    /* Entries still held by connections are left to their holders. */
+    while ((p = cache->head) != NULL) {
+        _unlink(cache, p);
+    }
+    safefree(cache->buckets);
+    safefree(cache);
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_CACHE_H__
+#define __GC_CACHE_H__
+
+#include <stddef.h>
+
+#include "gc_db.h"
+
+struct gc_cache_t;
+
+/* Entries are reference counted. A connection holding an entry may point
+ * its write at 'wire' until it releases the entry, even if the entry has
+ * been evicted or replaced in the meantime. */
+struct gc_cache_entry_t {
+    struct gc_cache_entry_t *hnext; /* hash chain */
+    struct gc_cache_entry_t *prev;  /* LRU list */
+    struct gc_cache_entry_t *next;
+    unsigned int hash;
+    unsigned int refcount;
+    int is_linked;
+    struct gc_db_query_t query;     /* Structured result */
+    size_t wire_len;
+    const char *wire;               /* Serialised response */
+    char location[1];
+};
+
+int gc_cache_init(struct gc_cache_t **cache, size_t size);
+int gc_cache_get(struct gc_cache_t *cache, const char *location,
+                 struct gc_cache_entry_t **entry);
+int gc_cache_put(struct gc_cache_t *cache, const char *location,
+                 const struct gc_db_query_t *query,
+                 const char *wire, size_t wire_len,
+                 struct gc_cache_entry_t **entry);
+void gc_cache_release(struct gc_cache_t *cache,
+                      struct gc_cache_entry_t *entry);
+size_t gc_cache_count(struct gc_cache_t *cache);
+int gc_cache_free(struct gc_cache_t *cache);
+
+#endif
+
+
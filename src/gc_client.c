@@ -0,0 +1,752 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "gc_client.h"
+#include "gc_debug.h"
+#include "gc_util.h"
+
+#define CLIENT_REQUEST        "@get " /* Asks the server to keep the socket */
+#define CLIENT_RESULT_FMT     "%d,%c,%lf,%lf"
+#define CLIENT_POOL_SIZE      4
+#define CLIENT_POOL_MAX       64
+#define CLIENT_DEPTH          64
+#define CLIENT_TIMEOUT_MSEC   5000
+#define CLIENT_RETRIES        2
+#define CLIENT_DOWN_MSEC      1000
+#define CLIENT_RD_SIZE        1024
+#define CLIENT_IOV_MAX        64
+#define CLIENT_HOST_SIZE      256
+
+struct _query_t {
+    struct _query_t *next;
+    void (*func)(void *arg, const char *query,
+                 const struct gc_client_result_t *result);
+    void *arg;
+    unsigned int tries;         /* Times sent, in part at least */
+    char *query;                /* As submitted */
+    size_t line_len;
+    char line[1];               /* Request line sent for it */
+};
+
+struct _server_t {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    unsigned long long down_until; /* Not to be connected to before */
+};
+
+struct _conn_t {
+    int fd;
+    int connecting;
+    size_t server;
+    struct _query_t *head;      /* Sent or to send, answered in order */
+    struct _query_t *tail;
+    struct _query_t *unsent;    /* First query not written in full */
+    size_t wr_pos;              /* Bytes of it written */
+    size_t count;
+    unsigned long long deadline; /* An answer is due by then */
+    char rd_buf[CLIENT_RD_SIZE];
+    size_t rd_len;
+};
+
+struct gc_client_internal_t {
+    size_t server_count;
+    struct _server_t servers[GC_CLIENT_SERVER_MAX];
+    size_t next_server;
+    struct _conn_t conns[CLIENT_POOL_MAX];
+    struct _query_t *todo_head; /* Not given to a connection yet */
+    struct _query_t *todo_tail;
+    size_t pending;             /* Submitted and not answered */
+};
+
+struct _wait_t {
+    struct gc_client_result_t *result;
+    int done;
+};
+
+static unsigned long long _now_msec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int _add_server(struct gc_client_internal_t *internal,
+                       const char *spec) {
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    struct _server_t *server = NULL;
+    char host[CLIENT_HOST_SIZE];
+    char port[16];
+    char *colon = NULL;
+    int ret = 0;
+
+    if (internal->server_count >= GC_CLIENT_SERVER_MAX) {
+        gc_error("Too many geocache servers");
+        return -1;
+    }
+    snprintf(host, CLIENT_HOST_SIZE, "%s", spec);
+    snprintf(port, sizeof(port), "%d", GC_CLIENT_PORT);
+    colon = strrchr(host, ':');
+    if (colon && strchr(host, ':') == colon) {
+        *colon = '\0';
+        snprintf(port, sizeof(port), "%s", colon + 1);
+    }
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    ret = getaddrinfo(host, port, &hints, &res);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot resolve geocache server '%s': %s\n",
+                spec, gai_strerror(ret));
+        return -1;
+    }
+    server = &(internal->servers[internal->server_count++]);
+    memcpy(&(server->addr), res->ai_addr, res->ai_addrlen);
+    server->addr_len = res->ai_addrlen;
+    server->down_until = 0;
+    freeaddrinfo(res);
+    return 0;
+}
+
+int gc_client_init(struct gc_client_t **client, const char *servers) {
+    not_null(client);
+    not_null(servers);
+
+    struct gc_client_internal_t *internal = NULL;
+    char *specs = NULL;
+    char *spec = NULL;
+    char *save = NULL;
+    register size_t i = 0;
+
+    *client = malloc(sizeof(struct gc_client_t));
+    if (*client == NULL) {
+        return -1;
+    }
+    internal = malloc(sizeof(struct gc_client_internal_t));
+    specs = strdup(servers);
+    if (internal == NULL || specs == NULL) {
+        safefree(internal);
+        safefree(specs);
+        safefree(*client);
+        return -1;
+    }
+    memset(internal, 0, sizeof(struct gc_client_internal_t));
+    for (i = 0; i < CLIENT_POOL_MAX; ++i) {
+        internal->conns[i].fd = -1;
+    }
+
+    for (spec = strtok_r(specs, ", ", &save); spec;
+         spec = strtok_r(NULL, ", ", &save)) {
+        if (_add_server(internal, spec) != 0) {
+            break;
+        }
+    }
+    safefree(specs);
+    if (spec || !internal->server_count) {
+        safefree(internal);
+        safefree(*client);
+        return -1;
+    }
+
+    (*client)->pool_size = CLIENT_POOL_SIZE;
+    (*client)->depth = CLIENT_DEPTH;
+    (*client)->timeout_msec = CLIENT_TIMEOUT_MSEC;
+    (*client)->retries = CLIENT_RETRIES;
+    (*client)->down_msec = CLIENT_DOWN_MSEC;
+    (*client)->internal = internal;
+    return 0;
+}
+
+/* The request line for query, made the way GeoCache::Client makes it
+ * so that both hit the same keys: white space squeezed, lower case and
+ * URI-escaped. Returns its length, 0 for an empty query. */
+static size_t _make_line(const char *query, char *line) {
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *p = (const unsigned char *) query;
+    size_t len = sizeof(CLIENT_REQUEST) - 1;
+    int space = 0;
+
+    memcpy(line, CLIENT_REQUEST, len);
+    while (isspace(*p)) {
+        ++p;
+    }
+    for (; *p; ++p) {
+        if (isspace(*p)) {
+            space = 1;
+            continue;
+        }
+        if (space) {
+            memcpy(line + len, "%20", 3);
+            len += 3;
+            space = 0;
+        }
+        if (isalnum(*p) || strchr("-_.~", *p)) {
+            line[len++] = tolower(*p);
+        }
+        else {
+            line[len++] = '%';
+            line[len++] = hex[*p >> 4];
+            line[len++] = hex[*p & 0xf];
+        }
+    }
+    if (len == sizeof(CLIENT_REQUEST) - 1) {
+        return 0;
+    }
+    line[len++] = '\n';
+    line[len] = '\0';
+    return len;
+}
+
+int gc_client_submit(struct gc_client_t *client, const char *query,
+                     void (*func)(void *arg, const char *query,
+                                  const struct gc_client_result_t *result),
+                     void *arg) {
+    not_null(client);
+    not_null(query);
+    not_null(func);
+
+    struct gc_client_internal_t *internal = client->internal;
+    struct _query_t *q = NULL;
+    size_t len = strlen(query);
+
+    q = malloc(sizeof(struct _query_t) + sizeof(CLIENT_REQUEST) + len * 3
+               + len + 2);
+    if (q == NULL) {
+        return -1;
+    }
+    q->line_len = _make_line(query, q->line);
+    if (!q->line_len) {
+        safefree(q);
+        return -1;
+    }
+    q->query = q->line + q->line_len + 1;
+    memcpy(q->query, query, len + 1);
+    q->next = NULL;
+    q->func = func;
+    q->arg = arg;
+    q->tries = 0;
+
+    if (internal->todo_tail) {
+        internal->todo_tail->next = q;
+    }
+    else {
+        internal->todo_head = q;
+    }
+    internal->todo_tail = q;
+    ++internal->pending;
+    return 0;
+}
+
+static void _complete(struct gc_client_t *client, struct _query_t *q,
+                      const struct gc_client_result_t *result) {
+    --client->internal->pending;
+    q->func(q->arg, q->query, result);
+    free(q);
+}
+
+static void _complete_error(struct gc_client_t *client,
+                            struct _query_t *q) {
+    struct gc_client_result_t result;
+
+    memset(&result, 0, sizeof(struct gc_client_result_t));
+    result.code = GC_CLIENT_ERROR;
+    result.accuracy = '0';
+    _complete(client, q, &result);
+}
+
+/* Give the queries of list, in order, another try before the others
+ * waiting, and the error result to those out of tries. */
+static void _retry(struct gc_client_t *client, struct _query_t *list) {
+    struct gc_client_internal_t *internal = client->internal;
+    struct _query_t *failed = NULL;
+    struct _query_t *head = NULL;
+    struct _query_t *tail = NULL;
+    struct _query_t *q = NULL;
+
+    while ((q = list) != NULL) {
+        list = q->next;
+        if (q->tries > client->retries) {
+            q->next = failed;
+            failed = q;
+            continue;
+        }
+        q->next = NULL;
+        if (tail) {
+            tail->next = q;
+        }
+        else {
+            head = q;
+        }
+        tail = q;
+    }
+    if (tail) {
+        tail->next = internal->todo_head;
+        internal->todo_head = head;
+        if (internal->todo_tail == NULL) {
+            internal->todo_tail = tail;
+        }
+    }
+    while ((q = failed) != NULL) {
+        failed = q->next;
+        _complete_error(client, q);
+    }
+}
+
+/* Drop the connection, putting its queries back. A server which failed
+ * is skipped for a while, unless no other one is left. */
+static void _close_conn(struct gc_client_t *client, struct _conn_t *conn,
+                        int down) {
+    struct _query_t *q = NULL;
+    int sent = 1;
+
+    /* A failed connect counts as a try of every query waiting on it */
+    if (conn->connecting) {
+        conn->unsent = NULL;
+    }
+    if (down) {
+        client->internal->servers[conn->server].down_until
+            = _now_msec() + client->down_msec;
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    conn->connecting = 0;
+    conn->rd_len = 0;
+
+    for (q = conn->head; q; q = q->next) {
+        if (q == conn->unsent) {
+            sent = conn->wr_pos > 0;
+        }
+        if (sent) {
+            ++q->tries;
+        }
+        if (q == conn->unsent) {
+            sent = 0;
+        }
+    }
+    q = conn->head;
+    conn->head = NULL;
+    conn->tail = NULL;
+    conn->unsent = NULL;
+    conn->wr_pos = 0;
+    conn->count = 0;
+    _retry(client, q);
+}
+
+/* The server next in turn which has not failed lately, or the one
+ * which failed the longest time ago. */
+static size_t _choose_server(struct gc_client_internal_t *internal,
+                             unsigned long long now) {
+    size_t best = 0;
+    size_t s = 0;
+    register size_t i = 0;
+
+    for (i = 0; i < internal->server_count; ++i) {
+        s = (internal->next_server + i) % internal->server_count;
+        if (internal->servers[s].down_until <= now) {
+            internal->next_server = s + 1;
+            return s;
+        }
+        if (internal->servers[s].down_until
+            < internal->servers[best].down_until) {
+            best = s;
+        }
+    }
+    return best;
+}
+
+static int _connect(struct gc_client_t *client, struct _conn_t *conn,
+                    unsigned long long now) {
+    struct _server_t *server = NULL;
+    int one = 1;
+
+    conn->server = _choose_server(client->internal, now);
+    server = &(client->internal->servers[conn->server]);
+    conn->fd = socket(server->addr.ss_family, SOCK_STREAM, 0);
+    if (conn->fd < 0) {
+        return -1;
+    }
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn->connecting = 0;
+    conn->rd_len = 0;
+    conn->deadline = now + client->timeout_msec;
+    if (connect(conn->fd, (struct sockaddr *) &(server->addr),
+                server->addr_len) != 0) {
+        if (errno != EINPROGRESS) {
+            server->down_until = now + client->down_msec;
+            close(conn->fd);
+            conn->fd = -1;
+            return -1;
+        }
+        conn->connecting = 1;
+    }
+    return 0;
+}
+
+static int _server_up(struct gc_client_internal_t *internal,
+                      unsigned long long now) {
+    register size_t i = 0;
+
+    for (i = 0; i < internal->server_count; ++i) {
+        if (internal->servers[i].down_until <= now) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Connect to a server, trying the others if it refuses at once. */
+static int _open_conn(struct gc_client_t *client, struct _conn_t *conn) {
+    unsigned long long now = _now_msec();
+    register size_t i = 0;
+
+    for (i = 0; i < client->internal->server_count; ++i) {
+        if (_connect(client, conn, now) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Write as many of the queries not sent yet as the socket takes. */
+static int _flush(struct _conn_t *conn) {
+    struct iovec iov[CLIENT_IOV_MAX];
+    struct _query_t *q = conn->unsent;
+    size_t count = 0;
+    ssize_t ret = 0;
+
+    while (conn->unsent && !conn->connecting) {
+        for (q = conn->unsent, count = 0; q && count < CLIENT_IOV_MAX;
+             q = q->next, ++count) {
+            iov[count].iov_base = q->line + (count ? 0 : conn->wr_pos);
+            iov[count].iov_len = q->line_len - (count ? 0 : conn->wr_pos);
+        }
+        ret = writev(conn->fd, iov, count);
+        if (ret < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        while (conn->unsent
+               && (size_t) ret >= conn->unsent->line_len - conn->wr_pos) {
+            ret -= conn->unsent->line_len - conn->wr_pos;
+            conn->unsent = conn->unsent->next;
+            conn->wr_pos = 0;
+        }
+        if (conn->unsent) {
+            conn->wr_pos += ret;
+        }
+    }
+    return 0;
+}
+
+/* Hand waiting queries to connections with room for them, opening
+ * connections as needed. */
+static void _dispatch(struct gc_client_t *client) {
+    struct gc_client_internal_t *internal = client->internal;
+    struct _conn_t *conn = NULL;
+    struct _query_t *q = NULL;
+    size_t pool_size = GC_MIN(GC_MAX(client->pool_size, 1),
+                              CLIENT_POOL_MAX);
+    register size_t i = 0;
+
+    for (i = 0; i < pool_size && internal->todo_head; ++i) {
+        conn = &(internal->conns[i]);
+        if (conn->count >= GC_MAX(client->depth, 1)) {
+            continue;
+        }
+        if (conn->fd < 0 && !_server_up(internal, _now_msec())) {
+            break;              /* Tried again once one is due */
+        }
+        if (conn->fd < 0 && _open_conn(client, conn) != 0) {
+            /* Every waiting query pays a try, so that none waits
+             * forever while no server can be reached. */
+            for (q = internal->todo_head; q; q = q->next) {
+                ++q->tries;
+            }
+            q = internal->todo_head;
+            internal->todo_head = NULL;
+            internal->todo_tail = NULL;
+            _retry(client, q);
+            break;
+        }
+        if (!conn->count) {
+            conn->deadline = _now_msec() + client->timeout_msec;
+        }
+        while (internal->todo_head && conn->count < GC_MAX(client->depth, 1)) {
+            q = internal->todo_head;
+            internal->todo_head = q->next;
+            if (internal->todo_head == NULL) {
+                internal->todo_tail = NULL;
+            }
+            q->next = NULL;
+            if (conn->tail) {
+                conn->tail->next = q;
+            }
+            else {
+                conn->head = q;
+            }
+            conn->tail = q;
+            if (conn->unsent == NULL) {
+                conn->unsent = q;
+                conn->wr_pos = 0;
+            }
+            ++conn->count;
+        }
+        if (_flush(conn) != 0) {
+            _close_conn(client, conn, 1);
+        }
+    }
+}
+
+/* Answer the queries whose result lines have arrived. Returns -1 when
+ * the connection is to be dropped. */
+static int _read_conn(struct gc_client_t *client, struct _conn_t *conn) {
+    struct gc_client_result_t result;
+    struct _query_t *q = NULL;
+    char *line = NULL;
+    char *end = NULL;
+    ssize_t ret = 0;
+
+    ret = read(conn->fd, conn->rd_buf + conn->rd_len,
+               CLIENT_RD_SIZE - conn->rd_len - 1);
+    if (ret < 0) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    if (ret == 0) {
+        return -1;
+    }
+    conn->rd_len += ret;
+    conn->rd_buf[conn->rd_len] = '\0';
+
+    line = conn->rd_buf;
+    while ((end = strchr(line, '\n')) != NULL) {
+        *end = '\0';
+        q = conn->head;
+        if (q == NULL || q == conn->unsent) {
+            return -1;          /* Not asked for */
+        }
+        memset(&result, 0, sizeof(struct gc_client_result_t));
+        if (sscanf(line, CLIENT_RESULT_FMT, &(result.code),
+                   &(result.accuracy), &(result.latitude),
+                   &(result.longitude)) != 4) {
+            return -1;
+        }
+        conn->head = q->next;
+        if (conn->head == NULL) {
+            conn->tail = NULL;
+        }
+        --conn->count;
+        conn->deadline = _now_msec() + client->timeout_msec;
+        _complete(client, q, &result);
+        line = end + 1;
+    }
+    conn->rd_len -= line - conn->rd_buf;
+    memmove(conn->rd_buf, line, conn->rd_len);
+    if (conn->rd_len == CLIENT_RD_SIZE - 1) {
+        return -1;              /* Longer than any result */
+    }
+    return 0;
+}
+
+static void _process(struct gc_client_t *client, struct _conn_t *conn,
+                     short revents) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (conn->connecting) {
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0
+            || err) {
+            _close_conn(client, conn, 1);
+            return;
+        }
+        conn->connecting = 0;
+    }
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (_read_conn(client, conn) != 0) {
+            /* A server closes kept connections idle for long; only
+             * one failing to connect or to answer is taken as down. */
+            _close_conn(client, conn, revents & POLLERR);
+            return;
+        }
+    }
+    if (_flush(conn) != 0) {
+        _close_conn(client, conn, 1);
+    }
+}
+
+size_t gc_client_poll(struct gc_client_t *client, int timeout_msec) {
+    if (client == NULL) {
+        return 0;
+    }
+
+    struct gc_client_internal_t *internal = client->internal;
+    struct pollfd fds[CLIENT_POOL_MAX];
+    struct _conn_t *conns[CLIENT_POOL_MAX];
+    struct _conn_t *conn = NULL;
+    unsigned long long now = 0;
+    unsigned long long until = 0;
+    size_t count = 0;
+    int wait = timeout_msec;
+    int ret = 0;
+    register size_t i = 0;
+
+    _dispatch(client);
+    if (!internal->pending) {
+        return 0;
+    }
+    now = _now_msec();
+    until = timeout_msec < 0 ? 0 : now + timeout_msec;
+    for (i = 0; i < CLIENT_POOL_MAX; ++i) {
+        conn = &(internal->conns[i]);
+        if (conn->fd < 0) {
+            continue;
+        }
+        fds[count].fd = conn->fd;
+        fds[count].events = POLLIN;
+        if (conn->connecting || conn->unsent) {
+            fds[count].events |= POLLOUT;
+        }
+        fds[count].revents = 0;
+        conns[count++] = conn;
+        if ((conn->count || conn->connecting)
+            && (!until || conn->deadline < until)) {
+            until = conn->deadline;
+        }
+    }
+    if (!count && internal->todo_head) {
+        /* No server can be reached; wait for one to be tried again */
+        for (i = 0; i < internal->server_count; ++i) {
+            if (!until || internal->servers[i].down_until < until) {
+                until = internal->servers[i].down_until;
+            }
+        }
+    }
+    if (until) {
+        wait = until > now ? (int) (until - now) : 0;
+    }
+    else if (!count) {
+        return internal->pending;
+    }
+
+    ret = poll(fds, count, wait);
+    if (ret < 0 && errno != EINTR) {
+        return internal->pending;
+    }
+    for (i = 0; ret > 0 && i < count; ++i) {
+        if (fds[i].revents) {
+            _process(client, conns[i], fds[i].revents);
+        }
+    }
+
+    now = _now_msec();
+    for (i = 0; i < CLIENT_POOL_MAX; ++i) {
+        conn = &(internal->conns[i]);
+        if (conn->fd >= 0 && (conn->count || conn->connecting)
+            && now >= conn->deadline) {
+            _close_conn(client, conn, 1);
+        }
+    }
+    _dispatch(client);
+    return internal->pending;
+}
+
+int gc_client_wait(struct gc_client_t *client) {
+    not_null(client);
+
+    while (gc_client_poll(client, -1) > 0) {
+    }
+    return 0;
+}
+
+size_t gc_client_pending(struct gc_client_t *client) {
+    return client ? client->internal->pending : 0;
+}
+
+static void _got_result(void *arg, const char *query,
+                        const struct gc_client_result_t *result) {
+    struct _wait_t *w = arg;
+
+    *(w->result) = *result;
+    w->done = 1;
+}
+
+/* Returns -1 if no server answered; result holds GC_CLIENT_ERROR then.
+ * Queries submitted before are served meanwhile. */
+int gc_client_get(struct gc_client_t *client, const char *query,
+                  struct gc_client_result_t *result) {
+    not_null(client);
+    not_null(query);
+    not_null(result);
+
+    struct _wait_t w;
+
+    w.result = result;
+    w.done = 0;
+    if (gc_client_submit(client, query, _got_result, &w) != 0) {
+        return -1;
+    }
+    while (!w.done) {
+        gc_client_poll(client, -1);
+    }
+    return result->code == GC_CLIENT_ERROR ? -1 : 0;
+}
+
+/* Queries not answered yet are dropped without a call. */
+int gc_client_free(struct gc_client_t *client) {
+    not_null(client);
+
+    struct gc_client_internal_t *internal = client->internal;
+    struct _conn_t *conn = NULL;
+    struct _query_t *q = NULL;
+    register size_t i = 0;
+
+    for (i = 0; i < CLIENT_POOL_MAX; ++i) {
+        conn = &(internal->conns[i]);
+        if (conn->fd >= 0) {
+            close(conn->fd);
+        }
+        while ((q = conn->head) != NULL) {
+            conn->head = q->next;
+            free(q);
+        }
+    }
+    while ((q = internal->todo_head) != NULL) {
+        internal->todo_head = q->next;
+        free(q);
+    }
+    safefree(internal);
+    safefree(client);
+    return 0;
+}
@@ -0,0 +1,67 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_CLIENT_H__
+#define __GC_CLIENT_H__
+
+#include <stddef.h>
+
+#define GC_CLIENT_SERVER_MAX  16
+#define GC_CLIENT_PORT        1732
+#define GC_CLIENT_ERROR       -1 /* Code of a query no server answered */
+
+struct gc_client_internal_t;
+
+struct gc_client_result_t {
+    int code;
+    char accuracy;
+    double latitude;
+    double longitude;
+};
+
+/* Queries go over a few kept connections to the servers, many at once
+ * on each. A client is for one thread; the settings may be changed
+ * between gc_client_init() and the first query. */
+struct gc_client_t {
+    size_t pool_size;           /* Connections open at once, at most */
+    size_t depth;               /* Queries in flight on a connection */
+    unsigned int timeout_msec;  /* Wait for an answer before a retry */
+    unsigned int retries;       /* Further tries of a failed query */
+    unsigned int down_msec;     /* A failed server is skipped so long */
+    struct gc_client_internal_t *internal;
+};
+
+/* servers is "host[:port],host[:port],..." */
+int gc_client_init(struct gc_client_t **client, const char *servers);
+/* Look query up and wait for the result. */
+int gc_client_get(struct gc_client_t *client, const char *query,
+                  struct gc_client_result_t *result);
+/* Queue query; func is called with its result by gc_client_poll(). */
+int gc_client_submit(struct gc_client_t *client, const char *query,
+                     void (*func)(void *arg, const char *query,
+                                  const struct gc_client_result_t *result),
+                     void *arg);
+/* Send and receive for up to timeout_msec, or until something is done
+ * if it is negative. Returns the number of queries not answered yet. */
+size_t gc_client_poll(struct gc_client_t *client, int timeout_msec);
+/* Poll until every query submitted is answered. */
+int gc_client_wait(struct gc_client_t *client);
+size_t gc_client_pending(struct gc_client_t *client);
+int gc_client_free(struct gc_client_t *client);
+
+#endif
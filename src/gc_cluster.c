@@ -0,0 +1,291 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_cluster.h"
+#include "gc_util.h"
+
+#define CLUSTER_RETRY_SECS 10   /* A failed node is left alone that long */
+
+extern int h_errno;
+extern int g_is_daemon;
+
+/* FNV-1a with a final mix. Locations are hashed in lower case, so
+ * that they have one owner however they are spelt. */
+static unsigned int _hash(const char *key, int fold) {
+    register unsigned int h = fold ? gc_hash_lower(key) : gc_hash(key);
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    return h;
+}
+
+static int _compare(const void *a, const void *b) {
+    const struct gc_cluster_point_t *x = a;
+    const struct gc_cluster_point_t *y = b;
+
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+static void _close_idle(struct gc_cluster_node_t *node) {
+    while (node->idle_count) {
+        if (close(node->idle[--node->idle_count]) != 0) {
+            gc_loge("Cannot close peer fd: %m");
+        }
+    }
+}
+
+int gc_cluster_init(struct gc_cluster_t **cluster) {
+    not_null(cluster);
+
+    *cluster = malloc(sizeof(struct gc_cluster_t));
+    if (*cluster == NULL) {
+        gc_loge("Cannot allocate memory for cluster");
+        return -1;
+    }
+    memset(*cluster, 0, sizeof(struct gc_cluster_t));
+    (*cluster)->self = GC_CLUSTER_MAX;
+    return 0;
+}
+
+/* Add a node given as host:port. */
+int gc_cluster_add(struct gc_cluster_t *cluster, const char *name,
+                   int is_self) {
+    not_null(cluster);
+    not_null(name);
+
+    struct gc_cluster_node_t *node = NULL;
+    struct hostent *host = NULL;
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    char hostname[64];
+    char *colon = NULL;
+    register size_t i = 0;
+
+    for (i = 0; i < cluster->count; ++i) {
+        if (strcmp(cluster->nodes[i].name, name) == 0) {
+            if (is_self) {
+                cluster->self = i;
+            }
+            return 0;
+        }
+    }
+    if (cluster->count >= GC_CLUSTER_MAX) {
+        gc_loge("Too many cluster nodes");
+        return -1;
+    }
+
+    snprintf(hostname, sizeof(hostname), "%s", name);
+    colon = strchr(hostname, ':');
+    if (colon == NULL) {
+        gc_loge("Cluster node '%s' has no port", name);
+        return -1;
+    }
+    *colon = '\0';
+    host = gethostbyname(hostname);
+    if (!host || host->h_addrtype != AF_INET) {
+        gc_loge("Cannot find cluster node %s: %s", hostname,
+                hstrerror(h_errno));
+        return -1;
+    }
+
+    node = &(cluster->nodes[cluster->count]);
+    memset(node, 0, sizeof(struct gc_cluster_node_t));
+    snprintf(node->name, sizeof(node->name), "%s", name);
+    node->addr.sin_family = AF_INET;
+    node->addr.sin_port = htons(atoi(colon + 1));
+    memcpy(&(node->addr.sin_addr), host->h_addr_list[0], sizeof(in_addr_t));
+    /* Nodes are asked over IPv4, but may come to an IPv6 listener */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET6;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(hostname, NULL, &hints, &res) == 0) {
+        node->has_addr6 = 1;
+        memcpy(&(node->addr6),
+               &(((struct sockaddr_in6 *) res->ai_addr)->sin6_addr),
+               sizeof(struct in6_addr));
+        freeaddrinfo(res);
+    }
+    if (is_self) {
+        cluster->self = cluster->count;
+    }
+    ++cluster->count;
+    return 0;
+}
+
+/* Place the points of every node on the ring. */
+void gc_cluster_build(struct gc_cluster_t *cluster) {
+    not_null_void(cluster);
+
+    char name[80];
+    register size_t i = 0;
+    register size_t j = 0;
+
+    cluster->point_count = 0;
+    for (i = 0; i < cluster->count; ++i) {
+        for (j = 0; j < GC_CLUSTER_POINTS; ++j) {
+            snprintf(name, sizeof(name), "%s#%lu", cluster->nodes[i].name,
+                     (unsigned long) j);
+            cluster->points[cluster->point_count].hash = _hash(name, 0);
+            cluster->points[cluster->point_count].node = i;
+            ++cluster->point_count;
+        }
+    }
+    qsort(cluster->points, cluster->point_count,
+          sizeof(struct gc_cluster_point_t), _compare);
+}
+
+/* The node to ask for a location, or -1 if it is this one. A node which
+ * is down hands its locations to the next nodes on the ring. */
+int gc_cluster_owner(struct gc_cluster_t *cluster, const char *location) {
+    not_null(cluster);
+    not_null(location);
+
+    unsigned int hash = _hash(location, 1);
+    time_t now = time(NULL);
+    size_t lo = 0;
+    size_t hi = cluster->point_count;
+    size_t mid = 0;
+    register size_t i = 0;
+    unsigned int node = 0;
+
+    if (!cluster->point_count) {
+        return -1;
+    }
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cluster->points[mid].hash < hash) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    for (i = 0; i < cluster->point_count; ++i) {
+        node = cluster->points[(lo + i) % cluster->point_count].node;
+        if (node == cluster->self) {
+            return -1;
+        }
+        if (cluster->nodes[node].down_until <= now) {
+            return node;
+        }
+    }
+    return -1;
+}
+
+/* Whether a client is one of the nodes. Ports are not compared, as
+ * nodes connect from ephemeral ones. Clients of a Unix domain socket
+ * are not nodes. */
+int gc_cluster_is_member(struct gc_cluster_t *cluster, int fd) {
+    not_null(cluster);
+
+    struct sockaddr_storage addr;
+    const struct sockaddr_in *s_in = (struct sockaddr_in *) &addr;
+    const struct sockaddr_in6 *s_in6 = (struct sockaddr_in6 *) &addr;
+    struct gc_cluster_node_t *node = NULL;
+    register size_t i = 0;
+
+    if (gc_peer_addr(fd, &addr) != 0) {
+        return 0;
+    }
+    for (i = 0; i < cluster->count; ++i) {
+        node = &(cluster->nodes[i]);
+        if ((addr.ss_family == AF_INET
+             && node->addr.sin_addr.s_addr == s_in->sin_addr.s_addr)
+            || (addr.ss_family == AF_INET6 && node->has_addr6
+                && memcmp(&(node->addr6), &(s_in6->sin6_addr),
+                          sizeof(struct in6_addr)) == 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const struct sockaddr_in *gc_cluster_addr(struct gc_cluster_t *cluster,
+                                          int node) {
+    return &(cluster->nodes[node].addr);
+}
+
+/* An idle connection to a node, or -1 if there is none. Connections the
+ * node has closed meanwhile are dropped. */
+int gc_cluster_take(struct gc_cluster_t *cluster, int node) {
+    not_null(cluster);
+
+    struct gc_cluster_node_t *p = &(cluster->nodes[node]);
+    char c = 0;
+    int fd = -1;
+
+    while (p->idle_count) {
+        fd = p->idle[--p->idle_count];
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+            && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return fd;
+        }
+        if (close(fd) != 0) {
+            gc_loge("Cannot close peer fd: %m");
+        }
+    }
+    return -1;
+}
+
+/* Keep a connection for the next request to the node. */
+void gc_cluster_give(struct gc_cluster_t *cluster, int node, int fd) {
+    not_null_void(cluster);
+
+    struct gc_cluster_node_t *p = &(cluster->nodes[node]);
+
+    if (p->idle_count < GC_CLUSTER_IDLE_MAX) {
+        p->idle[p->idle_count++] = fd;
+    }
+    else if (close(fd) != 0) {
+        gc_loge("Cannot close peer fd: %m");
+    }
+}
+
+void gc_cluster_down(struct gc_cluster_t *cluster, int node) {
+    not_null_void(cluster);
+
+    gc_log("Cluster node %s is down", cluster->nodes[node].name);
+    cluster->nodes[node].down_until = time(NULL) + CLUSTER_RETRY_SECS;
+    _close_idle(&(cluster->nodes[node]));
+}
+
+int gc_cluster_free(struct gc_cluster_t *cluster) {
+    not_null(cluster);
+
+    register size_t i = 0;
+
+    for (i = 0; i < cluster->count; ++i) {
+        _close_idle(&(cluster->nodes[i]));
+    }
+    safefree(cluster);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_CLUSTER_H__
+#define __GC_CLUSTER_H__
+
+#include <stddef.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define GC_CLUSTER_MAX      16  /* Nodes in a cluster */
+#define GC_CLUSTER_POINTS   128 /* Points of each node on the ring */
+#define GC_CLUSTER_IDLE_MAX 8   /* Idle connections kept to each node */
+
+struct gc_cluster_node_t {
+    char name[64];              /* host:port, the same on every node */
+    struct sockaddr_in addr;
+    int has_addr6;
+    struct in6_addr addr6;      /* It may connect from, if it has one */
+    time_t down_until;          /* Not asked until then */
+    size_t idle_count;
+    int idle[GC_CLUSTER_IDLE_MAX];
+};
+
+struct gc_cluster_point_t {
+    unsigned int hash;
+    unsigned int node;
+};
+
+/* Nodes sharing their stores. Each location is owned by the node
+ * following its hash on a ring of points, so that a node joining or
+ * leaving only moves the locations next to its own points. */
+struct gc_cluster_t {
+    size_t count;
+    size_t self;                /* This node, GC_CLUSTER_MAX if none */
+    size_t point_count;
+    struct gc_cluster_node_t nodes[GC_CLUSTER_MAX];
+    struct gc_cluster_point_t points[GC_CLUSTER_MAX * GC_CLUSTER_POINTS];
+};
+
+int gc_cluster_init(struct gc_cluster_t **cluster);
+int gc_cluster_add(struct gc_cluster_t *cluster, const char *name,
+                   int is_self);
+void gc_cluster_build(struct gc_cluster_t *cluster);
+int gc_cluster_owner(struct gc_cluster_t *cluster, const char *location);
+int gc_cluster_is_member(struct gc_cluster_t *cluster, int fd);
+const struct sockaddr_in *gc_cluster_addr(struct gc_cluster_t *cluster,
+                                          int node);
+int gc_cluster_take(struct gc_cluster_t *cluster, int node);
+void gc_cluster_give(struct gc_cluster_t *cluster, int node, int fd);
+void gc_cluster_down(struct gc_cluster_t *cluster, int node);
+int gc_cluster_free(struct gc_cluster_t *cluster);
+
+#endif
@@ -15,10 +15,13 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#define _GNU_SOURCE             /* recvmmsg() and sendmmsg() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
 #include <errno.h>
 #include <netdb.h>
@@ -27,14 +30,37 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <config.h>
+
 #include "gc_error.h"
 #include "gc_log.h"
 #include "gc_conn.h"
+#include "gc_admit.h"
+#include "gc_cache.h"
+#include "gc_shm.h"
+#include "gc_cluster.h"
+#include "gc_repl.h"
 #include "gc_db.h"
 #include "gc_debug.h"
+#include "gc_frozen.h"
+#include "gc_hedge.h"
+#include "gc_http.h"
+#include "gc_quota.h"
+#include "gc_reader.h"
+#include "gc_refresh.h"
+#include "gc_server.h"
+#include "gc_slab.h"
+#include "gc_stats.h"
+#include "gc_trace.h"
+#include "gc_uring.h"
 #include "gc_util.h"
 
-#define CONN_BUF_SIZE         256
+#define CONN_BUF_SIZE         256 /* Upstream answers and responses */
+#define CONN_RD_SIZE          128 /* First buffer of a request */
+
+/* Disk lookups read the record into a wr_buf of CONN_BUF_SIZE */
+typedef char _conn_buf_holds_record[CONN_BUF_SIZE >= GC_DB_RECORD_SIZE
+                                    ? 1 : -1];
 
 #define CONN_ST_NULL          0
 #define CONN_ST_INIT          1
@@ -42,329 +68,3135 @@
 #define CONN_ST_REMOTE_OPENED 3
 #define CONN_ST_FORWARDED     4
 #define CONN_ST_REMOTE_CLOSED 5
+#define CONN_ST_QUEUED        6 /* Miss waiting for an upstream call */
+#define CONN_ST_DB_READ       7 /* Lookup in a reader thread */
+#define CONN_ST_BATCHED       8 /* Miss waiting for its upstream batch */
 
 #define GEOCODING_OUTPUT_FMT  "%d,%c,%lf,%lf\n"
 
-#define GMAP_SERVER_HOSTNAME  "maps.google.com"
 #define GMAP_KEY_SIZE         128
 #define GMAP_SERVER_MAX_COUNT 5
+#define GMAP_TOO_MANY_QUERIES 620
+#define GMAP_REQUEST_FMT      "GET /maps/geo?q=%s&output=csv&key=%s\n"
+#define GMAP_REQUEST_SIZE(n)  ((n) + GMAP_KEY_SIZE + 64)
+
+/* Misses sent upstream in one request to providers answering several
+ * queries at once, separated by a character no query holds. The
+ * answer has one line for each query, in the same order. */
+#define GMAP_BATCH_REQUEST    "GET /maps/geo/batch?q="
+#define GMAP_BATCH_TAIL_FMT   "&output=csv&key=%s\n"
+#define GMAP_BATCH_SEP        '|'
+#define GMAP_BATCH_ANSWER_SIZE(n) ((n) * CONN_BUF_SIZE)
+
+/* A miss asked of the node owning it. The connection stays open for
+ * further requests once the answer has been written. */
+#define PEER_REQUEST          "@peer-get "
+#define PEER_REQUEST_FMT      PEER_REQUEST "%s\n"
+#define KEEP_REQUEST          "@get " /* Query on a kept connection */
+
+/* Misses of interactive clients are given upstream calls first. */
+#define QUEUE_INTERACTIVE     0
+#define QUEUE_BULK            1
+#define QUEUE_COUNT           2
+
+#define ADMIN_BUF_SIZE        1024
+#define ALIASES_REQUEST       "@aliases " /* Locations sharing a result */
+#define ALIASES_BUF_SIZE      65536
+
+/* Losers of a hedge which are waited for to measure their latency */
+#define CONN_DRAIN_MAX        64
+
+/* Lanes of the event loop. Ready hits are all served first in a round,
+ * and the work on misses follows, within the miss budget. */
+#define LANE_HIT              0
+#define LANE_MISS             1
+#define LANE_COUNT            2
+#define LANE_WINDOW           1024 /* Recent queries the latencies cover */
+#define LANE_REPORT_USEC      1000000 /* Between percentile updates */
+
+/* A datagram is "<id> <query>" and is answered with "<id> <response>".
+ * Datagrams are read and answered UDP_BATCH at a time. */
+#define UDP_BATCH             64
+#define UDP_ROUNDS            4  /* Batches read before serving the rest */
+#define UDP_ID_SIZE           32 /* Longest id and its terminator */
+#define UDP_REPLY_SIZE        (UDP_ID_SIZE + CONN_BUF_SIZE)
+
+/* io_uring submissions carry the item index, its generation and the
+ * operation, so completions of a recycled item can be told apart. */
+#define URING_ENTRIES         4096
+#define URING_BUF_COUNT       4096
+#define URING_TICK_MSEC       1000
+#define URING_PACE_MSEC       50 /* Tick while the quota paces misses */
+#define URING_OP_ACCEPT       1
+#define URING_OP_TICK         2
+#define URING_OP_CLIENT_RECV  3
+#define URING_OP_CLIENT_SEND  4
+#define URING_OP_CONNECT      5
+#define URING_OP_REMOTE_SEND  6
+#define URING_OP_REMOTE_RECV  7
+#define URING_OP_HEDGE_CONNECT 8
+#define URING_OP_HEDGE_SEND   9
+#define URING_OP_HEDGE_RECV   10
+#define URING_OP_CANCEL       11
+#define URING_OP_READER       12
+#define URING_OP_UDP          13
+#define URING_OP_HTTP_ACCEPT  14
+#define URING_DEFER_MAX       (URING_ENTRIES * 2) /* Miss events held */
+#define URING_DATA(op, gen, i)                                          \
+    (((unsigned long long) (op) << 56)                                  \
+     | ((unsigned long long) ((gen) & 0xffffff) << 32)                  \
+     | (unsigned long long) (i))
+#define URING_DATA_OP(d)      ((int) ((d) >> 56))
+#define URING_DATA_GEN(d)     ((unsigned int) (((d) >> 32) & 0xffffff))
+#define URING_DATA_INDEX(d)   ((size_t) ((d) & 0xffffffff))
+
+/* Misses waiting for the same upstream request */
+struct gc_conn_batch_t {
+    struct gc_conn_item_t *head;
+    struct gc_conn_item_t *tail;
+    size_t len;
+    size_t keys;                /* Distinct queries, once sent */
+    size_t bytes;               /* Of the queries and separators */
+    unsigned long long start_usec; /* When the first miss joined */
+};
+
+/* State of a request while it is being answered. It comes from the
+ * slab once the request line is complete, as do all the buffers. */
+struct gc_conn_work_t {
+    int remote_fd;              /* fd to remote geocoding service */
+    int hedge_fd;               /* Same request to another server */
+    char hedged;                /* A hedge has been sent for the miss */
+    char hedge_status;
+    char refresh;               /* Background refresh of a stale entry */
+    char owner_fresh;           /* Connection to the owner is a new one */
+    char sync;                  /* Poll of the primary by a replica */
+    char udp;                   /* Asked in a datagram */
+    char http_output;           /* Format asked for over HTTP */
+    char http_done;             /* Response is in an HTTP response */
+    int owner;                  /* Node asked for the miss, or -1 */
+    size_t server;              /* Server the miss was sent to first */
+    unsigned long long upstream_usec; /* When the miss went upstream */
+    unsigned long long start_usec; /* When the query was complete */
+    char missed;                /* Asked of a node or upstream */
+    char batch_retried;         /* Put in a batch again once */
+    struct gc_conn_batch_t *batch; /* Batch waited for, or NULL */
+    struct gc_conn_item_t *bprev; /* Links in it */
+    struct gc_conn_item_t *bnext;
+    size_t batch_index;         /* Line of the answer to the query */
+    struct gc_conn_batch_t carried; /* Others waiting for this request */
+    unsigned long long trace[GC_TRACE_STAGE_COUNT]; /* Stages reached */
+    struct gc_db_query_t result; /* Geocoding result */
+    struct gc_db_query_t stale;  /* Result being refreshed */
+    struct gc_cache_entry_t *entry; /* Held while writing its bytes */
+    const char *wr_ptr;          /* Response bytes to the client */
+    struct gc_conn_item_t *qprev; /* Links in a miss queue */
+    struct gc_conn_item_t *qnext;
+    size_t rd_next;             /* Queries sent after this one in rd_buf */
+    size_t rd_end;
+    char *wr_buf;               /* Upstream request, then response */
+    size_t wr_buf_size;
+    size_t wr_buf_pos;
+    size_t wr_buf_len;
+    char *up_buf;               /* Answer to the first request */
+    size_t up_buf_size;
+    size_t up_buf_len;
+    char *hedge_buf;            /* Answer to the hedge */
+    size_t hedge_buf_size;
+    size_t hedge_rd_len;
+    size_t hedge_wr_pos;
+    struct sockaddr_in udp_addr; /* Where the answer to a datagram goes */
+    char udp_id[UDP_ID_SIZE];
+};
 
+/* The part of a connection which idle connections pay for. */
 struct gc_conn_item_t {
     int client_fd;
-    int remote_fd;              /* fd to remote geocoding service */
+    unsigned int gen;           /* Bumped on every reset */
     char status;
+    char bulk;                  /* Client is a bulk client */
+    char peer;                  /* Client is a node of the cluster */
+    char keep;                  /* Client sends more queries after this */
+    char http;                  /* Client of the HTTP listener */
     time_t exptime;              /* expiration time */
-    struct gc_db_query_t result; /* Geocoding result */
+    unsigned long long accept_usec; /* Ready for a request, if tracing */
+    char *rd_buf;               /* Request, attached on the first read */
+    size_t rd_buf_size;
     size_t rd_buf_len;
-    size_t wr_buf_pos;
-    size_t wr_buf_len;
-    char rd_buf[CONN_BUF_SIZE];
-    char wr_buf[CONN_BUF_SIZE];
-    char location[CONN_BUF_SIZE];
+    struct gc_conn_work_t *work;
+};
+
+struct gc_conn_drain_t {
+    int fd;
+    size_t index;               /* Item and generation the fd was of */
+    unsigned int gen;
+    unsigned long long usec;    /* When the request went upstream */
+    time_t exptime;
+};
+
+struct gc_conn_udp_t {
+    int fd;
+    size_t in_size;             /* Longest datagram taken */
+    char *in_bufs;              /* UDP_BATCH buffers of in_size + 1 */
+    struct sockaddr_in in_addrs[UDP_BATCH];
+    struct iovec in_iovs[UDP_BATCH];
+    struct mmsghdr in_msgs[UDP_BATCH];
+    size_t out_count;           /* Answers waiting to be sent */
+    struct sockaddr_in out_addrs[UDP_BATCH];
+    struct iovec out_iovs[UDP_BATCH];
+    struct mmsghdr out_msgs[UDP_BATCH];
+    char out_bufs[UDP_BATCH][UDP_REPLY_SIZE];
 };
 
 struct gc_conn_internal_t {
     size_t gmap_server_count;
-    struct in_addr gmap_servers[GMAP_SERVER_MAX_COUNT];
+    struct sockaddr_in gmap_servers[GMAP_SERVER_MAX_COUNT];
     char gmap_key[GMAP_KEY_SIZE];
+    struct gc_slab_t *slab;     /* Buffers and request states */
+    struct gc_uring_t *uring;   /* NULL with the select() loop */
+    int server_fds[GC_SERVER_LISTEN_MAX]; /* Listeners with io_uring */
+    size_t server_count;
+    int http_fd;                /* HTTP listener with io_uring, or -1 */
+    int stopped;                /* The listener has been handed off */
+    int reader_armed;           /* Poll of the reader fd is queued */
+    struct gc_conn_udp_t *udp;  /* NULL without a datagram socket */
+    int udp_armed;              /* Poll of the datagram socket is queued */
+    unsigned int timeout;
+    size_t upstream_count;      /* Misses waiting for upstream */
+    struct gc_conn_item_t *queue_head[QUEUE_COUNT];
+    struct gc_conn_item_t *queue_tail[QUEUE_COUNT];
+    size_t queue_len[QUEUE_COUNT];
+    size_t drain_count;
+    struct gc_conn_drain_t drains[CONN_DRAIN_MAX];
+    struct gc_conn_batch_t batch; /* Misses waiting to be sent */
+    size_t *runs[LANE_COUNT];   /* Ready items of a select() round */
+    size_t miss_next;           /* Item the next miss round starts at */
+    struct gc_uring_event_t *deferred; /* Miss completions to work on */
+    size_t deferred_count;
+    size_t lane_count[LANE_COUNT];
+    size_t lane_reported[LANE_COUNT]; /* Count at the last update */
+    unsigned long long lane_report_usec;
+    unsigned int lane_usec[LANE_COUNT][LANE_WINDOW];
+    unsigned int lane_sorted[LANE_WINDOW];
 };
 
 extern int h_errno;
 extern int g_is_daemon;
 
-static void _reset_item(struct gc_conn_item_t *item) {
-    not_null_void(item);
+static struct gc_conn_item_t *_add_item(struct gc_conn_t *conn, int fd,
+                                        unsigned int timeout);
+static void _uring_arm(struct gc_conn_t *conn, struct gc_conn_item_t *item);
+static void _parse_request(struct gc_conn_t *conn,
+                           struct gc_conn_item_t *item);
+static void _parse_http(struct gc_conn_t *conn, struct gc_conn_item_t *item,
+                        size_t from);
+static void _uring_arm_hedge(struct gc_conn_t *conn,
+                             struct gc_conn_item_t *item);
+static void _batch_orphan(struct gc_conn_t *conn,
+                          struct gc_conn_item_t *item);
 
-    item->status = CONN_ST_NULL;
+/* Make sure *buf holds at least size bytes, keeping what it holds. */
+static int _reserve(struct gc_conn_t *conn, char **buf, size_t *buf_size,
+                    size_t size) {
+    char *new_buf = NULL;
 
-    if (item->client_fd >= 0 && close(item->client_fd) != 0) {
-        gc_loge("Cannot close client fd: %m");
+    if (*buf && *buf_size >= size) {
+        return 0;
     }
-    item->client_fd = -1;
-    
-    if (item->remote_fd >= 0 && close(item->remote_fd) != 0) {
+    new_buf = gc_slab_grow(conn->internal->slab, *buf, *buf_size, size,
+                           buf_size);
+    if (new_buf == NULL) {
+        gc_loge("Cannot allocate memory for buffer");
+        return -1;
+    }
+    *buf = new_buf;
+    return 0;
+}
+
+static void _release(struct gc_conn_t *conn, char **buf, size_t *buf_size) {
+    if (*buf) {
+        gc_slab_put(conn->internal->slab, *buf, *buf_size);
+        *buf = NULL;
+        *buf_size = 0;
+    }
+}
+
+/* Make room for extra more bytes of the request and a terminator.
+ * Requests longer than the limit are deemed as attacks. */
+static int _reserve_request(struct gc_conn_t *conn,
+                            struct gc_conn_item_t *item, size_t extra) {
+    size_t size = GC_MAX(item->rd_buf_size, CONN_RD_SIZE);
+
+    if (item->rd_buf_len + extra > conn->max_request) {
+        return -1;
+    }
+    while (size < item->rd_buf_len + extra + 1) {
+        size *= 2;
+    }
+    return _reserve(conn, &(item->rd_buf), &(item->rd_buf_size),
+                    GC_MIN(size, conn->max_request + 1));
+}
+
+static int _attach_work(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    size_t size = 0;
+
+    item->work = gc_slab_get(conn->internal->slab,
+                             sizeof(struct gc_conn_work_t), &size);
+    if (item->work == NULL) {
+        gc_loge("Cannot allocate memory for request");
+        return -1;
+    }
+    memset(item->work, 0, sizeof(struct gc_conn_work_t));
+    item->work->remote_fd = -1;
+    item->work->hedge_fd = -1;
+    item->work->owner = -1;
+    item->work->trace[GC_TRACE_ACCEPT] = item->accept_usec;
+    return 0;
+}
+
+/* Account for a miss which is done with upstream, successfully or
+ * not. Failures and timeouts count as the time they took. */
+static void _upstream_done(struct gc_conn_t *conn,
+                           struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    unsigned long msec = 0;
+
+    if (!work->upstream_usec) {
+        return;
+    }
+    msec = (gc_now_usec() - work->upstream_usec) / 1000;
+    if (conn->admit) {
+        gc_admit_upstream_done(conn->admit, msec);
+    }
+    if (conn->hedge) {
+        gc_hedge_served(conn->hedge, msec);
+    }
+    work->upstream_usec = 0;
+    --conn->internal->upstream_count;
+}
+
+/* Close an upstream socket. With io_uring, requests still in flight
+ * hold a reference to it; shutting it down makes them complete. */
+static void _close_remote(struct gc_conn_t *conn, int *fd) {
+    if (*fd < 0) {
+        return;
+    }
+    if (conn->internal->uring) {
+        shutdown(*fd, SHUT_RDWR);
+    }
+    if (close(*fd) != 0) {
         gc_loge("Cannot close remote fd: %m");
     }
-    item->remote_fd = -1;
-    
-    item->rd_buf_len = 0;
-    item->wr_buf_pos = 0;
-    item->wr_buf_len = 0;
+    *fd = -1;
+}
+
+/* The first request of a miss is over, whatever its outcome. */
+static void _primary_done(struct gc_conn_t *conn,
+                          struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (conn->hedge && work->upstream_usec && work->remote_fd >= 0) {
+        gc_hedge_first(conn->hedge,
+                       (gc_now_usec() - work->upstream_usec) / 1000);
+    }
+}
+
+static void _drain_done(struct gc_conn_t *conn, size_t i) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    struct gc_conn_drain_t *drain = &(internal->drains[i]);
+
+    gc_hedge_first(conn->hedge, (gc_now_usec() - drain->usec) / 1000);
+    _close_remote(conn, &(drain->fd));
+    *drain = internal->drains[--internal->drain_count];
+}
 
-    item->location[0] = '\0';
+/* A hedge answered first. Close the first request, or keep waiting for
+ * it in the background if it has been sent, so that hedging does not
+ * hide how slow it would have been. */
+static void _detach_primary(struct gc_conn_t *conn,
+                            struct gc_conn_item_t *item) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    struct gc_conn_work_t *work = item->work;
+    struct gc_conn_drain_t *drain = NULL;
+
+    if (work->remote_fd < 0) {
+        return;
+    }
+    if (item->status != CONN_ST_FORWARDED
+        || internal->drain_count >= CONN_DRAIN_MAX) {
+        _primary_done(conn, item);
+        _close_remote(conn, &(work->remote_fd));
+        return;
+    }
+    drain = &(internal->drains[internal->drain_count++]);
+    drain->fd = work->remote_fd;
+    drain->index = item - conn->items;
+    drain->gen = item->gen;
+    drain->usec = work->upstream_usec;
+    drain->exptime = item->exptime;
+    work->remote_fd = -1;
 }
 
-static int _check_request(const char *buf, size_t buf_size) {
-    static const char safe_char[]
-        = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
-        "0123456789\\-_.!~*'()%";
-    const size_t safe_char_len = strlen(safe_char);
-    int is_safe = 0;
+/* Poll the drained requests of the select() loop. */
+static void _drain_poll(struct gc_conn_t *conn, time_t curtime) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    char buf[CONN_BUF_SIZE];
     register size_t i = 0;
-    register size_t j = 0;
+    ssize_t ret = 0;
 
-    for (i = 0; i < buf_size; ++i) {
-        is_safe = 0;
-        for (j = 0; j < safe_char_len; ++j) {
-            if (safe_char[j] == buf[i]) {
-                is_safe = 1;
-                break;
-            }
-        }
-        if (!is_safe) {
-            gc_loge("Non-safe character %d is received", (int) buf[i]);
-            return 0;
+    while (i < internal->drain_count) {
+        ret = recv(internal->drains[i].fd, buf, CONN_BUF_SIZE, MSG_DONTWAIT);
+        if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)
+            || curtime > internal->drains[i].exptime) {
+            _drain_done(conn, i);
+            continue;
         }
+        ++i;
     }
-    return 1;
 }
 
-static void _read_request(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+static void _queue_stats(struct gc_conn_t *conn) {
+    gc_stat_set(GC_STAT_QUEUE_INTERACTIVE,
+                conn->internal->queue_len[QUEUE_INTERACTIVE]);
+    gc_stat_set(GC_STAT_QUEUE_BULK, conn->internal->queue_len[QUEUE_BULK]);
+}
+
+static void _enqueue(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    int lane = item->bulk ? QUEUE_BULK : QUEUE_INTERACTIVE;
+
+    item->work->qprev = internal->queue_tail[lane];
+    item->work->qnext = NULL;
+    if (internal->queue_tail[lane]) {
+        internal->queue_tail[lane]->work->qnext = item;
+    }
+    else {
+        internal->queue_head[lane] = item;
+    }
+    internal->queue_tail[lane] = item;
+    ++internal->queue_len[lane];
+    item->status = CONN_ST_QUEUED;
+    _queue_stats(conn);
+}
+
+static void _dequeue(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    struct gc_conn_work_t *work = item->work;
+    int lane = item->bulk ? QUEUE_BULK : QUEUE_INTERACTIVE;
+
+    if (work->qprev) {
+        work->qprev->work->qnext = work->qnext;
+    }
+    else {
+        internal->queue_head[lane] = work->qnext;
+    }
+    if (work->qnext) {
+        work->qnext->work->qprev = work->qprev;
+    }
+    else {
+        internal->queue_tail[lane] = work->qprev;
+    }
+    work->qprev = NULL;
+    work->qnext = NULL;
+    --internal->queue_len[lane];
+    _queue_stats(conn);
+}
+
+static void _batch_link(struct gc_conn_batch_t *batch,
+                        struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    work->batch = batch;
+    work->bprev = batch->tail;
+    work->bnext = NULL;
+    if (batch->tail) {
+        batch->tail->work->bnext = item;
+    }
+    else {
+        batch->head = item;
+    }
+    batch->tail = item;
+    ++batch->len;
+    batch->bytes += strlen(item->rd_buf) + 1;
+}
+
+static void _batch_unlink(struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    struct gc_conn_batch_t *batch = work->batch;
+
+    if (work->bprev) {
+        work->bprev->work->bnext = work->bnext;
+    }
+    else {
+        batch->head = work->bnext;
+    }
+    if (work->bnext) {
+        work->bnext->work->bprev = work->bprev;
+    }
+    else {
+        batch->tail = work->bprev;
+    }
+    --batch->len;
+    batch->bytes -= strlen(item->rd_buf) + 1;
+    work->batch = NULL;
+    work->bprev = NULL;
+    work->bnext = NULL;
+}
+
+/* Hand the stages of a query to the flight recorder, once. */
+static void _trace_done(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (conn->trace && work && work->trace[GC_TRACE_PARSED]) {
+        gc_trace_done(conn->trace, work->trace, item->rd_buf);
+        work->trace[GC_TRACE_PARSED] = 0;
+    }
+}
+
+static void _reset_item(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
     not_null_void(conn);
     not_null_void(item);
 
-    ssize_t ret = read(item->client_fd, item->rd_buf + item->rd_buf_len,
-                       CONN_BUF_SIZE - item->rd_buf_len);
-    if (ret > 0) {
-        item->rd_buf_len += ret;
-        /* Overflowed buffer are deemed as attacks. */
-        if (item->rd_buf_len >= CONN_BUF_SIZE) {
-            _reset_item(item);
-            return;
+    struct gc_conn_work_t *work = item->work;
+
+    if (g_trace_on) {
+        _trace_done(conn, item);
+    }
+    if (work) {
+        if (item->status == CONN_ST_QUEUED) {
+            _dequeue(conn, item);
+        }
+        if (work->batch) {
+            _batch_unlink(item);
+        }
+        if (work->carried.keys) {
+            _batch_orphan(conn, item);
+        }
+        if (work->upstream_usec) {
+            gc_stat_inc(GC_STAT_UPSTREAM_ERRORS);
+        }
+        _primary_done(conn, item);
+        _upstream_done(conn, item);
+        if (work->refresh) {
+            gc_refresh_done(conn->refresh, item->rd_buf);
+        }
+        if (work->sync) {
+            gc_repl_failed(conn->repl);
         }
-        item->rd_buf[item->rd_buf_len - 1] = '\0';
     }
-    else if (ret == 0) {
-        if (!item->rd_buf_len) {
-            _reset_item(item);
-            return;
+
+    item->status = CONN_ST_NULL;
+    ++item->gen;
+
+    /* With io_uring, requests still in flight hold a reference to the
+     * socket. Shut it down so that they complete and the peer sees the
+     * connection going away. */
+    if (conn->internal->uring && item->client_fd >= 0) {
+        shutdown(item->client_fd, SHUT_RDWR);
+    }
+    if (item->client_fd >= 0 && close(item->client_fd) != 0) {
+        gc_loge("Cannot close client fd: %m");
+    }
+    item->client_fd = -1;
+    item->peer = 0;
+    item->keep = 0;
+    item->http = 0;
+
+    if (work) {
+        _close_remote(conn, &(work->remote_fd));
+        _close_remote(conn, &(work->hedge_fd));
+        if (work->entry) {
+            gc_cache_release(conn->cache, work->entry);
         }
-        item->status = CONN_ST_GOT_REQUEST;
+        _release(conn, &(work->wr_buf), &(work->wr_buf_size));
+        _release(conn, &(work->up_buf), &(work->up_buf_size));
+        _release(conn, &(work->hedge_buf), &(work->hedge_buf_size));
+        gc_slab_put(conn->internal->slab, work,
+                    sizeof(struct gc_conn_work_t));
+        item->work = NULL;
     }
-    else if (ret < 0 && errno != EINPROGRESS) {
-        _reset_item(item);
+
+    _release(conn, &(item->rd_buf), &(item->rd_buf_size));
+    item->rd_buf_len = 0;
+}
+
+/* Account for the latency of a query answered in full, in the lane of
+ * hits or of misses. */
+static void _served(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    struct gc_conn_work_t *work = item->work;
+    int lane = LANE_HIT;
+
+    if (work == NULL || !work->start_usec) {
         return;
     }
+    if (work->missed) {
+        lane = LANE_MISS;
+    }
+    internal->lane_usec[lane][internal->lane_count[lane]++ % LANE_WINDOW]
+        = gc_now_usec() - work->start_usec;
+}
 
-    /* Check if we have got a newline. We just need the first line. */
-    if (item->status != CONN_ST_GOT_REQUEST) {
-        if (gc_chomp(item->rd_buf, item->rd_buf_len) < item->rd_buf_len) {
-            item->rd_buf_len = strlen(item->rd_buf);
-            item->status = CONN_ST_GOT_REQUEST;
-        }
+/* Update the p99 latency of each lane with new queries, at most once a
+ * second, as sorting the window is no work for every query. */
+static void _report_lanes(struct gc_conn_t *conn) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    unsigned long long now = gc_now_usec();
+    size_t n = 0;
+    int lane = 0;
+
+    if (now - internal->lane_report_usec < LANE_REPORT_USEC) {
+        return;
     }
-    
-    if (item->rd_buf_len && item->status == CONN_ST_GOT_REQUEST) {
-        if (!_check_request(item->rd_buf, item->rd_buf_len)) {
-            _reset_item(item);
-            return;
+    internal->lane_report_usec = now;
+    for (lane = 0; lane < LANE_COUNT; ++lane) {
+        n = internal->lane_count[lane];
+        if (n == internal->lane_reported[lane]) {
+            continue;
         }
+        internal->lane_reported[lane] = n;
+        gc_stat_set(lane == LANE_HIT
+                    ? GC_STAT_HIT_P99_USEC : GC_STAT_MISS_P99_USEC,
+                    gc_percentile(internal->lane_usec[lane],
+                                  GC_MIN(n, LANE_WINDOW),
+                                  internal->lane_sorted, 99));
+    }
+}
 
-        gc_log("Query: [%s]", item->rd_buf);
+/* The answer has been written. Connections of other nodes, of clients
+ * asking with KEEP_REQUEST and of HTTP clients keeping them alive are
+ * kept open for their next request, which may have been read already. */
+static void _finish_item(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    int fd = item->client_fd;
+    char peer = item->peer;
+    char keep = item->keep;
+    char http = item->http;
+    char *rd_buf = NULL;
+    size_t rd_buf_size = 0;
+    size_t more = 0;
 
-        if (gc_db_get(conn->db, item->rd_buf, &(item->result)) == 0) {
-            /* Data found in local database */
-            snprintf(item->wr_buf, CONN_BUF_SIZE, GEOCODING_OUTPUT_FMT,
-                     item->result.code, item->result.accuracy,
-                     item->result.latitude, item->result.longitude);
-            item->wr_buf_len = strlen(item->wr_buf);
-            item->status = CONN_ST_REMOTE_CLOSED;
+    _served(conn, item);
+    if (work) {
+        gc_trace_mark(work->trace[GC_TRACE_WRITTEN]);
+    }
+    if (g_trace_on) {
+        _trace_done(conn, item);
+    }
+    if (work && work->rd_end > work->rd_next) {
+        more = work->rd_end - work->rd_next;
+    }
+    /* A node keeps its connection for the next miss, unless this
+     * process is going away and the node is to connect to the next.
+     * Requests read already are answered all the same. */
+    if ((!peer && !keep) || (conn->internal->stopped && !more)) {
+        _reset_item(conn, item);
+        return;
+    }
+    if (more) {
+        memmove(item->rd_buf, item->rd_buf + work->rd_next, more);
+        rd_buf = item->rd_buf;
+        rd_buf_size = item->rd_buf_size;
+        item->rd_buf = NULL;
+    }
+    item->client_fd = -1;
+    _reset_item(conn, item);
+    item->client_fd = fd;
+    item->peer = peer;
+    item->keep = keep;
+    item->http = http;
+    item->exptime = time(NULL) + conn->internal->timeout;
+    item->status = CONN_ST_INIT;
+    gc_trace_mark(item->accept_usec);
+    if (more) {
+        item->rd_buf = rd_buf;
+        item->rd_buf_size = rd_buf_size;
+        item->rd_buf_len = more;
+        item->rd_buf[more] = '\0';
+        if (http) {
+            _parse_http(conn, item, 0);
         }
         else {
-            /* Prepare the request to geocoding service */
-            strncpy(item->location, item->rd_buf, item->rd_buf_len);
-            item->location[item->rd_buf_len] = '\0';
-
-            snprintf(item->wr_buf, CONN_BUF_SIZE,
-                     "GET /maps/geo?q=%s&output=csv&key=%s\n",
-                     item->rd_buf, conn->internal->gmap_key);
-            item->wr_buf_len = strlen(item->wr_buf);
+            _parse_request(conn, item);
         }
     }
 }
 
-static void _open_remote(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
-    not_null_void(conn);
-    not_null_void(item);
+/* Answer a client we cannot take in, without giving it an item. */
+static void _reject(int fd, int code, int http) {
+    char buf[CONN_BUF_SIZE];
+
+    if (http) {
+        gc_http_error(buf, CONN_BUF_SIZE, code, 0);
+    }
+    else {
+        snprintf(buf, CONN_BUF_SIZE, GEOCODING_OUTPUT_FMT, code, '0',
+                 0.0, 0.0);
+    }
+    if (write(fd, buf, strlen(buf)) < 0) {
+        gc_debug(printf("Cannot write busy response: %d\n", errno));
+    }
+    if (close(fd) != 0) {
+        gc_loge("Cannot close client fd: %m");
+    }
+}
+
+/* Serialise the result into wr_buf and point the write at it. Every
+ * request but a memory hit has a wr_buf of CONN_BUF_SIZE at least. */
+static void _format_result(struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    work->wr_ptr = work->wr_buf;
+    work->wr_buf_len = gc_db_format_result(&(work->result), work->wr_buf,
+                                           work->wr_buf_size);
+    work->wr_buf_pos = 0;
+}
 
-    int i = rand() % conn->internal->gmap_server_count;
-    item->remote_fd
-        = gc_socket_connect(conn->internal->gmap_servers[i].s_addr, 80);
-    if (item->remote_fd < 0) {
-        _reset_item(item);
+/* Answer the client with a code of our own instead of a result. */
+static void _answer(struct gc_conn_item_t *item, int code) {
+    memset(&(item->work->result), 0, sizeof(struct gc_db_query_t));
+    item->work->result.code = code;
+    item->work->result.accuracy = '0';
+    _format_result(item);
+    item->status = CONN_ST_REMOTE_CLOSED;
+    if (code == GC_CODE_DEFERRED) {
+        gc_stat_inc(GC_STAT_DEFERRED);
+    }
+}
+
+/* Hand the bytes in wr_buf over to the memory tier, so that the write
+ * goes out from the cached entry. */
+static void _keep_response(struct gc_conn_t *conn,
+                           struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (!conn->cache || work->entry) {
         return;
     }
-    item->status = CONN_ST_REMOTE_OPENED;
+    if (gc_cache_put(conn->cache, item->rd_buf, &(work->result),
+                     work->wr_ptr, work->wr_buf_len, &(work->entry)) == 0) {
+        work->wr_ptr = work->entry->wire;
+    }
 }
 
-static void _write_remote(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
-    not_null_void(conn);
-    not_null_void(item);
+/* Copy the response in wr_buf to the shared memory tier as well */
+static void _cache_response(struct gc_conn_t *conn,
+                            struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
 
-    ssize_t ret =  write(item->remote_fd, item->wr_buf + item->wr_buf_pos,
-                         item->wr_buf_len - item->wr_buf_pos);
-    if (ret > 0) {
-        item->wr_buf_pos += ret;
+    if (conn->shm && !work->entry) {
+        gc_shm_put(conn->shm, item->rd_buf, &(work->result),
+                   work->wr_ptr, work->wr_buf_len);
     }
-    else if (ret == 0) {
-        item->rd_buf_len = 0;
-        item->status = CONN_ST_FORWARDED;
+    _keep_response(conn, item);
+}
+
+/* Look the request up in the frozen set. The result is formatted into
+ * wr_buf and kept in no memory tier, the set being as quick to read. */
+static int _lookup_frozen(struct gc_conn_t *conn,
+                          struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (!conn->frozen
+        || gc_frozen_get(conn->frozen, item->rd_buf, &(work->result)) != 0
+        || _reserve(conn, &(work->wr_buf), &(work->wr_buf_size),
+                    CONN_BUF_SIZE) != 0) {
+        return -1;
     }
-    else if (ret < 0 && errno != EINPROGRESS) {
-        gc_loge("Cannot write request to remote: %m");
-        _reset_item(item);
+    _format_result(item);
+    return 0;
+}
+
+/* Look the request up in the memory tier. On a hit the response bytes
+ * are ready to be written, without a buffer of the item's own. */
+static int _lookup_memory(struct gc_conn_t *conn,
+                          struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (!conn->cache
+        || gc_cache_get(conn->cache, item->rd_buf, &(work->entry)) != 0) {
+        return -1;
     }
+    work->result = work->entry->query;
+    work->wr_ptr = work->entry->wire;
+    work->wr_buf_len = work->entry->wire_len;
+    work->wr_buf_pos = 0;
+    return 0;
 }
 
-static void _read_remote(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
-    not_null_void(conn);
-    not_null_void(item);
+/* Look the request up in the memory tier shared with other processes,
+ * and with those before this one. The response bytes are copied. */
+static int _lookup_shared(struct gc_conn_t *conn,
+                          struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    size_t wire_len = 0;
 
-    ssize_t ret = read(item->remote_fd, item->rd_buf + item->rd_buf_len,
-                       CONN_BUF_SIZE - item->rd_buf_len);
-    if (ret > 0) {
-        item->rd_buf_len += ret;
-        if (item->rd_buf_len >= CONN_BUF_SIZE) {
-            /* Geocoding sources usually are trusted, but checking the
-             * buffer length is still a good thing. */
-            _reset_item(item);
-            return;
+    if (!conn->shm
+        || gc_shm_get(conn->shm, item->rd_buf, &(work->result),
+                      work->wr_buf, work->wr_buf_size, &wire_len) != 0) {
+        return -1;
+    }
+    if (wire_len) {
+        work->wr_ptr = work->wr_buf;
+        work->wr_buf_len = wire_len;
+        work->wr_buf_pos = 0;
+    }
+    else {
+        _format_result(item);
+    }
+    _keep_response(conn, item);
+    return 0;
+}
+
+/* Look the request up in the failed results of recent misses. The
+ * entry is let go at once, the result being formatted into wr_buf. */
+static int _lookup_negative(struct gc_conn_t *conn,
+                            struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    struct gc_cache_entry_t *entry = NULL;
+    int is_fresh = 0;
+
+    if (!conn->negative
+        || gc_cache_get(conn->negative, item->rd_buf, &entry) != 0) {
+        return -1;
+    }
+    is_fresh = time(NULL) - entry->query.mtime < (time_t) conn->negative_ttl;
+    if (is_fresh) {
+        work->result = entry->query;
+    }
+    gc_cache_release(conn->negative, entry);
+    if (!is_fresh) {
+        return -1;
+    }
+    _format_result(item);
+    return 0;
+}
+
+/* Answer with a result read from the database, with the response
+ * bytes stored next to it at wire if wire_len is not 0. */
+static void _found_disk(struct gc_conn_t *conn, struct gc_conn_item_t *item,
+                        const char *wire, size_t wire_len) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (wire_len) {
+        work->wr_ptr = wire;
+        work->wr_buf_len = wire_len;
+        work->wr_buf_pos = 0;
+    }
+    else {
+        _format_result(item);
+    }
+    _cache_response(conn, item);
+}
+
+/* Look the request up in the database. The record is read into wr_buf,
+ * and a response stored with it is written to the client from there. */
+static int _lookup_disk(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    const char *wire = NULL;
+    size_t wire_len = 0;
+
+    if (gc_db_get_wire(conn->db, item->rd_buf, &(work->result),
+                       work->wr_buf, work->wr_buf_size,
+                       &wire, &wire_len) != 0) {
+        return -1;
+    }
+    _found_disk(conn, item, wire, wire_len);
+    return 0;
+}
+
+static void _update_stats(struct gc_conn_t *conn) {
+    register size_t i = 0;
+    size_t count = 0;
+
+    for (i = 0; i < conn->size; ++i) {
+        if (conn->items[i].status != CONN_ST_NULL) {
+            ++count;
         }
-        item->rd_buf[item->rd_buf_len - 1] = '\0';
     }
-    else if (ret == 0) {
-        if (item->rd_buf_len) {
-            gc_chomp(item->rd_buf, item->rd_buf_len);
-            if (sscanf(item->rd_buf, "%d,%c,%lf,%lf",
-                       &(item->result.code),
-                       &(item->result.accuracy),
-                       &(item->result.latitude),
-                       &(item->result.longitude)) != 4) {
-                _reset_item(item);
-                return;
-            }
-            snprintf(item->wr_buf, CONN_BUF_SIZE, GEOCODING_OUTPUT_FMT,
-                     item->result.code, item->result.accuracy,
-                     item->result.latitude, item->result.longitude);
-            item->wr_buf_len = strlen(item->wr_buf);
-            item->wr_buf_pos = 0;
+    gc_stat_set(GC_STAT_CONNECTIONS, count);
+    gc_stat_set(GC_STAT_CACHE_ENTRIES,
+                conn->cache ? gc_cache_count(conn->cache) : 0);
+    gc_stat_set(GC_STAT_NEGATIVE_ENTRIES, gc_cache_count(conn->negative));
+    gc_stat_set(GC_STAT_BUFFER_BYTES, gc_slab_in_use(conn->internal->slab));
+    gc_stat_set(GC_STAT_BUFFER_POOL_BYTES,
+                gc_slab_reserved(conn->internal->slab));
+    gc_stat_set(GC_STAT_REFRESH_PENDING, gc_refresh_pending(conn->refresh));
+    gc_stat_set(GC_STAT_READS_PENDING,
+                conn->reader ? conn->reader->pending : 0);
+    gc_repl_stats(conn->repl);
+    gc_stat_set(GC_STAT_LOG_DROPPED, gc_log_dropped());
+}
+
+/* Add an alias to the answer to "@aliases", while it fits */
+static int _append_alias(void *arg, const char *alias, size_t len) {
+    struct gc_conn_work_t *work = arg;
+
+    if (work->wr_buf_len + len + 1 > work->wr_buf_size) {
+        return 1;
+    }
+    memcpy(work->wr_buf + work->wr_buf_len, alias, len);
+    work->wr_buf_len += len;
+    work->wr_buf[work->wr_buf_len++] = '\n';
+    return 0;
+}
+
+/* Requests starting with '@' are commands to geocache itself. The
+ * character is not allowed in a query, so they cannot be mistaken for
+ * one. */
+static void _admin(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    ssize_t len = 0;
+
+    if (conn->repl && conn->repl->size
+        && (strncmp(item->rd_buf, "@sync ", 6) == 0
+            || strncmp(item->rd_buf, "@snapshot ", 10) == 0)) {
+        /* A replica polling for changes */
+        if (_reserve(conn, &(work->wr_buf), &(work->wr_buf_size),
+                     GC_REPL_RESPONSE_SIZE) != 0
+            || (len = gc_repl_serve(conn->repl, conn->db, item->rd_buf,
+                                    work->wr_buf,
+                                    work->wr_buf_size)) < 0) {
+            _reset_item(conn, item);
+            return;
+        }
+        work->wr_ptr = work->wr_buf;
+        work->wr_buf_len = len;
+        work->wr_buf_pos = 0;
+        item->status = CONN_ST_REMOTE_CLOSED;
+        return;
+    }
+    if (strncmp(item->rd_buf, ALIASES_REQUEST,
+                strlen(ALIASES_REQUEST)) == 0) {
+        /* One line for each location stored with the same result */
+        if (_reserve(conn, &(work->wr_buf), &(work->wr_buf_size),
+                     ALIASES_BUF_SIZE) != 0) {
+            _reset_item(conn, item);
+            return;
+        }
+        work->wr_buf_len = 0;
+        gc_db_aliases(conn->db, item->rd_buf + strlen(ALIASES_REQUEST),
+                      _append_alias, work);
+        work->wr_ptr = work->wr_buf;
+        work->wr_buf_pos = 0;
+        item->status = CONN_ST_REMOTE_CLOSED;
+        return;
+    }
+    if (conn->trace && strcmp(item->rd_buf, "@trace") == 0) {
+        /* The slow requests kept, as Chrome trace events */
+        if (_reserve(conn, &(work->wr_buf), &(work->wr_buf_size),
+                     GC_TRACE_RESPONSE_SIZE(conn->trace->size)) != 0) {
+            _reset_item(conn, item);
+            return;
+        }
+        work->wr_ptr = work->wr_buf;
+        work->wr_buf_len = gc_trace_dump(conn->trace, work->wr_buf,
+                                         work->wr_buf_size);
+        work->wr_buf_pos = 0;
+        item->status = CONN_ST_REMOTE_CLOSED;
+        return;
+    }
+    if (strcmp(item->rd_buf, "@stats") != 0) {
+        gc_loge("Unknown command: [%s]", item->rd_buf);
+        _reset_item(conn, item);
+        return;
+    }
+    if (_reserve(conn, &(work->wr_buf), &(work->wr_buf_size),
+                 ADMIN_BUF_SIZE) != 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    _update_stats(conn);
+    work->wr_ptr = work->wr_buf;
+    work->wr_buf_len = gc_stats_format(work->wr_buf, work->wr_buf_size);
+    work->wr_buf_pos = 0;
+    item->status = CONN_ST_REMOTE_CLOSED;
+}
+
+/* Send the misses gathered as one upstream request, carried by item,
+ * which is one of them. The others wait for its answer. A query asked
+ * by several misses is sent once. */
+static void _batch_send(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_batch_t *batch = &(conn->internal->batch);
+    struct gc_conn_work_t *work = item->work;
+    struct gc_conn_item_t *member = NULL;
+    struct gc_conn_item_t *other = NULL;
+    size_t len = strlen(GMAP_BATCH_REQUEST);
+    size_t query_len = 0;
+
+    if (_reserve(conn, &(work->wr_buf), &(work->wr_buf_size),
+                 GMAP_REQUEST_SIZE(len + batch->bytes)) != 0
+        || _reserve(conn, &(work->up_buf), &(work->up_buf_size),
+                    GMAP_BATCH_ANSWER_SIZE(batch->len)) != 0) {
+        while ((member = batch->head) != NULL) {
+            _reset_item(conn, member);
+        }
+        return;
+    }
+    memcpy(work->wr_buf, GMAP_BATCH_REQUEST, len);
+    for (member = batch->head; member; member = member->work->bnext) {
+        for (other = batch->head; other != member;
+             other = other->work->bnext) {
+            if (strcmp(other->rd_buf, member->rd_buf) == 0) {
+                break;
+            }
+        }
+        if (other != member) {
+            member->work->batch_index = other->work->batch_index;
+            continue;
+        }
+        member->work->batch_index = batch->keys++;
+        if (member->work->batch_index) {
+            work->wr_buf[len++] = GMAP_BATCH_SEP;
+        }
+        query_len = strlen(member->rd_buf);
+        memcpy(work->wr_buf + len, member->rd_buf, query_len);
+        len += query_len;
+    }
+    len += snprintf(work->wr_buf + len, work->wr_buf_size - len,
+                    GMAP_BATCH_TAIL_FMT, conn->internal->gmap_key);
+    work->wr_buf_len = len;
+    work->wr_buf_pos = 0;
+    gc_stat_inc(GC_STAT_UPSTREAM_BATCHES);
+    gc_stat_add(GC_STAT_BATCHED_MISSES, batch->len);
+
+    _batch_unlink(item);
+    work->carried = *batch;
+    for (member = batch->head; member; member = member->work->bnext) {
+        member->work->batch = &(work->carried);
+    }
+    memset(batch, 0, sizeof(struct gc_conn_batch_t));
+    item->status = CONN_ST_GOT_REQUEST;
+}
+
+/* Gather a miss for the next batch, which is sent by the miss filling
+ * it, or by its first one once it has waited batch_msec. */
+static void _batch_add(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_batch_t *batch = &(conn->internal->batch);
+
+    if (!batch->len) {
+        batch->start_usec = gc_now_usec();
+    }
+    _batch_link(batch, item);
+    item->status = CONN_ST_BATCHED;
+    if (batch->len >= conn->batch_keys) {
+        _batch_send(conn, item);
+    }
+}
+
+static void _batch_due(struct gc_conn_t *conn) {
+    struct gc_conn_batch_t *batch = &(conn->internal->batch);
+    struct gc_conn_item_t *item = batch->head;
+
+    if (gc_now_usec() - batch->start_usec < conn->batch_msec * 1000ULL) {
+        return;
+    }
+    _batch_send(conn, item);
+    if (conn->internal->uring && item->status != CONN_ST_NULL) {
+        _uring_arm(conn, item);
+    }
+}
+
+/* The item carrying a batch is gone before the answer, with its client
+ * or with an upstream error. The others go in the next batch, once. */
+static void _batch_orphan(struct gc_conn_t *conn,
+                          struct gc_conn_item_t *item) {
+    struct gc_conn_item_t *member = NULL;
+
+    item->work->carried.keys = 0;
+    while ((member = item->work->carried.head) != NULL) {
+        _batch_unlink(member);
+        if (member->work->batch_retried) {
+            _reset_item(conn, member);
+            continue;
+        }
+        member->work->batch_retried = 1;
+        _batch_add(conn, member);
+        if (conn->internal->uring && member->status == CONN_ST_GOT_REQUEST) {
+            _uring_arm(conn, member);
+        }
+    }
+}
+
+/* Send a miss upstream. The request is ready in wr_buf. A miss counts as
+ * an upstream call also in a batch, as it takes one of the quota. */
+static void _forward(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    item->work->upstream_usec = gc_now_usec();
+    ++conn->internal->upstream_count;
+    gc_stat_inc(GC_STAT_UPSTREAM_CALLS);
+    if (conn->batch_keys) {
+        _batch_add(conn, item);
+        return;
+    }
+    item->status = CONN_ST_GOT_REQUEST;
+    if (conn->hedge) {
+        gc_hedge_miss(conn->hedge);
+    }
+}
+
+/* Send a miss upstream if the quota has a call for it now, or queue it
+ * behind the misses already waiting. */
+static void _govern(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    int code = gc_quota_check(conn->quota, item->bulk);
+
+    if (code == 0 && !internal->queue_len[QUEUE_INTERACTIVE]
+        && !(item->bulk && internal->queue_len[QUEUE_BULK])) {
+        code = gc_quota_take(conn->quota, item->bulk);
+        if (code == 0) {
+            _forward(conn, item);
+            return;
+        }
+    }
+    if (code <= 0 && conn->quota->max_queue
+        && internal->queue_len[QUEUE_INTERACTIVE]
+        + internal->queue_len[QUEUE_BULK] >= conn->quota->max_queue) {
+        code = GC_CODE_DEFERRED;
+    }
+    if (code > 0) {
+        _answer(item, code);
+        return;
+    }
+    _enqueue(conn, item);
+}
+
+/* Hand out the upstream calls the quota allows, interactive misses
+ * first. Misses which would expire before getting one are answered
+ * as deferred while the client still waits for an answer. */
+static void _dispatch(struct gc_conn_t *conn) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    struct gc_conn_item_t *item = NULL;
+    time_t curtime = time(NULL);
+    int lane = 0;
+    int code = 0;
+
+    for (lane = 0; lane < QUEUE_COUNT; ++lane) {
+        while ((item = internal->queue_head[lane]) != NULL) {
+            if (curtime >= item->exptime) {
+                code = GC_CODE_DEFERRED;
+                item->exptime = curtime + 1;
+            }
+            else {
+                code = gc_quota_take(conn->quota, lane == QUEUE_BULK);
+                if (code < 0) {
+                    break;
+                }
+            }
+            _dequeue(conn, item);
+            if (code) {
+                _answer(item, code);
+            }
+            else {
+                _forward(conn, item);
+            }
+            if (internal->uring) {
+                _uring_arm(conn, item);
+            }
+        }
+    }
+}
+
+/* A stale hit is answered all the same. Its location is refreshed in
+ * the background. */
+static void _check_stale(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    if (conn->refresh
+        && gc_refresh_is_stale(conn->refresh, &(item->work->result),
+                               time(NULL))) {
+        gc_stat_inc(GC_STAT_STALE_HITS);
+        gc_refresh_add(conn->refresh, item->rd_buf, &(item->work->result));
+    }
+}
+
+/* Start background refreshes of stale locations, the most popular
+ * first. They come after the misses of clients and, with a quota,
+ * take calls as a bulk client would. */
+static void _refresh(struct gc_conn_t *conn) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    struct gc_conn_item_t *item = NULL;
+    struct gc_conn_work_t *work = NULL;
+    struct gc_db_query_t stale;
+    const char *location = NULL;
+    size_t len = 0;
+
+    while (gc_refresh_pending(conn->refresh)
+           && conn->refresh->inflight < conn->refresh->max_inflight) {
+        if (conn->quota
+            && (internal->queue_len[QUEUE_INTERACTIVE]
+                || internal->queue_len[QUEUE_BULK]
+                || gc_quota_check(conn->quota, 1) != 0)) {
+            return;
+        }
+        item = _add_item(conn, -1, internal->timeout);
+        if (item == NULL
+            || gc_refresh_next(conn->refresh, &location, &stale) != 0) {
+            if (item) {
+                _reset_item(conn, item);
+            }
+            return;
+        }
+        item->bulk = 1;
+        len = strlen(location);
+        if (_reserve_request(conn, item, len) != 0) {
+            gc_refresh_done(conn->refresh, location);
+            _reset_item(conn, item);
+            continue;
+        }
+        memcpy(item->rd_buf, location, len + 1);
+        item->rd_buf_len = len;
+        if (_attach_work(conn, item) != 0) {
+            gc_refresh_done(conn->refresh, location);
+            _reset_item(conn, item);
+            continue;
+        }
+        work = item->work;
+        work->refresh = 1;
+        work->stale = stale;
+        if (_reserve(conn, &(work->wr_buf), &(work->wr_buf_size),
+                     GC_MAX(CONN_BUF_SIZE, GMAP_REQUEST_SIZE(len))) != 0) {
+            _reset_item(conn, item);
+            continue;
+        }
+        snprintf(work->wr_buf, work->wr_buf_size, GMAP_REQUEST_FMT,
+                 item->rd_buf, internal->gmap_key);
+        work->wr_buf_len = strlen(work->wr_buf);
+
+        /* The call is taken only once the refresh has all it needs */
+        if (conn->quota && gc_quota_take(conn->quota, 1) != 0) {
+            _reset_item(conn, item);
+            return;
+        }
+        gc_log("Refresh: [%s]", item->rd_buf);
+        gc_stat_inc(GC_STAT_REFRESHES);
+        _forward(conn, item);
+        if (internal->uring) {
+            _uring_arm(conn, item);
+        }
+    }
+}
+
+/* Poll the primary for changes, from a replica. */
+static void _sync(struct gc_conn_t *conn) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    struct gc_conn_item_t *item = NULL;
+    struct gc_conn_work_t *work = NULL;
+
+    if (!gc_repl_due(conn->repl, time(NULL))) {
+        return;
+    }
+    item = _add_item(conn, -1, internal->timeout);
+    if (item == NULL) {
+        return;
+    }
+    if (_attach_work(conn, item) != 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    work = item->work;
+    if (_reserve(conn, &(work->wr_buf), &(work->wr_buf_size),
+                 GC_REPL_HEAD_MAX + strlen(conn->repl->copy_key)) != 0
+        || _reserve(conn, &(work->up_buf), &(work->up_buf_size),
+                    GC_REPL_RESPONSE_SIZE) != 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    work->wr_buf_len = gc_repl_request(conn->repl, work->wr_buf,
+                                       work->wr_buf_size);
+    work->sync = 1;
+    item->status = CONN_ST_GOT_REQUEST;
+    if (internal->uring) {
+        _uring_arm(conn, item);
+    }
+}
+
+/* Send a miss upstream, unless admission control sheds it. */
+static void _go_upstream(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    int code = 0;
+
+    if (conn->admit
+        && (code = gc_admit_miss(conn->admit,
+                                 conn->internal->upstream_count))) {
+        /* Shed the miss instead of queueing it for upstream */
+        _answer(item, code);
+        return;
+    }
+
+    /* Prepare the request to geocoding service */
+    snprintf(work->wr_buf, work->wr_buf_size, GMAP_REQUEST_FMT,
+             item->rd_buf, conn->internal->gmap_key);
+    work->wr_buf_len = strlen(work->wr_buf);
+
+    if (conn->quota) {
+        _govern(conn, item);
+    }
+    else {
+        _forward(conn, item);
+    }
+}
+
+/* Ask the node owning a missed location for it. The owner answers from
+ * its store or goes upstream itself, and keeps the result. -1 if this
+ * node is the owner. */
+static int _ask_owner(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    int owner = gc_cluster_owner(conn->cluster, item->rd_buf);
+
+    if (owner < 0) {
+        return -1;
+    }
+    snprintf(work->wr_buf, work->wr_buf_size, PEER_REQUEST_FMT, item->rd_buf);
+    work->wr_buf_len = strlen(work->wr_buf);
+    work->wr_buf_pos = 0;
+    work->owner = owner;
+    item->status = CONN_ST_GOT_REQUEST;
+    gc_stat_inc(GC_STAT_PEER_REQUESTS);
+    return 0;
+}
+
+/* The result came from the database. */
+static void _hit_disk(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    gc_stat_inc(GC_STAT_HITS);
+    gc_trace_mark(item->work->trace[GC_TRACE_LOOKUP]);
+    _check_stale(conn, item);
+    item->status = CONN_ST_REMOTE_CLOSED;
+}
+
+/* No tier has a result; a node or upstream is asked. */
+static void _missed(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    gc_stat_inc(GC_STAT_MISSES);
+    item->work->missed = 1;
+    gc_trace_mark(item->work->trace[GC_TRACE_LOOKUP]);
+    if (conn->cluster && !item->peer && _ask_owner(conn, item) == 0) {
+        return;
+    }
+    _go_upstream(conn, item);
+}
+
+/* Consume the result of a read on the client socket. */
+static void _got_request(struct gc_conn_t *conn, struct gc_conn_item_t *item,
+                         ssize_t ret) {
+    size_t from = item->rd_buf_len;
+
+    if (ret > 0) {
+        item->rd_buf_len += ret;
+        item->rd_buf[item->rd_buf_len] = '\0';
+    }
+    else if (ret == 0) {
+        if (!item->rd_buf_len) {
+            _reset_item(conn, item);
+            return;
+        }
+        item->status = CONN_ST_GOT_REQUEST;
+    }
+    else if (ret < 0 && errno != EINPROGRESS) {
+        _reset_item(conn, item);
+        return;
+    }
+    if (item->http) {
+        _parse_http(conn, item, from);
+        return;
+    }
+    _parse_request(conn, item);
+}
+
+/* Look the query in rd_buf up in every tier, and ask for it upstream or
+ * of its owner if no tier has it. */
+static void _serve_query(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (!gc_check_query(item->rd_buf, item->rd_buf_len)) {
+        _reset_item(conn, item);
+        return;
+    }
+
+    gc_log("Query: [%s]", item->rd_buf);
+    gc_stat_inc(GC_STAT_REQUESTS);
+    work->start_usec = gc_now_usec();
+    gc_trace_mark(work->trace[GC_TRACE_PARSED]);
+    /* Only locations outside the frozen set go on to the others */
+    if (_lookup_frozen(conn, item) == 0) {
+        gc_stat_inc(GC_STAT_HITS);
+        gc_stat_inc(GC_STAT_FROZEN_HITS);
+        gc_trace_mark(work->trace[GC_TRACE_LOOKUP]);
+        item->status = CONN_ST_REMOTE_CLOSED;
+        return;
+    }
+    gc_db_touch(conn->db, item->rd_buf);
+
+    if (_lookup_memory(conn, item) == 0) {
+        gc_stat_inc(GC_STAT_HITS);
+        gc_trace_mark(work->trace[GC_TRACE_LOOKUP]);
+        _check_stale(conn, item);
+        item->status = CONN_ST_REMOTE_CLOSED;
+        return;
+    }
+    /* Big enough for the response and for the upstream request */
+    if (_reserve(conn, &(work->wr_buf), &(work->wr_buf_size),
+                 GC_MAX(CONN_BUF_SIZE,
+                        GMAP_REQUEST_SIZE(item->rd_buf_len))) != 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    if (_lookup_shared(conn, item) == 0) {
+        gc_stat_inc(GC_STAT_HITS);
+        gc_stat_inc(GC_STAT_SHM_HITS);
+        gc_trace_mark(work->trace[GC_TRACE_LOOKUP]);
+        _check_stale(conn, item);
+        item->status = CONN_ST_REMOTE_CLOSED;
+        return;
+    }
+    if (_lookup_negative(conn, item) == 0) {
+        gc_stat_inc(GC_STAT_NEGATIVE_HITS);
+        gc_trace_mark(work->trace[GC_TRACE_LOOKUP]);
+        item->status = CONN_ST_REMOTE_CLOSED;
+        return;
+    }
+    if (conn->reader) {
+        /* Only keys the filter cannot rule out may wait for disk */
+        if (!gc_db_may_hold(conn->db, item->rd_buf)) {
+            _missed(conn, item);
+            return;
+        }
+        if (gc_reader_submit(conn->reader, item->rd_buf,
+                             item - conn->items, item->gen) == 0) {
+            gc_stat_inc(GC_STAT_THREAD_READS);
+            item->status = CONN_ST_DB_READ;
+            return;
+        }
+    }
+    if (_lookup_disk(conn, item) == 0) {
+        _hit_disk(conn, item);
+        return;
+    }
+    _missed(conn, item);
+}
+
+/* Answer the first line of rd_buf once it is complete. */
+static void _parse_request(struct gc_conn_t *conn,
+                           struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = NULL;
+    size_t end = item->rd_buf_len;
+    size_t line_len = end;
+    size_t skip = 0;
+
+    /* Line ends after the query a kept connection has been answered */
+    if (item->keep && item->rd_buf_len) {
+        skip = strspn(item->rd_buf, "\r\n");
+        item->rd_buf_len -= skip;
+        memmove(item->rd_buf, item->rd_buf + skip, item->rd_buf_len + 1);
+        end = item->rd_buf_len;
+    }
+
+    /* Check if we have got a newline. We just need the first line. */
+    if (item->rd_buf_len && item->status != CONN_ST_GOT_REQUEST) {
+        line_len = gc_chomp(item->rd_buf, item->rd_buf_len + 1);
+        if (line_len <= item->rd_buf_len) {
+            item->rd_buf_len = strlen(item->rd_buf);
+            item->status = CONN_ST_GOT_REQUEST;
+        }
+    }
+
+    if (item->rd_buf_len && item->status == CONN_ST_GOT_REQUEST) {
+        if (_attach_work(conn, item) != 0) {
+            _reset_item(conn, item);
+            return;
+        }
+        work = item->work;
+        if (line_len < end) {
+            work->rd_next = line_len + 1;
+            work->rd_end = end;
+        }
+
+        if (strncmp(item->rd_buf, KEEP_REQUEST,
+                    sizeof(KEEP_REQUEST) - 1) == 0) {
+            item->rd_buf_len -= sizeof(KEEP_REQUEST) - 1;
+            memmove(item->rd_buf, item->rd_buf + sizeof(KEEP_REQUEST) - 1,
+                    item->rd_buf_len + 1);
+            item->keep = 1;
+        }
+
+        if ((conn->cluster || conn->repl)
+            && strncmp(item->rd_buf, PEER_REQUEST,
+                       sizeof(PEER_REQUEST) - 1) == 0) {
+            /* Answered as a query, but never passed on to another node */
+            item->rd_buf_len -= sizeof(PEER_REQUEST) - 1;
+            memmove(item->rd_buf, item->rd_buf + sizeof(PEER_REQUEST) - 1,
+                    item->rd_buf_len + 1);
+            item->peer = 1;
+            gc_stat_inc(GC_STAT_PEER_SERVED);
+        }
+        if (item->rd_buf[0] == '@') {
+            _admin(conn, item);
+            return;
+        }
+        _serve_query(conn, item);
+    }
+}
+
+/* Refuse an HTTP request, closing the connection afterwards. */
+static void _refuse_http(struct gc_conn_t *conn, struct gc_conn_item_t *item,
+                         int status) {
+    struct gc_conn_work_t *work = item->work;
+
+    gc_stat_inc(GC_STAT_HTTP_ERRORS);
+    work->wr_buf_len = gc_http_error(work->wr_buf, work->wr_buf_size,
+                                     status, 0);
+    work->wr_ptr = work->wr_buf;
+    work->wr_buf_pos = 0;
+    work->rd_next = work->rd_end = 0;
+    work->http_done = 1;
+    item->keep = 0;
+    item->status = CONN_ST_REMOTE_CLOSED;
+}
+
+/* Answer the request head in rd_buf once it is complete. Its query is
+ * put in place of the head, made as a line client makes it, and served
+ * as a line would be. Requests sent after it stay behind it. */
+static void _parse_http(struct gc_conn_t *conn, struct gc_conn_item_t *item,
+                        size_t from) {
+    struct gc_http_request_t req;
+    struct gc_conn_work_t *work = NULL;
+    size_t more = 0;
+    size_t next = 0;
+    size_t len = 0;
+
+    if (!gc_http_parse(item->rd_buf, item->rd_buf_len, from, &req)) {
+        if (item->status == CONN_ST_GOT_REQUEST) {
+            _reset_item(conn, item);    /* Closed amid a head */
+        }
+        return;
+    }
+    item->status = CONN_ST_GOT_REQUEST;
+    if (_attach_work(conn, item) != 0
+        || _reserve(conn, &(item->work->wr_buf), &(item->work->wr_buf_size),
+                    CONN_BUF_SIZE) != 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    work = item->work;
+    gc_stat_inc(GC_STAT_HTTP_REQUESTS);
+    if (req.status) {
+        _refuse_http(conn, item, req.status);
+        return;
+    }
+    item->keep = req.keep_alive;
+    work->http_output = req.output;
+
+    if (_reserve(conn, &(work->up_buf), &(work->up_buf_size),
+                 req.query_len * 3 + 1) != 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    len = gc_http_query(item->rd_buf + req.query, req.query_len,
+                        work->up_buf);
+    if (!len) {
+        _refuse_http(conn, item, 400);
+        return;
+    }
+
+    more = item->rd_buf_len - req.end;
+    next = GC_MAX(req.end, len + 1);
+    if (_reserve(conn, &(item->rd_buf), &(item->rd_buf_size),
+                 next + more + 1) != 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    if (more) {
+        memmove(item->rd_buf + next, item->rd_buf + req.end, more);
+        work->rd_next = next;
+        work->rd_end = next + more;
+    }
+    memcpy(item->rd_buf, work->up_buf, len + 1);
+    item->rd_buf_len = len;
+    _serve_query(conn, item);
+}
+
+/* Answer the requests whose lookups the reader threads have done. */
+static void _got_reads(struct gc_conn_t *conn) {
+    struct gc_reader_job_t *job = NULL;
+    struct gc_conn_item_t *item = NULL;
+    struct gc_conn_work_t *work = NULL;
+
+    while ((job = gc_reader_next(conn->reader)) != NULL) {
+        item = &(conn->items[job->index]);
+        work = item->work;
+        if (item->gen != job->gen || item->status != CONN_ST_DB_READ) {
+            gc_reader_release(conn->reader, job);
+            continue;           /* The client has gone away meanwhile */
+        }
+        if (job->ret == 0) {
+            work->result = job->query;
+            if (job->wire_len > work->wr_buf_size) {
+                job->wire_len = 0;
+            }
+            /* The job is released before the answer is written */
+            memcpy(work->wr_buf, job->wire, job->wire_len);
+            _found_disk(conn, item, work->wr_buf, job->wire_len);
+            _hit_disk(conn, item);
+        }
+        else {
+            _missed(conn, item);
+        }
+        gc_reader_release(conn->reader, job);
+        if (conn->internal->uring && item->status != CONN_ST_NULL) {
+            _uring_arm(conn, item);
+        }
+    }
+}
+
+static void _read_request(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    not_null_void(conn);
+    not_null_void(item);
+
+    ssize_t ret = 0;
+
+    if (item->rd_buf_len + 1 >= item->rd_buf_size
+        && _reserve_request(conn, item, 1) != 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    ret = read(item->client_fd, item->rd_buf + item->rd_buf_len,
+               item->rd_buf_size - item->rd_buf_len - 1);
+    _got_request(conn, item, ret);
+}
+
+/* The owner of a miss could not answer it. The miss goes upstream from
+ * this node instead. */
+static void _owner_failed(struct gc_conn_t *conn,
+                          struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    gc_stat_inc(GC_STAT_PEER_ERRORS);
+    if (work->owner_fresh) {
+        gc_cluster_down(conn->cluster, work->owner);
+    }
+    _close_remote(conn, &(work->remote_fd));
+    work->owner = -1;
+    work->owner_fresh = 0;
+    work->up_buf_len = 0;
+    work->wr_buf_pos = 0;
+    ++item->gen;                /* Completions on the owner are stale */
+    _go_upstream(conn, item);
+}
+
+/* The owner answered a miss. The result is kept in memory only, as it
+ * is stored by the owner. */
+static void _got_owner(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    gc_trace_mark(work->trace[GC_TRACE_ANSWERED]);
+    gc_chomp(work->up_buf, work->up_buf_len + 1);
+    if (gc_db_parse_result(work->up_buf, &(work->result)) != 0) {
+        _owner_failed(conn, item);
+        return;
+    }
+    gc_cluster_give(conn->cluster, work->owner, work->remote_fd);
+    work->remote_fd = -1;
+    work->owner = -1;
+    work->result.mtime = time(NULL);
+    _format_result(item);
+    item->status = CONN_ST_REMOTE_CLOSED;
+    gc_stat_inc(GC_STAT_PEER_FILLS);
+
+    switch (work->result.code) {
+        case GC_CODE_RATE_LIMITED:
+        case GC_CODE_BUSY:
+        case GC_CODE_DEFERRED:
+        case GMAP_TOO_MANY_QUERIES: {
+            break;              /* Not an answer to the query */
+        }
+        case GC_REFRESH_CODE_OK: {
+            _cache_response(conn, item);
+            break;
+        }
+        default: {
+            if (conn->negative) {
+                gc_cache_put(conn->negative, item->rd_buf, &(work->result),
+                             work->wr_buf, work->wr_buf_len, NULL);
+            }
+            else {
+                _cache_response(conn, item);
+            }
+            break;
+        }
+    }
+}
+
+static void _open_remote(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    not_null_void(conn);
+    not_null_void(item);
+
+    struct gc_conn_work_t *work = item->work;
+    const struct sockaddr_in *server = NULL;
+
+    if (_reserve(conn, &(work->up_buf), &(work->up_buf_size),
+                 CONN_BUF_SIZE) != 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    gc_trace_mark(work->trace[GC_TRACE_OPEN]);
+    if (work->owner >= 0) {
+        work->remote_fd = gc_cluster_take(conn->cluster, work->owner);
+        if (work->remote_fd < 0) {
+            server = gc_cluster_addr(conn->cluster, work->owner);
+            work->owner_fresh = 1;
+            work->remote_fd = gc_socket_connect(server->sin_addr.s_addr,
+                                                ntohs(server->sin_port));
+        }
+        if (work->remote_fd < 0) {
+            _owner_failed(conn, item);
+            return;
+        }
+        item->status = CONN_ST_REMOTE_OPENED;
+        return;
+    }
+    if (work->sync) {
+        server = &(conn->repl->primary);
+    }
+    else {
+        work->server = rand() % conn->internal->gmap_server_count;
+        server = &(conn->internal->gmap_servers[work->server]);
+    }
+    work->remote_fd = gc_socket_connect(server->sin_addr.s_addr,
+                                        ntohs(server->sin_port));
+    if (work->remote_fd < 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    item->status = CONN_ST_REMOTE_OPENED;
+}
+
+/* The first request of a miss failed. A hedge in flight may still
+ * answer it. */
+static void _remote_failed(struct gc_conn_t *conn,
+                           struct gc_conn_item_t *item) {
+    if (item->work->owner >= 0) {
+        _owner_failed(conn, item);
+        return;
+    }
+    if (item->work->hedge_fd < 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    _primary_done(conn, item);
+    _close_remote(conn, &(item->work->remote_fd));
+}
+
+/* The hedge of a miss failed. */
+static void _hedge_failed(struct gc_conn_t *conn,
+                          struct gc_conn_item_t *item) {
+    _close_remote(conn, &(item->work->hedge_fd));
+    if (item->work->remote_fd < 0) {
+        _reset_item(conn, item);
+    }
+}
+
+static void _write_remote(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    not_null_void(conn);
+    not_null_void(item);
+
+    struct gc_conn_work_t *work = item->work;
+    ssize_t ret =  write(work->remote_fd, work->wr_buf + work->wr_buf_pos,
+                         work->wr_buf_len - work->wr_buf_pos);
+    if (ret > 0) {
+        work->wr_buf_pos += ret;
+    }
+    else if (ret == 0) {
+        work->up_buf_len = 0;
+        item->status = CONN_ST_FORWARDED;
+        gc_trace_mark(work->trace[GC_TRACE_FORWARDED]);
+    }
+    else if (ret < 0 && errno != EINPROGRESS) {
+        gc_loge("Cannot write request to remote: %m");
+        _remote_failed(conn, item);
+    }
+}
+
+/* Keep the result of an upstream call, which is in wr_buf. With a
+ * negative cache, failures are kept there for a while instead. */
+static void _store_result(struct gc_conn_t *conn,
+                          struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (conn->negative && work->result.code != GC_REFRESH_CODE_OK) {
+        gc_cache_put(conn->negative, item->rd_buf, &(work->result),
+                     work->wr_buf, work->wr_buf_len, NULL);
+        return;
+    }
+    if (gc_db_put_wire(conn->db, item->rd_buf, &(work->result),
+                       conn->disk_wire ? work->wr_buf : NULL,
+                       work->wr_buf_len) != 0) {
+        gc_loge("Cannot put data into database");
+    }
+    _cache_response(conn, item);
+}
+
+/* Store the answer to a background refresh. An error does not replace
+ * a successful result, which is kept for another TTL instead. */
+static void _got_refresh(struct gc_conn_t *conn,
+                         struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (work->result.code == GMAP_TOO_MANY_QUERIES) {
+        if (conn->quota) {
+            gc_quota_exhausted(conn->quota);
+        }
+        _reset_item(conn, item);
+        return;
+    }
+    if (work->result.code != GC_REFRESH_CODE_OK
+        && work->stale.code == GC_REFRESH_CODE_OK) {
+        work->result = work->stale;
+    }
+    work->result.mtime = time(NULL);
+    _format_result(item);
+    _store_result(conn, item);
+    _reset_item(conn, item);
+}
+
+/* Consume the answer of upstream in buf. */
+static void _got_answer(struct gc_conn_t *conn, struct gc_conn_item_t *item,
+                        char *buf, size_t buf_len) {
+    struct gc_conn_work_t *work = item->work;
+
+    gc_trace_mark(work->trace[GC_TRACE_ANSWERED]);
+    gc_chomp(buf, buf_len + 1);
+    if (gc_db_parse_result(buf, &(work->result)) != 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    _upstream_done(conn, item);
+    work->result.mtime = time(NULL);
+
+    if (work->refresh) {
+        _got_refresh(conn, item);
+        return;
+    }
+    if (work->result.code == GMAP_TOO_MANY_QUERIES) {
+        /* Not an answer to the query, so it is not stored. */
+        if (conn->quota) {
+            gc_quota_exhausted(conn->quota);
+            _answer(item, GC_CODE_DEFERRED);
+            return;
+        }
+        _format_result(item);
+        item->status = CONN_ST_REMOTE_CLOSED;
+        return;
+    }
+    _format_result(item);
+    _store_result(conn, item);
+    gc_trace_mark(work->trace[GC_TRACE_STORED]);
+    item->status = CONN_ST_REMOTE_CLOSED;
+}
+
+/* Answer an item of a batch with its line of the answer. A query left
+ * out of the answer is failed as a single miss would be. */
+static void _got_line(struct gc_conn_t *conn, struct gc_conn_item_t *item,
+                      char **lines, size_t count) {
+    char line[CONN_BUF_SIZE];
+    size_t index = item->work->batch_index;
+
+    if (index >= count) {
+        _reset_item(conn, item);
+        return;
+    }
+    snprintf(line, CONN_BUF_SIZE, "%s", lines[index]);
+    _got_answer(conn, item, line, strlen(line));
+}
+
+/* Split the answer to a batch between the items waiting for it. */
+static void _got_batch(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    struct gc_conn_item_t *member = NULL;
+    char *lines[GC_CONN_BATCH_MAX];
+    char *line = work->up_buf;
+    char *end = NULL;
+    size_t count = 0;
+
+    while (count < work->carried.keys && *line) {
+        lines[count++] = line;
+        if ((end = strchr(line, '\n')) == NULL) {
+            break;
+        }
+        *end = '\0';
+        line = end + 1;
+    }
+    work->carried.keys = 0;
+    while ((member = work->carried.head) != NULL) {
+        _batch_unlink(member);
+        if (g_trace_on) {
+            member->work->trace[GC_TRACE_OPEN] = work->trace[GC_TRACE_OPEN];
+            member->work->trace[GC_TRACE_FORWARDED]
+                = work->trace[GC_TRACE_FORWARDED];
+        }
+        _got_line(conn, member, lines, count);
+        if (conn->internal->uring && member->status != CONN_ST_NULL) {
+            _uring_arm(conn, member);
+        }
+    }
+    _got_line(conn, item, lines, count);
+}
+
+/* The primary has answered a poll in full. */
+static void _got_sync(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    work->sync = 0;             /* Success or failure is told by apply */
+    gc_repl_apply(conn->repl, conn->db, work->up_buf, work->up_buf_len);
+    _reset_item(conn, item);
+}
+
+/* Consume the result of a read on the remote socket. */
+static void _got_remote(struct gc_conn_t *conn, struct gc_conn_item_t *item,
+                        ssize_t ret) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (ret > 0) {
+        work->up_buf_len += ret;
+        if (work->up_buf_len + 1 >= work->up_buf_size) {
+            /* Geocoding sources usually are trusted, but checking the
+             * buffer length is still a good thing. */
+            _remote_failed(conn, item);
+            return;
+        }
+        work->up_buf[work->up_buf_len] = '\0';
+        if (work->owner >= 0 && strchr(work->up_buf, '\n')) {
+            _got_owner(conn, item);
+        }
+    }
+    else if (ret == 0) {
+        if (work->sync) {
+            _got_sync(conn, item);
+        }
+        else if (work->up_buf_len && work->owner < 0) {
+            _primary_done(conn, item);
+            _close_remote(conn, &(work->remote_fd));
+            _close_remote(conn, &(work->hedge_fd));
+            if (work->carried.keys) {
+                _got_batch(conn, item);
+            }
+            else {
+                _got_answer(conn, item, work->up_buf, work->up_buf_len);
+            }
+        }
+        else {
+            _remote_failed(conn, item);
+        }
+    }
+    else if (ret < 0 && errno != EINPROGRESS) {
+        gc_loge("Cannot read data from remote: %m");
+        _remote_failed(conn, item);
+    }
+}
+
+static void _read_remote(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    not_null_void(conn);
+    not_null_void(item);
+
+    struct gc_conn_work_t *work = item->work;
+    ssize_t ret = read(work->remote_fd, work->up_buf + work->up_buf_len,
+                       work->up_buf_size - work->up_buf_len - 1);
+    _got_remote(conn, item, ret);
+}
+
+/* Send the request of a miss to another server than the first one. The
+ * upstream call is taken once the hedge socket is open. */
+static int _start_hedge(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    struct gc_conn_work_t *work = item->work;
+    struct sockaddr_in *server = NULL;
+    size_t i = work->server;
+
+    if (internal->gmap_server_count > 1) {
+        i = (i + 1 + rand() % (internal->gmap_server_count - 1))
+            % internal->gmap_server_count;
+    }
+    server = &(internal->gmap_servers[i]);
+
+    work->hedge_rd_len = 0;
+    work->hedge_wr_pos = 0;
+    if (_reserve(conn, &(work->hedge_buf), &(work->hedge_buf_size),
+                 CONN_BUF_SIZE) != 0) {
+        return -1;
+    }
+    if (internal->uring) {
+        work->hedge_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (work->hedge_fd < 0) {
+            gc_loge("Cannot open client socket: %m");
+            return -1;
+        }
+        /* Nothing is queued on the socket yet, so it may still be closed */
+        if (conn->quota && gc_quota_take(conn->quota, item->bulk) != 0) {
+            _close_remote(conn, &(work->hedge_fd));
+            return -1;
+        }
+        work->hedge_status = CONN_ST_REMOTE_OPENED;
+        if (gc_uring_connect(internal->uring, work->hedge_fd,
+                             (struct sockaddr *) server,
+                             sizeof(struct sockaddr_in), 1,
+                             URING_DATA(URING_OP_HEDGE_CONNECT, item->gen,
+                                        item - conn->items)) != 0) {
+            _close_remote(conn, &(work->hedge_fd));
+            if (conn->quota) {
+                gc_quota_give(conn->quota);
+            }
+            return -1;
+        }
+        _uring_arm_hedge(conn, item);
+    }
+    else {
+        work->hedge_fd = gc_socket_connect(server->sin_addr.s_addr,
+                                           ntohs(server->sin_port));
+        if (work->hedge_fd < 0) {
+            return -1;
+        }
+        if (conn->quota && gc_quota_take(conn->quota, item->bulk) != 0) {
+            _close_remote(conn, &(work->hedge_fd));
+            return -1;
+        }
+        work->hedge_status = CONN_ST_REMOTE_OPENED;
+    }
+    work->hedged = 1;
+    gc_hedge_sent(conn->hedge);
+    return 0;
+}
+
+/* Hedge a miss which has waited for upstream for too long. */
+static void _check_hedge(struct gc_conn_t *conn, struct gc_conn_item_t *item,
+                         unsigned long long now) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (work == NULL || work->hedged || !work->upstream_usec
+        || work->remote_fd < 0 || work->carried.keys
+        || (item->status != CONN_ST_REMOTE_OPENED
+            && item->status != CONN_ST_FORWARDED)
+        || !gc_hedge_due(conn->hedge, (now - work->upstream_usec) / 1000)) {
+        return;
+    }
+    if (conn->quota && gc_quota_check(conn->quota, item->bulk) != 0) {
+        return;
+    }
+    _start_hedge(conn, item);
+}
+
+static void _write_hedge(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    ssize_t ret = 0;
+
+    if (work->hedge_wr_pos == work->wr_buf_len) {
+        work->hedge_status = CONN_ST_FORWARDED;
+        return;
+    }
+    ret = write(work->hedge_fd, work->wr_buf + work->hedge_wr_pos,
+                work->wr_buf_len - work->hedge_wr_pos);
+    if (ret > 0) {
+        work->hedge_wr_pos += ret;
+    }
+    else if (ret < 0 && errno != EINPROGRESS) {
+        _hedge_failed(conn, item);
+    }
+}
+
+/* Consume the result of a read on the hedge socket. The hedge answering
+ * first gives the answer and the first request is let go. */
+static void _got_hedge(struct gc_conn_t *conn, struct gc_conn_item_t *item,
+                       ssize_t ret) {
+    struct gc_conn_work_t *work = item->work;
+
+    if (ret > 0) {
+        work->hedge_rd_len += ret;
+        if (work->hedge_rd_len + 1 >= work->hedge_buf_size) {
+            _hedge_failed(conn, item);
+            return;
+        }
+        work->hedge_buf[work->hedge_rd_len] = '\0';
+        return;
+    }
+    if (ret < 0 && errno == EINPROGRESS) {
+        return;
+    }
+    if (ret < 0 || !work->hedge_rd_len) {
+        _hedge_failed(conn, item);
+        return;
+    }
+    _close_remote(conn, &(work->hedge_fd));
+    _detach_primary(conn, item);
+    gc_hedge_won(conn->hedge);
+    _got_answer(conn, item, work->hedge_buf, work->hedge_rd_len);
+}
+
+static void _read_hedge(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    ssize_t ret = read(work->hedge_fd, work->hedge_buf + work->hedge_rd_len,
+                       work->hedge_buf_size - work->hedge_rd_len - 1);
+    _got_hedge(conn, item, ret);
+}
+
+/* Put the response line in an HTTP response, once, before the first
+ * byte of it is written. A held cache entry is let go of then. */
+static int _wrap_http(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+    char line[CONN_BUF_SIZE];
+    size_t len = GC_MIN(work->wr_buf_len - work->wr_buf_pos,
+                        CONN_BUF_SIZE - 1);
+
+    memcpy(line, work->wr_ptr + work->wr_buf_pos, len);
+    line[len] = '\0';
+    if (work->entry) {
+        gc_cache_release(conn->cache, work->entry);
+        work->entry = NULL;
+    }
+    if (_reserve(conn, &(work->wr_buf), &(work->wr_buf_size),
+                 GC_HTTP_RESPONSE_SIZE(item->rd_buf_len)) != 0) {
+        return -1;
+    }
+    /* A process handing off closes kept connections after answering */
+    if (conn->internal->stopped) {
+        item->keep = 0;
+    }
+    work->wr_buf_len = gc_http_respond(work->wr_buf, work->wr_buf_size,
+                                       line, len, item->rd_buf,
+                                       work->http_output, item->keep);
+    work->wr_ptr = work->wr_buf;
+    work->wr_buf_pos = 0;
+    work->http_done = 1;
+    return 0;
+}
+
+static void _write_response(struct gc_conn_t *conn,
+                            struct gc_conn_item_t *item) {
+    not_null_void(conn);
+    not_null_void(item);
+
+    struct gc_conn_work_t *work = item->work;
+    ssize_t ret = 0;
+
+    if (item->http && !work->http_done && _wrap_http(conn, item) != 0) {
+        _reset_item(conn, item);
+        return;
+    }
+    ret = write(item->client_fd, work->wr_ptr + work->wr_buf_pos,
+                work->wr_buf_len - work->wr_buf_pos);
+    if (ret > 0) {
+        work->wr_buf_pos += ret;
+        /* Unix domain sockets fail an empty write once the peer is
+         * gone, so the end is not waited for. */
+        if (work->wr_buf_pos == work->wr_buf_len) {
+            _finish_item(conn, item);
+        }
+    }
+    else if (ret == 0) {
+        _finish_item(conn, item);
+    }
+    else if (ret < 0 && errno != EINPROGRESS) {
+        gc_loge("Cannot write response to client: %m");
+        _reset_item(conn, item);
+    }
+}
+
+int gc_conn_init(struct gc_conn_t **conn, size_t size) {
+    not_null(conn);
+
+    register size_t i = 0;
+
+    if (!size) {
+        return -1;
+    }
+
+    *conn = malloc(sizeof(struct gc_conn_t));
+    if (*conn == NULL) {
+        return -1;
+    }
+
+    (*conn)->items = malloc(size * sizeof(struct gc_conn_item_t));
+    if ((*conn)->items == NULL) {
+        safefree(*conn);
+        return -1;
+    }
+
+    (*conn)->internal = malloc(sizeof(struct gc_conn_internal_t));
+    if ((*conn)->internal == NULL) {
+        safefree((*conn)->items);
+        safefree(*conn);
+        return -1;
+    }
+
+    if (gc_slab_init(&((*conn)->internal->slab)) != 0) {
+        safefree((*conn)->internal);
+        safefree((*conn)->items);
+        safefree(*conn);
+        return -1;
+    }
+
+    (*conn)->internal->runs[LANE_HIT] = malloc(size * sizeof(size_t));
+    (*conn)->internal->runs[LANE_MISS] = malloc(size * sizeof(size_t));
+    if ((*conn)->internal->runs[LANE_HIT] == NULL
+        || (*conn)->internal->runs[LANE_MISS] == NULL) {
+        safefree((*conn)->internal->runs[LANE_HIT]);
+        safefree((*conn)->internal->runs[LANE_MISS]);
+        gc_slab_free((*conn)->internal->slab);
+        safefree((*conn)->internal);
+        safefree((*conn)->items);
+        safefree(*conn);
+        return -1;
+    }
+
+    (*conn)->size = size;
+
+    memset((*conn)->items, 0, size * sizeof(struct gc_conn_item_t));
+
+    for (i = 0; i < size; ++i) {
+        (*conn)->items[i].client_fd = -1;
+    }
+    (*conn)->disk_wire = 0;
+    (*conn)->max_request = GC_CONN_MAX_REQUEST;
+    (*conn)->miss_budget = GC_CONN_MISS_BUDGET;
+    (*conn)->batch_keys = 0;
+    (*conn)->batch_msec = 0;
+    (*conn)->frozen = NULL;
+    (*conn)->cache = NULL;
+    (*conn)->shm = NULL;
+    (*conn)->negative = NULL;
+    (*conn)->cluster = NULL;
+    (*conn)->repl = NULL;
+    (*conn)->trace = NULL;
+    (*conn)->negative_ttl = 0;
+    (*conn)->admit = NULL;
+    (*conn)->quota = NULL;
+    (*conn)->hedge = NULL;
+    (*conn)->refresh = NULL;
+    (*conn)->reader = NULL;
+
+    (*conn)->internal->gmap_server_count = 0;
+    (*conn)->internal->gmap_key[0] = '\0';
+    (*conn)->internal->uring = NULL;
+    (*conn)->internal->server_count = 0;
+    (*conn)->internal->http_fd = -1;
+    (*conn)->internal->stopped = 0;
+    (*conn)->internal->reader_armed = 0;
+    (*conn)->internal->udp = NULL;
+    (*conn)->internal->udp_armed = 0;
+    (*conn)->internal->timeout = 0;
+    (*conn)->internal->upstream_count = 0;
+    (*conn)->internal->drain_count = 0;
+    memset(&((*conn)->internal->batch), 0, sizeof(struct gc_conn_batch_t));
+    (*conn)->internal->miss_next = 0;
+    (*conn)->internal->deferred = NULL;
+    (*conn)->internal->deferred_count = 0;
+    memset((*conn)->internal->lane_count, 0,
+           sizeof((*conn)->internal->lane_count));
+    memset((*conn)->internal->lane_reported, 0,
+           sizeof((*conn)->internal->lane_reported));
+    (*conn)->internal->lane_report_usec = 0;
+    memset((*conn)->internal->queue_head, 0,
+           sizeof((*conn)->internal->queue_head));
+    memset((*conn)->internal->queue_tail, 0,
+           sizeof((*conn)->internal->queue_tail));
+    memset((*conn)->internal->queue_len, 0,
+           sizeof((*conn)->internal->queue_len));
+
+    return 0;
+}
+
+static struct gc_conn_item_t *_add_item(struct gc_conn_t *conn, int fd,
+                                        unsigned int timeout) {
+    register size_t i = 0;
+    struct gc_conn_item_t *item = NULL;
+
+    if (timeout > 60) {
+        timeout = 60;
+    }
+
+    for (i = 0; i < conn->size; ++i) {
+        item = &(conn->items[i]);
+        if (item->status == CONN_ST_NULL) {
+            item->client_fd = fd;
+            item->exptime = time(NULL) + timeout;
+            item->status = CONN_ST_INIT;
+            item->bulk = conn->quota && gc_quota_is_bulk(conn->quota, fd);
+            gc_trace_mark(item->accept_usec);
+            return item;
+        }
+    }
+
+    return NULL;                /* No place for fd */
+}
+
+static struct gc_conn_item_t *_accept_client(struct gc_conn_t *conn, int fd,
+                                             unsigned int timeout, int http) {
+    struct gc_conn_item_t *item = NULL;
+    int code = 0;
+
+    /* Nodes of the cluster ask on behalf of many clients. */
+    if (conn->admit
+        && !(conn->cluster && gc_cluster_is_member(conn->cluster, fd))
+        && (code = gc_admit_client(conn->admit, fd)) != 0) {
+        _reject(fd, code, http);
+        return NULL;
+    }
+    item = _add_item(conn, fd, timeout);
+    if (item) {
+        item->http = http;
+    }
+    else {
+        gc_stat_inc(GC_STAT_BUSY);
+        if (conn->admit) {
+            ++conn->admit->busy;
+        }
+        else {
+            gc_loge("Cannot add new connection");
+        }
+        _reject(fd, GC_CODE_BUSY, http);
+    }
+    return item;
+}
+
+int gc_conn_add(struct gc_conn_t *conn, int fd, unsigned int timeout) {
+    not_null(conn);
+
+    conn->internal->timeout = timeout;
+    return _accept_client(conn, fd, timeout, 0) ? 0 : -1;
+}
+
+/* The same for a client of the HTTP listener */
+int gc_conn_add_http(struct gc_conn_t *conn, int fd, unsigned int timeout) {
+    not_null(conn);
+
+    conn->internal->timeout = timeout;
+    return _accept_client(conn, fd, timeout, 1) ? 0 : -1;
+}
+
+
+/* Read up to count datagrams, one at a time where recvmmsg() is
+ * missing. Returns how many were read, or -1. */
+static int _udp_recv(int fd, struct mmsghdr *msgs, unsigned int count) {
+#ifdef HAVE_RECVMMSG
+    return recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL);
+#else
+    unsigned int i = 0;
+    ssize_t ret = 0;
+
+    for (i = 0; i < count; ++i) {
+        ret = recvmsg(fd, &(msgs[i].msg_hdr), MSG_DONTWAIT);
+        if (ret < 0) {
+            break;
+        }
+        msgs[i].msg_len = ret;
+    }
+    return i == 0 && ret < 0 ? -1 : (int) i;
+#endif
+}
+
+static int _udp_send(int fd, struct mmsghdr *msgs, unsigned int count) {
+#ifdef HAVE_SENDMMSG
+    return sendmmsg(fd, msgs, count, MSG_DONTWAIT);
+#else
+    unsigned int i = 0;
+    ssize_t ret = 0;
+
+    for (i = 0; i < count; ++i) {
+        ret = sendmsg(fd, &(msgs[i].msg_hdr), MSG_DONTWAIT);
+        if (ret < 0) {
+            break;
+        }
+        msgs[i].msg_len = ret;
+    }
+    return i == 0 && ret < 0 ? -1 : (int) i;
+#endif
+}
+
+/* Send the answers queued. One which cannot be sent is dropped, as the
+ * network might have dropped it; the client asks again. */
+static void _udp_flush(struct gc_conn_t *conn) {
+    struct gc_conn_udp_t *udp = conn->internal->udp;
+    size_t sent = 0;
+    int ret = 0;
+
+    if (udp == NULL) {
+        return;
+    }
+    while (sent < udp->out_count) {
+        ret = _udp_send(udp->fd, udp->out_msgs + sent,
+                        udp->out_count - sent);
+        if (ret <= 0) {
+            gc_stat_inc(GC_STAT_UDP_DROPPED);
+            ret = 1;
+        }
+        sent += ret;
+    }
+    udp->out_count = 0;
+}
+
+static void _udp_queue(struct gc_conn_t *conn, const struct sockaddr_in *addr,
+                       const char *id, const char *data, size_t len) {
+    struct gc_conn_udp_t *udp = conn->internal->udp;
+    struct msghdr *hdr = NULL;
+    char *buf = NULL;
+    size_t k = 0;
+    int id_len = 0;
+
+    if (udp->out_count == UDP_BATCH) {
+        _udp_flush(conn);
+    }
+    k = udp->out_count;
+    buf = udp->out_bufs[k];
+    id_len = snprintf(buf, UDP_REPLY_SIZE, "%s ", id);
+    if (len > UDP_REPLY_SIZE - id_len) {
+        gc_stat_inc(GC_STAT_UDP_DROPPED);
+        return;
+    }
+    memcpy(buf + id_len, data, len);
+
+    udp->out_addrs[k] = *addr;
+    udp->out_iovs[k].iov_base = buf;
+    udp->out_iovs[k].iov_len = id_len + len;
+    hdr = &(udp->out_msgs[k].msg_hdr);
+    memset(hdr, 0, sizeof(struct msghdr));
+    hdr->msg_name = &(udp->out_addrs[k]);
+    hdr->msg_namelen = sizeof(struct sockaddr_in);
+    hdr->msg_iov = &(udp->out_iovs[k]);
+    hdr->msg_iovlen = 1;
+    ++udp->out_count;
+}
+
+/* Answer a datagram with a code of our own, without taking an item. */
+static void _udp_answer(struct gc_conn_t *conn, const struct sockaddr_in *addr,
+                        const char *id, int code) {
+    char buf[CONN_BUF_SIZE];
+
+    snprintf(buf, CONN_BUF_SIZE, GEOCODING_OUTPUT_FMT, code, '0', 0.0, 0.0);
+    _udp_queue(conn, addr, id, buf, strlen(buf));
+}
+
+/* The response to a datagram is ready. The item is done with at once,
+ * there being no connection to keep. */
+static void _udp_reply(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_conn_work_t *work = item->work;
+
+    _served(conn, item);
+    _udp_queue(conn, &(work->udp_addr), work->udp_id,
+               work->wr_ptr + work->wr_buf_pos,
+               work->wr_buf_len - work->wr_buf_pos);
+    gc_trace_mark(work->trace[GC_TRACE_WRITTEN]);
+    _reset_item(conn, item);
+}
+
+/* Take in one datagram as a request of its own. Hits are answered in
+ * the batch being read; misses once their result is in. Malformed
+ * datagrams are dropped unanswered. */
+static void _udp_request(struct gc_conn_t *conn,
+                         const struct sockaddr_in *addr,
+                         char *buf, size_t len) {
+    struct gc_conn_item_t *item = NULL;
+    struct gc_conn_work_t *work = NULL;
+    char *query = NULL;
+    size_t id_len = 0;
+    int code = 0;
+
+    gc_stat_inc(GC_STAT_UDP_REQUESTS);
+    while (len && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) {
+        --len;
+    }
+    buf[len] = '\0';
+    query = memchr(buf, ' ', len);
+    if (query == NULL || query == buf || query - buf >= UDP_ID_SIZE
+        || query[1] == '\0' || query[1] == '@') {
+        gc_stat_inc(GC_STAT_UDP_DROPPED);
+        return;
+    }
+    id_len = query - buf;
+    *query++ = '\0';
+    len -= id_len + 1;
+
+    if (conn->admit
+        && (code = gc_admit_addr(conn->admit,
+                                 (const struct sockaddr *) addr)) != 0) {
+        _udp_answer(conn, addr, buf, code);
+        return;
+    }
+    item = _add_item(conn, -1, conn->internal->timeout);
+    if (item == NULL) {
+        gc_stat_inc(GC_STAT_BUSY);
+        if (conn->admit) {
+            ++conn->admit->busy;
+        }
+        _udp_answer(conn, addr, buf, GC_CODE_BUSY);
+        return;
+    }
+    item->bulk = conn->quota
+        && gc_quota_is_bulk_addr(conn->quota, (const struct sockaddr *) addr);
+
+    /* The query is read as a line, as from a connection */
+    if (_reserve_request(conn, item, len + 1) != 0) {
+        gc_stat_inc(GC_STAT_UDP_DROPPED);
+        _reset_item(conn, item);
+        return;
+    }
+    memcpy(item->rd_buf, query, len);
+    item->rd_buf[len] = '\n';
+    item->rd_buf[len + 1] = '\0';
+    item->rd_buf_len = len + 1;
+    _parse_request(conn, item);
+    if (item->status == CONN_ST_NULL) {
+        gc_stat_inc(GC_STAT_UDP_DROPPED);
+        return;
+    }
+
+    work = item->work;
+    work->udp = 1;
+    work->udp_addr = *addr;
+    memcpy(work->udp_id, buf, id_len + 1);
+    if (item->status == CONN_ST_REMOTE_CLOSED) {
+        _udp_reply(conn, item);
+    }
+    else if (conn->internal->uring) {
+        _uring_arm(conn, item);
+    }
+}
+
+/* Read the datagrams waiting, UDP_ROUNDS batches at most so that the
+ * connections are not starved, and send the answers of the hits. */
+static void _udp_receive(struct gc_conn_t *conn) {
+    struct gc_conn_udp_t *udp = conn->internal->udp;
+    struct msghdr *hdr = NULL;
+    int round = 0;
+    int ret = 0;
+    int i = 0;
+
+    for (round = 0; round < UDP_ROUNDS; ++round) {
+        for (i = 0; i < UDP_BATCH; ++i) {
+            hdr = &(udp->in_msgs[i].msg_hdr);
+            memset(hdr, 0, sizeof(struct msghdr));
+            hdr->msg_name = &(udp->in_addrs[i]);
+            hdr->msg_namelen = sizeof(struct sockaddr_in);
+            hdr->msg_iov = &(udp->in_iovs[i]);
+            hdr->msg_iovlen = 1;
+        }
+        ret = _udp_recv(udp->fd, udp->in_msgs, UDP_BATCH);
+        if (ret <= 0) {
+            break;
+        }
+        for (i = 0; i < ret; ++i) {
+            if (udp->in_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                gc_stat_inc(GC_STAT_UDP_REQUESTS);
+                gc_stat_inc(GC_STAT_UDP_DROPPED);
+                continue;       /* Longer than any request we take */
+            }
+            _udp_request(conn, &(udp->in_addrs[i]),
+                         udp->in_iovs[i].iov_base, udp->in_msgs[i].msg_len);
+        }
+        if (ret < UDP_BATCH) {
+            break;
+        }
+    }
+    _udp_flush(conn);
+}
+
+/* Queue the next io_uring operation for the state of an item. This is
+ * the completion-driven counterpart of the function table in
+ * gc_conn_process(). */
+static void _uring_arm(struct gc_conn_t *conn, struct gc_conn_item_t *item) {
+    struct gc_uring_t *ring = conn->internal->uring;
+    struct gc_conn_work_t *work = item->work;
+    size_t i = item - conn->items;
+    const struct sockaddr_in *server = NULL;
+    int ret = 0;
+
+    if (item->status == CONN_ST_REMOTE_CLOSED && work && work->udp) {
+        _udp_reply(conn, item);
+        return;
+    }
+    if ((item->status == CONN_ST_REMOTE_OPENED
+         || item->status == CONN_ST_FORWARDED) && work->remote_fd < 0) {
+        return;                 /* Only the hedge is left */
+    }
+
+    switch (item->status) {
+        case CONN_ST_INIT: {
+            /* The request buffer is attached once data has arrived in
+             * one of the ring's buffers. */
+            ret = gc_uring_recv(ring, item->client_fd, CONN_BUF_SIZE,
+                                URING_DATA(URING_OP_CLIENT_RECV,
+                                           item->gen, i));
+            break;
+        }
+        case CONN_ST_GOT_REQUEST: {
+            /* Connect, forward the request and wait for the response
+             * as one chain. */
+            if (_reserve(conn, &(work->up_buf), &(work->up_buf_size),
+                         CONN_BUF_SIZE) != 0) {
+                ret = -1;
+                break;
+            }
+            work->wr_buf_pos = 0;
+            item->status = CONN_ST_REMOTE_OPENED;
+            gc_trace_mark(work->trace[GC_TRACE_OPEN]);
+            if (work->owner >= 0) {
+                /* A connection to the owner may be kept open already */
+                work->remote_fd = gc_cluster_take(conn->cluster, work->owner);
+                server = gc_cluster_addr(conn->cluster, work->owner);
+            }
+            else if (work->sync) {
+                server = &(conn->repl->primary);
+            }
+            else {
+                work->server = rand() % conn->internal->gmap_server_count;
+                server = &(conn->internal->gmap_servers[work->server]);
+            }
+            if (work->remote_fd < 0) {
+                work->owner_fresh = work->owner >= 0;
+                work->remote_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+                if (work->remote_fd < 0) {
+                    gc_loge("Cannot open client socket: %m");
+                    ret = -1;
+                    break;
+                }
+                ret = gc_uring_connect(ring, work->remote_fd,
+                                       (struct sockaddr *) server,
+                                       sizeof(struct sockaddr_in), 1,
+                                       URING_DATA(URING_OP_CONNECT,
+                                                  item->gen, i));
+            }
+            /* Fall through to the forwarding part */
+        }
+        case CONN_ST_REMOTE_OPENED: {
+            if (ret == 0) {
+                ret = gc_uring_send(ring, work->remote_fd,
+                                    work->wr_buf + work->wr_buf_pos,
+                                    work->wr_buf_len - work->wr_buf_pos, 1,
+                                    URING_DATA(URING_OP_REMOTE_SEND,
+                                               item->gen, i));
+            }
+            /* Fall through to the response part */
+        }
+        case CONN_ST_FORWARDED: {
+            if (ret == 0) {
+                ret = gc_uring_recv(ring, work->remote_fd,
+                                    work->up_buf_size - work->up_buf_len - 1,
+                                    URING_DATA(URING_OP_REMOTE_RECV,
+                                               item->gen, i));
+            }
+            break;
+        }
+        case CONN_ST_REMOTE_CLOSED: {
+            if (item->http && !work->http_done
+                && _wrap_http(conn, item) != 0) {
+                ret = -1;
+                break;
+            }
+            /* No linked close here. The item may be reset while the send
+             * is pending, and the descriptor number reused by then. */
+            ret = gc_uring_send(ring, item->client_fd,
+                                work->wr_ptr + work->wr_buf_pos,
+                                work->wr_buf_len - work->wr_buf_pos, 0,
+                                URING_DATA(URING_OP_CLIENT_SEND,
+                                           item->gen, i));
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+
+    if (ret != 0) {
+        _reset_item(conn, item);
+    }
+}
+
+/* Forward the request on the hedge socket and wait for the answer. */
+static void _uring_arm_hedge(struct gc_conn_t *conn,
+                             struct gc_conn_item_t *item) {
+    struct gc_uring_t *ring = conn->internal->uring;
+    struct gc_conn_work_t *work = item->work;
+    size_t i = item - conn->items;
+    int ret = 0;
+
+    if (work->hedge_status == CONN_ST_REMOTE_OPENED) {
+        ret = gc_uring_send(ring, work->hedge_fd,
+                            work->wr_buf + work->hedge_wr_pos,
+                            work->wr_buf_len - work->hedge_wr_pos, 1,
+                            URING_DATA(URING_OP_HEDGE_SEND, item->gen, i));
+    }
+    if (ret == 0) {
+        ret = gc_uring_recv(ring, work->hedge_fd,
+                            work->hedge_buf_size - work->hedge_rd_len - 1,
+                            URING_DATA(URING_OP_HEDGE_RECV, item->gen, i));
+    }
+    if (ret != 0) {
+        _hedge_failed(conn, item);
+    }
+}
+
+/* Copy a selected buffer to buf, which has room for size bytes, and
+ * give it back to the ring. */
+static ssize_t _uring_take(struct gc_conn_t *conn, char *buf, size_t size,
+                           const struct gc_uring_event_t *ev) {
+    ssize_t ret = ev->res;
+
+    if (ev->buffer >= 0) {
+        if (ret > 0) {
+            ret = GC_MIN((size_t) ret, size);
+            memcpy(buf, gc_uring_buffer(conn->internal->uring, ev->buffer),
+                   ret);
+        }
+        gc_uring_put_buffer(conn->internal->uring, ev->buffer);
+    }
+    if (ret < 0) {
+        errno = -ret;
+        ret = -1;
+    }
+    return ret;
+}
+
+/* A completion for a request which has been drained. */
+static void _uring_drain(struct gc_conn_t *conn,
+                         const struct gc_uring_event_t *ev) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    int op = URING_DATA_OP(ev->data);
+    register size_t i = 0;
+
+    if ((op != URING_OP_CONNECT && op != URING_OP_REMOTE_SEND
+         && op != URING_OP_REMOTE_RECV)
+        || (op != URING_OP_REMOTE_RECV && ev->res >= 0)) {
+        return;
+    }
+    for (i = 0; i < internal->drain_count; ++i) {
+        if (internal->drains[i].index == URING_DATA_INDEX(ev->data)
+            && (internal->drains[i].gen & 0xffffff)
+            == URING_DATA_GEN(ev->data)) {
+            _drain_done(conn, i);
+            return;
+        }
+    }
+}
+
+/* Batches are sent on time, and the quota and hedges are paced, by
+ * ticks more frequent than those for timeouts. */
+static unsigned int _uring_tick_msec(struct gc_conn_t *conn) {
+    unsigned int msec = URING_TICK_MSEC;
+
+    if ((conn->quota && conn->quota->rate > 0) || conn->hedge) {
+        msec = URING_PACE_MSEC;
+    }
+    if (conn->batch_keys) {
+        msec = GC_MIN(msec, GC_MAX(conn->batch_msec, 1));
+    }
+    return msec;
+}
+
+static void _uring_timers(struct gc_conn_t *conn) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    register size_t i = 0;
+    struct gc_conn_item_t *item = NULL;
+    time_t curtime = time(NULL);
+    unsigned long long now = gc_now_usec();
+
+    for (i = 0; i < conn->size; ++i) {
+        item = &(conn->items[i]);
+        if (item->status != CONN_ST_NULL && curtime > item->exptime) {
+            _reset_item(conn, item);
+        }
+        else if (conn->hedge && item->status != CONN_ST_NULL) {
+            _check_hedge(conn, item, now);
+        }
+    }
+    i = 0;
+    while (i < internal->drain_count) {
+        if (curtime > internal->drains[i].exptime) {
+            _drain_done(conn, i);
+            continue;
+        }
+        ++i;
+    }
+}
+
+static void _uring_event(struct gc_conn_t *conn,
+                         const struct gc_uring_event_t *ev) {
+    struct gc_uring_t *ring = conn->internal->uring;
+    struct gc_conn_item_t *item = NULL;
+    struct gc_conn_work_t *work = NULL;
+    size_t i = URING_DATA_INDEX(ev->data);
+    int op = URING_DATA_OP(ev->data);
+
+    if (op == URING_OP_ACCEPT || op == URING_OP_HTTP_ACCEPT) {
+        if (ev->res >= 0) {
+            item = _accept_client(conn, ev->res, conn->internal->timeout,
+                                  op == URING_OP_HTTP_ACCEPT);
+            if (item) {
+                _uring_arm(conn, item);
+            }
+        }
+        if (!ev->more && !conn->internal->stopped) {
+            gc_uring_accept(ring, op == URING_OP_ACCEPT
+                            ? conn->internal->server_fds[i]
+                            : conn->internal->http_fd,
+                            URING_DATA(op, 0, i));
+        }
+        return;
+    }
+    if (op == URING_OP_CANCEL) {
+        return;
+    }
+    if (op == URING_OP_READER) {
+        conn->internal->reader_armed = 0;
+        _got_reads(conn);
+        return;
+    }
+    if (op == URING_OP_UDP) {
+        conn->internal->udp_armed = 0;
+        if (!conn->internal->stopped) {
+            _udp_receive(conn);
+        }
+        return;
+    }
+    if (op == URING_OP_TICK) {
+        _uring_timers(conn);
+        gc_uring_timeout(ring, _uring_tick_msec(conn),
+                         URING_DATA(URING_OP_TICK, 0, 0));
+        return;
+    }
+
+    if (i < conn->size) {
+        item = &(conn->items[i]);
+        work = item->work;
+    }
+    if (item == NULL || item->status == CONN_ST_NULL
+        || URING_DATA_GEN(ev->data) != (item->gen & 0xffffff)
+        || ev->res == -ECANCELED
+        || ((op == URING_OP_CONNECT || op == URING_OP_REMOTE_SEND
+             || op == URING_OP_REMOTE_RECV)
+            && (work == NULL || work->remote_fd < 0))
+        || (op >= URING_OP_HEDGE_CONNECT
+            && (work == NULL || work->hedge_fd < 0))) {
+        /* Stale completion of a recycled item or of a closed request,
+         * or the rest of a broken chain which has been queued again. */
+        if (ev->buffer >= 0) {
+            gc_uring_put_buffer(ring, ev->buffer);
+        }
+        if (conn->internal->drain_count && ev->res != -ECANCELED) {
+            _uring_drain(conn, ev);
+        }
+        return;
+    }
+
+    switch (op) {
+        case URING_OP_CLIENT_RECV: {
+            if (ev->res == -ENOBUFS) {
+                break;
+            }
+            if (ev->res > 0 && _reserve_request(conn, item, ev->res) != 0) {
+                if (ev->buffer >= 0) {
+                    gc_uring_put_buffer(ring, ev->buffer);
+                }
+                _reset_item(conn, item);
+                return;
+            }
+            _got_request(conn, item,
+                         _uring_take(conn, item->rd_buf + item->rd_buf_len,
+                                     item->rd_buf_size - item->rd_buf_len - 1,
+                                     ev));
+            break;
+        }
+        case URING_OP_CONNECT: {
+            if (ev->res < 0) {
+                errno = -ev->res;
+                gc_loge("Cannot connect to remote host: %m");
+                _remote_failed(conn, item);
+                break;          /* A failed owner leaves a miss to send */
+            }
+            return;
+        }
+        case URING_OP_REMOTE_SEND: {
+            if (ev->res < 0) {
+                errno = -ev->res;
+                gc_loge("Cannot write request to remote: %m");
+                _remote_failed(conn, item);
+                break;
+            }
+            work->wr_buf_pos += ev->res;
+            if (work->wr_buf_pos < work->wr_buf_len) {
+                break;          /* Short write broke the chain */
+            }
+            /* The linked receive is already queued. */
+            work->up_buf_len = 0;
+            item->status = CONN_ST_FORWARDED;
+            gc_trace_mark(work->trace[GC_TRACE_FORWARDED]);
+            return;
+        }
+        case URING_OP_REMOTE_RECV: {
+            if (ev->res == -ENOBUFS) {
+                break;
+            }
+            _got_remote(conn, item,
+                        _uring_take(conn, work->up_buf + work->up_buf_len,
+                                    work->up_buf_size - work->up_buf_len - 1,
+                                    ev));
+            break;
+        }
+        case URING_OP_HEDGE_CONNECT: {
+            if (ev->res < 0) {
+                _hedge_failed(conn, item);
+            }
+            return;
+        }
+        case URING_OP_HEDGE_SEND: {
+            if (ev->res < 0) {
+                _hedge_failed(conn, item);
+                return;
+            }
+            work->hedge_wr_pos += ev->res;
+            if (work->hedge_wr_pos < work->wr_buf_len) {
+                _uring_arm_hedge(conn, item);
+                return;
+            }
+            work->hedge_status = CONN_ST_FORWARDED;
+            return;
+        }
+        case URING_OP_HEDGE_RECV: {
+            if (ev->res != -ENOBUFS) {
+                _got_hedge(conn, item,
+                           _uring_take(conn,
+                                       work->hedge_buf + work->hedge_rd_len,
+                                       work->hedge_buf_size
+                                       - work->hedge_rd_len - 1, ev));
+            }
+            if (item->status == CONN_ST_REMOTE_CLOSED) {
+                break;          /* The hedge answered */
+            }
+            if (item->status != CONN_ST_NULL && work->hedge_fd >= 0) {
+                _uring_arm_hedge(conn, item);
+            }
+            return;
+        }
+        case URING_OP_CLIENT_SEND: {
+            if (ev->res < 0) {
+                _reset_item(conn, item);
+                return;
+            }
+            work->wr_buf_pos += ev->res;
+            if (work->wr_buf_pos < work->wr_buf_len) {
+                break;
+            }
+            _finish_item(conn, item);
+            break;
+        }
+        default: {
+            return;
+        }
+    }
+
+    if (item->status != CONN_ST_NULL) {
+        _uring_arm(conn, item);
+    }
+}
 
-            if (gc_db_put(conn->db, item->location, &(item->result)) != 0) {
-                gc_loge("Cannot put data into database");
-            }
-            if (close(item->remote_fd) != 0) {
-                gc_loge("Cannot close remote fd");
-            }
-            item->remote_fd = -1;
-            item->status = CONN_ST_REMOTE_CLOSED;
+/* Lane of a completion. Those of upstream and hedges are misses. */
+static int _uring_lane(const struct gc_uring_event_t *ev) {
+    switch (URING_DATA_OP(ev->data)) {
+        case URING_OP_CONNECT:
+        case URING_OP_REMOTE_SEND:
+        case URING_OP_REMOTE_RECV:
+        case URING_OP_HEDGE_CONNECT:
+        case URING_OP_HEDGE_SEND:
+        case URING_OP_HEDGE_RECV: {
+            return LANE_MISS;
         }
-        else {
-            _reset_item(item);
+        default: {
+            return LANE_HIT;
         }
     }
-    else if (ret < 0 && errno != EINPROGRESS) {
-        gc_loge("Cannot read data from remote: %m");
-        _reset_item(item);        
-    }
 }
 
-static void _write_response(struct gc_conn_t *conn,
-                            struct gc_conn_item_t *item) {
-    not_null_void(conn);
-    not_null_void(item);
+/* Work on the miss completions held back, oldest first and within the
+ * budget. The rest wait for the next round. */
+static size_t _uring_misses(struct gc_conn_t *conn) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    size_t count = internal->deferred_count;
+    size_t i = 0;
 
-    ssize_t ret = write(item->client_fd,
-                        item->wr_buf + item->wr_buf_pos,
-                        item->wr_buf_len - item->wr_buf_pos);
-    if (ret > 0) {
-        item->wr_buf_pos += ret;
+    if (conn->miss_budget && count > conn->miss_budget) {
+        count = conn->miss_budget;
     }
-    else if (ret == 0) {
-        _reset_item(item);
+    for (i = 0; i < count; ++i) {
+        _uring_event(conn, &(internal->deferred[i]));
     }
-    else if (ret < 0 && errno != EINPROGRESS) {
-        gc_loge("Cannot write response to client: %m");
-        _reset_item(item);
+    internal->deferred_count -= count;
+    if (internal->deferred_count) {
+        memmove(internal->deferred, internal->deferred + count,
+                internal->deferred_count * sizeof(struct gc_uring_event_t));
+        gc_stat_add(GC_STAT_MISSES_POSTPONED, internal->deferred_count);
     }
+    return count;
 }
-            
-int gc_conn_init(struct gc_conn_t **conn, size_t size) {
-    not_null(conn);
 
-    register size_t i = 0;
-    struct hostent *host = NULL;
-    
-    if (!size) {
-        return -1;
+static size_t _uring_process(struct gc_conn_t *conn) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    struct gc_uring_event_t ev;
+    size_t proc_count = 0;
+    int ret = 0;
+
+    if (conn->reader && !internal->reader_armed
+        && gc_uring_poll(internal->uring, conn->reader->fd,
+                         URING_DATA(URING_OP_READER, 0, 0)) == 0) {
+        internal->reader_armed = 1;
     }
-    
-    *conn = malloc(sizeof(struct gc_conn_t));
-    if (*conn == NULL) {
-        return -1;
+    if (internal->udp && !internal->udp_armed && !internal->stopped
+        && gc_uring_poll(internal->uring, internal->udp->fd,
+                         URING_DATA(URING_OP_UDP, 0, 0)) == 0) {
+        internal->udp_armed = 1;
     }
-
-    (*conn)->items = malloc(size * sizeof(struct gc_conn_item_t));
-    if ((*conn)->items == NULL) {
-        safefree(*conn);
-        return -1;
+    /* Held completions are worked on without waiting for new ones */
+    if (internal->deferred_count) {
+        ret = gc_uring_submit(internal->uring);
+    }
+    else {
+        ret = gc_uring_wait(internal->uring);
+    }
+    if (ret < 0) {
+        return 0;
+    }
+    while (gc_uring_next(internal->uring, &ev) == 0) {
+        if (_uring_lane(&ev) == LANE_MISS
+            && internal->deferred_count < URING_DEFER_MAX) {
+            internal->deferred[internal->deferred_count++] = ev;
+            continue;
+        }
+        _uring_event(conn, &ev);
+        ++proc_count;
     }
+    proc_count += _uring_misses(conn);
+    _udp_flush(conn);
+    return proc_count;
+}
 
-    (*conn)->internal = malloc(sizeof(struct gc_conn_internal_t));
-    if ((*conn)->internal == NULL) {
-        safefree((*conn)->items);
-        safefree(*conn);
-        return -1;
+/* Whether the step of an item's status can be taken now */
+static int _primary_ready(struct gc_conn_item_t *item,
+                          fd_set *rdfds, fd_set *wrfds) {
+    struct gc_conn_work_t *work = item->work;
+
+    switch (item->status) {
+        case CONN_ST_INIT: {
+            return item->client_fd >= 0 && FD_ISSET(item->client_fd, rdfds);
+        }
+        case CONN_ST_GOT_REQUEST: {
+            return 1;
+        }
+        case CONN_ST_REMOTE_OPENED: {
+            return work->remote_fd >= 0 && FD_ISSET(work->remote_fd, wrfds);
+        }
+        case CONN_ST_FORWARDED: {
+            return work->remote_fd >= 0 && FD_ISSET(work->remote_fd, rdfds);
+        }
+        case CONN_ST_REMOTE_CLOSED: {
+            return item->client_fd >= 0 && FD_ISSET(item->client_fd, wrfds);
+        }
+        default: {
+            return 0;
+        }
     }
+}
 
-    (*conn)->size = size;
+static int _hedge_ready(struct gc_conn_item_t *item,
+                        fd_set *rdfds, fd_set *wrfds) {
+    struct gc_conn_work_t *work = item->work;
 
-    memset((*conn)->items, 0, size * sizeof(struct gc_conn_item_t));
+    return work && work->hedge_fd >= 0
+        && ((work->hedge_status == CONN_ST_REMOTE_OPENED
+             && FD_ISSET(work->hedge_fd, wrfds))
+            || (work->hedge_status == CONN_ST_FORWARDED
+                && FD_ISSET(work->hedge_fd, rdfds)));
+}
 
-    for (i = 0; i < size; ++i) {
-        (*conn)->items[i].client_fd = -1;
-        (*conn)->items[i].remote_fd = -1;
-    }
+/* Take the steps of an item which select() found ready. */
+static size_t _run(struct gc_conn_t *conn, size_t i,
+                   fd_set *rdfds, fd_set *wrfds) {
+    struct {
+        void (*func_ptr)(struct gc_conn_t *conn,
+                         struct gc_conn_item_t *item);
+    } func_table[5] = {
+        { _read_request },
+        { _open_remote },
+        { _write_remote },
+        { _read_remote },
+        { _write_response }
+    };
+    struct gc_conn_item_t *item = &(conn->items[i]);
+    size_t proc_count = 0;
 
-    /* Resolve host name */
-    host = gethostbyname(GMAP_SERVER_HOSTNAME);
-    if (host) {
-        (*conn)->internal->gmap_server_count
-            = GC_MIN(host->h_length, GMAP_SERVER_MAX_COUNT);
-        for (i = 0; i < GC_MIN(host->h_length,
-                               GMAP_SERVER_MAX_COUNT); ++i) {
-            memcpy(&((*conn)->internal->gmap_servers[i]),
-                   host->h_addr_list[i], sizeof(in_addr_t));
-        }
+    if (_primary_ready(item, rdfds, wrfds)) {
+        gc_debug(printf("%zu: Func: %d\n", i, item->status - 1));
+        (func_table[item->status - 1].func_ptr)(conn, item);
+        ++proc_count;
     }
-    else {
-        gc_loge("Cannot find any map server: %s", hstrerror(h_errno));
-        return -1;
+    if (_hedge_ready(item, rdfds, wrfds)) {
+        if (item->work->hedge_status == CONN_ST_REMOTE_OPENED) {
+            _write_hedge(conn, item);
+        }
+        else {
+            _read_hedge(conn, item);
+        }
+        ++proc_count;
     }
-
-    return 0;
+    return proc_count;
 }
 
-int gc_conn_add(struct gc_conn_t *conn, int fd, unsigned int timeout) {
-    not_null(conn);
-
+/* Sort the items select() found ready into the run queues of hits and
+ * misses: reading requests and writing answers are hits, everything
+ * done with nodes and upstream is a miss. */
+static void _queue_runs(struct gc_conn_t *conn, size_t *counts,
+                        fd_set *rdfds, fd_set *wrfds) {
     register size_t i = 0;
     struct gc_conn_item_t *item = NULL;
+    int lane = 0;
 
-    if (timeout > 60) {
-        timeout = 60;
-    }
-    
+    counts[LANE_HIT] = 0;
+    counts[LANE_MISS] = 0;
     for (i = 0; i < conn->size; ++i) {
         item = &(conn->items[i]);
         if (item->status == CONN_ST_NULL) {
-            item->client_fd = fd;
-            item->exptime = time(NULL) + timeout;
-            item->status = CONN_ST_INIT;
-            return 0;
+            continue;
+        }
+        if (_primary_ready(item, rdfds, wrfds)) {
+            lane = (item->status == CONN_ST_INIT
+                    || item->status == CONN_ST_REMOTE_CLOSED)
+                ? LANE_HIT : LANE_MISS;
+        }
+        else if (_hedge_ready(item, rdfds, wrfds)) {
+            lane = LANE_MISS;
+        }
+        else {
+            continue;
         }
+        conn->internal->runs[lane][counts[lane]++] = i;
     }
+}
+
+/* Work on the ready misses within the budget. A round cut short by the
+ * budget is taken up by the next one where it stopped, so that no miss
+ * waits on the others for long. */
+static size_t _run_misses(struct gc_conn_t *conn, size_t count,
+                          fd_set *rdfds, fd_set *wrfds) {
+    struct gc_conn_internal_t *internal = conn->internal;
+    size_t *run = internal->runs[LANE_MISS];
+    size_t budget = count;
+    size_t start = 0;
+    size_t proc_count = 0;
+    size_t n = 0;
 
-    return -1;                  /* No place for fd */
+    if (conn->miss_budget && budget > conn->miss_budget) {
+        budget = conn->miss_budget;
+    }
+    while (start < count && run[start] < internal->miss_next) {
+        ++start;
+    }
+    for (n = 0; n < budget; ++n) {
+        proc_count += _run(conn, run[(start + n) % count], rdfds, wrfds);
+    }
+    internal->miss_next = 0;
+    if (budget < count) {
+        internal->miss_next = run[(start + budget) % count];
+        gc_stat_add(GC_STAT_MISSES_POSTPONED, count - budget);
+    }
+    return proc_count;
 }
 
 size_t gc_conn_process(struct gc_conn_t *conn) {
@@ -372,31 +3204,57 @@ size_t gc_conn_process(struct gc_conn_t *conn) {
         return 0;
     }
 
-    struct {
-        void (*func_ptr)(struct gc_conn_t *conn,
-                         struct gc_conn_item_t *item);
-    } func_table[5] = {
-        { _read_request },
-        { _open_remote },
-        { _write_remote },
-        { _read_remote },
-        { _write_response }
-    };
-    
+    if (conn->admit) {
+        gc_admit_report(conn->admit);
+    }
+    _report_lanes(conn);
+    if (conn->hedge) {
+        gc_hedge_report(conn->hedge);
+    }
+    if (conn->quota) {
+        gc_quota_save(conn->quota, 0);
+        _dispatch(conn);
+    }
+    if (conn->internal->batch.len) {
+        _batch_due(conn);
+    }
+    /* Whatever a process handing off would store is lost */
+    if (conn->refresh && !conn->internal->stopped) {
+        _refresh(conn);
+    }
+    if (conn->repl && !conn->internal->stopped) {
+        _sync(conn);
+    }
+    gc_db_maintain(conn->db);
+    if (conn->internal->uring) {
+        return _uring_process(conn);
+    }
+
     register size_t i = 0;
     struct gc_conn_item_t *item = NULL;
+    struct gc_conn_work_t *work = NULL;
     size_t proc_count = 0;
+    size_t counts[LANE_COUNT];
     int ret = 0;
     int max_fd = -1;
+    int opening = 0;
     fd_set rdfds;
     fd_set wrfds;
     struct timeval tv;
     time_t curtime;
+    unsigned long long now = 0;
 
     curtime = time(NULL);
     FD_ZERO(&rdfds);
     FD_ZERO(&wrfds);
-    
+
+    if (conn->internal->drain_count) {
+        _drain_poll(conn, curtime);
+    }
+    if (conn->hedge) {
+        now = gc_now_usec();
+    }
+
     for (i = 0; i < conn->size; ++i) {
         item = &(conn->items[i]);
 
@@ -405,10 +3263,19 @@ size_t gc_conn_process(struct gc_conn_t *conn) {
         }
 
         if (curtime > item->exptime) {
-            _reset_item(item);
+            _reset_item(conn, item);
+            continue;
+        }
+        if (item->status == CONN_ST_REMOTE_CLOSED && item->work
+            && item->work->udp) {
+            _udp_reply(conn, item);
             continue;
         }
 
+        /* Refreshes have no client fd to wait for */
+        if (item->status == CONN_ST_GOT_REQUEST) {
+            opening = 1;
+        }
         if (item->client_fd >= 0) {
             if (item->status == CONN_ST_INIT) {
                 FD_SET(item->client_fd, &rdfds);
@@ -421,20 +3288,52 @@ size_t gc_conn_process(struct gc_conn_t *conn) {
             }
         }
 
-        if (item->remote_fd >= 0) {
+        if ((work = item->work) == NULL) {
+            continue;
+        }
+        if (conn->hedge) {
+            _check_hedge(conn, item, now);
+        }
+        if (work->hedge_fd >= 0) {
+            if (work->hedge_status == CONN_ST_REMOTE_OPENED) {
+                FD_SET(work->hedge_fd, &wrfds);
+            }
+            if (work->hedge_status == CONN_ST_FORWARDED) {
+                FD_SET(work->hedge_fd, &rdfds);
+            }
+            if (work->hedge_fd > max_fd) {
+                max_fd = work->hedge_fd;
+            }
+        }
+        if (work->remote_fd >= 0) {
             if (item->status == CONN_ST_REMOTE_OPENED) {
-                FD_SET(item->remote_fd, &wrfds);
+                FD_SET(work->remote_fd, &wrfds);
             }
             if (item->status == CONN_ST_FORWARDED) {
-                FD_SET(item->remote_fd, &rdfds);
+                FD_SET(work->remote_fd, &rdfds);
             }
-            if (item->remote_fd > max_fd) {
-                max_fd = item->remote_fd;
+            if (work->remote_fd > max_fd) {
+                max_fd = work->remote_fd;
             }
         }
     }
 
-    if (max_fd < 0) {
+    _udp_flush(conn);
+
+    if (conn->reader && conn->reader->pending) {
+        FD_SET(conn->reader->fd, &rdfds);
+        if (conn->reader->fd > max_fd) {
+            max_fd = conn->reader->fd;
+        }
+    }
+    if (conn->internal->udp && !conn->internal->stopped) {
+        FD_SET(conn->internal->udp->fd, &rdfds);
+        if (conn->internal->udp->fd > max_fd) {
+            max_fd = conn->internal->udp->fd;
+        }
+    }
+
+    if (max_fd < 0 && !opening) {
         return 0;
     }
     tv.tv_sec = 0;
@@ -449,33 +3348,25 @@ size_t gc_conn_process(struct gc_conn_t *conn) {
         return 0;
     }
 
-    for (i = 0; i < conn->size; ++i) {
-        item = &(conn->items[i]);
-        if (item->status == CONN_ST_NULL) {
-            continue;
-        }
-        if ((item->status == CONN_ST_INIT
-             && item->client_fd >= 0
-             && FD_ISSET(item->client_fd, &rdfds))
-            || item->status == CONN_ST_GOT_REQUEST
-            || (item->status == CONN_ST_REMOTE_OPENED
-                && item->remote_fd >= 0
-                && FD_ISSET(item->remote_fd, &wrfds))
-            || (item->status == CONN_ST_FORWARDED
-                && item->remote_fd >= 0
-                && FD_ISSET(item->remote_fd, &rdfds))
-            || (item->status == CONN_ST_REMOTE_CLOSED
-                && item->client_fd >= 0
-                && FD_ISSET(item->client_fd, &wrfds))) {
-            gc_debug(printf("%d: Func: %d\n", i, item->status - 1));
-            (func_table[item->status - 1].func_ptr)(conn, item);
-            ++proc_count;
-        }
-
-        if (proc_count == ret) { /* We've processed enough file
-                                  * descriptors. */
-            break;
-        }
+    if (conn->reader && conn->reader->pending
+        && FD_ISSET(conn->reader->fd, &rdfds)) {
+        _got_reads(conn);
+        ++proc_count;
+    }
+    if (conn->internal->udp && !conn->internal->stopped
+        && FD_ISSET(conn->internal->udp->fd, &rdfds)) {
+        _udp_receive(conn);
+        ++proc_count;
+    }
+
+    /* Hits first, all of them, then misses within the budget */
+    _queue_runs(conn, counts, &rdfds, &wrfds);
+    for (i = 0; i < counts[LANE_HIT]; ++i) {
+        proc_count += _run(conn, conn->internal->runs[LANE_HIT][i],
+                           &rdfds, &wrfds);
+    }
+    if (counts[LANE_MISS]) {
+        proc_count += _run_misses(conn, counts[LANE_MISS], &rdfds, &wrfds);
     }
 
     return proc_count;
@@ -501,9 +3392,239 @@ int gc_conn_load_key_file(struct gc_conn_t *conn, const char *filename) {
     return 0;
 }
 
+int gc_conn_set_upstream(struct gc_conn_t *conn, const char *hostname,
+                         int port) {
+    not_null(conn);
+    not_null(hostname);
+
+    register size_t i = 0;
+    struct hostent *host = NULL;
+    struct sockaddr_in *server = NULL;
+
+    /* Resolve host name */
+    host = gethostbyname(hostname);
+    if (!host || host->h_addrtype != AF_INET) {
+        gc_loge("Cannot find any map server: %s", hstrerror(h_errno));
+        return -1;
+    }
+    for (i = 0; i < GMAP_SERVER_MAX_COUNT && host->h_addr_list[i]; ++i) {
+        server = &(conn->internal->gmap_servers[i]);
+        memset(server, 0, sizeof(struct sockaddr_in));
+        server->sin_family = AF_INET;
+        server->sin_port = htons(port);
+        memcpy(&(server->sin_addr), host->h_addr_list[i], sizeof(in_addr_t));
+    }
+    conn->internal->gmap_server_count = i;
+
+    return i ? 0 : -1;
+}
+
+int gc_conn_use_uring(struct gc_conn_t *conn, int server_fd,
+                      unsigned int timeout) {
+    not_null(conn);
+
+    struct gc_uring_t *ring = NULL;
+    int flags = 0;
+
+    if (gc_uring_init(&ring, URING_ENTRIES) != 0) {
+        return -1;
+    }
+    if (gc_uring_setup_buffers(ring, URING_BUF_COUNT, CONN_BUF_SIZE) != 0) {
+        gc_uring_free(ring);
+        return -1;
+    }
+    conn->internal->deferred = malloc(URING_DEFER_MAX
+                                      * sizeof(struct gc_uring_event_t));
+    if (conn->internal->deferred == NULL) {
+        gc_loge("Cannot allocate memory for io_uring completions");
+        gc_uring_free(ring);
+        return -1;
+    }
+
+    /* Completions are the readiness notification. A nonblocking listener
+     * would have the multishot accept fail with EAGAIN instead. */
+    flags = fcntl(server_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(server_fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        gc_loge("Cannot set server socket to blocking mode: %m");
+        gc_uring_free(ring);
+        return -1;
+    }
+
+    conn->internal->uring = ring;
+    conn->internal->server_fds[0] = server_fd;
+    conn->internal->server_count = 1;
+    conn->internal->timeout = timeout;
+
+    if (gc_uring_accept(ring, server_fd,
+                        URING_DATA(URING_OP_ACCEPT, 0, 0)) != 0
+        || gc_uring_timeout(ring, _uring_tick_msec(conn),
+                            URING_DATA(URING_OP_TICK, 0, 0)) != 0) {
+        conn->internal->uring = NULL;
+        conn->internal->server_count = 0;
+        gc_uring_free(ring);
+        return -1;
+    }
+    return 0;
+}
+
+/* With io_uring, accept the clients of one more listener. With select(),
+ * they are passed to gc_conn_add() instead. */
+int gc_conn_use_listener(struct gc_conn_t *conn, int fd) {
+    not_null(conn);
+
+    struct gc_conn_internal_t *internal = conn->internal;
+    int flags = 0;
+
+    if (internal->uring == NULL
+        || internal->server_count >= GC_SERVER_LISTEN_MAX) {
+        return -1;
+    }
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        gc_loge("Cannot set server socket to blocking mode: %m");
+        return -1;
+    }
+    if (gc_uring_accept(internal->uring, fd,
+                        URING_DATA(URING_OP_ACCEPT, 0,
+                                   internal->server_count)) != 0) {
+        return -1;
+    }
+    internal->server_fds[internal->server_count++] = fd;
+    return 0;
+}
+
+/* With io_uring, accept the clients of the HTTP listener as well. With
+ * select(), they are passed to gc_conn_add_http() instead. */
+int gc_conn_use_http(struct gc_conn_t *conn, int http_fd) {
+    not_null(conn);
+
+    int flags = 0;
+
+    if (conn->internal->uring == NULL) {
+        return -1;
+    }
+    flags = fcntl(http_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(http_fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        gc_loge("Cannot set HTTP socket to blocking mode: %m");
+        return -1;
+    }
+    if (gc_uring_accept(conn->internal->uring, http_fd,
+                        URING_DATA(URING_OP_HTTP_ACCEPT, 0, 0)) != 0) {
+        return -1;
+    }
+    conn->internal->http_fd = http_fd;
+    return 0;
+}
+
+/* Serve datagrams from fd besides the clients of the listener. fd
+ * stays open for the answers once the listener has been handed off. */
+int gc_conn_use_udp(struct gc_conn_t *conn, int fd, unsigned int timeout) {
+    not_null(conn);
+
+    struct gc_conn_udp_t *udp = NULL;
+    register size_t i = 0;
+
+    udp = malloc(sizeof(struct gc_conn_udp_t));
+    if (udp == NULL) {
+        gc_loge("Cannot allocate memory for datagrams");
+        return -1;
+    }
+    memset(udp, 0, sizeof(struct gc_conn_udp_t));
+    udp->fd = fd;
+    udp->in_size = UDP_ID_SIZE + conn->max_request + 2;
+    udp->in_bufs = malloc(UDP_BATCH * (udp->in_size + 1));
+    if (udp->in_bufs == NULL) {
+        gc_loge("Cannot allocate memory for datagrams");
+        safefree(udp);
+        return -1;
+    }
+    for (i = 0; i < UDP_BATCH; ++i) {
+        udp->in_iovs[i].iov_base = udp->in_bufs + i * (udp->in_size + 1);
+        udp->in_iovs[i].iov_len = udp->in_size;
+    }
+    conn->internal->udp = udp;
+    conn->internal->timeout = timeout;
+    return 0;
+}
+
+/* Take no more clients, the listener now being another process's.
+ * Idle connections of nodes are closed for them to connect to it. */
+int gc_conn_stop_accept(struct gc_conn_t *conn) {
+    not_null(conn);
+
+    struct gc_conn_item_t *item = NULL;
+    register size_t i = 0;
+
+    if (conn->internal->stopped) {
+        return 0;
+    }
+    conn->internal->stopped = 1;
+    for (i = 0; i < conn->internal->server_count; ++i) {
+        if (gc_uring_cancel(conn->internal->uring,
+                            URING_DATA(URING_OP_ACCEPT, 0, i),
+                            URING_DATA(URING_OP_CANCEL, 0, 0)) != 0) {
+            gc_loge("Cannot cancel accepting clients");
+            return -1;
+        }
+    }
+    if (conn->internal->http_fd >= 0
+        && gc_uring_cancel(conn->internal->uring,
+                           URING_DATA(URING_OP_HTTP_ACCEPT, 0, 0),
+                           URING_DATA(URING_OP_CANCEL, 0, 0)) != 0) {
+        gc_loge("Cannot cancel accepting HTTP clients");
+        return -1;
+    }
+    if (conn->internal->udp_armed
+        && gc_uring_cancel(conn->internal->uring,
+                           URING_DATA(URING_OP_UDP, 0, 0),
+                           URING_DATA(URING_OP_CANCEL, 0, 0)) != 0) {
+        gc_loge("Cannot cancel reading datagrams");
+        return -1;
+    }
+    for (i = 0; i < conn->size; ++i) {
+        item = &(conn->items[i]);
+        if ((item->peer || item->keep) && item->status == CONN_ST_INIT
+            && item->rd_buf_len == 0) {
+            _reset_item(conn, item);
+        }
+    }
+    return 0;
+}
+
+/* Connections still being served, background requests included */
+size_t gc_conn_active(struct gc_conn_t *conn) {
+    register size_t i = 0;
+    size_t count = 0;
+
+    if (conn == NULL) {
+        return 0;
+    }
+    for (i = 0; i < conn->size; ++i) {
+        if (conn->items[i].status != CONN_ST_NULL) {
+            ++count;
+        }
+    }
+    return count;
+}
+
 int gc_conn_free(struct gc_conn_t *conn) {
     not_null(conn);
 
+    if (conn->internal && conn->internal->uring) {
+        gc_uring_free(conn->internal->uring);
+        conn->internal->uring = NULL;
+    }
+    if (conn->internal && conn->internal->udp) {
+        safefree(conn->internal->udp->in_bufs);
+        safefree(conn->internal->udp);
+    }
+    if (conn->internal) {
+        safefree(conn->internal->deferred);
+        safefree(conn->internal->runs[LANE_HIT]);
+        safefree(conn->internal->runs[LANE_MISS]);
+        gc_slab_free(conn->internal->slab);
+    }
+    safefree(conn->internal);
     safefree(conn->items);
     safefree(conn);
 
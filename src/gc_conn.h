@@ -20,21 +20,72 @@
 
 #include <stddef.h>
 
+/* Result codes geocache answers with by itself */
+#define GC_CODE_RATE_LIMITED  429
+#define GC_CODE_BUSY          503
+#define GC_CODE_DEFERRED      509 /* Upstream quota does not allow it */
+
+#define GC_CONN_MAX_REQUEST   2048 /* Default limit of a request line */
+#define GC_CONN_MISS_BUDGET   64   /* Default misses worked on at a time */
+#define GC_CONN_BATCH_KEYS    32   /* Default misses in an upstream batch */
+#define GC_CONN_BATCH_MAX     128
+
 struct gc_conn_item_t;
 struct gc_conn_internal_t;
 struct gc_db_t;
+struct gc_frozen_t;
+struct gc_cache_t;
+struct gc_shm_t;
+struct gc_reader_t;
+struct gc_admit_t;
+struct gc_quota_t;
+struct gc_hedge_t;
+struct gc_refresh_t;
+struct gc_cluster_t;
+struct gc_repl_t;
+struct gc_trace_t;
 
 struct gc_conn_t {
     size_t size;
+    int disk_wire;              /* Store serialised responses on disk */
+    size_t max_request;         /* Longer requests are dropped */
+    size_t miss_budget;         /* Misses worked on per round, 0 for all */
+    size_t batch_keys;          /* Misses sent upstream together, 0 for none */
+    unsigned int batch_msec;    /* Longest a miss waits for its batch */
     struct gc_db_t *db;
+    struct gc_frozen_t *frozen; /* Optional fixed set in front of db */
+    struct gc_reader_t *reader; /* Optional threads for database reads */
+    struct gc_cache_t *cache;   /* Optional in-memory tier */
+    struct gc_shm_t *shm;       /* Optional tier shared between processes */
+    struct gc_cache_t *negative; /* Optional cache of failed results */
+    unsigned int negative_ttl;  /* Seconds failed results are kept */
+    struct gc_admit_t *admit;   /* Optional admission control */
+    struct gc_quota_t *quota;   /* Optional upstream quota governor */
+    struct gc_hedge_t *hedge;   /* Optional hedging of slow misses */
+    struct gc_refresh_t *refresh; /* Optional expiry of stored results */
+    struct gc_cluster_t *cluster; /* Optional peers sharing the key space */
+    struct gc_repl_t *repl;     /* Optional replication of stored results */
+    struct gc_trace_t *trace;   /* Optional recorder of slow requests */
     struct gc_conn_item_t *items;
     struct gc_conn_internal_t *internal;
 };
 
 int gc_conn_init(struct gc_conn_t **conn, size_t size);
+/* Takes over fd. A client which cannot be served is answered with a
+ * busy or rate-limited code and closed, and -1 is returned. */
 int gc_conn_add(struct gc_conn_t *conn, int fd, unsigned int timeout);
+int gc_conn_add_http(struct gc_conn_t *conn, int fd, unsigned int timeout);
 size_t gc_conn_process(struct gc_conn_t *conn);
 int gc_conn_load_key_file(struct gc_conn_t *conn, const char *filename);
+int gc_conn_set_upstream(struct gc_conn_t *conn, const char *hostname,
+                         int port);
+int gc_conn_use_uring(struct gc_conn_t *conn, int server_fd,
+                      unsigned int timeout);
+int gc_conn_use_listener(struct gc_conn_t *conn, int fd);
+int gc_conn_use_http(struct gc_conn_t *conn, int http_fd);
+int gc_conn_use_udp(struct gc_conn_t *conn, int fd, unsigned int timeout);
+int gc_conn_stop_accept(struct gc_conn_t *conn);
+size_t gc_conn_active(struct gc_conn_t *conn);
 int gc_conn_free(struct gc_conn_t *conn);
 
 #endif
@@ -15,26 +15,289 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <db.h>
 #include <errno.h>
+#include <pthread.h>
 
+#include "gc_bloom.h"
 #include "gc_debug.h"
 #include "gc_error.h"
 #include "gc_log.h"
 #include "gc_db.h"
+#include "gc_repl.h"
+#include "gc_sketch.h"
+#include "gc_stats.h"
 #include "gc_util.h"
 
+#define DB_PENDING_MAX  (4 * 1024 * 1024) /* Bytes of puts kept frozen */
+#define DB_RECORD_MAGIC 0x31524347 /* "GCR1" */
+#define DB_LINK_MAGIC   0x32524347 /* "GCR2" */
+#define DB_BLOOM_MIN    65536   /* Keys the filter is sized for, at least */
+#define DB_BLOOM_STEP   4096    /* Keys added to a new filter in a step */
+#define DB_FILENAME_SIZE 512
+#define DB_RESULT_FMT   "%d,%c,%lf,%lf"
+#define DB_KEY_SIZE     2048    /* Where eviction and compaction go on */
+#define DB_SKETCH_WIDTH (1 << 20)
+#define DB_STEP_USEC    100000  /* Between steps of size keeping */
+#define DB_EVICT_BATCH  128     /* Records weighed against each other */
+#define DB_EVICT_STEP   8       /* Batches in a step, at most */
+#define DB_LOW_WATER    90      /* Percent of the limit eviction goes to */
+#define DB_AGE_HALF     86400   /* Age in seconds which halves a weight */
+#define DB_RECORD_SIZE  GC_DB_RECORD_SIZE
+
+/* Keys of the result store start with DB_INDEX, which no location does,
+ * and a kind. Those of an id carry it big-endian, so that the aliases
+ * of a result are next to each other. */
+#define DB_INDEX         '\377'
+#define DB_INDEX_LAST    'n'    /* Last result id given out */
+#define DB_INDEX_RESULT  'r'    /* Result, by id */
+#define DB_INDEX_POINT   'p'    /* Id, by code, accuracy and coordinates */
+#define DB_INDEX_ALIAS   'a'    /* Nothing, by id and location */
+#define DB_INDEX_SIZE    6      /* Of a key with an id */
+#define DB_POINT_SIZE    (2 + sizeof(int) + 1 + 2 * sizeof(double))
+#define DB_ALIAS_SIZE    (DB_INDEX_SIZE + DB_KEY_SIZE)
+
+#define DB_PHASE_IDLE    0
+#define DB_PHASE_EVICT   1
+#define DB_PHASE_COMPACT 2
+
 struct gc_db_t {
     DB * bdb;
+    struct gc_bloom_t *bloom;   /* Keys stored, NULL if unknown */
+    struct gc_bloom_t *next_bloom; /* Being filled to replace it */
+    char bloom_hand[DB_KEY_SIZE];  /* Next key to add to that one */
+    unsigned long bloom_skips;  /* Lookups the filter has answered */
+    unsigned long bloom_false_positives;
+    struct gc_repl_t *repl;     /* Change log for replicas, optional */
+    int frozen;                 /* Another process writes the file now */
+    char *pending;              /* Puts since then, as lines for it */
+    size_t pending_len;
+    size_t pending_size;
+    unsigned long pending_dropped;
+    char filename[DB_FILENAME_SIZE];
+    size_t max_bytes;           /* File size to keep under, 0 for none */
+    unsigned int compact_rate;  /* Pages compaction may free a second */
+    struct gc_sketch_t *sketch; /* How often locations are asked for */
+    int phase;
+    size_t evict_left;          /* Bytes to delete in this round */
+    char hand[DB_KEY_SIZE];     /* Next location to weigh */
+    char compact_from[DB_KEY_SIZE];
+    size_t compact_from_len;
+    double compact_budget;      /* Pages compaction may free now */
+    unsigned long long step_usec;
+    unsigned long evictions;
+    unsigned long compacted_pages;
+    int threaded;               /* Reader threads look records up too */
+    pthread_rwlock_t lock;      /* Held to write while they may read */
+    unsigned int last_id;       /* Of results, 0 until read */
+    struct _evicted_t *evicted; /* Links deleted by a batch */
+};
+
+/* Record of a location, after the magic number, whose result is stored
+ * once for all the locations it is the result of */
+struct _link_t {
+    unsigned int id;
+    time_t mtime;               /* When the location was written */
+};
+
+/* Link deleted by eviction, to be let go of its result afterwards */
+struct _evicted_t {
+    unsigned int id;
+    size_t len;
+    char location[DB_KEY_SIZE];
+};
+
+/* Result layout of records written before they carried a timestamp */
+struct _legacy_query_t {
+    int code;
+    char accuracy;
+    double latitude;
+    double longitude;
 };
 
 extern int g_is_daemon;
 
+static void _write_lock(struct gc_db_t *db) {
+    if (db->threaded) {
+        pthread_rwlock_wrlock(&(db->lock));
+    }
+}
+
+static int _try_write_lock(struct gc_db_t *db) {
+    if (db->threaded) {
+        return pthread_rwlock_trywrlock(&(db->lock)) == 0 ? 0 : -1;
+    }
+    return 0;
+}
+
+static void _read_lock(struct gc_db_t *db) {
+    if (db->threaded) {
+        pthread_rwlock_rdlock(&(db->lock));
+    }
+}
+
+static void _unlock(struct gc_db_t *db) {
+    if (db->threaded) {
+        pthread_rwlock_unlock(&(db->lock));
+    }
+}
+
+/* Whether key is one of the result store rather than a location */
+static int _is_index(const DBT *key) {
+    return key->size && *(const char *) key->data == DB_INDEX;
+}
+
+/* Handles opened with DB_THREAD return records only into memory given
+ * by the caller, so cursors go through buffers of their own. */
+static int _cursor_first(DBC *cursor, DBT *key, DBT *data,
+                         const char *from) {
+    size_t len = strlen(from);
+    int ret = 0;
+
+    memset(key, 0, sizeof(DBT));
+    memset(data, 0, sizeof(DBT));
+    key->flags = DB_DBT_REALLOC;
+    data->flags = DB_DBT_REALLOC;
+    if (!len) {
+        ret = cursor->c_get(cursor, key, data, DB_FIRST);
+    }
+    else {
+        key->data = malloc(len);
+        if (key->data == NULL) {
+            return ENOMEM;
+        }
+        memcpy(key->data, from, len);
+        key->size = len;
+        ret = cursor->c_get(cursor, key, data, DB_SET_RANGE);
+    }
+    return ret == 0 && _is_index(key) ? DB_NOTFOUND : ret;
+}
+
+/* Locations are followed by the result store, which reads as their
+ * end. */
+static int _cursor_next(DBC *cursor, DBT *key, DBT *data) {
+    int ret = cursor->c_get(cursor, key, data, DB_NEXT);
+
+    return ret == 0 && _is_index(key) ? DB_NOTFOUND : ret;
+}
+
+static void _cursor_close(DBC *cursor, DBT *key, DBT *data) {
+    cursor->c_close(cursor);
+    if (key->data) {
+        free(key->data);
+    }
+    if (data->data) {
+        free(data->data);
+    }
+}
+
+static void _index_key(char *key, char kind, unsigned int id) {
+    key[0] = DB_INDEX;
+    key[1] = kind;
+    key[2] = (char) (id >> 24);
+    key[3] = (char) (id >> 16);
+    key[4] = (char) (id >> 8);
+    key[5] = (char) id;
+}
+
+/* Key under which the id of a result equal to query is found */
+static void _point_key(char *key, const struct gc_db_query_t *query) {
+    key[0] = DB_INDEX;
+    key[1] = DB_INDEX_POINT;
+    memcpy(key + 2, &(query->code), sizeof(int));
+    key[2 + sizeof(int)] = query->accuracy;
+    memcpy(key + 3 + sizeof(int), &(query->latitude), sizeof(double));
+    memcpy(key + 3 + sizeof(int) + sizeof(double), &(query->longitude),
+           sizeof(double));
+}
+
+/* Read the record under key into buf. Returns 0 if found, 1 if not. */
+static int _get(struct gc_db_t *db, const void *key_data, size_t key_len,
+                DBT *data, void *buf, size_t buf_size) {
+    DBT key;
+    int ret = 0;
+
+    memset(&key, 0, sizeof(DBT));
+    memset(data, 0, sizeof(DBT));
+    key.data = (void*) key_data;
+    key.size = key_len;
+    data->data = buf;
+    data->ulen = buf_size;
+    data->flags = DB_DBT_USERMEM;
+
+    ret = db->bdb->get(db->bdb, NULL, &key, data, 0);
+    if (ret != 0) {
+        if (ret == DB_NOTFOUND) {
+            return 1;
+        }
+        gc_loge("Cannot get data from database: %s", db_strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+static int _put(struct gc_db_t *db, const void *key_data, size_t key_len,
+                const void *buf, size_t len) {
+    DBT key;
+    DBT data;
+    int ret = 0;
+
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = (void*) key_data;
+    key.size = key_len;
+    data.data = (void*) buf;
+    data.size = len;
+
+    ret = db->bdb->put(db->bdb, NULL, &key, &data, 0);
+    if (ret != 0) {
+        gc_loge("Cannot put data into database: %s", db_strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+static void _del(struct gc_db_t *db, const void *key_data, size_t key_len) {
+    DBT key;
+    int ret = 0;
+
+    memset(&key, 0, sizeof(DBT));
+    key.data = (void*) key_data;
+    key.size = key_len;
+
+    ret = db->bdb->del(db->bdb, NULL, &key, 0);
+    if (ret != 0 && ret != DB_NOTFOUND) {
+        gc_loge("Cannot delete from database: %s", db_strerror(ret));
+    }
+}
+
+size_t gc_db_format_result(const struct gc_db_query_t *query,
+                           char *buf, size_t buf_size) {
+    int len = snprintf(buf, buf_size, DB_RESULT_FMT "\n", query->code,
+                       query->accuracy, query->latitude, query->longitude);
+
+    if (len < 0) {
+        return 0;
+    }
+    return GC_MIN((size_t) len, buf_size - 1);
+}
+
+/* Fills in all but the mtime. -1 if line is not a result. */
+int gc_db_parse_result(const char *line, struct gc_db_query_t *query) {
+    if (sscanf(line, DB_RESULT_FMT, &(query->code), &(query->accuracy),
+               &(query->latitude), &(query->longitude)) != 4) {
+        return -1;
+    }
+    return 0;
+}
+
 int gc_db_init(struct gc_db_t **db) {
     not_null(db);
 
@@ -48,10 +311,187 @@ int gc_db_init(struct gc_db_t **db) {
         safefree(*db);
         return -1;
     }
+    (*db)->bloom = NULL;
+    (*db)->next_bloom = NULL;
+    (*db)->bloom_hand[0] = '\0';
+    (*db)->bloom_skips = 0;
+    (*db)->bloom_false_positives = 0;
+    (*db)->repl = NULL;
+    (*db)->frozen = 0;
+    (*db)->pending = NULL;
+    (*db)->pending_len = 0;
+    (*db)->pending_size = 0;
+    (*db)->pending_dropped = 0;
+    (*db)->filename[0] = '\0';
+    (*db)->max_bytes = 0;
+    (*db)->compact_rate = 0;
+    (*db)->sketch = NULL;
+    (*db)->phase = DB_PHASE_IDLE;
+    (*db)->evict_left = 0;
+    (*db)->hand[0] = '\0';
+    (*db)->compact_from_len = 0;
+    (*db)->compact_budget = 0;
+    (*db)->step_usec = 0;
+    (*db)->evictions = 0;
+    (*db)->compacted_pages = 0;
+    (*db)->threaded = 0;
+    (*db)->last_id = 0;
+    (*db)->evicted = NULL;
+
+    return 0;
+}
+
+/* Let reader threads call gc_db_read(). Must come before loading. */
+int gc_db_set_threaded(struct gc_db_t *db) {
+    not_null(db);
+
+    pthread_rwlockattr_t attr;
+
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    /* Puts are not to wait behind a stream of lookups */
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    if (pthread_rwlock_init(&(db->lock), &attr) != 0) {
+        gc_loge("Cannot create database lock");
+        pthread_rwlockattr_destroy(&attr);
+        return -1;
+    }
+    pthread_rwlockattr_destroy(&attr);
+    db->threaded = 1;
+    return 0;
+}
+
+/* Add up to limit stored locations (0 for no limit) to bloom, from the
+ * one at hand on, and stop early once it is half full. The cursor ends
+ * at the result store, whose keys are not locations. Returns 1 once all
+ * are in, 0 if some are left, with hand at the next, or -1 on errors. */
+static int _fill_bloom(struct gc_db_t *db, struct gc_bloom_t *bloom,
+                       char *hand, size_t limit) {
+    DBC *cursor = NULL;
+    DBT key;
+    DBT data;
+    size_t count = 0;
+    size_t size = 0;
+    int ret = 0;
+
+    ret = db->bdb->cursor(db->bdb, NULL, &cursor, 0);
+    if (ret != 0) {
+        gc_loge("Cannot open database cursor: %s", db_strerror(ret));
+        return -1;
+    }
+
+    ret = _cursor_first(cursor, &key, &data, hand);
+    while (ret == 0 && (!limit || count < limit)
+           && bloom->count * 2 <= bloom->capacity) {
+        gc_bloom_add(bloom, key.data, key.size);
+        ++count;
+        ret = _cursor_next(cursor, &key, &data);
+    }
+    if (ret == 0) {
+        size = GC_MIN(key.size, DB_KEY_SIZE - 1);
+        memcpy(hand, key.data, size);
+        hand[size] = '\0';
+    }
+    _cursor_close(cursor, &key, &data);
+
+    if (ret == 0) {
+        return 0;
+    }
+    if (ret != DB_NOTFOUND) {
+        gc_loge("Cannot read database: %s", db_strerror(ret));
+        return -1;
+    }
+    hand[0] = '\0';
+    return 1;
+}
+
+static void _set_bloom(struct gc_db_t *db, struct gc_bloom_t *bloom) {
+    if (db->bloom) {
+        gc_bloom_free(db->bloom);
+    }
+    db->bloom = bloom;
+    gc_log("Filter holds %lu keys in %lu bytes",
+           (unsigned long) bloom->count, (unsigned long) bloom->bits / 8);
+}
+
+/* Fill a new filter with all the stored keys. It is sized for twice
+ * their count, so that puts do not make it rebuild again soon. */
+static int _build_bloom(struct gc_db_t *db, size_t capacity) {
+    struct gc_bloom_t *bloom = NULL;
+    char hand[DB_KEY_SIZE];
+    int ret = 0;
 
+    if (gc_bloom_init(&bloom, capacity) != 0) {
+        return -1;
+    }
+    hand[0] = '\0';
+    ret = _fill_bloom(db, bloom, hand, 0);
+    if (ret == 0) {
+        /* Too small; start over at the next size. */
+        gc_bloom_free(bloom);
+        return _build_bloom(db, capacity * 2);
+    }
+    if (ret < 0) {
+        gc_bloom_free(bloom);
+        return -1;
+    }
+    _set_bloom(db, bloom);
     return 0;
 }
 
+/* The filter is full: fill one twice its size in maintenance steps, in
+ * place of a scan on the put which filled it. */
+static void _grow_bloom(struct gc_db_t *db) {
+    if (gc_bloom_init(&(db->next_bloom), db->bloom->capacity * 2) != 0) {
+        gc_loge("Cannot rebuild filter of stored keys");
+        db->next_bloom = NULL;
+        return;
+    }
+    db->bloom_hand[0] = '\0';
+}
+
+/* Add the next stored keys to the new filter, and put it in place once
+ * it holds them all. Only the event loop writes, which is where this
+ * runs, so the scan takes no lock. */
+static void _bloom_step(struct gc_db_t *db) {
+    size_t capacity = db->next_bloom->capacity;
+    int ret = _fill_bloom(db, db->next_bloom, db->bloom_hand,
+                          DB_BLOOM_STEP);
+
+    if (ret < 0) {
+        gc_loge("Cannot rebuild filter of stored keys");
+        gc_bloom_free(db->next_bloom);
+        db->next_bloom = NULL;
+        return;
+    }
+    if (db->next_bloom->count * 2 > capacity) {
+        /* Puts in the meantime filled it; start over at the next size */
+        gc_bloom_free(db->next_bloom);
+        if (gc_bloom_init(&(db->next_bloom), capacity * 2) != 0) {
+            gc_loge("Cannot rebuild filter of stored keys");
+            db->next_bloom = NULL;
+        }
+        db->bloom_hand[0] = '\0';
+        return;
+    }
+    if (ret == 1) {
+        _set_bloom(db, db->next_bloom);
+        db->next_bloom = NULL;
+    }
+}
+
+static void _bloom_stats(struct gc_db_t *db) {
+    unsigned long negatives = db->bloom_skips + db->bloom_false_positives;
+
+    gc_stat_set(GC_STAT_BLOOM_SKIPS, db->bloom_skips);
+    gc_stat_set(GC_STAT_BLOOM_FALSE_POSITIVES, db->bloom_false_positives);
+    gc_stat_set(GC_STAT_BLOOM_FP_PPM,
+                negatives ? (unsigned long long) db->bloom_false_positives
+                * 1000000 / negatives : 0);
+}
+
 int gc_db_load(struct gc_db_t *db, const char *filename) {
     not_null(db);
     not_null(filename);
@@ -67,74 +507,957 @@ int gc_db_load(struct gc_db_t *db, const char *filename) {
         }
     }
     
-    ret = db->bdb->open(db->bdb, NULL, filename, NULL, DB_BTREE, DB_CREATE, 0);
+    snprintf(db->filename, DB_FILENAME_SIZE, "%s", filename);
+    ret = db->bdb->open(db->bdb, NULL, filename, NULL, DB_BTREE,
+                        DB_CREATE | (db->threaded ? DB_THREAD : 0), 0);
     if (ret != 0) {
         gc_loge("Cannot open database file: %s", db_strerror(ret));
         return -1;
     }
 
+    /* Lookups go to the B-tree for every key if this fails. */
+    if (_build_bloom(db, DB_BLOOM_MIN) != 0) {
+        gc_loge("Cannot build filter of stored keys");
+    }
+
     return 0;
 }
 
 int gc_db_get(struct gc_db_t *db, const char *location,
               const struct gc_db_query_t *query) {
+    char record[DB_RECORD_SIZE];
+    const char *wire = NULL;
+    size_t wire_len = 0;
+
+    return gc_db_get_wire(db, location, (struct gc_db_query_t *) query,
+                          record, DB_RECORD_SIZE, &wire, &wire_len);
+}
+
+int gc_db_put(struct gc_db_t *db, const char *location,
+              const struct gc_db_query_t *query) {
+    return gc_db_put_wire(db, location, query, NULL, 0);
+}
+
+/* A record is a magic number and the structured result, optionally
+ * followed by the serialised response bytes. Records from before the
+ * magic number are read with an mtime of 0. */
+static int _parse_record(const DBT *data, struct gc_db_query_t *query,
+                         size_t *head_len) {
+    unsigned int magic = 0;
+    struct _legacy_query_t legacy;
+
+    *head_len = sizeof(unsigned int) + sizeof(struct gc_db_query_t);
+    if (data->size >= sizeof(unsigned int)) {
+        memcpy(&magic, data->data, sizeof(unsigned int));
+    }
+    if (magic == DB_RECORD_MAGIC && data->size >= *head_len) {
+        memcpy((void*) query, (char*) data->data + sizeof(unsigned int),
+               sizeof(struct gc_db_query_t));
+    }
+    else if (data->size >= sizeof(struct _legacy_query_t)) {
+        memcpy(&legacy, data->data, sizeof(struct _legacy_query_t));
+        memset(query, 0, sizeof(struct gc_db_query_t));
+        query->code = legacy.code;
+        query->accuracy = legacy.accuracy;
+        query->latitude = legacy.latitude;
+        query->longitude = legacy.longitude;
+        *head_len = sizeof(struct _legacy_query_t);
+    }
+    else {
+        gc_loge("Broken record in database");
+        return -1;
+    }
+    return 0;
+}
+
+/* Records of locations written before results were stored once are
+ * records of results themselves. */
+static int _parse_link(const DBT *data, unsigned int *id, time_t *mtime) {
+    unsigned int magic = 0;
+    struct _link_t link;
+
+    if (data->size != sizeof(unsigned int) + sizeof(struct _link_t)) {
+        return -1;
+    }
+    memcpy(&magic, data->data, sizeof(unsigned int));
+    if (magic != DB_LINK_MAGIC) {
+        return -1;
+    }
+    memcpy(&link, (char*) data->data + sizeof(unsigned int),
+           sizeof(struct _link_t));
+    *id = link.id;
+    *mtime = link.mtime;
+    return 0;
+}
+
+/* The result of the record of a location, which is in the record or
+ * linked to by it. A linked result is read into buf, of DB_RECORD_SIZE
+ * bytes, or into a buffer of its own if it is NULL, and the response
+ * stored with the result is left where it was read. Returns 0 if
+ * found, 1 if the result is missing. */
+static int _resolve(struct gc_db_t *db, const DBT *data,
+                    struct gc_db_query_t *query, char *buf,
+                    const char **wire, size_t *wire_len) {
+    unsigned int id = 0;
+    time_t mtime = 0;
+    size_t head_len = 0;
+    int ret = 0;
+    char key[DB_INDEX_SIZE];
+    char record[DB_RECORD_SIZE];
+    DBT result;
+
+    if (_parse_link(data, &id, &mtime) == 0) {
+        _index_key(key, DB_INDEX_RESULT, id);
+        ret = _get(db, key, DB_INDEX_SIZE, &result, buf ? buf : record,
+                   DB_RECORD_SIZE);
+        if (ret != 0) {
+            if (ret == 1) {
+                gc_loge("Result %u is missing from database", id);
+            }
+            return ret;
+        }
+        data = &result;
+    }
+    if (_parse_record(data, query, &head_len) != 0) {
+        return -1;
+    }
+    if (data == &result) {
+        query->mtime = mtime;
+    }
+
+    if (wire_len) {
+        *wire = (const char *) data->data + head_len;
+        *wire_len = data->size - head_len;
+    }
+    return 0;
+}
+
+/* Look location up in the B-tree, reading its records into buf. Returns
+ * 0 if found, 1 if not. */
+static int _read_record(struct gc_db_t *db, const char *location,
+                        struct gc_db_query_t *query, char *buf,
+                        const char **wire, size_t *wire_len) {
+    int ret = 0;
+    DBT data;
+
+    ret = _get(db, location, strlen(location), &data, buf, DB_RECORD_SIZE);
+    if (ret != 0) {
+        return ret;
+    }
+    return _resolve(db, &data, query, buf, wire, wire_len);
+}
+
+/* Look location up, reading its record into buf of GC_DB_RECORD_SIZE
+ * bytes at least. The response stored with it is left in buf, as the
+ * wire_len bytes at *wire, so that it is written out from there.
+ * Returns 0 if found, -1 if not and -2 if buf is too small. */
+int gc_db_get_wire(struct gc_db_t *db, const char *location,
+                   struct gc_db_query_t *query, char *buf, size_t buf_size,
+                   const char **wire, size_t *wire_len) {
     not_null(db);
     not_null(location);
     not_null(query);
+    not_null(buf);
+    not_null(wire);
+    not_null(wire_len);
+
+    int ret = 0;
+
+    if (buf_size < DB_RECORD_SIZE) {
+        gc_loge("Lookup buffer of %lu bytes cannot hold a record",
+                (unsigned long) buf_size);
+        return -2;
+    }
+    if (!gc_db_may_hold(db, location)) {
+        return -1;
+    }
+
+    _read_lock(db);
+    ret = _read_record(db, location, query, buf, wire, wire_len);
+    _unlock(db);
+    if (ret == 1 && db->bloom && !db->next_bloom) {
+        __sync_fetch_and_add(&(db->bloom_false_positives), 1);
+        _bloom_stats(db);
+    }
+    return ret == 0 ? 0 : -1;
+}
+
+/* Whether location may be stored, as far as the filter knows. Only
+ * locations it may hold need a read of the B-tree. A full filter is not
+ * asked while the one to replace it is being filled. */
+int gc_db_may_hold(struct gc_db_t *db, const char *location) {
+    not_null(db);
+    not_null(location);
+
+    if (db->bloom && !db->next_bloom
+        && !gc_bloom_check(db->bloom, location, strlen(location))) {
+        ++db->bloom_skips;
+        _bloom_stats(db);
+        return 0;
+    }
+    return 1;
+}
+
+/* gc_db_get_wire() for reader threads, without the filter. Returns 0
+ * if found, 1 if not and -1 on errors. */
+int gc_db_read(struct gc_db_t *db, const char *location,
+               struct gc_db_query_t *query, char *buf, size_t buf_size,
+               const char **wire, size_t *wire_len) {
+    not_null(db);
+    not_null(location);
+    not_null(query);
+    not_null(buf);
+    not_null(wire);
+    not_null(wire_len);
+
+    int ret = 0;
+
+    if (buf_size < DB_RECORD_SIZE) {
+        gc_loge("Lookup buffer of %lu bytes cannot hold a record",
+                (unsigned long) buf_size);
+        return -1;
+    }
+
+    _read_lock(db);
+    ret = _read_record(db, location, query, buf, wire, wire_len);
+    _unlock(db);
+    if (ret == 1 && db->bloom && !db->next_bloom) {
+        /* Reported with the next lookup of the event loop */
+        __sync_fetch_and_add(&(db->bloom_false_positives), 1);
+    }
+    return ret;
+}
+
+/* Record holding a result itself, followed by wire. Returns its
+ * length. */
+static size_t _make_record(char *record, const struct gc_db_query_t *query,
+                           const char *wire, size_t wire_len) {
+    unsigned int magic = DB_RECORD_MAGIC;
+    size_t head_len = sizeof(unsigned int) + sizeof(struct gc_db_query_t);
+
+    memcpy(record, &magic, sizeof(unsigned int));
+    memcpy(record + sizeof(unsigned int), query,
+           sizeof(struct gc_db_query_t));
+    if (wire_len) {
+        memcpy(record + head_len, wire, wire_len);
+    }
+    return head_len + wire_len;
+}
+
+/* Id of the result location links to, 0 if it does not */
+static unsigned int _link_of(struct gc_db_t *db, const char *location,
+                             size_t len) {
+    unsigned int id = 0;
+    time_t mtime = 0;
+    char record[DB_RECORD_SIZE];
+    DBT data;
+
+    if (_get(db, location, len, &data, record, DB_RECORD_SIZE) != 0
+        || _parse_link(&data, &id, &mtime) != 0) {
+        return 0;
+    }
+    return id;
+}
+
+/* Give out a result id. Returns 0, which is none, on errors. */
+static unsigned int _next_id(struct gc_db_t *db) {
+    char key[2];
+    DBT data;
+
+    key[0] = DB_INDEX;
+    key[1] = DB_INDEX_LAST;
+    if (!db->last_id && _get(db, key, sizeof(key), &data, &(db->last_id),
+                             sizeof(unsigned int)) < 0) {
+        return 0;
+    }
+    if (!++db->last_id) {
+        ++db->last_id;
+    }
+    if (_put(db, key, sizeof(key), &(db->last_id),
+             sizeof(unsigned int)) != 0) {
+        return 0;
+    }
+    return db->last_id;
+}
 
+/* Id of the result equal to query, stored with wire if it is new.
+ * Returns 0 on errors. */
+static unsigned int _intern(struct gc_db_t *db,
+                            const struct gc_db_query_t *query,
+                            const char *wire, size_t wire_len) {
+    struct gc_db_query_t result = *query;
+    unsigned int id = 0;
     int ret = 0;
+    char point[DB_POINT_SIZE];
+    char key[DB_INDEX_SIZE];
+    char record[DB_RECORD_SIZE];
+    DBT data;
+
+    _point_key(point, query);
+    ret = _get(db, point, DB_POINT_SIZE, &data, &id, sizeof(unsigned int));
+    if (ret == 0) {
+        return id;
+    }
+    if (ret < 0 || (id = _next_id(db)) == 0) {
+        return 0;
+    }
+    result.mtime = 0;           /* Links have the times of locations */
+    _index_key(key, DB_INDEX_RESULT, id);
+    if (_put(db, key, DB_INDEX_SIZE, record,
+             _make_record(record, &result, wire, wire_len)) != 0
+        || _put(db, point, DB_POINT_SIZE, &id, sizeof(unsigned int)) != 0) {
+        return 0;
+    }
+    return id;
+}
+
+/* Point location at result id, listing it as an alias of the result
+ * if it was not. */
+static int _link(struct gc_db_t *db, const char *location, size_t len,
+                 unsigned int id, time_t mtime, int is_new) {
+    unsigned int magic = DB_LINK_MAGIC;
+    struct _link_t link;
+    char record[sizeof(unsigned int) + sizeof(struct _link_t)];
+    char alias[DB_ALIAS_SIZE];
+
+    if (is_new) {
+        _index_key(alias, DB_INDEX_ALIAS, id);
+        memcpy(alias + DB_INDEX_SIZE, location, len);
+        if (_put(db, alias, DB_INDEX_SIZE + len, "", 0) != 0) {
+            return -1;
+        }
+    }
+    memset(&link, 0, sizeof(struct _link_t));
+    link.id = id;
+    link.mtime = mtime;
+    memcpy(record, &magic, sizeof(unsigned int));
+    memcpy(record + sizeof(unsigned int), &link, sizeof(struct _link_t));
+    return _put(db, location, len, record, sizeof(record));
+}
+
+/* Whether a key starts with prefix. Errors count as yes. */
+static int _has_prefix(struct gc_db_t *db, const char *prefix, size_t len) {
+    char found[DB_ALIAS_SIZE];
+    char value[DB_RECORD_SIZE];
+    DBC *cursor = NULL;
     DBT key;
     DBT data;
+    int ret = 0;
 
+    if (db->bdb->cursor(db->bdb, NULL, &cursor, 0) != 0) {
+        return 1;
+    }
     memset(&key, 0, sizeof(DBT));
     memset(&data, 0, sizeof(DBT));
+    memcpy(found, prefix, len);
+    key.data = found;
+    key.size = len;
+    key.ulen = DB_ALIAS_SIZE;
+    key.flags = DB_DBT_USERMEM;
+    data.data = value;
+    data.ulen = DB_RECORD_SIZE;
+    data.flags = DB_DBT_USERMEM;
 
-    key.data = (void*) location;
-    key.size = strlen(location);
+    ret = cursor->c_get(cursor, &key, &data, DB_SET_RANGE);
+    cursor->c_close(cursor);
+    if (ret == DB_NOTFOUND) {
+        return 0;
+    }
+    return ret != 0 || (key.size >= len && memcmp(found, prefix, len) == 0);
+}
 
-    data.data = (void*) query;
-    data.size = sizeof(struct gc_db_query_t);
+/* Take location off the aliases of result id, and drop the result once
+ * no location is left to it. */
+static void _unlink(struct gc_db_t *db, unsigned int id,
+                    const char *location, size_t len) {
+    struct gc_db_query_t query;
+    size_t head_len = 0;
+    char key[DB_ALIAS_SIZE];
+    char point[DB_POINT_SIZE];
+    char record[DB_RECORD_SIZE];
+    DBT data;
 
-    ret = db->bdb->get(db->bdb, NULL, &key, &data, 0);
-    memcpy((void*) query, data.data, sizeof(struct gc_db_query_t));
-    
-    if (ret != 0) {
-        if (ret != DB_NOTFOUND) {
-            gc_loge("Cannot get data from database: %s", db_strerror(ret));
-        }
-        return -1;
+    _index_key(key, DB_INDEX_ALIAS, id);
+    memcpy(key + DB_INDEX_SIZE, location, len);
+    _del(db, key, DB_INDEX_SIZE + len);
+    if (_has_prefix(db, key, DB_INDEX_SIZE)) {
+        return;
     }
+    _index_key(key, DB_INDEX_RESULT, id);
+    if (_get(db, key, DB_INDEX_SIZE, &data, record, DB_RECORD_SIZE) != 0
+        || _parse_record(&data, &query, &head_len) != 0) {
+        return;
+    }
+    _point_key(point, &query);
+    _del(db, point, DB_POINT_SIZE);
+    _del(db, key, DB_INDEX_SIZE);
+}
 
+/* Keep a put to a frozen database as a line of the location and the
+ * result, for the process writing the file now. Puts beyond
+ * DB_PENDING_MAX are dropped. */
+static int _keep_pending(struct gc_db_t *db, const char *location,
+                         size_t len, const struct gc_db_query_t *query) {
+    size_t need = len + 1 + GC_DB_LINE_SIZE;
+    size_t size = 0;
+    char *buf = NULL;
+
+    if (db->pending_len + need > db->pending_size) {
+        size = GC_MAX(db->pending_size * 2, db->pending_len + need);
+        if (size > DB_PENDING_MAX
+            || (buf = realloc(db->pending, size)) == NULL) {
+            if (!db->pending_dropped++) {
+                gc_loge("Results put while frozen are dropped");
+            }
+            return 0;
+        }
+        db->pending = buf;
+        db->pending_size = size;
+    }
+    memcpy(db->pending + db->pending_len, location, len);
+    db->pending[db->pending_len + len] = ' ';
+    db->pending_len += len + 1;
+    db->pending_len += gc_db_format_result(query,
+                                           db->pending + db->pending_len,
+                                           db->pending_size
+                                           - db->pending_len);
     return 0;
 }
 
-int gc_db_put(struct gc_db_t *db, const char *location,
-              const struct gc_db_query_t *query) {
+/* Records are stamped with the time of the result, or with the current
+ * time if it has none, and replace what is stored for the location.
+ * Each distinct result is stored once, and locations link to it. */
+int gc_db_put_wire(struct gc_db_t *db, const char *location,
+                   const struct gc_db_query_t *query,
+                   const char *wire, size_t wire_len) {
     not_null(db);
     not_null(location);
     not_null(query);
 
     int ret = 0;
+    size_t len = strlen(location);
+    unsigned int old_id = 0;
+    unsigned int id = 0;
+    struct gc_db_query_t stamped = *query;
+    char record[DB_RECORD_SIZE];
+
+    if (db->frozen) {
+        return _keep_pending(db, location, len, query);
+    }
+    if (!wire || wire_len > GC_DB_WIRE_SIZE) {
+        wire_len = 0;
+    }
+    if (!stamped.mtime) {
+        stamped.mtime = time(NULL);
+    }
+
+    _write_lock(db);
+    old_id = _link_of(db, location, len);
+    if (len > DB_KEY_SIZE) {
+        /* Too long to list as an alias; the record holds the result */
+        ret = _put(db, location, len, record,
+                   _make_record(record, &stamped, wire, wire_len));
+    }
+    else {
+        id = _intern(db, &stamped, wire, wire_len);
+        ret = id ? _link(db, location, len, id, stamped.mtime,
+                         id != old_id) : -1;
+    }
+    if (ret != 0) {
+        _unlock(db);
+        return -1;
+    }
+    if (old_id && old_id != id) {
+        _unlink(db, old_id, location, len);
+    }
+    _unlock(db);
+    if (db->bloom) {
+        gc_bloom_add(db->bloom, location, len);
+        if (db->next_bloom) {
+            /* It may have gone past location already */
+            gc_bloom_add(db->next_bloom, location, len);
+        }
+        else if (db->bloom->count > db->bloom->capacity) {
+            _grow_bloom(db);
+        }
+    }
+    if (db->repl) {
+        gc_repl_record(db->repl, location, &stamped);
+    }
+    return 0;
+}
+
+/* Call func for every location whose result is that of location, until
+ * it returns non-zero. Returns -1 if location is not stored. */
+int gc_db_aliases(struct gc_db_t *db, const char *location,
+                  int (*func)(void *arg, const char *alias, size_t len),
+                  void *arg) {
+    not_null(db);
+    not_null(location);
+    not_null(func);
+
+    size_t len = strlen(location);
+    unsigned int id = 0;
+    time_t mtime = 0;
+    char prefix[DB_INDEX_SIZE];
+    char found[DB_ALIAS_SIZE];
+    char record[DB_RECORD_SIZE];
+    DBC *cursor = NULL;
     DBT key;
     DBT data;
+    int ret = 0;
 
+    _read_lock(db);
+    if (_get(db, location, len, &data, record, DB_RECORD_SIZE) != 0) {
+        _unlock(db);
+        return -1;
+    }
+    if (_parse_link(&data, &id, &mtime) != 0) {
+        /* Written before results were stored once */
+        func(arg, location, len);
+        _unlock(db);
+        return 0;
+    }
+    ret = db->bdb->cursor(db->bdb, NULL, &cursor, 0);
+    if (ret != 0) {
+        _unlock(db);
+        gc_loge("Cannot open database cursor: %s", db_strerror(ret));
+        return -1;
+    }
+
+    _index_key(prefix, DB_INDEX_ALIAS, id);
     memset(&key, 0, sizeof(DBT));
     memset(&data, 0, sizeof(DBT));
+    memcpy(found, prefix, DB_INDEX_SIZE);
+    key.data = found;
+    key.size = DB_INDEX_SIZE;
+    key.ulen = DB_ALIAS_SIZE;
+    key.flags = DB_DBT_USERMEM;
+    data.data = record;
+    data.ulen = DB_RECORD_SIZE;
+    data.flags = DB_DBT_USERMEM;
 
-    key.data = (void*) location;
-    key.size = strlen(location);
+    ret = cursor->c_get(cursor, &key, &data, DB_SET_RANGE);
+    while (ret == 0 && key.size >= DB_INDEX_SIZE
+           && memcmp(found, prefix, DB_INDEX_SIZE) == 0) {
+        if (func(arg, found + DB_INDEX_SIZE, key.size - DB_INDEX_SIZE) != 0) {
+            break;
+        }
+        ret = cursor->c_get(cursor, &key, &data, DB_NEXT);
+    }
+    cursor->c_close(cursor);
+    _unlock(db);
 
-    data.data = (void*) query;
-    data.size = sizeof(struct gc_db_query_t);
+    if (ret != 0 && ret != DB_NOTFOUND) {
+        gc_loge("Cannot read database: %s", db_strerror(ret));
+        return -1;
+    }
+    return 0;
+}
 
-    ret = db->bdb->put(db->bdb, NULL, &key, &data, DB_NOOVERWRITE);
+/* Call func for the records from the first location not before from,
+ * in key order, until it returns non-zero or the records run out. */
+int gc_db_scan(struct gc_db_t *db, const char *from,
+               int (*func)(void *arg, const char *location, size_t len,
+                           const struct gc_db_query_t *query),
+               void *arg) {
+    not_null(db);
+    not_null(from);
+    not_null(func);
+
+    struct gc_db_query_t query;
+    DBC *cursor = NULL;
+    DBT key;
+    DBT data;
+    int ret = 0;
+
+    _read_lock(db);
+    ret = db->bdb->cursor(db->bdb, NULL, &cursor, 0);
     if (ret != 0) {
-        gc_loge("Cannot put data into database: %s", db_strerror(ret));
+        _unlock(db);
+        gc_loge("Cannot open database cursor: %s", db_strerror(ret));
+        return -1;
+    }
+
+    ret = _cursor_first(cursor, &key, &data, from);
+    while (ret == 0) {
+        if (_resolve(db, &data, &query, NULL, NULL, NULL) == 0
+            && func(arg, key.data, key.size, &query) != 0) {
+            break;
+        }
+        ret = _cursor_next(cursor, &key, &data);
+    }
+    _cursor_close(cursor, &key, &data);
+    _unlock(db);
+
+    if (ret != 0 && ret != DB_NOTFOUND) {
+        gc_loge("Cannot read database: %s", db_strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+/* Keep the file under max_bytes, evicting the records least asked for
+ * and longest unchanged, and compacting the file afterwards. */
+int gc_db_set_limit(struct gc_db_t *db, size_t max_bytes,
+                    unsigned int compact_rate) {
+    not_null(db);
+
+    if (!db->sketch && gc_sketch_init(&(db->sketch), DB_SKETCH_WIDTH) != 0) {
+        return -1;
+    }
+    if (!db->evicted) {
+        db->evicted = malloc(DB_EVICT_BATCH * sizeof(struct _evicted_t));
+        if (db->evicted == NULL) {
+            gc_loge("Cannot allocate memory for eviction");
+            return -1;
+        }
+    }
+    db->max_bytes = max_bytes;
+    db->compact_rate = compact_rate ? compact_rate : 1;
+    return 0;
+}
+
+/* Count a request for location, which weighs its record */
+void gc_db_touch(struct gc_db_t *db, const char *location) {
+    if (db && db->sketch) {
+        gc_sketch_add(db->sketch, location, strlen(location));
+    }
+}
+
+/* Records asked for often and recently written weigh the most. */
+static double _weigh(struct gc_db_t *db, const DBT *key, const DBT *data,
+                     time_t now) {
+    struct gc_db_query_t query;
+    size_t head_len = 0;
+    unsigned int id = 0;
+    double age = 0;
+
+    if (_parse_link(data, &id, &(query.mtime)) != 0
+        && _parse_record(data, &query, &head_len) != 0) {
+        return -1;
+    }
+    if (!query.mtime) {
+        age = now;              /* Written before records had a time */
+    }
+    else if (query.mtime < now) {
+        age = now - query.mtime;
+    }
+    return (gc_sketch_estimate(db->sketch, key->data, key->size) + 1)
+        * (double) DB_AGE_HALF / (DB_AGE_HALF + age);
+}
+
+static int _compare_weights(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Weigh the next batch of records from the hand and delete the lighter
+ * half of it. Returns the number of records weighed, 0 at the end. */
+static int _evict_batch(struct gc_db_t *db, time_t now) {
+    double weights[DB_EVICT_BATCH];
+    double sorted[DB_EVICT_BATCH];
+    double threshold = 0;
+    char next[DB_KEY_SIZE];
+    size_t count = 0;
+    size_t lighter = 0;
+    size_t equal = 0;
+    size_t size = 0;
+    size_t unlinks = 0;
+    unsigned int id = 0;
+    time_t mtime = 0;
+    int is_link = 0;
+    struct _evicted_t *evicted = NULL;
+    register size_t i = 0;
+    DBC *cursor = NULL;
+    DBT key;
+    DBT data;
+    int ret = 0;
+
+    ret = db->bdb->cursor(db->bdb, NULL, &cursor, 0);
+    if (ret != 0) {
+        gc_loge("Cannot open database cursor: %s", db_strerror(ret));
+        return -1;
+    }
+
+    ret = _cursor_first(cursor, &key, &data, db->hand);
+    while (ret == 0 && count < DB_EVICT_BATCH) {
+        weights[count++] = _weigh(db, &key, &data, now);
+        ret = _cursor_next(cursor, &key, &data);
+    }
+    next[0] = '\0';
+    if (ret == 0) {
+        size = GC_MIN(key.size, DB_KEY_SIZE - 1);
+        memcpy(next, key.data, size);
+        next[size] = '\0';
+    }
+    else if (ret != DB_NOTFOUND) {
+        gc_loge("Cannot read database: %s", db_strerror(ret));
+        _cursor_close(cursor, &key, &data);
         return -1;
     }
+    if (!count) {
+        _cursor_close(cursor, &key, &data);
+        db->hand[0] = '\0';
+        return 0;
+    }
+
+    memcpy(sorted, weights, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), _compare_weights);
+    threshold = sorted[(count - 1) / 2];
+    for (i = 0; i < count; ++i) {
+        lighter += weights[i] < threshold;
+    }
+    equal = (count + 1) / 2 - lighter;
+
+    /* The same records again, nothing having changed in between */
+    free(key.data);
+    free(data.data);
+    ret = _cursor_first(cursor, &key, &data, db->hand);
+    for (i = 0; ret == 0 && i < count && db->evict_left; ++i) {
+        if (weights[i] < threshold || (weights[i] == threshold && equal)) {
+            if (weights[i] == threshold) {
+                --equal;
+            }
+            size = key.size + data.size;
+            is_link = _parse_link(&data, &id, &mtime) == 0;
+            if (is_link) {
+                size += DB_INDEX_SIZE + key.size; /* Its alias */
+            }
+            if (cursor->c_del(cursor, 0) == 0) {
+                db->evict_left -= GC_MIN(size, db->evict_left);
+                ++db->evictions;
+                if (is_link) {
+                    evicted = &(db->evicted[unlinks++]);
+                    evicted->id = id;
+                    evicted->len = key.size;
+                    memcpy(evicted->location, key.data, key.size);
+                }
+            }
+        }
+        ret = _cursor_next(cursor, &key, &data);
+    }
+    _cursor_close(cursor, &key, &data);
+    /* Results are let go of with no cursor open */
+    for (i = 0; i < unlinks; ++i) {
+        _unlink(db, db->evicted[i].id, db->evicted[i].location,
+                db->evicted[i].len);
+    }
+
+    strcpy(db->hand, next);
+    gc_stat_set(GC_STAT_EVICTIONS, db->evictions);
+    return count;
+}
+
+/* Free up to the pages the budget allows, going on from where the last
+ * step stopped. Lookups wait for one step at most. */
+static void _compact_step(struct gc_db_t *db, unsigned long long elapsed) {
+    DB_COMPACT c_data;
+    char end_key[DB_KEY_SIZE];
+    DBT start;
+    DBT end;
+    int ret = 0;
+
+    db->compact_budget += (double) db->compact_rate * elapsed / 1000000;
+    if (db->compact_budget > db->compact_rate) {
+        db->compact_budget = db->compact_rate;
+    }
+    if (db->compact_budget < 1) {
+        return;
+    }
+
+    memset(&c_data, 0, sizeof(DB_COMPACT));
+    memset(&start, 0, sizeof(DBT));
+    memset(&end, 0, sizeof(DBT));
+    c_data.compact_pages = (u_int32_t) db->compact_budget;
+    start.data = db->compact_from;
+    start.size = db->compact_from_len;
+    end.data = end_key;
+    end.ulen = DB_KEY_SIZE;
+    end.flags = DB_DBT_USERMEM;
+
+    ret = db->bdb->compact(db->bdb, NULL, start.size ? &start : NULL, NULL,
+                           &c_data, DB_FREE_SPACE, &end);
+    if (ret != 0) {
+        gc_loge("Cannot compact database: %s", db_strerror(ret));
+        db->phase = DB_PHASE_IDLE;
+        return;
+    }
+    db->compact_budget -= c_data.compact_pages_free;
+    db->compacted_pages += c_data.compact_pages_free;
+    gc_stat_set(GC_STAT_COMPACTED_PAGES, db->compacted_pages);
+
+    /* Fewer pages freed than allowed means the file is done */
+    if (!end.size || c_data.compact_pages_free < c_data.compact_pages) {
+        gc_log("Database is compacted, %lu pages returned",
+               (unsigned long) c_data.compact_pages_truncated);
+        db->phase = DB_PHASE_IDLE;
+        return;
+    }
+    memcpy(db->compact_from, end.data, end.size);
+    db->compact_from_len = end.size;
+}
+
+/* One step of filling a grown filter and of keeping the file under its
+ * limit. Called as often as wanted; steps are paced so that lookups are
+ * never held up for long. A round evicts down to DB_LOW_WATER percent
+ * of the limit, then compacts the file, then looks at its size again. */
+void gc_db_maintain(struct gc_db_t *db) {
+    unsigned long long now = 0;
+    unsigned long long elapsed = 0;
+    struct stat st;
+    int from_start = 0;
+    int ret = 0;
+    register size_t i = 0;
+
+    if (db == NULL || db->frozen) {
+        return;
+    }
+    if (db->next_bloom) {
+        _bloom_step(db);
+    }
+    if (!db->max_bytes) {
+        return;
+    }
+    now = gc_now_usec();
+    if (now - db->step_usec < DB_STEP_USEC) {
+        return;
+    }
+    elapsed = db->step_usec ? now - db->step_usec : DB_STEP_USEC;
+    db->step_usec = now;
+
+    if (db->phase == DB_PHASE_COMPACT) {
+        if (_try_write_lock(db) == 0) {
+            _compact_step(db, elapsed);
+            _unlock(db);
+        }
+        return;
+    }
+    if (stat(db->filename, &st) != 0) {
+        return;
+    }
+    gc_stat_set(GC_STAT_DB_BYTES, st.st_size);
+    if (db->phase == DB_PHASE_IDLE) {
+        if ((size_t) st.st_size <= db->max_bytes) {
+            return;
+        }
+        db->evict_left = st.st_size - db->max_bytes / 100 * DB_LOW_WATER;
+        db->phase = DB_PHASE_EVICT;
+        gc_log("Database is %lu bytes. Evicting %lu bytes of records",
+               (unsigned long) st.st_size, (unsigned long) db->evict_left);
+    }
+
+    if (_try_write_lock(db) != 0) {
+        return;                 /* Readers are busy; next step */
+    }
+    for (i = 0; i < DB_EVICT_STEP && db->evict_left; ++i) {
+        from_start = !db->hand[0];
+        ret = _evict_batch(db, time(NULL));
+        if (ret < 0 || (ret == 0 && from_start)) {
+            break;              /* Nothing left to evict */
+        }
+    }
+    _unlock(db);
+    if (!db->evict_left || ret < 0 || (ret == 0 && from_start)) {
+        db->evict_left = 0;
+        db->phase = DB_PHASE_COMPACT;
+        db->compact_from_len = 0;
+        db->compact_budget = 0;
+    }
+}
+
+/* Record every put in the change log of repl from now on. */
+void gc_db_set_repl(struct gc_db_t *db, struct gc_repl_t *repl) {
+    not_null_void(db);
+
+    db->repl = repl;
+}
+
+/* Write out what has been put and keep every later put as a line for
+ * gc_db_pending, to be stored by the process writing the file next.
+ * Berkeley DB without an environment cannot have two processes writing
+ * a file. */
+int gc_db_freeze(struct gc_db_t *db) {
+    not_null(db);
+
+    int ret = 0;
+
+    _write_lock(db);
+    ret = gc_db_sync(db);
+    if (ret == 0) {
+        db->frozen = 1;
+    }
+    _unlock(db);
+    return ret;
+}
+
+/* Write again after a freeze whose process has gone away, storing the
+ * puts kept meanwhile */
+int gc_db_thaw(struct gc_db_t *db) {
+    not_null(db);
+
+    if (!db->frozen) {
+        return 0;
+    }
+    db->frozen = 0;
+    gc_db_put_lines(db, db->pending, db->pending_len);
+    db->pending_len = 0;
+    if (db->pending_dropped) {
+        gc_loge("%lu results put while frozen are lost",
+                db->pending_dropped);
+        db->pending_dropped = 0;
+    }
     return 0;
 }
 
+/* Lines of the puts to a frozen database not yet taken, and their
+ * length */
+size_t gc_db_pending(struct gc_db_t *db, const char **lines) {
+    not_null(db);
+    not_null(lines);
+
+    *lines = db->pending;
+    return db->pending_len;
+}
+
+/* Drop the first len bytes of the pending lines, once passed on */
+void gc_db_pending_taken(struct gc_db_t *db, size_t len) {
+    not_null_void(db);
+
+    len = GC_MIN(len, db->pending_len);
+    memmove(db->pending, db->pending + len, db->pending_len - len);
+    db->pending_len -= len;
+}
+
+/* Store the puts of another process in lines as gc_db_pending gives
+ * them. Returns the bytes of whole lines, which are changed; the rest
+ * is for a later call. */
+size_t gc_db_put_lines(struct gc_db_t *db, char *lines, size_t len) {
+    not_null(db);
+
+    char *line = lines;
+    char *end = NULL;
+    char *space = NULL;
+    struct gc_db_query_t query;
+
+    while (line < lines + len
+           && (end = memchr(line, '\n', lines + len - line)) != NULL) {
+        space = memchr(line, ' ', end - line);
+        memset(&query, 0, sizeof(query));
+        if (space == NULL || gc_db_parse_result(space + 1, &query) != 0) {
+            gc_loge("Malformed result is passed on");
+        }
+        else {
+            *space = '\0';
+            gc_db_put(db, line, &query);
+        }
+        line = end + 1;
+    }
+    return line - lines;
+}
+
 int gc_db_sync(struct gc_db_t *db) {
     int ret = db->bdb->sync(db->bdb, 0);
     if (ret != 0) {
@@ -147,6 +1470,20 @@ int gc_db_sync(struct gc_db_t *db) {
 int gc_db_free(struct gc_db_t *db) {
     not_null(db);
 
+    if (db->bloom) {
+        gc_bloom_free(db->bloom);
+    }
+    if (db->next_bloom) {
+        gc_bloom_free(db->next_bloom);
+    }
+    if (db->sketch) {
+        gc_sketch_free(db->sketch);
+    }
+    safefree(db->evicted);
+    safefree(db->pending);
+    if (db->threaded) {
+        pthread_rwlock_destroy(&(db->lock));
+    }
     if (db != NULL && db->bdb != NULL) {
         if (db->bdb->close(db->bdb, 0) != 0) {
             return -1;
@@ -18,21 +18,69 @@
 #ifndef __GC_DB_H__
 #define __GC_DB_H__
 
+#include <stddef.h>
+#include <time.h>
+
+/* Largest serialised response stored next to a record */
+#define GC_DB_WIRE_SIZE 64
+/* Longest result as gc_db_format_result writes it */
+#define GC_DB_LINE_SIZE 128
+
 struct gc_db_t;
+struct gc_repl_t;
 
 struct gc_db_query_t {
     int code;
     char accuracy;
     double latitude;
     double longitude;
+    time_t mtime;               /* When the record was written */
 };
 
+/* Largest record, which lookups read into the buffer given to them */
+#define GC_DB_RECORD_SIZE                                               \
+    (sizeof(unsigned int) + sizeof(struct gc_db_query_t) + GC_DB_WIRE_SIZE)
+
+/* A result as upstream answers it and as clients are answered,
+ * "code,accuracy,latitude,longitude" and a newline */
+size_t gc_db_format_result(const struct gc_db_query_t *query,
+                           char *buf, size_t buf_size);
+int gc_db_parse_result(const char *line, struct gc_db_query_t *query);
+
 int gc_db_init(struct gc_db_t **db);
+int gc_db_set_threaded(struct gc_db_t *db);
 int gc_db_load(struct gc_db_t *db, const char *filename);
 int gc_db_get(struct gc_db_t *db, const char *location,
               const struct gc_db_query_t *query);
 int gc_db_put(struct gc_db_t *db, const char *location,
               const struct gc_db_query_t *query);
+int gc_db_get_wire(struct gc_db_t *db, const char *location,
+                   struct gc_db_query_t *query, char *buf, size_t buf_size,
+                   const char **wire, size_t *wire_len);
+int gc_db_may_hold(struct gc_db_t *db, const char *location);
+int gc_db_read(struct gc_db_t *db, const char *location,
+               struct gc_db_query_t *query, char *buf, size_t buf_size,
+               const char **wire, size_t *wire_len);
+int gc_db_put_wire(struct gc_db_t *db, const char *location,
+                   const struct gc_db_query_t *query,
+                   const char *wire, size_t wire_len);
+int gc_db_aliases(struct gc_db_t *db, const char *location,
+                  int (*func)(void *arg, const char *alias, size_t len),
+                  void *arg);
+int gc_db_scan(struct gc_db_t *db, const char *from,
+               int (*func)(void *arg, const char *location, size_t len,
+                           const struct gc_db_query_t *query),
+               void *arg);
+void gc_db_set_repl(struct gc_db_t *db, struct gc_repl_t *repl);
+int gc_db_set_limit(struct gc_db_t *db, size_t max_bytes,
+                    unsigned int compact_rate);
+void gc_db_touch(struct gc_db_t *db, const char *location);
+void gc_db_maintain(struct gc_db_t *db);
+int gc_db_freeze(struct gc_db_t *db);
+int gc_db_thaw(struct gc_db_t *db);
+size_t gc_db_pending(struct gc_db_t *db, const char **lines);
+void gc_db_pending_taken(struct gc_db_t *db, size_t len);
+size_t gc_db_put_lines(struct gc_db_t *db, char *lines, size_t len);
 int gc_db_sync(struct gc_db_t *db);
 int gc_db_free(struct gc_db_t *db);
 
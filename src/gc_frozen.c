@@ -0,0 +1,538 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_db.h"
+#include "gc_frozen.h"
+#include "gc_util.h"
+
+#define FROZEN_MAGIC        "gcfrz"
+#define FROZEN_VERSION      1
+#define FROZEN_ALIGN        64      /* Entries start on a cache line */
+#define FROZEN_BUCKET_KEYS  4       /* Locations in a bucket, on average */
+#define FROZEN_DIRECT       0x80000000U /* Bucket of one; the slot itself */
+#define FROZEN_DISPLACEMENTS (1U << 24) /* Tried for a bucket at most */
+#define FROZEN_SEEDS        16      /* Tried before the build gives up */
+#define FROZEN_GOLDEN       0x9e3779b97f4a7c15ULL
+
+/* Start of the file, followed by the displacements of the buckets at
+ * FROZEN_ALIGN and by the entries at entries_offset. */
+struct gc_frozen_header_t {
+    char magic[8];
+    unsigned int version;
+    unsigned int entry_size;
+    unsigned long long seed;
+    unsigned long long count;
+    unsigned long long bucket_count;
+    unsigned long long entries_offset;
+    unsigned int checksum;      /* Of the fields above */
+    unsigned int pad;
+};
+
+/* Two entries to a cache line, neither of them crossing one */
+struct gc_frozen_entry_t {
+    unsigned long long fingerprint; /* Hash of the location */
+    double latitude;
+    double longitude;
+    unsigned int mtime;
+    short code;
+    char accuracy;
+    char pad;
+};
+
+/* Entries read from the database for a build */
+struct _collect_t {
+    struct gc_frozen_entry_t *entries;
+    size_t count;
+    size_t size;
+    int failed;
+};
+
+extern int g_is_daemon;
+
+/* 64-bit FNV-1a with a final mix. It is the fingerprint of a location
+ * as well. */
+static unsigned long long _hash(const char *key, size_t key_len) {
+    register unsigned long long h = 14695981039346656037ULL;
+    register size_t i = 0;
+
+    for (i = 0; i < key_len; ++i) {
+        h ^= (unsigned char) key[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static unsigned long long _mix(unsigned long long h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* The high half of x scaled to [0, n), n being below 2^32 */
+static size_t _range(unsigned long long x, size_t n) {
+    return (size_t) (((x >> 32) * (unsigned long long) n) >> 32);
+}
+
+/* Slot of a location whose mixed hash is g, in a bucket displaced by
+ * d */
+static size_t _slot(unsigned long long g, unsigned int d, size_t count) {
+    if (d & FROZEN_DIRECT) {
+        return d & ~FROZEN_DIRECT;
+    }
+    return _range(_mix(g + d * FROZEN_GOLDEN), count);
+}
+
+static unsigned int _checksum(const struct gc_frozen_header_t *header) {
+    return (unsigned int) _hash((const char *) header,
+                                offsetof(struct gc_frozen_header_t,
+                                         checksum));
+}
+
+static size_t _align(size_t offset) {
+    return (offset + FROZEN_ALIGN - 1) / FROZEN_ALIGN * FROZEN_ALIGN;
+}
+
+static int _collect(void *arg, const char *location, size_t len,
+                    const struct gc_db_query_t *query) {
+    struct _collect_t *c = arg;
+    struct gc_frozen_entry_t *entries = NULL;
+    struct gc_frozen_entry_t *entry = NULL;
+    size_t size = 0;
+
+    if (c->count == c->size) {
+        size = c->size ? c->size * 2 : 65536;
+        entries = realloc(c->entries,
+                          size * sizeof(struct gc_frozen_entry_t));
+        if (entries == NULL) {
+            gc_loge("Cannot allocate memory for frozen set");
+            c->failed = 1;
+            return -1;
+        }
+        c->entries = entries;
+        c->size = size;
+    }
+    entry = &(c->entries[c->count++]);
+    memset(entry, 0, sizeof(struct gc_frozen_entry_t));
+    entry->fingerprint = _hash(location, len);
+    entry->latitude = query->latitude;
+    entry->longitude = query->longitude;
+    entry->mtime = (unsigned int) query->mtime;
+    entry->code = (short) query->code;
+    entry->accuracy = query->accuracy;
+    return 0;
+}
+
+static int _compare_fingerprints(const void *a, const void *b) {
+    unsigned long long x = ((const struct gc_frozen_entry_t *) a)->fingerprint;
+    unsigned long long y = ((const struct gc_frozen_entry_t *) b)->fingerprint;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Locations with the same fingerprint cannot be told apart, so none of
+ * them is kept. Entries are sorted. Returns the count left. */
+static size_t _drop_collisions(struct gc_frozen_entry_t *entries,
+                               size_t count) {
+    size_t kept = 0;
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < count) {
+        for (j = i + 1; j < count
+                 && entries[j].fingerprint == entries[i].fingerprint; ++j) {
+        }
+        if (j == i + 1) {
+            entries[kept++] = entries[i];
+        }
+        i = j;
+    }
+    return kept;
+}
+
+/* Find a displacement for the bucket of the k entries in members, such
+ * that their slots are free and differ. Returns -1 if there is none. */
+static int _displace(const unsigned long long *mixed,
+                     const unsigned int *members, size_t k,
+                     const unsigned char *taken, size_t count,
+                     size_t *slots, unsigned int *displacement) {
+    unsigned int d = 0;
+    register size_t i = 0;
+    register size_t j = 0;
+
+    for (d = 0; d < FROZEN_DISPLACEMENTS; ++d) {
+        for (i = 0; i < k; ++i) {
+            slots[i] = _slot(mixed[members[i]], d, count);
+            if (taken[slots[i]]) {
+                break;
+            }
+            for (j = 0; j < i && slots[j] != slots[i]; ++j) {
+            }
+            if (j < i) {
+                break;
+            }
+        }
+        if (i == k) {
+            *displacement = d;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Build the hash for seed: buckets of more than one location get a
+ * displacement, largest first while the table is empty, and buckets of
+ * one get a free slot of their own. Entries are put in their slots in
+ * out. Returns 1 if seed does not work. */
+static int _place(const struct gc_frozen_entry_t *entries, size_t count,
+                  unsigned long long seed, unsigned int *buckets,
+                  size_t bucket_count, struct gc_frozen_entry_t *out) {
+    unsigned long long *mixed = malloc(count * sizeof(unsigned long long));
+    size_t *start = calloc(bucket_count + 1, sizeof(size_t));
+    unsigned int *members = malloc(count * sizeof(unsigned int));
+    unsigned int *order = calloc(bucket_count, sizeof(unsigned int));
+    unsigned char *taken = calloc(count, 1);
+    size_t *by_size = NULL;
+    size_t *slots = NULL;
+    size_t max_size = 0;
+    size_t free_slot = 0;
+    size_t first = 0;
+    size_t b = 0;
+    size_t k = 0;
+    unsigned int d = 0;
+    int ret = 0;
+    register size_t i = 0;
+    register size_t j = 0;
+
+    if (mixed && start && members && order && taken) {
+        /* Entries grouped by bucket, bucket b's from start[b] on */
+        for (i = 0; i < count; ++i) {
+            mixed[i] = _mix(entries[i].fingerprint ^ seed);
+            ++start[_range(mixed[i], bucket_count) + 1];
+        }
+        for (b = 0; b < bucket_count; ++b) {
+            max_size = GC_MAX(max_size, start[b + 1]);
+            start[b + 1] += start[b];
+        }
+        for (i = 0; i < count; ++i) {
+            b = _range(mixed[i], bucket_count);
+            members[start[b] + order[b]++] = i;
+        }
+        by_size = calloc(max_size + 1, sizeof(size_t));
+        slots = malloc((max_size + 1) * sizeof(size_t));
+    }
+    if (!by_size || !slots) {
+        gc_loge("Cannot allocate memory for frozen set");
+        ret = -1;
+    }
+    else {
+        /* Buckets by size, largest first */
+        for (b = 0; b < bucket_count; ++b) {
+            ++by_size[start[b + 1] - start[b]];
+        }
+        for (k = max_size + 1, first = 0; k-- > 0; ) {
+            i = by_size[k];
+            by_size[k] = first;
+            first += i;
+        }
+        for (b = 0; b < bucket_count; ++b) {
+            order[by_size[start[b + 1] - start[b]]++] = b;
+        }
+
+        memset(buckets, 0, bucket_count * sizeof(unsigned int));
+        for (i = 0; i < bucket_count; ++i) {
+            b = order[i];
+            first = start[b];
+            k = start[b + 1] - first;
+            if (k == 0) {
+                break;              /* The rest are empty as well */
+            }
+            if (k == 1) {
+                while (taken[free_slot]) {
+                    ++free_slot;
+                }
+                buckets[b] = FROZEN_DIRECT | free_slot;
+                taken[free_slot] = 1;
+                out[free_slot] = entries[members[first]];
+                continue;
+            }
+            if (_displace(mixed, members + first, k, taken, count, slots,
+                          &d) != 0) {
+                ret = 1;
+                break;
+            }
+            buckets[b] = d;
+            for (j = 0; j < k; ++j) {
+                taken[slots[j]] = 1;
+                out[slots[j]] = entries[members[first + j]];
+            }
+        }
+    }
+
+    free(mixed);
+    free(start);
+    free(members);
+    free(order);
+    free(taken);
+    free(by_size);
+    free(slots);
+    return ret;
+}
+
+/* Write the file under a temporary name, and move it in place once it
+ * is complete. A process serving the old file keeps it. */
+static int _write(const char *filename,
+                  const struct gc_frozen_header_t *header,
+                  const unsigned int *buckets,
+                  const struct gc_frozen_entry_t *entries) {
+    char tmp_filename[520];
+    char zeros[FROZEN_ALIGN];
+    size_t offset = 0;
+    FILE *fp = NULL;
+    int ok = 1;
+
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+    memset(zeros, 0, FROZEN_ALIGN);
+    fp = fopen(tmp_filename, "wb");
+    if (fp == NULL) {
+        gc_loge("Cannot create '%s': %m", tmp_filename);
+        return -1;
+    }
+    ok = fwrite(header, sizeof(struct gc_frozen_header_t), 1, fp) == 1
+        && fwrite(zeros, FROZEN_ALIGN - sizeof(struct gc_frozen_header_t),
+                  1, fp) == 1;
+    offset = FROZEN_ALIGN + header->bucket_count * sizeof(unsigned int);
+    ok = ok && fwrite(buckets, sizeof(unsigned int), header->bucket_count,
+                      fp) == header->bucket_count;
+    if (ok && header->entries_offset > offset) {
+        ok = fwrite(zeros, header->entries_offset - offset, 1, fp) == 1;
+    }
+    ok = ok && fwrite(entries, sizeof(struct gc_frozen_entry_t),
+                      header->count, fp) == header->count;
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    if (!ok || rename(tmp_filename, filename) != 0) {
+        gc_loge("Cannot write frozen set '%s': %m", filename);
+        unlink(tmp_filename);
+        return -1;
+    }
+    return 0;
+}
+
+/* Compile every record of db into a frozen set at filename. */
+int gc_frozen_build(struct gc_db_t *db, const char *filename) {
+    not_null(db);
+    not_null(filename);
+
+    struct _collect_t c;
+    struct gc_frozen_header_t header;
+    struct gc_frozen_entry_t *out = NULL;
+    unsigned int *buckets = NULL;
+    size_t read = 0;
+    size_t bucket_count = 0;
+    unsigned long long seed = 0;
+    int ret = 1;
+    int tries = 0;
+
+    memset(&c, 0, sizeof(struct _collect_t));
+    if (gc_db_scan(db, "", _collect, &c) != 0 || c.failed) {
+        safefree(c.entries);
+        return -1;
+    }
+    read = c.count;
+    qsort(c.entries, c.count, sizeof(struct gc_frozen_entry_t),
+          _compare_fingerprints);
+    c.count = _drop_collisions(c.entries, c.count);
+    if (c.count >= FROZEN_DIRECT) {
+        gc_loge("Too many locations for a frozen set");
+        safefree(c.entries);
+        return -1;
+    }
+
+    bucket_count = c.count / FROZEN_BUCKET_KEYS + 1;
+    buckets = malloc(bucket_count * sizeof(unsigned int));
+    out = malloc((c.count ? c.count : 1) * sizeof(struct gc_frozen_entry_t));
+    if (buckets == NULL || out == NULL) {
+        gc_loge("Cannot allocate memory for frozen set");
+        ret = -1;
+    }
+    for (tries = 0; ret == 1 && tries < FROZEN_SEEDS; ++tries) {
+        seed = _mix(FROZEN_GOLDEN * (tries + 1));
+        ret = _place(c.entries, c.count, seed, buckets, bucket_count, out);
+    }
+    if (ret == 1) {
+        gc_loge("Cannot find a perfect hash for %lu locations",
+                (unsigned long) c.count);
+    }
+
+    if (ret == 0) {
+        memset(&header, 0, sizeof(struct gc_frozen_header_t));
+        memcpy(header.magic, FROZEN_MAGIC, sizeof(FROZEN_MAGIC));
+        header.version = FROZEN_VERSION;
+        header.entry_size = sizeof(struct gc_frozen_entry_t);
+        header.seed = seed;
+        header.count = c.count;
+        header.bucket_count = bucket_count;
+        header.entries_offset = _align(FROZEN_ALIGN + bucket_count
+                                       * sizeof(unsigned int));
+        header.checksum = _checksum(&header);
+        ret = _write(filename, &header, buckets, out);
+    }
+    if (ret == 0) {
+        gc_log("Frozen set '%s' holds %lu locations, %lu left out as "
+               "indistinguishable", filename, (unsigned long) c.count,
+               (unsigned long) (read - c.count));
+    }
+
+    safefree(c.entries);
+    safefree(buckets);
+    safefree(out);
+    return ret == 0 ? 0 : -1;
+}
+
+/* Map the frozen set at filename. Nothing is read until it is looked
+ * up, so this takes no longer for a larger set. */
+int gc_frozen_open(struct gc_frozen_t **frozen, const char *filename) {
+    not_null(frozen);
+    not_null(filename);
+
+    struct gc_frozen_header_t *header = NULL;
+    struct stat st;
+    void *base = NULL;
+    int fd = -1;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        gc_loge("Cannot open frozen set '%s': %m", filename);
+        return -1;
+    }
+    if (fstat(fd, &st) != 0
+        || (size_t) st.st_size < sizeof(struct gc_frozen_header_t)) {
+        gc_loge("Frozen set '%s' is not usable", filename);
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        gc_loge("Cannot map frozen set '%s': %m", filename);
+        return -1;
+    }
+    header = base;
+    if (memcmp(header->magic, FROZEN_MAGIC, sizeof(FROZEN_MAGIC)) != 0
+        || header->version != FROZEN_VERSION
+        || header->entry_size != sizeof(struct gc_frozen_entry_t)
+        || header->checksum != _checksum(header)
+        || !header->bucket_count
+        || header->entries_offset < FROZEN_ALIGN + header->bucket_count
+        * sizeof(unsigned int)
+        || header->entries_offset + header->count * header->entry_size
+        != (unsigned long long) st.st_size) {
+        gc_loge("Frozen set '%s' is not usable", filename);
+        munmap(base, st.st_size);
+        return -1;
+    }
+    /* Lookups go anywhere; reading ahead is of no use */
+    madvise(base, st.st_size, MADV_RANDOM);
+
+    *frozen = malloc(sizeof(struct gc_frozen_t));
+    if (*frozen == NULL) {
+        gc_loge("Cannot allocate memory for frozen set");
+        munmap(base, st.st_size);
+        return -1;
+    }
+    snprintf((*frozen)->filename, sizeof((*frozen)->filename), "%s",
+             filename);
+    (*frozen)->map_size = st.st_size;
+    (*frozen)->count = header->count;
+    (*frozen)->bucket_count = header->bucket_count;
+    (*frozen)->seed = header->seed;
+    (*frozen)->header = header;
+    (*frozen)->buckets = (const unsigned int *) ((char *) base
+                                                 + FROZEN_ALIGN);
+    (*frozen)->entries = (const struct gc_frozen_entry_t *)
+        ((char *) base + header->entries_offset);
+    gc_log("Frozen set '%s' holds %lu locations", filename,
+           (unsigned long) header->count);
+    return 0;
+}
+
+/* One hash of location and one entry read. A location not in the set
+ * may be taken for one that is only if their fingerprints are equal. */
+int gc_frozen_get(struct gc_frozen_t *frozen, const char *location,
+                  struct gc_db_query_t *query) {
+    not_null(frozen);
+    not_null(location);
+    not_null(query);
+
+    const struct gc_frozen_entry_t *entry = NULL;
+    unsigned long long h = 0;
+    unsigned long long g = 0;
+    size_t slot = 0;
+
+    if (!frozen->count) {
+        return -1;
+    }
+    h = _hash(location, strlen(location));
+    g = _mix(h ^ frozen->seed);
+    slot = _slot(g, frozen->buckets[_range(g, frozen->bucket_count)],
+                 frozen->count);
+    if (slot >= frozen->count) {
+        return -1;
+    }
+    entry = frozen->entries + slot;
+    if (entry->fingerprint != h) {
+        return -1;
+    }
+    query->code = entry->code;
+    query->accuracy = entry->accuracy;
+    query->latitude = entry->latitude;
+    query->longitude = entry->longitude;
+    query->mtime = entry->mtime;
+    return 0;
+}
+
+int gc_frozen_free(struct gc_frozen_t *frozen) {
+    not_null(frozen);
+
+    if (frozen->header && munmap(frozen->header, frozen->map_size) != 0) {
+        gc_loge("Cannot unmap frozen set '%s': %m", frozen->filename);
+    }
+    safefree(frozen);
+    return 0;
+}
@@ -0,0 +1,50 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __GC_FROZEN_H__
+#define __GC_FROZEN_H__
+
+#include <stddef.h>
+
+#include "gc_db.h"
+
+struct gc_frozen_header_t;
+struct gc_frozen_entry_t;
+
+/* Immutable set of results compiled from a database, served from a
+ * read-only mapping. Locations are found through a minimal perfect
+ * hash and told apart by a 64-bit fingerprint; the locations
+ * themselves are not in the file. Nothing is written after opening,
+ * so lookups take no lock. */
+struct gc_frozen_t {
+    char filename[512];
+    size_t map_size;
+    size_t count;
+    size_t bucket_count;
+    unsigned long long seed;
+    struct gc_frozen_header_t *header;
+    const unsigned int *buckets;    /* Displacement of each bucket */
+    const struct gc_frozen_entry_t *entries;
+};
+
+int gc_frozen_build(struct gc_db_t *db, const char *filename);
+int gc_frozen_open(struct gc_frozen_t **frozen, const char *filename);
+int gc_frozen_get(struct gc_frozen_t *frozen, const char *location,
+                  struct gc_db_query_t *query);
+int gc_frozen_free(struct gc_frozen_t *frozen);
+
+#endif
@@ -0,0 +1,137 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_hedge.h"
+#include "gc_stats.h"
+#include "gc_util.h"
+
+#define HEDGE_MIN_SAMPLES 64    /* Before that the delay is not known */
+#define HEDGE_REPORT_USEC 1000000 /* Between percentile updates */
+#define HEDGE_MAX_TOKENS  10    /* Largest burst of hedges */
+
+extern int g_is_daemon;
+
+int gc_hedge_init(struct gc_hedge_t **hedge) {
+    not_null(hedge);
+
+    *hedge = malloc(sizeof(struct gc_hedge_t));
+    if (*hedge == NULL) {
+        gc_loge("Cannot allocate memory for hedging");
+        return -1;
+    }
+    memset(*hedge, 0, sizeof(struct gc_hedge_t));
+    return 0;
+}
+
+static unsigned int _percentile(struct gc_hedge_t *hedge,
+                                const unsigned int *samples, size_t count,
+                                double percentile) {
+    return gc_percentile(samples, GC_MIN(count, GC_HEDGE_WINDOW),
+                         hedge->sorted, percentile);
+}
+
+/* Every miss adds to the budget of hedges. */
+void gc_hedge_miss(struct gc_hedge_t *hedge) {
+    not_null_void(hedge);
+
+    hedge->tokens += hedge->max_ratio;
+    if (hedge->tokens > HEDGE_MAX_TOKENS) {
+        hedge->tokens = HEDGE_MAX_TOKENS;
+    }
+}
+
+/* Whether a miss waiting msec for upstream should be hedged now. */
+int gc_hedge_due(struct gc_hedge_t *hedge, unsigned long msec) {
+    not_null(hedge);
+
+    return hedge->delay_msec && msec >= hedge->delay_msec
+        && hedge->tokens >= 1;
+}
+
+void gc_hedge_sent(struct gc_hedge_t *hedge) {
+    not_null_void(hedge);
+
+    hedge->tokens -= 1;
+    gc_stat_inc(GC_STAT_HEDGES);
+}
+
+void gc_hedge_won(struct gc_hedge_t *hedge) {
+    not_null_void(hedge);
+
+    gc_stat_inc(GC_STAT_HEDGE_WINS);
+}
+
+/* Latency of a first request, as it would have been without hedging.
+ * Losers of a hedge are still waited for in the background. */
+void gc_hedge_first(struct gc_hedge_t *hedge, unsigned long msec) {
+    not_null_void(hedge);
+
+    hedge->first[hedge->first_count++ % GC_HEDGE_WINDOW] = msec;
+}
+
+/* Latency of a miss as its client saw it. */
+void gc_hedge_served(struct gc_hedge_t *hedge, unsigned long msec) {
+    not_null_void(hedge);
+
+    hedge->served[hedge->served_count++ % GC_HEDGE_WINDOW] = msec;
+}
+
+/* Work out the hedging delay and the percentiles of the stats from the
+ * recent latencies, at most once a second. */
+void gc_hedge_report(struct gc_hedge_t *hedge) {
+    not_null_void(hedge);
+
+    unsigned long long now = gc_now_usec();
+
+    if (now - hedge->report_usec < HEDGE_REPORT_USEC) {
+        return;
+    }
+    hedge->report_usec = now;
+
+    if (hedge->first_count >= HEDGE_MIN_SAMPLES
+        && hedge->first_count != hedge->first_reported) {
+        hedge->first_reported = hedge->first_count;
+        hedge->delay_msec = GC_MAX(_percentile(hedge, hedge->first,
+                                               hedge->first_count,
+                                               hedge->percentile), 1);
+        gc_stat_set(GC_STAT_HEDGE_DELAY_MSEC, hedge->delay_msec);
+        gc_stat_set(GC_STAT_UPSTREAM_P99_UNHEDGED_MSEC,
+                    _percentile(hedge, hedge->first, hedge->first_count,
+                                99));
+    }
+    if (hedge->served_count != hedge->served_reported) {
+        hedge->served_reported = hedge->served_count;
+        gc_stat_set(GC_STAT_UPSTREAM_P99_MSEC,
+                    _percentile(hedge, hedge->served, hedge->served_count,
+                                99));
+    }
+}
+
+int gc_hedge_free(struct gc_hedge_t *hedge) {
+    not_null(hedge);
+
+    safefree(hedge);
+    return 0;
+}
@@ -0,0 +1,56 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_HEDGE_H__
+#define __GC_HEDGE_H__
+
+#include <stddef.h>
+
+#define GC_HEDGE_WINDOW 1024    /* Recent misses the latencies cover */
+
+/* Hedged upstream requests. A miss whose answer is later than the given
+ * percentile of recent upstream latency is also sent to another server,
+ * as long as the budget of hedges per miss allows. */
+struct gc_hedge_t {
+    double percentile;          /* Hedge after this latency percentile */
+    double max_ratio;           /* Hedges per miss, at most */
+    double tokens;
+    unsigned long delay_msec;   /* Current hedging delay, 0 until known */
+    size_t first_count;
+    size_t served_count;
+    size_t first_reported;      /* Counts at the last update */
+    size_t served_reported;
+    unsigned long long report_usec;
+    unsigned int first[GC_HEDGE_WINDOW];  /* Latency of first requests */
+    unsigned int served[GC_HEDGE_WINDOW]; /* Latency seen by clients */
+    unsigned int sorted[GC_HEDGE_WINDOW]; /* Scratch of the updates */
+};
+
+int gc_hedge_init(struct gc_hedge_t **hedge);
+void gc_hedge_miss(struct gc_hedge_t *hedge);
+int gc_hedge_due(struct gc_hedge_t *hedge, unsigned long msec);
+void gc_hedge_sent(struct gc_hedge_t *hedge);
+void gc_hedge_won(struct gc_hedge_t *hedge);
+void gc_hedge_first(struct gc_hedge_t *hedge, unsigned long msec);
+void gc_hedge_served(struct gc_hedge_t *hedge, unsigned long msec);
+void gc_hedge_report(struct gc_hedge_t *hedge);
+int gc_hedge_free(struct gc_hedge_t *hedge);
+
+#endif
+
+
@@ -0,0 +1,380 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_http.h"
+#include "gc_util.h"
+
+#define HTTP_PATH          "/maps/geo"
+#define HTTP_SAFE          "-_.~" /* Left unescaped besides alphanumerics */
+
+extern int g_is_daemon;
+
+/* Find the blank line ending the head. A line end before from has been
+ * looked at already. Returns the length of the head, or 0. */
+static size_t _head_end(const char *buf, size_t len, size_t start,
+                        size_t from) {
+    const char *p = NULL;
+    size_t i = GC_MAX(start, from);
+
+    while (i < len && (p = memchr(buf + i, '\n', len - i)) != NULL) {
+        i = p - buf;
+        if ((i > start && buf[i - 1] == '\n')
+            || (i > start + 1 && buf[i - 1] == '\r' && buf[i - 2] == '\n')) {
+            return i + 1;
+        }
+        ++i;
+    }
+    return 0;
+}
+
+/* The line at *pos, its end excluded. *pos moves past it. */
+static size_t _next_line(const char *buf, size_t end, size_t *pos,
+                         const char **line) {
+    const char *p = memchr(buf + *pos, '\n', end - *pos);
+    size_t len = 0;
+
+    *line = buf + *pos;
+    if (p == NULL) {
+        *pos = end;
+        return 0;
+    }
+    len = p - *line;
+    *pos += len + 1;
+    if (len && (*line)[len - 1] == '\r') {
+        --len;
+    }
+    return len;
+}
+
+/* Point value at what follows "name:" if the line is that header */
+static int _is_header(const char *line, size_t len, const char *name,
+                      const char **value, size_t *value_len) {
+    size_t name_len = strlen(name);
+
+    if (len <= name_len || line[name_len] != ':'
+        || strncasecmp(line, name, name_len) != 0) {
+        return 0;
+    }
+    *value = line + name_len + 1;
+    *value_len = len - name_len - 1;
+    while (*value_len && isspace((unsigned char) **value)) {
+        ++*value;
+        --*value_len;
+    }
+    return 1;
+}
+
+static int _has_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    size_t i = 0;
+
+    for (i = 0; i + token_len <= len; ++i) {
+        if (strncasecmp(value + i, token, token_len) == 0
+            && (i == 0 || value[i - 1] == ',' || value[i - 1] == ' ')
+            && (i + token_len == len || value[i + token_len] == ','
+                || value[i + token_len] == ' ')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Take the parameters we know of from the query string of the target */
+static int _parse_params(const char *buf, const char *p, const char *end,
+                         struct gc_http_request_t *req) {
+    const char *amp = NULL;
+
+    for (; p < end; p = amp + 1) {
+        amp = memchr(p, '&', end - p);
+        if (amp == NULL) {
+            amp = end;
+        }
+        if (amp - p > 2 && strncmp(p, "q=", 2) == 0) {
+            req->query = p + 2 - buf;
+            req->query_len = amp - p - 2;
+        }
+        else if (amp - p == 10 && strncmp(p, "output=csv", 10) == 0) {
+            req->output = GC_HTTP_CSV;
+        }
+        else if (amp - p == 11 && strncmp(p, "output=json", 11) == 0) {
+            req->output = GC_HTTP_JSON;
+        }
+        else if (amp - p > 7 && strncmp(p, "output=", 7) == 0) {
+            return -1;          /* No xml or kml here */
+        }
+    }
+    return req->query_len ? 0 : -1;
+}
+
+/* Parse the request head at the start of buf, of which len bytes have
+ * arrived, the first from of them looked at before. Returns 0 until the
+ * head is complete, then 1. A request which cannot be answered has its
+ * status set, and the connection is to be closed after refusing it. */
+int gc_http_parse(const char *buf, size_t len, size_t from,
+                  struct gc_http_request_t *req) {
+    not_null(buf);
+    not_null(req);
+
+    const char *line = NULL;
+    const char *target = NULL;
+    const char *version = NULL;
+    const char *value = NULL;
+    size_t value_len = 0;
+    size_t line_len = 0;
+    size_t start = 0;
+    size_t pos = 0;
+
+    /* Line ends after the request before are not part of this one */
+    while (start < len && (buf[start] == '\r' || buf[start] == '\n')) {
+        ++start;
+    }
+    memset(req, 0, sizeof(struct gc_http_request_t));
+    req->end = _head_end(buf, len, start, from);
+    if (!req->end) {
+        return 0;
+    }
+
+    pos = start;
+    line_len = _next_line(buf, req->end, &pos, &line);
+    if (line_len < 4 || strncmp(line, "GET ", 4) != 0) {
+        req->status = memchr(line, ' ', line_len) ? 405 : 400;
+        return 1;
+    }
+    target = line + 4;
+    version = memchr(target, ' ', line_len - 4);
+    if (version == NULL) {
+        req->status = 400;
+        return 1;
+    }
+    ++version;
+    if (line + line_len - version != 8 || strncmp(version, "HTTP/1.", 7)) {
+        req->status = strncmp(version, "HTTP/", 5) == 0 ? 505 : 400;
+        return 1;
+    }
+    req->keep_alive = version[7] == '1';
+
+    while ((line_len = _next_line(buf, req->end, &pos, &line)) > 0) {
+        if (_is_header(line, line_len, "Connection", &value, &value_len)) {
+            if (_has_token(value, value_len, "close")) {
+                req->keep_alive = 0;
+            }
+            else if (_has_token(value, value_len, "keep-alive")) {
+                req->keep_alive = 1;
+            }
+        }
+        else if ((_is_header(line, line_len, "Content-Length", &value,
+                             &value_len)
+                  && strspn(value, "0") < value_len)
+                 || _is_header(line, line_len, "Transfer-Encoding", &value,
+                               &value_len)) {
+            req->status = 400;  /* A GET has no body to skip */
+            break;
+        }
+    }
+
+    if (!req->status
+        && (strncmp(target, HTTP_PATH "?", sizeof(HTTP_PATH)) != 0)) {
+        req->status = 404;
+    }
+    if (!req->status
+        && _parse_params(buf, target + sizeof(HTTP_PATH), version - 1,
+                         req) != 0) {
+        req->status = 400;
+    }
+    if (req->status) {
+        req->keep_alive = 0;
+    }
+    return 1;
+}
+
+static int _hex_value(int c) {
+    if (isdigit(c)) {
+        return c - '0';
+    }
+    c = tolower(c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* Unescape the q parameter into out and make the query of it the way
+ * GeoCache::Client does: white space squeezed, lower case and
+ * URI-escaped, so that both hit the same keys. out has room for three
+ * bytes a byte of src. Returns the length of the query, 0 if empty. */
+size_t gc_http_query(const char *src, size_t len, char *out) {
+    not_null(src);
+    not_null(out);
+
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned char c = 0;
+    size_t n = 0;
+    size_t i = 0;
+    int space = 0;
+    int hi = 0;
+    int lo = 0;
+
+    for (i = 0; i < len; ++i) {
+        c = src[i];
+        if (c == '+') {
+            c = ' ';
+        }
+        else if (c == '%' && i + 2 < len
+                 && (hi = _hex_value((unsigned char) src[i + 1])) >= 0
+                 && (lo = _hex_value((unsigned char) src[i + 2])) >= 0) {
+            c = hi << 4 | lo;
+            i += 2;
+        }
+        if (isspace(c)) {
+            space = n > 0;
+            continue;
+        }
+        if (space) {
+            memcpy(out + n, "%20", 3);
+            n += 3;
+            space = 0;
+        }
+        if (isalnum(c) || (c && strchr(HTTP_SAFE, c))) {
+            out[n++] = tolower(c);
+        }
+        else {
+            out[n++] = '%';
+            out[n++] = hex[c >> 4];
+            out[n++] = hex[c & 0xf];
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+/* The body of output=json, after the old upstream JSON output */
+static size_t _json(char *buf, size_t size, const char *name,
+                    const char *line) {
+    int code = 0;
+    char accuracy = '0';
+    double latitude = 0;
+    double longitude = 0;
+    size_t len = 0;
+
+    sscanf(line, "%d,%c,%lf,%lf", &code, &accuracy, &latitude, &longitude);
+    len = snprintf(buf, size, "{\"name\":\"");
+    for (; *name && len + 2 < size; ++name) {
+        if (*name == '"' || *name == '\\') {
+            buf[len++] = '\\';
+        }
+        buf[len++] = *name;
+    }
+    len += snprintf(buf + len, size - len,
+                    "\",\"Status\":{\"code\":%d,\"request\":\"geocode\"}",
+                    code);
+    if (code == 200 && len < size) {
+        len += snprintf(buf + len, size - len,
+                        ",\"Placemark\":[{\"AddressDetails\":"
+                        "{\"Accuracy\":%c},\"Point\":{\"coordinates\":"
+                        "[%lf,%lf,0]}}]", accuracy, longitude, latitude);
+    }
+    if (len < size) {
+        len += snprintf(buf + len, size - len, "}\n");
+    }
+    return GC_MIN(len, size - 1);
+}
+
+/* Put the response line, NUL-terminated, in an HTTP response for the
+ * query name. buf has GC_HTTP_RESPONSE_SIZE() bytes for name. The body
+ * is made behind the room for the head, which is then put before it. */
+size_t gc_http_respond(char *buf, size_t size, const char *line,
+                       size_t line_len, const char *name, int output,
+                       int keep_alive) {
+    not_null(buf);
+    not_null(line);
+    not_null(name);
+
+    char *body = buf + GC_HTTP_HEAD_SIZE;
+    size_t body_len = 0;
+    size_t head_len = 0;
+
+    if (size <= GC_HTTP_HEAD_SIZE) {
+        return 0;
+    }
+    if (output == GC_HTTP_JSON) {
+        body_len = _json(body, size - GC_HTTP_HEAD_SIZE, name, line);
+    }
+    else {
+        body_len = GC_MIN(line_len, size - GC_HTTP_HEAD_SIZE);
+        memcpy(body, line, body_len);
+    }
+    head_len = snprintf(buf, GC_HTTP_HEAD_SIZE,
+                        "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: %s; charset=UTF-8\r\n"
+                        "Content-Length: %lu\r\n"
+                        "Connection: %s\r\n\r\n",
+                        output == GC_HTTP_JSON
+                        ? "application/json" : "text/plain",
+                        (unsigned long) body_len,
+                        keep_alive ? "keep-alive" : "close");
+    memmove(buf + head_len, body, body_len);
+    return head_len + body_len;
+}
+
+static const char *_reason(int status) {
+    static const struct {
+        int status;
+        const char *reason;
+    } reasons[] = {
+        { 400, "Bad Request" },
+        { 404, "Not Found" },
+        { 405, "Method Not Allowed" },
+        { 429, "Too Many Requests" },
+        { 505, "HTTP Version Not Supported" },
+        { 0, NULL }
+    };
+    register int i = 0;
+
+    for (i = 0; reasons[i].reason; ++i) {
+        if (reasons[i].status == status) {
+            return reasons[i].reason;
+        }
+    }
+    return "Service Unavailable";
+}
+
+/* A response with no result, for a request refused or a client which
+ * cannot be taken in. */
+size_t gc_http_error(char *buf, size_t size, int status, int keep_alive) {
+    not_null(buf);
+
+    const char *reason = _reason(status);
+    int len = snprintf(buf, size,
+                       "HTTP/1.1 %d %s\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Content-Length: %lu\r\n"
+                       "%s"
+                       "Connection: %s\r\n\r\n"
+                       "%s\n",
+                       status, reason, (unsigned long) strlen(reason) + 1,
+                       status == 405 ? "Allow: GET\r\n" : "",
+                       keep_alive ? "keep-alive" : "close", reason);
+
+    return len < 0 ? 0 : GC_MIN((size_t) len, size - 1);
+}
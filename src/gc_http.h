@@ -0,0 +1,53 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+
+#ifndef __GC_HTTP_H__
+#define __GC_HTTP_H__
+
+#include <stddef.h>
+
+/* Formats of the upstream geocoding URL geocache answers in */
+#define GC_HTTP_CSV        0
+#define GC_HTTP_JSON       1
+
+#define GC_HTTP_HEAD_SIZE  192  /* Status line and headers we send */
+/* Room for a response to the query name of name_len bytes */
+#define GC_HTTP_RESPONSE_SIZE(name_len) (GC_HTTP_HEAD_SIZE + 320 \
+                                         + 2 * (name_len))
+
+/* A request head, as "GET /maps/geo?q=...&output=csv HTTP/1.1". Offsets
+ * are into the buffer parsed. */
+struct gc_http_request_t {
+    size_t end;                 /* Bytes of the head, blank line included */
+    size_t query;               /* The q parameter, still escaped */
+    size_t query_len;
+    int output;                 /* GC_HTTP_CSV or GC_HTTP_JSON */
+    int keep_alive;
+    int status;                 /* 0, or the status to refuse it with */
+};
+
+int gc_http_parse(const char *buf, size_t len, size_t from,
+                  struct gc_http_request_t *req);
+size_t gc_http_query(const char *src, size_t len, char *out);
+size_t gc_http_respond(char *buf, size_t size, const char *line,
+                       size_t line_len, const char *name, int output,
+                       int keep_alive);
+size_t gc_http_error(char *buf, size_t size, int status, int keep_alive);
+
+#endif
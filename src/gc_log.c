@@ -0,0 +1,216 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_util.h"
+
+#define LOG_MSG_SIZE     240
+#define LOG_RING_SIZE    1024   /* Records per thread, a power of two */
+#define LOG_OUT_BUF_SIZE 65536
+#define LOG_IDLE_USEC    2000
+
+/* Fixed-size record. The producer only renders the message; prefixing,
+ * batching and the actual I/O happen in the logger thread. */
+struct gc_log_record_t {
+    int level;
+    char msg[LOG_MSG_SIZE];
+};
+
+/* Single producer, single consumer ring owned by one thread. */
+struct gc_log_ring_t {
+    struct gc_log_ring_t *next;
+    unsigned int head;          /* Written by the logger thread */
+    unsigned int tail;          /* Written by the owner thread */
+    struct gc_log_record_t records[LOG_RING_SIZE];
+};
+
+extern int g_is_daemon;
+
+int g_log_async = 0;
+unsigned int g_log_sample[GC_LOG_LEVELS] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+__thread unsigned int g_log_seen[GC_LOG_LEVELS];
+
+static __thread struct gc_log_ring_t *tls_ring = NULL;
+static struct gc_log_ring_t *gs_rings = NULL;
+static unsigned long gs_dropped = 0;
+static volatile int gs_running = 0;
+static pthread_t gs_thread;
+
+static struct gc_log_ring_t *_ring(void) {
+    struct gc_log_ring_t *ring = NULL;
+
+    if (tls_ring) {
+        return tls_ring;
+    }
+    ring = malloc(sizeof(struct gc_log_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(struct gc_log_ring_t));
+
+    /* Rings are only ever added, never removed. */
+    ring->next = __atomic_load_n(&gs_rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&gs_rings, &(ring->next), ring, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+    }
+    tls_ring = ring;
+    return ring;
+}
+
+void gc_log_push(int level, const char *fmt, ...) {
+    struct gc_log_ring_t *ring = _ring();
+    struct gc_log_record_t *rec = NULL;
+    unsigned int tail = 0;
+    va_list ap;
+
+    if (ring == NULL) {
+        __atomic_add_fetch(&gs_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    tail = ring->tail;
+    if (tail - __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE)
+        >= LOG_RING_SIZE) {
+        __atomic_add_fetch(&gs_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec = &(ring->records[tail & (LOG_RING_SIZE - 1)]);
+    rec->level = level;
+    va_start(ap, fmt);
+    vsnprintf(rec->msg, LOG_MSG_SIZE, fmt, ap);
+    va_end(ap);
+
+    __atomic_store_n(&(ring->tail), tail + 1, __ATOMIC_RELEASE);
+}
+
+static void _emit(int level, const char *msg, char *out, size_t *out_len) {
+    size_t len = 0;
+
+    if (g_is_daemon) {
+        syslog(level, "%s", msg);
+        return;
+    }
+
+    len = strlen(msg);
+    if (*out_len + len + 1 > LOG_OUT_BUF_SIZE) {
+        if (write(STDERR_FILENO, out, *out_len) < 0) {
+        }
+        *out_len = 0;
+    }
+    memcpy(out + *out_len, msg, len);
+    out[*out_len + len] = '\n';
+    *out_len += len + 1;
+}
+
+/* Move everything queued so far to the log. Returns the number of
+ * records written. */
+static size_t _drain(char *out) {
+    static unsigned long reported = 0;
+    struct gc_log_ring_t *ring = NULL;
+    struct gc_log_record_t *rec = NULL;
+    unsigned int head = 0;
+    unsigned int tail = 0;
+    unsigned long dropped = 0;
+    size_t out_len = 0;
+    size_t count = 0;
+    char msg[64];
+
+    for (ring = __atomic_load_n(&gs_rings, __ATOMIC_ACQUIRE);
+         ring; ring = ring->next) {
+        head = ring->head;
+        tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            rec = &(ring->records[head & (LOG_RING_SIZE - 1)]);
+            _emit(rec->level, rec->msg, out, &out_len);
+            ++count;
+        }
+        __atomic_store_n(&(ring->head), head, __ATOMIC_RELEASE);
+    }
+
+    dropped = __atomic_load_n(&gs_dropped, __ATOMIC_RELAXED);
+    if (dropped != reported) {
+        snprintf(msg, sizeof(msg), "Dropped %lu log records",
+                 dropped - reported);
+        _emit(LOG_WARNING, msg, out, &out_len);
+        reported = dropped;
+    }
+
+    if (out_len && write(STDERR_FILENO, out, out_len) < 0) {
+    }
+    return count;
+}
+
+static void *_logger(void *arg) {
+    char *out = arg;
+    struct timespec ts;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = LOG_IDLE_USEC * 1000;
+
+    while (gs_running) {
+        if (!_drain(out)) {
+            nanosleep(&ts, NULL);
+        }
+    }
+    _drain(out);
+    return NULL;
+}
+
+int gc_log_start(void) {
+    static char out[LOG_OUT_BUF_SIZE];
+    int ret = 0;
+
+    if (gs_running) {
+        return 0;
+    }
+    gs_running = 1;
+    ret = pthread_create(&gs_thread, NULL, _logger, out);
+    if (ret != 0) {
+        gs_running = 0;
+        errno = ret;
+        gc_loge("Cannot start logger thread: %m");
+        return -1;
+    }
+    g_log_async = 1;
+    return 0;
+}
+
+void gc_log_stop(void) {
+    if (!gs_running) {
+        return;
+    }
+    g_log_async = 0;
+    gs_running = 0;
+    pthread_join(gs_thread, NULL);
+}
+
+unsigned long gc_log_dropped(void) {
+    return __atomic_load_n(&gs_dropped, __ATOMIC_RELAXED);
+}
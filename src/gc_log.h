@@ -23,18 +23,41 @@
 
 #include "gc_error.h"
 
-#define gc_logl(l, ...) do {                    \
-        if (g_is_daemon) {                      \
-            syslog(l, __VA_ARGS__);             \
-        }                                       \
-        else {                                  \
-            fprintf(stderr, __VA_ARGS__);       \
-            fprintf(stderr, "\n");              \
-        }                                       \
+/* Sampling keeps 1 in g_log_sample[level] messages of a level. The
+ * counters are per thread. */
+#define GC_LOG_LEVELS 8
+
+extern int g_log_async;
+extern unsigned int g_log_sample[GC_LOG_LEVELS];
+extern __thread unsigned int g_log_seen[GC_LOG_LEVELS];
+
+#define gc_log_sampled(l)                                               \
+    (g_log_sample[(l) & 7] <= 1                                         \
+     || g_log_seen[(l) & 7]++ % g_log_sample[(l) & 7] == 0)
+
+#define gc_logl(l, ...) do {                            \
+        if (gc_log_sampled(l)) {                        \
+            if (g_log_async) {                          \
+                gc_log_push(l, __VA_ARGS__);            \
+            }                                           \
+            else if (g_is_daemon) {                     \
+                syslog(l, __VA_ARGS__);                 \
+            }                                           \
+            else {                                      \
+                fprintf(stderr, __VA_ARGS__);           \
+                fprintf(stderr, "\n");                  \
+            }                                           \
+        }                                               \
     } while (0)
 
 #define gc_log(...) gc_logl(LOG_INFO, __VA_ARGS__)
 
 #define gc_loge(...) gc_logl(LOG_ERR, __VA_ARGS__)
 
+void gc_log_push(int level, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+int gc_log_start(void);
+void gc_log_stop(void);
+unsigned long gc_log_dropped(void);
+
 #endif
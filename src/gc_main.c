@@ -21,6 +21,9 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -33,23 +36,109 @@
 #include "gc_debug.h"
 #include "gc_error.h"
 #include "gc_log.h"
+#include "gc_admit.h"
+#include "gc_cache.h"
+#include "gc_shm.h"
+#include "gc_hedge.h"
+#include "gc_refresh.h"
+#include "gc_cluster.h"
+#include "gc_repl.h"
+#include "gc_trace.h"
+#include "gc_quota.h"
 #include "gc_db.h"
+#include "gc_frozen.h"
+#include "gc_reader.h"
 #include "gc_server.h"
 #include "gc_conn.h"
 #include "gc_util.h"
 
 #define FILENAME_SIZE 64
+#define HOSTNAME_SIZE 128
+#define NETWORK_SIZE  64
+#define PASSED_SIZE   65536     /* Results passed on at a handoff */
 #define PROG_NAME PACKAGE_NAME
 
+#define IO_BACKEND_SELECT 0
+#define IO_BACKEND_URING  1
+
 struct gc_main_t {
-    int server_fd;
+    int server_fds[GC_SERVER_LISTEN_MAX]; /* Listeners of clients */
+    size_t server_count;
     int port;
+    int udp_fd;                 /* Datagram socket, or -1 */
+    int udp_port;               /* 0 to take no datagrams */
+    int http_fd;                /* HTTP listener, or -1 */
+    int http_port;              /* 0 to speak no HTTP */
+    int upstream_port;
+    int io_backend;
+    int log_async;
+    int backlog;
+    size_t listen_count;        /* Listeners given, or 0 for -p */
+    struct gc_server_listen_t listens[GC_SERVER_LISTEN_MAX];
+    size_t max_conns;
+    size_t max_upstream;
+    double rate;
+    double burst;
+    unsigned int shed_msec;
+    unsigned long quota_daily;
+    unsigned long quota_reserve;
+    double quota_rate;
+    size_t quota_queue;
+    double hedge_percentile;
+    double hedge_max_pct;
+    unsigned int ttl;
+    unsigned int fail_ttl;
+    size_t bulk_count;
     unsigned int timeout;
+    size_t cache_size;
+    char shm_name[FILENAME_SIZE];
+    size_t shm_size;
+    unsigned int negative_ttl;
+    size_t negative_size;
+    size_t max_request;
+    size_t miss_budget;
+    unsigned int batch_msec;    /* Window of upstream batches */
+    size_t batch_keys;          /* Misses in a batch, 0 for no batches */
+    unsigned long trace_usec;   /* Slowest requests recorded, 0 for none */
+    size_t trace_records;
+    int disk_wire;
+    size_t db_limit;
+    unsigned int compact_rate;
+    size_t io_threads;
     struct gc_db_t *db;
+    struct gc_frozen_t *frozen;
+    struct gc_reader_t *reader;
+    struct gc_cache_t *cache;
+    struct gc_shm_t *shm;
+    struct gc_cache_t *negative;
+    struct gc_admit_t *admit;
+    struct gc_quota_t *quota;
+    struct gc_hedge_t *hedge;
+    struct gc_refresh_t *refresh;
+    struct gc_cluster_t *cluster;
+    struct gc_repl_t *repl;
+    struct gc_trace_t *trace;
     struct gc_conn_t *conn;
     char db_filename[FILENAME_SIZE];
+    char frozen_filename[FILENAME_SIZE]; /* Served in front of the db */
+    char compile_filename[FILENAME_SIZE]; /* Frozen set to build */
     char key_filename[FILENAME_SIZE];
     char pid_filename[FILENAME_SIZE];
+    char upstream[HOSTNAME_SIZE];
+    char bulk_clients[GC_QUOTA_BULK_MAX][NETWORK_SIZE];
+    size_t peer_count;
+    char peers[GC_CLUSTER_MAX][HOSTNAME_SIZE];
+    char self[HOSTNAME_SIZE];
+    size_t repl_log;
+    char primary[HOSTNAME_SIZE];
+    char handoff[FILENAME_SIZE];  /* Socket to pass the listener over */
+    unsigned int drain_sec;
+    int handoff_fd;             /* Listening for the next process */
+    int successor_fd;           /* Next process, waiting for the listener */
+    int predecessor_fd;         /* Process taken over from, or -1 */
+    time_t drain_end;           /* Exit by then, 0 while serving */
+    char passed[PASSED_SIZE];   /* Results from it not yet stored */
+    size_t passed_len;
 };
 
 extern char *optarg;
@@ -102,6 +191,89 @@ static void _dbsync_handler(int signum) {
     gc_log("Database is syncked");
 }
 
+/* Release everything and exit. Once the listener has been handed off,
+ * the pid file and the database are the next process's. */
+static void _terminate(struct gc_main_t *gc) {
+    not_null_void(gc);
+
+    struct gc_server_listen_t *lsn = NULL;
+    size_t i = 0;
+
+    /* No lookup is to be in progress while the file is closed */
+    if (gc->reader && gc_reader_free(gc->reader) != 0) {
+        gc_loge("Cannot stop reader threads");
+    }
+    if (!gc->drain_end) {
+        /* Sync database */
+        if (gc_db_sync(gc->db) != 0) {
+            gc_loge("Cannot sync database: %m");
+        }
+
+        /* Remove pid file */
+        if (unlink(gc->pid_filename) != 0) {
+            gc_loge("Cannot remove pid file '%s': %m", gc->pid_filename);
+        }
+        if (gc->handoff_fd >= 0 && unlink(gc->handoff) != 0) {
+            gc_loge("Cannot remove handoff socket '%s': %m", gc->handoff);
+        }
+        for (i = 0; i < gc->listen_count; ++i) {
+            lsn = &(gc->listens[i]);
+            if (lsn->addr.ss_family == AF_UNIX
+                && unlink(((struct sockaddr_un *) &(lsn->addr))->sun_path)
+                != 0) {
+                gc_loge("Cannot remove socket file: %m");
+            }
+        }
+
+        if (gc_db_free(gc->db) != 0) {
+            gc_loge("Cannot free database: %m");
+        }
+    }
+    if (gc_conn_free(gc->conn) != 0) {
+        gc_loge("Cannot free connections: %m");
+    }
+    if (gc->cache && gc_cache_free(gc->cache) != 0) {
+        gc_loge("Cannot free cache: %m");
+    }
+    if (gc->shm && gc_shm_free(gc->shm) != 0) {
+        gc_loge("Cannot detach shared memory: %m");
+    }
+    if (gc->frozen && gc_frozen_free(gc->frozen) != 0) {
+        gc_loge("Cannot free frozen set: %m");
+    }
+    if (gc->negative && gc_cache_free(gc->negative) != 0) {
+        gc_loge("Cannot free negative cache: %m");
+    }
+    if (gc->admit && gc_admit_free(gc->admit) != 0) {
+        gc_loge("Cannot free admission control: %m");
+    }
+    if (gc->quota) {
+        gc_quota_save(gc->quota, 1);
+    }
+    if (gc->quota && gc_quota_free(gc->quota) != 0) {
+        gc_loge("Cannot free upstream quota: %m");
+    }
+    if (gc->hedge && gc_hedge_free(gc->hedge) != 0) {
+        gc_loge("Cannot free hedging: %m");
+    }
+    if (gc->refresh && gc_refresh_free(gc->refresh) != 0) {
+        gc_loge("Cannot free refresh: %m");
+    }
+    if (gc->cluster && gc_cluster_free(gc->cluster) != 0) {
+        gc_loge("Cannot free cluster: %m");
+    }
+    if (gc->repl && gc_repl_free(gc->repl) != 0) {
+        gc_loge("Cannot free replication: %m");
+    }
+    if (gc->trace && gc_trace_free(gc->trace) != 0) {
+        gc_loge("Cannot free tracing: %m");
+    }
+
+    gc_log("Program terminated");
+    
+    exit(0);
+}
+
 static void _termination_handler(int signum) {
     sigset_t mask_set;
     sigset_t old_set;
@@ -112,38 +284,149 @@ static void _termination_handler(int signum) {
     sigfillset(&mask_set);
     sigprocmask(SIG_SETMASK, &mask_set, &old_set);
 
-    /* Sync database */
-    if (gc_db_sync(gs_gc.db) != 0) {
-        gc_loge("Cannot sync database: %m");
-    }
+    _terminate(&gs_gc);
+}
 
-    /* Remove pid file */
-    if (unlink(gs_gc.pid_filename) != 0) {
-        gc_loge("Cannot remove pid file '%s': %m", gs_gc.pid_filename);
-    }
-    
-    if (gc_db_free(gs_gc.db) != 0) {
-        gc_loge("Cannot free database: %m");
+/* Parse "level=N", e.g. "info=100" to log 1 in 100 queries. */
+static int _parse_log_sample(const char *arg) {
+    static const struct {
+        const char *name;
+        int level;
+    } levels[] = {
+        { "debug",   LOG_DEBUG },
+        { "info",    LOG_INFO },
+        { "notice",  LOG_NOTICE },
+        { "warning", LOG_WARNING },
+        { "error",   LOG_ERR },
+        { NULL, 0 }
+    };
+    const char *eq = strchr(arg, '=');
+    register int i = 0;
+
+    if (!eq || atoi(eq + 1) < 1) {
+        return -1;
     }
-    if (gc_conn_free(gs_gc.conn) != 0) {
-        gc_loge("Cannot free connections: %m");
+    for (i = 0; levels[i].name; ++i) {
+        if (strncmp(arg, levels[i].name, eq - arg) == 0
+            && levels[i].name[eq - arg] == '\0') {
+            g_log_sample[levels[i].level] = atoi(eq + 1);
+            return 0;
+        }
     }
-
-    gc_log("Program terminated");
-    
-    exit(0);
+    return -1;
 }
 
 static void _parse_opts(int argc, char *argv[], struct gc_main_t *gc) {
     not_null_void(gc);
     
     int opt = 0;
+    static const struct option long_opts[] = {
+        { "database",   required_argument, NULL, 'd' },
+        { "db-limit",   required_argument, NULL, 'E' },
+        { "key-file",   required_argument, NULL, 'k' },
+        { "pid-file",   required_argument, NULL, 'P' },
+        { "port",       required_argument, NULL, 'p' },
+        { "udp-port",   required_argument, NULL, 'y' },
+        { "http-port",  required_argument, NULL, 'F' },
+        { "timeout",    required_argument, NULL, 't' },
+        { "cache-size", required_argument, NULL, 'c' },
+        { "shared-cache", required_argument, NULL, 'X' },
+        { "disk-wire",  no_argument,       NULL, 'w' },
+        { "frozen",     required_argument, NULL, 'f' },
+        { "compile",    required_argument, NULL, 'O' },
+        { "io-threads", required_argument, NULL, 'j' },
+        { "max-request", required_argument, NULL, 'm' },
+        { "miss-budget", required_argument, NULL, 'e' },
+        { "trace",      required_argument, NULL, 'x' },
+        { "upstream",   required_argument, NULL, 'u' },
+        { "batch",      required_argument, NULL, 'J' },
+        { "io-backend", required_argument, NULL, 'b' },
+        { "log-async",  no_argument,       NULL, 'A' },
+        { "log-sample", required_argument, NULL, 'L' },
+        { "backlog",    required_argument, NULL, 'B' },
+        { "listen",     required_argument, NULL, 'a' },
+        { "max-conns",  required_argument, NULL, 'n' },
+        { "max-upstream", required_argument, NULL, 'U' },
+        { "rate-limit", required_argument, NULL, 'r' },
+        { "shed-latency", required_argument, NULL, 'l' },
+        { "quota",      required_argument, NULL, 'q' },
+        { "quota-rate", required_argument, NULL, 'Q' },
+        { "quota-queue", required_argument, NULL, 'W' },
+        { "bulk-client", required_argument, NULL, 'C' },
+        { "hedge",      required_argument, NULL, 'H' },
+        { "ttl",        required_argument, NULL, 'T' },
+        { "negative-ttl", required_argument, NULL, 'N' },
+        { "peer",       required_argument, NULL, 'g' },
+        { "self",       required_argument, NULL, 'G' },
+        { "repl-log",   required_argument, NULL, 'M' },
+        { "replicate",  required_argument, NULL, 'R' },
+        { "handoff",    required_argument, NULL, 'Z' },
+        { "daemon",     no_argument,       NULL, 'D' },
+        { "version",    no_argument,       NULL, 'v' },
+        { "kill",       no_argument,       NULL, 'K' },
+        { "sync",       no_argument,       NULL, 'S' },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
 
     g_is_daemon = 0;
 
     /* Set up default values */
     gc->port = 1732;
+    gc->udp_fd = -1;
+    gc->udp_port = 0;
+    gc->http_fd = -1;
+    gc->http_port = 0;
+    gc->db_limit = 0;
+    gc->compact_rate = 256;
+    gc->io_threads = 0;
     gc->timeout = 5;
+    gc->cache_size = 0;
+    gc->shm_name[0] = '\0';
+    gc->shm_size = 65536;
+    gc->negative_ttl = 0;
+    gc->negative_size = 10000;
+    gc->disk_wire = 0;
+    gc->frozen_filename[0] = '\0';
+    gc->compile_filename[0] = '\0';
+    gc->max_request = GC_CONN_MAX_REQUEST;
+    gc->miss_budget = GC_CONN_MISS_BUDGET;
+    gc->trace_usec = 0;
+    gc->trace_records = GC_TRACE_RECORDS;
+    gc->upstream_port = 80;
+    gc->batch_msec = 0;
+    gc->batch_keys = 0;
+    gc->io_backend = IO_BACKEND_SELECT;
+    gc->log_async = 0;
+    gc->backlog = 128;
+    gc->server_count = 0;
+    gc->listen_count = 0;
+    gc->max_conns = 500;
+    gc->max_upstream = 0;
+    gc->rate = 0;
+    gc->burst = 0;
+    gc->shed_msec = 0;
+    gc->quota_daily = 0;
+    gc->quota_reserve = 0;
+    gc->quota_rate = 0;
+    gc->quota_queue = 1000;
+    gc->bulk_count = 0;
+    gc->hedge_percentile = 0;
+    gc->hedge_max_pct = 0;
+    gc->ttl = 0;
+    gc->fail_ttl = 0;
+    gc->peer_count = 0;
+    gc->self[0] = '\0';
+    gc->repl_log = 0;
+    gc->primary[0] = '\0';
+    gc->handoff[0] = '\0';
+    gc->drain_sec = 10;
+    gc->handoff_fd = -1;
+    gc->successor_fd = -1;
+    gc->predecessor_fd = -1;
+    gc->drain_end = 0;
+    gc->passed_len = 0;
+    snprintf(gc->upstream, HOSTNAME_SIZE, "%s", "maps.google.com");
     snprintf(gc->db_filename,
              FILENAME_SIZE, "%s", "/var/lib/" PROG_NAME "/" PROG_NAME ".db");
     snprintf(gc->key_filename,
@@ -151,12 +434,23 @@ static void _parse_opts(int argc, char *argv[], struct gc_main_t *gc) {
     snprintf(gc->pid_filename,
              FILENAME_SIZE, "%s", "/var/run/" PROG_NAME ".pid");
 
-    while ((opt = getopt(argc, argv, "d:k:P:p:t:DvKSh")) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:E:k:P:p:y:F:t:c:X:wf:O:j:m:e:x:u:J:b:AL:B:n:U:r:l:q:Q:W:C:H:T:N:g:G:M:R:Z:a:DvKSh",
+                              long_opts, NULL)) != -1) {
         switch (opt) {
             case 'd': {
                 snprintf(gc->db_filename, FILENAME_SIZE, "%s", optarg);
                 break;
             }
+            case 'E': {
+                char *colon = NULL;
+
+                gc->db_limit = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                colon = strchr(optarg, ':');
+                if (colon) {
+                    gc->compact_rate = strtoul(colon + 1, NULL, 10);
+                }
+                break;
+            }
             case 'k': {
                 snprintf(gc->key_filename, FILENAME_SIZE, "%s", optarg);
                 break;
@@ -169,10 +463,253 @@ static void _parse_opts(int argc, char *argv[], struct gc_main_t *gc) {
                 gc->port = atoi(optarg);
                 break;
             }
+            case 'y': {
+                gc->udp_port = atoi(optarg);
+                break;
+            }
+            case 'F': {
+                gc->http_port = atoi(optarg);
+                break;
+            }
             case 't': {
                 gc->timeout = atoi(optarg);
                 break;
             }
+            case 'c': {
+                gc->cache_size = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 'X': {
+                char *colon = NULL;
+
+                snprintf(gc->shm_name, FILENAME_SIZE, "%s", optarg);
+                if ((colon = strchr(gc->shm_name, ':')) != NULL) {
+                    *colon = '\0';
+                    gc->shm_size = strtoul(colon + 1, NULL, 10);
+                }
+                if (gc->shm_name[0] != '/' || !gc->shm_size) {
+                    fprintf(stderr, "Bad shared cache '%s'\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'w': {
+                gc->disk_wire = 1;
+                break;
+            }
+            case 'f': {
+                snprintf(gc->frozen_filename, FILENAME_SIZE, "%s", optarg);
+                break;
+            }
+            case 'O': {
+                snprintf(gc->compile_filename, FILENAME_SIZE, "%s", optarg);
+                break;
+            }
+            case 'j': {
+                gc->io_threads = strtoul(optarg, NULL, 10);
+                if (gc->io_threads > GC_READER_MAX) {
+                    gc_loge("At most %d reader threads", GC_READER_MAX);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'm': {
+                gc->max_request = strtoul(optarg, NULL, 10);
+                if (!gc->max_request || gc->max_request > 65536) {
+                    fprintf(stderr, "Bad request size limit '%s'\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'e': {
+                gc->miss_budget = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 'x': {
+                char *colon = NULL;
+
+                gc->trace_usec = strtoul(optarg, &colon, 10);
+                if (*colon == ':') {
+                    gc->trace_records = strtoul(colon + 1, NULL, 10);
+                }
+                if (!gc->trace_usec || !gc->trace_records
+                    || gc->trace_records > GC_TRACE_MAX) {
+                    fprintf(stderr, "Bad trace setting '%s'\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'u': {
+                char *colon = NULL;
+
+                snprintf(gc->upstream, HOSTNAME_SIZE, "%s", optarg);
+                if ((colon = strchr(gc->upstream, ':')) != NULL) {
+                    *colon = '\0';
+                    gc->upstream_port = atoi(colon + 1);
+                }
+                break;
+            }
+            case 'J': {
+                char *colon = NULL;
+
+                gc->batch_msec = strtoul(optarg, &colon, 10);
+                gc->batch_keys = GC_CONN_BATCH_KEYS;
+                if (*colon == ':') {
+                    gc->batch_keys = strtoul(colon + 1, NULL, 10);
+                }
+                if (!gc->batch_keys || gc->batch_keys > GC_CONN_BATCH_MAX) {
+                    fprintf(stderr, "Bad batch setting '%s'\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'b': {
+                if (strcmp(optarg, "uring") == 0) {
+                    gc->io_backend = IO_BACKEND_URING;
+                }
+                else if (strcmp(optarg, "select") == 0) {
+                    gc->io_backend = IO_BACKEND_SELECT;
+                }
+                else {
+                    fprintf(stderr, "Unknown I/O backend '%s'\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'A': {
+                gc->log_async = 1;
+                break;
+            }
+            case 'L': {
+                if (_parse_log_sample(optarg) != 0) {
+                    fprintf(stderr, "Bad log sampling '%s'\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'B': {
+                gc->backlog = atoi(optarg);
+                break;
+            }
+            case 'a': {
+                if (gc->listen_count >= GC_SERVER_LISTEN_MAX) {
+                    fprintf(stderr, "Too many listeners\n");
+                    exit(-1);
+                }
+                if (gc_server_parse_listen(&(gc->listens[gc->listen_count]),
+                                           optarg) != 0) {
+                    fprintf(stderr, "Bad listener '%s'\n", optarg);
+                    exit(-1);
+                }
+                ++gc->listen_count;
+                break;
+            }
+            case 'n': {
+                gc->max_conns = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 'U': {
+                gc->max_upstream = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 'r': {
+                char *colon = NULL;
+
+                gc->rate = atof(optarg);
+                colon = strchr(optarg, ':');
+                gc->burst = colon ? atof(colon + 1) : gc->rate;
+                break;
+            }
+            case 'l': {
+                gc->shed_msec = atoi(optarg);
+                break;
+            }
+            case 'q': {
+                char *colon = NULL;
+
+                gc->quota_daily = strtoul(optarg, NULL, 10);
+                colon = strchr(optarg, ':');
+                gc->quota_reserve = colon ? strtoul(colon + 1, NULL, 10) : 0;
+                break;
+            }
+            case 'Q': {
+                gc->quota_rate = atof(optarg);
+                break;
+            }
+            case 'W': {
+                gc->quota_queue = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 'C': {
+                if (gc->bulk_count >= GC_QUOTA_BULK_MAX) {
+                    fprintf(stderr, "Too many bulk client networks\n");
+                    exit(-1);
+                }
+                snprintf(gc->bulk_clients[gc->bulk_count++], NETWORK_SIZE,
+                         "%s", optarg);
+                break;
+            }
+            case 'H': {
+                char *colon = NULL;
+
+                gc->hedge_percentile = atof(optarg);
+                colon = strchr(optarg, ':');
+                gc->hedge_max_pct = colon ? atof(colon + 1) : 5;
+                if (gc->hedge_percentile <= 0 || gc->hedge_percentile >= 100) {
+                    fprintf(stderr, "Bad hedging percentile '%s'\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'T': {
+                char *colon = NULL;
+
+                gc->ttl = strtoul(optarg, NULL, 10);
+                colon = strchr(optarg, ':');
+                gc->fail_ttl = colon ? strtoul(colon + 1, NULL, 10) : gc->ttl;
+                break;
+            }
+            case 'N': {
+                char *colon = NULL;
+
+                gc->negative_ttl = strtoul(optarg, NULL, 10);
+                colon = strchr(optarg, ':');
+                if (colon) {
+                    gc->negative_size = strtoul(colon + 1, NULL, 10);
+                }
+                break;
+            }
+            case 'g': {
+                if (gc->peer_count >= GC_CLUSTER_MAX) {
+                    fprintf(stderr, "Too many cluster nodes\n");
+                    exit(-1);
+                }
+                snprintf(gc->peers[gc->peer_count++], HOSTNAME_SIZE,
+                         "%s", optarg);
+                break;
+            }
+            case 'G': {
+                snprintf(gc->self, HOSTNAME_SIZE, "%s", optarg);
+                break;
+            }
+            case 'M': {
+                gc->repl_log = strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 'R': {
+                snprintf(gc->primary, HOSTNAME_SIZE, "%s", optarg);
+                break;
+            }
+            case 'Z': {
+                char *colon = NULL;
+
+                snprintf(gc->handoff, FILENAME_SIZE, "%s", optarg);
+                if ((colon = strchr(gc->handoff, ':')) != NULL) {
+                    *colon = '\0';
+                    gc->drain_sec = strtoul(colon + 1, NULL, 10);
+                }
+                break;
+            }
             case 'D': {
                 g_is_daemon = 1;
                 break;
@@ -210,10 +747,63 @@ static void _parse_opts(int argc, char *argv[], struct gc_main_t *gc) {
                         PROG_NAME "\n"
                         "\n"
                         "    -d database\n"
+                        "    -E mbytes[:pages] database size limit, and pages\n"
+                        "       compaction frees a second (Default: 0, none;\n"
+                        "       256 pages)\n"
                         "    -k file of google key\n"
                         "    -p port (Default: 1732)\n"
+                        "    -y port for queries in datagrams\n"
+                        "    -F port for queries over HTTP\n"
                         "    -P pid_file\n"
                         "    -t timeout value (in seconds) (Default: 5 seconds)\n"
+                        "    -c entries in memory cache (Default: 0, disabled)\n"
+                        "    -X /name[:entries] memory cache shared between\n"
+                        "       processes and restarts (Default: 65536 entries)\n"
+                        "    -w (store serialised responses on disk)\n"
+                        "    -f file of a frozen set served before the\n"
+                        "       database\n"
+                        "    -O file (compile the database into a frozen\n"
+                        "       set, and exit)\n"
+                        "    -j threads reading the database (Default: 0,\n"
+                        "       read in the event loop)\n"
+                        "    -m maximum request size (Default: 2048 bytes)\n"
+                        "    -e misses worked on per round after the hits\n"
+                        "       (Default: 64, 0 for all)\n"
+                        "    -x usec[:records] keep the last requests slower\n"
+                        "       than usec for @trace (Default: 256 records)\n"
+                        "    -u upstream host[:port] (Default: maps.google.com:80)\n"
+                        "    -J msec[:keys] send misses upstream in batches of\n"
+                        "       up to keys, waiting msec at most (Default: 32 keys)\n"
+                        "    -b I/O backend, select or uring (Default: select)\n"
+                        "    -A (write the log from a background thread)\n"
+                        "    -L level=N (log 1 in N messages of a level)\n"
+                        "    -B listen backlog (Default: 128)\n"
+                        "    -a [addr:]port|unix:path[,opt...] listen there\n"
+                        "       instead of on -p (repeatable); opts are\n"
+                        "       backlog=N, rcvbuf=N, sndbuf=N, fastopen=N,\n"
+                        "       defer=secs, v6only\n"
+                        "    -n maximum connections (Default: 500)\n"
+                        "    -U maximum misses waiting for upstream\n"
+                        "    -r rate[:burst] requests per second per client\n"
+                        "    -l upstream latency (in ms) to start shedding\n"
+                        "    -q daily[:reserve] upstream calls per day\n"
+                        "    -Q upstream calls per second\n"
+                        "    -W misses waiting for an upstream call (Default: 1000)\n"
+                        "    -C addr/bits network of bulk clients, or unix\n"
+                        "    -H pct[:max] hedge misses slower than the pct\n"
+                        "       percentile, at most max%% of misses (Default: 5)\n"
+                        "    -T ttl[:fail_ttl] seconds results stay fresh\n"
+                        "       (Default: 0, forever)\n"
+                        "    -N secs[:entries] keep failed results in memory\n"
+                        "       instead of on disk (Default: 0, disabled)\n"
+                        "    -g host:port node of the cluster (repeatable)\n"
+                        "    -G host:port this node, as the others name it\n"
+                        "    -M changes kept for replicas (Default: 0, none)\n"
+                        "    -R host:port primary to replicate, and to ask\n"
+                        "       for misses\n"
+                        "    -Z path[:secs] socket to hand the listener over\n"
+                        "       on a restart, and to drain within secs\n"
+                        "       (Default: 10)\n"
                         "    -K (kill the running daemon)\n"
                         "    -S (sync database)\n"
                         "    -D (run as a daemon)\n"
@@ -301,80 +891,601 @@ static void _set_signal_handlers(struct gc_main_t *gc) {
         gc_loge("Cannot set signal handler: %m");
         exit(-1);
     }
+    /* A client gone before its answer is written fails the write */
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        gc_loge("Cannot set signal handler: %m");
+        exit(-1);
+    }
+}
+
+/* Have the process taken over from write the database out and keep
+ * what it would store from then on for this one */
+static int _freeze_predecessor(struct gc_main_t *gc) {
+    char byte = 0;
+    struct timeval tv;
+
+    tv.tv_sec = GC_MAX(gc->timeout, 5);
+    tv.tv_usec = 0;
+    if (setsockopt(gc->predecessor_fd, SOL_SOCKET, SO_RCVTIMEO,
+                   &tv, sizeof(tv)) != 0
+        || write(gc->predecessor_fd, "F", 1) != 1
+        || recv(gc->predecessor_fd, &byte, 1, 0) != 1 || byte != 'F') {
+        gc_loge("Cannot have the database written out: %m");
+        return -1;
+    }
+    return 0;
 }
 
 static void _initialize_gc(struct gc_main_t *gc) {
     not_null_void(gc);
-    
-    size_t conn_size = 500;
 
+    register size_t i = 0;
+    int fd = -1;
+    char path[GC_QUOTA_PATH_SIZE];
+    
     if (gc_db_init(&(gc->db)) != 0) {
         gc_loge("Cannot initialize database");
         exit(-1);
     }
     not_null_void(gc->db);
 
-    gc_db_load(gc->db, gc->db_filename);
-
-    if (gc_conn_init(&(gc->conn), conn_size) != 0) {
+    if (gc_conn_init(&(gc->conn), gc->max_conns) != 0) {
         gc_loge("Cannot initialize connection");
         exit(-1);
     }
     not_null_void(gc->conn);
     gc->conn->db = gc->db;
+    gc->conn->disk_wire = gc->disk_wire;
+    gc->conn->max_request = gc->max_request;
+    gc->conn->miss_budget = gc->miss_budget;
+    gc->conn->batch_msec = gc->batch_msec;
+    gc->conn->batch_keys = gc->batch_keys;
+
+    if (gc->trace_usec) {
+        if (gc_trace_init(&(gc->trace), gc->trace_usec,
+                          gc->trace_records) != 0) {
+            gc_loge("Cannot initialize tracing");
+            exit(-1);
+        }
+        gc->conn->trace = gc->trace;
+    }
+
+    if (gc_admit_init(&(gc->admit)) != 0) {
+        gc_loge("Cannot initialize admission control");
+        exit(-1);
+    }
+    gc->admit->rate = gc->rate;
+    gc->admit->burst = gc->burst < 1 ? 1 : gc->burst;
+    gc->admit->max_upstream = gc->max_upstream;
+    gc->admit->shed_msec = gc->shed_msec;
+    gc->conn->admit = gc->admit;
+
+    if (gc->quota_daily || gc->quota_rate > 0) {
+        if (gc_quota_init(&(gc->quota)) != 0) {
+            gc_loge("Cannot initialize upstream quota");
+            exit(-1);
+        }
+        gc->quota->daily = gc->quota_daily;
+        gc->quota->reserve = gc->quota_reserve;
+        gc->quota->rate = gc->quota_rate;
+        gc->quota->max_queue = gc->quota_queue;
+        for (i = 0; i < gc->bulk_count; ++i) {
+            if (gc_quota_add_bulk(gc->quota, gc->bulk_clients[i]) != 0) {
+                exit(-1);
+            }
+        }
+        /* The calls of the day are kept next to the database */
+        if (gc->quota_daily) {
+            snprintf(path, sizeof(path), "%s.quota", gc->db_filename);
+            gc_quota_set_state(gc->quota, path);
+        }
+        gc->conn->quota = gc->quota;
+    }
+
+    if (gc->hedge_percentile > 0) {
+        if (gc_hedge_init(&(gc->hedge)) != 0) {
+            gc_loge("Cannot initialize hedging");
+            exit(-1);
+        }
+        gc->hedge->percentile = gc->hedge_percentile;
+        gc->hedge->max_ratio = gc->hedge_max_pct / 100;
+        gc->conn->hedge = gc->hedge;
+    }
+
+    if (gc->ttl || gc->fail_ttl) {
+        if (gc_refresh_init(&(gc->refresh)) != 0) {
+            gc_loge("Cannot initialize refresh");
+            exit(-1);
+        }
+        gc->refresh->ttl = gc->ttl;
+        gc->refresh->fail_ttl = gc->fail_ttl;
+        gc->conn->refresh = gc->refresh;
+    }
+
+    if (gc->cache_size) {
+        if (gc_cache_init(&(gc->cache), gc->cache_size) != 0) {
+            gc_loge("Cannot initialize cache");
+            exit(-1);
+        }
+        gc->conn->cache = gc->cache;
+    }
+
+    if (gc->shm_name[0]) {
+        if (gc_shm_attach(&(gc->shm), gc->shm_name, gc->shm_size) != 0) {
+            exit(-1);
+        }
+        gc->conn->shm = gc->shm;
+    }
+
+    if (gc->frozen_filename[0]) {
+        if (gc_frozen_open(&(gc->frozen), gc->frozen_filename) != 0) {
+            exit(-1);
+        }
+        gc->conn->frozen = gc->frozen;
+    }
+
+    if (gc->negative_ttl && gc->negative_size) {
+        if (gc_cache_init(&(gc->negative), gc->negative_size) != 0) {
+            gc_loge("Cannot initialize negative cache");
+            exit(-1);
+        }
+        gc->conn->negative = gc->negative;
+        gc->conn->negative_ttl = gc->negative_ttl;
+    }
+
+    if (gc->primary[0] && (gc->peer_count || gc->ttl || gc->fail_ttl)) {
+        /* The primary refreshes and owns every location */
+        gc_loge("A replica (-R) cannot be in a cluster (-g) or refresh (-T)");
+        exit(-1);
+    }
+    if (gc->repl_log || gc->primary[0]) {
+        if (gc_repl_init(&(gc->repl)) != 0) {
+            gc_loge("Cannot initialize replication");
+            exit(-1);
+        }
+        if (gc->repl_log) {
+            if (gc_repl_set_log(gc->repl, gc->repl_log) != 0) {
+                exit(-1);
+            }
+            gc_db_set_repl(gc->db, gc->repl);
+        }
+        if (gc->primary[0] && gc_repl_set_primary(gc->repl, gc->primary) != 0) {
+            exit(-1);
+        }
+        gc->conn->repl = gc->repl;
+    }
+
+    if (gc->primary[0]) {
+        /* Misses are asked of the primary, as of the owner in a cluster
+         * which this node is not part of. */
+        if (gc_cluster_init(&(gc->cluster)) != 0
+            || gc_cluster_add(gc->cluster, gc->primary, 0) != 0) {
+            gc_loge("Cannot initialize cluster");
+            exit(-1);
+        }
+        gc_cluster_build(gc->cluster);
+        gc->conn->cluster = gc->cluster;
+    }
+    else if (gc->peer_count) {
+        if (gc->self[0] == '\0') {
+            gc_loge("A cluster needs this node's own name (-G)");
+            exit(-1);
+        }
+        if (gc_cluster_init(&(gc->cluster)) != 0) {
+            gc_loge("Cannot initialize cluster");
+            exit(-1);
+        }
+        for (i = 0; i < gc->peer_count; ++i) {
+            if (gc_cluster_add(gc->cluster, gc->peers[i], 0) != 0) {
+                exit(-1);
+            }
+        }
+        if (gc_cluster_add(gc->cluster, gc->self, 1) != 0) {
+            exit(-1);
+        }
+        gc_cluster_build(gc->cluster);
+        gc_log("Cluster of %lu nodes", (unsigned long) gc->cluster->count);
+        gc->conn->cluster = gc->cluster;
+    }
 
     if (gc_conn_load_key_file(gc->conn, gc->key_filename) != 0) {
         gc_loge("Cannot load key file");
         exit(-1);
     }
+
+    if (gc_conn_set_upstream(gc->conn, gc->upstream,
+                             gc->upstream_port) != 0) {
+        gc_loge("Cannot resolve upstream '%s'", gc->upstream);
+        exit(-1);
+    }
     
-    gc->server_fd = gc_server_setup(gc->port);
-    if (gc->server_fd < 0) {
-        gc_loge("Cannot set up server: %m");
+    /* The process taken over from writes the database until it is
+     * asked to stop, so it is opened only afterwards. It goes on
+     * serving meanwhile and passes on what it would have stored. */
+    if (gc->predecessor_fd >= 0 && _freeze_predecessor(gc) != 0) {
+        exit(-1);
+    }
+    if (gc->io_threads && gc_db_set_threaded(gc->db) != 0) {
+        exit(-1);
+    }
+    gc_db_load(gc->db, gc->db_filename);
+    if (gc->io_threads) {
+        if (gc_reader_init(&(gc->reader), gc->db, gc->io_threads) != 0) {
+            gc_loge("Cannot start reader threads");
+            exit(-1);
+        }
+        gc->conn->reader = gc->reader;
+    }
+    if (gc->db_limit
+        && gc_db_set_limit(gc->db, gc->db_limit, gc->compact_rate) != 0) {
+        gc_loge("Cannot limit database size");
         exit(-1);
     }
 
+    /* The listener is asked for only once everything else is set up */
+    if (gc->predecessor_fd >= 0) {
+        if (write(gc->predecessor_fd, "H", 1) != 1) {
+            gc_loge("Cannot ask for the listener: %m");
+            exit(-1);
+        }
+        gc->server_fds[0] = gc_server_recv_fd(gc->predecessor_fd,
+                                              GC_MAX(gc->timeout, 5));
+        if (gc->server_fds[0] < 0) {
+            exit(-1);
+        }
+        gc->server_count = 1;
+        /* The datagram socket and the HTTP listener follow, or word
+         * that there is none */
+        gc->udp_fd = gc_server_recv_fd(gc->predecessor_fd,
+                                       GC_MAX(gc->timeout, 5));
+        if (gc->udp_fd >= 0 && !gc->udp_port) {
+            close(gc->udp_fd);
+            gc->udp_fd = -1;
+        }
+        gc->http_fd = gc_server_recv_fd(gc->predecessor_fd,
+                                        GC_MAX(gc->timeout, 5));
+        if (gc->http_fd >= 0 && !gc->http_port) {
+            close(gc->http_fd);
+            gc->http_fd = -1;
+        }
+        /* Further listeners follow, until word that there are no more.
+         * An earlier version passes none. */
+        while (gc->server_count < GC_SERVER_LISTEN_MAX
+               && (fd = gc_server_recv_fd(gc->predecessor_fd,
+                                          GC_MAX(gc->timeout, 5))) >= 0) {
+            gc->server_fds[gc->server_count++] = fd;
+        }
+        gc_log("Took over %lu listeners", (unsigned long) gc->server_count);
+    }
+    else if (gc->listen_count) {
+        for (i = 0; i < gc->listen_count; ++i) {
+            if (!gc->listens[i].backlog) {
+                gc->listens[i].backlog = gc->backlog;
+            }
+            gc->server_fds[i] = gc_server_listen(&(gc->listens[i]));
+            if (gc->server_fds[i] < 0) {
+                gc_loge("Cannot set up listener %lu", (unsigned long) i + 1);
+                exit(-1);
+            }
+            ++gc->server_count;
+        }
+    }
+    else {
+        gc->server_fds[0] = gc_server_setup(gc->port, gc->backlog);
+        if (gc->server_fds[0] < 0) {
+            gc_loge("Cannot set up server: %m");
+            exit(-1);
+        }
+        gc->server_count = 1;
+    }
+    if (gc->udp_port && gc->udp_fd < 0) {
+        gc->udp_fd = gc_server_setup_udp(gc->udp_port);
+        if (gc->udp_fd < 0) {
+            exit(-1);
+        }
+    }
+    if (gc->http_port && gc->http_fd < 0) {
+        gc->http_fd = gc_server_setup(gc->http_port, gc->backlog);
+        if (gc->http_fd < 0) {
+            gc_loge("Cannot set up HTTP server: %m");
+            exit(-1);
+        }
+    }
+
+    if (gc->handoff[0]) {
+        gc->handoff_fd = gc_server_handoff_setup(gc->handoff);
+        if (gc->handoff_fd < 0) {
+            exit(-1);
+        }
+    }
+
     _set_signal_handlers(gc);
 }
 
+/* Pass the listener to a new process asking for it, and start draining.
+ * The new process first has the database written out, and sets itself
+ * up while this one serves on. Until the listener is passed, a new
+ * process going away leaves nothing changed. The datagram socket is
+ * passed as well, but kept to answer the misses in flight. */
+static void _handoff(struct gc_main_t *gc) {
+    not_null_void(gc);
+
+    char byte = 0;
+    ssize_t ret = 0;
+    size_t i = 0;
+    struct timeval tv;
+
+    if (gc->successor_fd < 0) {
+        gc->successor_fd = gc_server_handoff_accept(gc->handoff_fd);
+        if (gc->successor_fd < 0) {
+            return;
+        }
+    }
+    ret = recv(gc->successor_fd, &byte, 1, MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (ret == 1 && byte == 'F') {
+        if (gc_db_freeze(gc->db) == 0
+            && send(gc->successor_fd, "F", 1, MSG_NOSIGNAL) == 1) {
+            gc_log("Database is written out for the next process");
+            return;
+        }
+        ret = 0;
+    }
+    if (ret != 1 || gc_db_freeze(gc->db) != 0
+        || gc_server_send_fd(gc->successor_fd, gc->server_fds[0]) != 0
+        || gc_server_send_fd(gc->successor_fd, gc->udp_fd) != 0
+        || gc_server_send_fd(gc->successor_fd, gc->http_fd) != 0) {
+        gc_loge("Handoff is abandoned");
+        gc_db_thaw(gc->db);
+        close(gc->successor_fd);
+        gc->successor_fd = -1;
+        return;
+    }
+    /* The listener is passed already; the others go if they can */
+    for (i = 1; i < gc->server_count; ++i) {
+        gc_server_send_fd(gc->successor_fd, gc->server_fds[i]);
+    }
+    gc_server_send_fd(gc->successor_fd, -1);
+
+    /* The socket stays open for the results got while draining */
+    tv.tv_sec = GC_MAX(gc->timeout, 5);
+    tv.tv_usec = 0;
+    setsockopt(gc->successor_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    gc_conn_stop_accept(gc->conn);
+    close(gc->handoff_fd);
+    for (i = 0; i < gc->server_count; ++i) {
+        close(gc->server_fds[i]);
+    }
+    if (gc->http_fd >= 0) {
+        close(gc->http_fd);
+    }
+    gc->handoff_fd = -1;
+    gc->server_count = 0;
+    gc->http_fd = -1;
+    gc->drain_end = time(NULL) + gc->drain_sec;
+    gc_log("Listener is handed off. Draining %lu connections",
+           (unsigned long) gc_conn_active(gc->conn));
+}
+
+/* Pass the results got since the database was frozen on to the next
+ * process, waiting until it has taken them all if wait is set */
+static void _pass_results(struct gc_main_t *gc, int wait) {
+    not_null_void(gc);
+
+    const char *lines = NULL;
+    size_t len = 0;
+    ssize_t sent = 0;
+
+    while (gc->successor_fd >= 0
+           && (len = gc_db_pending(gc->db, &lines)) > 0) {
+        sent = send(gc->successor_fd, lines, len,
+                    MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT));
+        if (sent < 0 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (sent <= 0) {
+            gc_loge("Cannot pass results on: %m");
+            close(gc->successor_fd);
+            gc->successor_fd = -1;
+            return;
+        }
+        gc_db_pending_taken(gc->db, sent);
+    }
+}
+
+/* Store what the process taken over from passes on while it drains,
+ * until it closes the socket */
+static void _take_results(struct gc_main_t *gc) {
+    not_null_void(gc);
+
+    ssize_t ret = 0;
+    size_t used = 0;
+
+    ret = recv(gc->predecessor_fd, gc->passed + gc->passed_len,
+               PASSED_SIZE - gc->passed_len, MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (ret <= 0) {
+        gc_log("Previous process is done");
+        close(gc->predecessor_fd);
+        gc->predecessor_fd = -1;
+        return;
+    }
+    gc->passed_len += ret;
+    used = gc_db_put_lines(gc->db, gc->passed, gc->passed_len);
+    if (!used && gc->passed_len == PASSED_SIZE) {
+        gc_loge("Result passed on is too long");
+        used = gc->passed_len;
+    }
+    memmove(gc->passed, gc->passed + used, gc->passed_len - used);
+    gc->passed_len -= used;
+}
+
+/* Exit when the last connection is answered or the time is up */
+static void _drain(struct gc_main_t *gc) {
+    not_null_void(gc);
+
+    size_t active = gc_conn_active(gc->conn);
+
+    _pass_results(gc, 0);
+    if (active && time(NULL) < gc->drain_end) {
+        return;
+    }
+    if (active) {
+        gc_loge("Drain time is up. Dropping %lu connections",
+                (unsigned long) active);
+    }
+    _pass_results(gc, 1);
+    if (gc->successor_fd >= 0) {
+        close(gc->successor_fd);
+        gc->successor_fd = -1;
+    }
+    _terminate(gc);
+}
+
+/* Take in a client of a listener, if one is waiting. One which cannot
+ * be taken in gets a busy answer. */
+static void _accept_client(struct gc_main_t *gc, int fd) {
+    int client_fd = accept(fd, NULL, NULL);
+
+    if (client_fd < 0) {
+        return;
+    }
+    if (gc_set_nonblock(client_fd) != 0) {
+        close(client_fd);
+        return;
+    }
+    gc_conn_add(gc->conn, client_fd, gc->timeout);
+}
+
+/* Take in a client of the HTTP listener, if one is waiting */
+static void _accept_http(struct gc_main_t *gc) {
+    int client_fd = accept(gc->http_fd, NULL, NULL);
+
+    if (client_fd < 0) {
+        return;
+    }
+    if (gc_set_nonblock(client_fd) != 0) {
+        close(client_fd);
+        return;
+    }
+    gc_conn_add_http(gc->conn, client_fd, gc->timeout);
+}
+
 static void _process_requests(struct gc_main_t *gc) {
     not_null_void(gc);
 
-    int client_fd = 0;
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    size_t i = 0;
 
-    if (gc_set_nonblock(gc->server_fd) != 0) {
+    for (i = 0; i < gc->server_count; ++i) {
+        if (gc_set_nonblock(gc->server_fds[i]) != 0) {
+            exit(-1);
+        }
+    }
+    if (gc->http_fd >= 0 && gc_set_nonblock(gc->http_fd) != 0) {
         exit(-1);
     }
+    if (gc->udp_fd >= 0
+        && gc_conn_use_udp(gc->conn, gc->udp_fd, gc->timeout) != 0) {
+        exit(-1);
+    }
+
+    if (gc->io_backend == IO_BACKEND_URING) {
+        if (gc_conn_use_uring(gc->conn, gc->server_fds[0],
+                              gc->timeout) == 0) {
+            gc_log("Using io_uring backend");
+            for (i = 1; i < gc->server_count; ++i) {
+                if (gc_conn_use_listener(gc->conn, gc->server_fds[i]) != 0) {
+                    gc_loge("Cannot accept clients of listener %lu",
+                            (unsigned long) i + 1);
+                    exit(-1);
+                }
+            }
+            if (gc->http_fd >= 0
+                && gc_conn_use_http(gc->conn, gc->http_fd) != 0) {
+                gc_loge("Cannot accept HTTP clients");
+                exit(-1);
+            }
+            while (1) {
+                gc_conn_process(gc->conn);
+                if (gc->predecessor_fd >= 0) {
+                    _take_results(gc);
+                }
+                if (gc->drain_end) {
+                    _drain(gc);
+                }
+                else if (gc->handoff_fd >= 0) {
+                    _handoff(gc);
+                }
+            }
+        }
+        gc_loge("io_uring is not available. Falling back to select()");
+    }
+
     while (1) {
         gc_conn_process(gc->conn);
-        client_fd = accept(gc->server_fd, (struct sockaddr *) &client_addr,
-                           &client_len);
-        if (client_fd < 0 && errno != EAGAIN) {
+        if (gc->predecessor_fd >= 0) {
+            _take_results(gc);
+        }
+        if (gc->drain_end) {
+            _drain(gc);
             continue;
         }
-        
-        if (gc_set_nonblock(client_fd) != 0) {
-            if (close(client_fd) != 0) {
+        if (gc->handoff_fd >= 0) {
+            _handoff(gc);
+            if (gc->drain_end) {
+                continue;
             }
-            continue;
         }
-
-        if (gc_conn_add(gc->conn, client_fd, gc->timeout) != 0) {
-            gc_loge("Cannot add new connection");
+        if (gc->http_fd >= 0) {
+            _accept_http(gc);
+        }
+        for (i = 0; i < gc->server_count; ++i) {
+            _accept_client(gc, gc->server_fds[i]);
         }
     }
 }
 
+/* Build a frozen set of the database and exit. The database is not to
+ * be written meanwhile; a copy of a running one is compiled instead. */
+static void _compile(struct gc_main_t *gc) {
+    not_null_void(gc);
+
+    openlog(PROG_NAME, LOG_NDELAY | LOG_PERROR, 0);
+    if (gc_db_init(&(gc->db)) != 0) {
+        gc_loge("Cannot initialize database");
+        exit(-1);
+    }
+    if (gc_db_load(gc->db, gc->db_filename) != 0
+        || gc_frozen_build(gc->db, gc->compile_filename) != 0) {
+        gc_loge("Cannot compile '%s' into '%s'", gc->db_filename,
+                gc->compile_filename);
+        gc_db_free(gc->db);
+        exit(-1);
+    }
+    gc_db_free(gc->db);
+    exit(0);
+}
+
 int main(int argc, char *argv[]) {
     struct stat stbuf;
     
     srand(time(NULL));
     
     _parse_opts(argc, argv, &gs_gc);
+    if (gs_gc.compile_filename[0]) {
+        _compile(&gs_gc);
+    }
 
-    if (stat(gs_gc.pid_filename, &stbuf) == 0) {
+    /* A running process listening for a handoff is taken over from */
+    if (gs_gc.handoff[0]) {
+        gs_gc.predecessor_fd = gc_server_handoff_connect(gs_gc.handoff);
+    }
+    if (gs_gc.predecessor_fd < 0 && stat(gs_gc.pid_filename, &stbuf) == 0) {
         fprintf(stderr, PROG_NAME " is already running\n");
         exit(-1);
     }
@@ -395,6 +1506,13 @@ int main(int argc, char *argv[]) {
         openlog(PROG_NAME, LOG_NDELAY, 0);
     }
     
+    if (gs_gc.log_async) {
+        if (gc_log_start() != 0) {
+            exit(-1);
+        }
+        atexit(gc_log_stop);
+    }
+
     gc_log(PROG_NAME " is started");
 
     _initialize_gc(&gs_gc);
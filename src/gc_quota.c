@@ -0,0 +1,331 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_conn.h"
+#include "gc_quota.h"
+#include "gc_stats.h"
+#include "gc_util.h"
+
+#define QUOTA_BLOCK_USEC 60000000ULL /* Back-off after upstream refuses */
+#define QUOTA_SAVE_USEC  1000000ULL  /* Between saves of the calls */
+#define QUOTA_STATE_SIZE 64
+
+extern int g_is_daemon;
+
+int gc_quota_init(struct gc_quota_t **quota) {
+    not_null(quota);
+
+    *quota = malloc(sizeof(struct gc_quota_t));
+    if (*quota == NULL) {
+        gc_loge("Cannot allocate memory for upstream quota");
+        return -1;
+    }
+    memset(*quota, 0, sizeof(struct gc_quota_t));
+    return 0;
+}
+
+/* Whether the first bits of addr are those of network */
+static int _in_network(const unsigned char *addr,
+                       const unsigned char *network, int bits) {
+    int bytes = bits / 8;
+    unsigned char mask = 0xff << (8 - bits % 8);
+
+    if (memcmp(addr, network, bytes) != 0) {
+        return 0;
+    }
+    return bits % 8 == 0 || ((addr[bytes] ^ network[bytes]) & mask) == 0;
+}
+
+/* Add a network whose clients are bulk clients: an IPv4 network in
+ * ADDR/BITS form, an IPv6 one in the same form with a colon in ADDR,
+ * or "unix" for every client of a Unix domain socket. */
+int gc_quota_add_bulk(struct gc_quota_t *quota, const char *network) {
+    not_null(quota);
+    not_null(network);
+
+    char buf[64];
+    char *slash = NULL;
+    int family = AF_INET;
+    int max_bits = 32;
+    int bits = 0;
+    int ret = 0;
+
+    if (quota->bulk_count >= GC_QUOTA_BULK_MAX) {
+        gc_loge("Too many bulk client networks");
+        return -1;
+    }
+    memset(&(quota->bulk[quota->bulk_count]), 0,
+           sizeof(quota->bulk[quota->bulk_count]));
+    if (strcmp(network, "unix") == 0) {
+        quota->bulk[quota->bulk_count++].family = AF_UNIX;
+        return 0;
+    }
+    snprintf(buf, sizeof(buf), "%s", network);
+    slash = strchr(buf, '/');
+    if (slash) {
+        *slash = '\0';
+        bits = atoi(slash + 1);
+    }
+    if (strchr(buf, ':')) {
+        family = AF_INET6;
+        max_bits = 128;
+        ret = inet_pton(AF_INET6, buf, quota->bulk[quota->bulk_count].addr);
+    }
+    else {
+        ret = inet_aton(buf, (struct in_addr *)
+                        quota->bulk[quota->bulk_count].addr);
+    }
+    if (!slash) {
+        bits = max_bits;
+    }
+    if (ret != 1 || bits < 0 || bits > max_bits) {
+        gc_loge("Invalid bulk client network: %s", network);
+        return -1;
+    }
+    quota->bulk[quota->bulk_count].family = family;
+    quota->bulk[quota->bulk_count].bits = bits;
+    ++quota->bulk_count;
+    return 0;
+}
+
+int gc_quota_is_bulk(struct gc_quota_t *quota, int fd) {
+    not_null(quota);
+
+    struct sockaddr_storage addr;
+
+    if (!quota->bulk_count || gc_peer_addr(fd, &addr) != 0) {
+        return 0;
+    }
+    return gc_quota_is_bulk_addr(quota, (struct sockaddr *) &addr);
+}
+
+int gc_quota_is_bulk_addr(struct gc_quota_t *quota,
+                          const struct sockaddr *addr) {
+    not_null(quota);
+    not_null(addr);
+
+    const unsigned char *bytes = NULL;
+    register size_t i = 0;
+
+    if (addr->sa_family == AF_INET) {
+        bytes = (const unsigned char *)
+            &(((const struct sockaddr_in *) addr)->sin_addr);
+    }
+    else if (addr->sa_family == AF_INET6) {
+        bytes = ((const struct sockaddr_in6 *) addr)->sin6_addr.s6_addr;
+    }
+    for (i = 0; i < quota->bulk_count; ++i) {
+        if (quota->bulk[i].family != addr->sa_family) {
+            continue;
+        }
+        if (addr->sa_family == AF_UNIX
+            || (bytes && _in_network(bytes, quota->bulk[i].addr,
+                                     quota->bulk[i].bits))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void _update_stats(struct gc_quota_t *quota) {
+    gc_stat_set(GC_STAT_QUOTA_USED, quota->used);
+    if (quota->daily) {
+        gc_stat_set(GC_STAT_QUOTA_REMAINING,
+                    quota->used < quota->daily
+                    ? quota->daily - quota->used : 0);
+    }
+}
+
+/* Start over with a full budget when a new day begins. */
+static void _roll_day(struct gc_quota_t *quota) {
+    long day = time(NULL) / 86400;
+
+    if (day != quota->day) {
+        if (quota->day && quota->used) {
+            gc_log("Upstream calls made yesterday: %lu", quota->used);
+        }
+        quota->day = day;
+        quota->used = 0;
+        quota->saved = 0;
+        _update_stats(quota);
+    }
+}
+
+/* Returns 0 if a miss may wait for an upstream call, or the code to
+ * answer it with if there will be none for it today. */
+int gc_quota_check(struct gc_quota_t *quota, int bulk) {
+    not_null(quota);
+
+    unsigned long floor = bulk ? quota->reserve : 0;
+
+    _roll_day(quota);
+    if (quota->daily && quota->used + floor >= quota->daily) {
+        return GC_CODE_DEFERRED;
+    }
+    if (quota->blocked_usec) {
+        if (gc_now_usec() < quota->blocked_usec) {
+            return GC_CODE_DEFERRED;
+        }
+        quota->blocked_usec = 0;
+    }
+    return 0;
+}
+
+/* Take an upstream call. Returns 0 if the call may be made now, -1 if
+ * the miss has to wait for the next one, or the code to answer with. */
+int gc_quota_take(struct gc_quota_t *quota, int bulk) {
+    not_null(quota);
+
+    unsigned long long now = 0;
+    int code = gc_quota_check(quota, bulk);
+
+    if (code) {
+        return code;
+    }
+    if (quota->rate > 0) {
+        now = gc_now_usec();
+        if (!quota->usec) {
+            quota->tokens = 1;
+        }
+        else {
+            quota->tokens += quota->rate * (now - quota->usec) / 1000000.0;
+            if (quota->tokens > GC_MAX(quota->rate, 1)) {
+                quota->tokens = GC_MAX(quota->rate, 1);
+            }
+        }
+        quota->usec = now;
+        if (quota->tokens < 1) {
+            return -1;
+        }
+        quota->tokens -= 1;
+    }
+    ++quota->used;
+    _update_stats(quota);
+    return 0;
+}
+
+/* Give back a call taken for a request which could not be sent after
+ * all. */
+void gc_quota_give(struct gc_quota_t *quota) {
+    not_null_void(quota);
+
+    if (quota->used) {
+        --quota->used;
+    }
+    if (quota->rate > 0) {
+        quota->tokens += 1;
+    }
+    _update_stats(quota);
+}
+
+/* Upstream refused a call for being over quota. Our count is behind, so
+ * hold calls back for a while rather than have them refused too. */
+void gc_quota_exhausted(struct gc_quota_t *quota) {
+    not_null_void(quota);
+
+    if (!quota->blocked_usec) {
+        gc_loge("Upstream is out of quota after %lu calls today",
+                quota->used);
+    }
+    quota->blocked_usec = gc_now_usec() + QUOTA_BLOCK_USEC;
+}
+
+/* Keep the calls of the day in the file at path, so that a restart or
+ * a handoff goes on with them rather than with a fresh budget. */
+int gc_quota_set_state(struct gc_quota_t *quota, const char *path) {
+    not_null(quota);
+    not_null(path);
+
+    snprintf(quota->state, sizeof(quota->state), "%s", path);
+    return gc_quota_save(quota, 1);
+}
+
+/* Add the calls made since the last save to the file, and take in
+ * those every other process using it has added, as one handing off
+ * does. At most once a second unless now is set. */
+int gc_quota_save(struct gc_quota_t *quota, int now) {
+    not_null(quota);
+
+    unsigned long long usec = gc_now_usec();
+    char buf[QUOTA_STATE_SIZE];
+    long day = 0;
+    unsigned long used = 0;
+    ssize_t len = 0;
+    int fd = -1;
+    int ret = 0;
+
+    if (!quota->state[0]
+        || (!now && usec - quota->save_usec < QUOTA_SAVE_USEC)) {
+        return 0;
+    }
+    quota->save_usec = usec;
+    _roll_day(quota);
+
+    fd = open(quota->state, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        gc_loge("Cannot open quota state '%s': %m", quota->state);
+        return -1;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        gc_loge("Cannot lock quota state '%s': %m", quota->state);
+        close(fd);
+        return -1;
+    }
+    len = pread(fd, buf, sizeof(buf) - 1, 0);
+    buf[len > 0 ? len : 0] = '\0';
+    if (sscanf(buf, "%ld %lu", &day, &used) != 2 || day != quota->day) {
+        used = 0;
+        day = 0;
+    }
+    if (quota->used != quota->saved || !day) {
+        used += quota->used - quota->saved;
+        len = snprintf(buf, sizeof(buf), "%ld %lu\n", quota->day, used);
+        if (pwrite(fd, buf, len, 0) != len || ftruncate(fd, len) != 0) {
+            gc_loge("Cannot write quota state '%s': %m", quota->state);
+            ret = -1;
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (ret == 0) {
+        quota->used = used;
+        quota->saved = used;
+        _update_stats(quota);
+    }
+    return ret;
+}
+
+int gc_quota_free(struct gc_quota_t *quota) {
+    not_null(quota);
+
+    safefree(quota);
+    return 0;
+}
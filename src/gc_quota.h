@@ -0,0 +1,66 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_QUOTA_H__
+#define __GC_QUOTA_H__
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define GC_QUOTA_BULK_MAX  16
+#define GC_QUOTA_PATH_SIZE 256
+
+/* Upstream call budget. Zero disables a limit. Days are UTC days. */
+struct gc_quota_t {
+    unsigned long daily;        /* Upstream calls per day */
+    double rate;                /* Upstream calls per second */
+    unsigned long reserve;      /* Calls of the day kept for interactive
+                                 * clients */
+    size_t max_queue;           /* Misses waiting for a call */
+    unsigned long used;         /* Calls made today */
+    long day;
+    char state[GC_QUOTA_PATH_SIZE]; /* File the calls are kept in */
+    unsigned long saved;        /* Of them, those in the file */
+    unsigned long long save_usec;
+    double tokens;
+    unsigned long long usec;
+    unsigned long long blocked_usec; /* Upstream said it is out of quota */
+    size_t bulk_count;
+    struct {
+        sa_family_t family;     /* AF_UNIX for all Unix socket clients */
+        unsigned char addr[16];
+        int bits;
+    } bulk[GC_QUOTA_BULK_MAX];  /* Networks of bulk clients */
+};
+
+int gc_quota_init(struct gc_quota_t **quota);
+int gc_quota_add_bulk(struct gc_quota_t *quota, const char *network);
+int gc_quota_is_bulk(struct gc_quota_t *quota, int fd);
+int gc_quota_is_bulk_addr(struct gc_quota_t *quota,
+                          const struct sockaddr *addr);
+int gc_quota_check(struct gc_quota_t *quota, int bulk);
+int gc_quota_take(struct gc_quota_t *quota, int bulk);
+void gc_quota_give(struct gc_quota_t *quota);
+void gc_quota_exhausted(struct gc_quota_t *quota);
+int gc_quota_set_state(struct gc_quota_t *quota, const char *path);
+int gc_quota_save(struct gc_quota_t *quota, int now);
+int gc_quota_free(struct gc_quota_t *quota);
+
+#endif
+
+
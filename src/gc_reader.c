@@ -0,0 +1,264 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <config.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_reader.h"
+#include "gc_util.h"
+
+extern int g_is_daemon;
+
+static void _wake(struct gc_reader_t *reader) {
+#ifdef HAVE_SYS_EVENTFD_H
+    unsigned long long one = 1;
+
+    if (write(reader->wr_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        gc_loge("Cannot signal finished lookups: %m");
+    }
+#else
+    if (write(reader->wr_fd, "", 1) < 0 && errno != EAGAIN) {
+        gc_loge("Cannot signal finished lookups: %m");
+    }
+#endif
+}
+
+static void *_run(void *arg) {
+    struct gc_reader_t *reader = arg;
+    struct gc_reader_job_t *job = NULL;
+
+    pthread_mutex_lock(&(reader->mutex));
+    while (1) {
+        while (!reader->stop && reader->todo_head == NULL) {
+            pthread_cond_wait(&(reader->cond), &(reader->mutex));
+        }
+        if (reader->stop) {
+            break;
+        }
+        job = reader->todo_head;
+        reader->todo_head = job->next;
+        if (reader->todo_head == NULL) {
+            reader->todo_tail = NULL;
+        }
+        pthread_mutex_unlock(&(reader->mutex));
+
+        job->ret = gc_db_read(reader->db, job->location, &(job->query),
+                              job->record, GC_DB_RECORD_SIZE, &(job->wire),
+                              &(job->wire_len));
+
+        pthread_mutex_lock(&(reader->mutex));
+        job->next = NULL;
+        if (reader->done_tail) {
+            reader->done_tail->next = job;
+        }
+        else {
+            reader->done_head = job;
+        }
+        reader->done_tail = job;
+        _wake(reader);
+    }
+    pthread_mutex_unlock(&(reader->mutex));
+    return NULL;
+}
+
+static int _open_fds(struct gc_reader_t *reader) {
+#ifdef HAVE_SYS_EVENTFD_H
+    reader->fd = eventfd(0, EFD_NONBLOCK);
+    if (reader->fd < 0) {
+        gc_loge("Cannot open eventfd: %m");
+        return -1;
+    }
+    reader->wr_fd = reader->fd;
+#else
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        gc_loge("Cannot open pipe: %m");
+        return -1;
+    }
+    reader->fd = fds[0];
+    reader->wr_fd = fds[1];
+    if (gc_set_nonblock(reader->fd) != 0
+        || gc_set_nonblock(reader->wr_fd) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static void _close_fds(struct gc_reader_t *reader) {
+    if (reader->wr_fd != reader->fd) {
+        close(reader->wr_fd);
+    }
+    close(reader->fd);
+}
+
+int gc_reader_init(struct gc_reader_t **reader, struct gc_db_t *db,
+                   size_t threads) {
+    not_null(reader);
+    not_null(db);
+
+    register size_t i = 0;
+
+    if (!threads || threads > GC_READER_MAX) {
+        gc_loge("Reader threads must be 1 to %d", GC_READER_MAX);
+        return -1;
+    }
+
+    *reader = malloc(sizeof(struct gc_reader_t));
+    if (*reader == NULL) {
+        gc_loge("Cannot allocate memory for readers");
+        return -1;
+    }
+    memset(*reader, 0, sizeof(struct gc_reader_t));
+    (*reader)->db = db;
+    if (_open_fds(*reader) != 0) {
+        safefree(*reader);
+        return -1;
+    }
+    pthread_mutex_init(&((*reader)->mutex), NULL);
+    pthread_cond_init(&((*reader)->cond), NULL);
+
+    for (i = 0; i < threads; ++i) {
+        if (pthread_create(&((*reader)->threads[i]), NULL, _run,
+                           *reader) != 0) {
+            gc_loge("Cannot start reader thread: %m");
+            gc_reader_free(*reader);
+            *reader = NULL;
+            return -1;
+        }
+        ++(*reader)->thread_count;
+    }
+    return 0;
+}
+
+/* Look location up in a thread. The answer comes from gc_reader_next()
+ * with index and gen. */
+int gc_reader_submit(struct gc_reader_t *reader, const char *location,
+                     size_t index, unsigned int gen) {
+    not_null(reader);
+    not_null(location);
+
+    size_t len = strlen(location);
+    struct gc_reader_job_t *job = NULL;
+
+    job = malloc(sizeof(struct gc_reader_job_t) + len);
+    if (job == NULL) {
+        gc_loge("Cannot allocate memory for lookup");
+        return -1;
+    }
+    memcpy(job->location, location, len + 1);
+    job->next = NULL;
+    job->index = index;
+    job->gen = gen;
+    job->ret = -1;
+    job->wire_len = 0;
+
+    pthread_mutex_lock(&(reader->mutex));
+    if (reader->todo_tail) {
+        reader->todo_tail->next = job;
+    }
+    else {
+        reader->todo_head = job;
+    }
+    reader->todo_tail = job;
+    pthread_cond_signal(&(reader->cond));
+    pthread_mutex_unlock(&(reader->mutex));
+
+    ++reader->pending;
+    return 0;
+}
+
+/* Take a finished lookup, or NULL if there are no more for now. */
+struct gc_reader_job_t *gc_reader_next(struct gc_reader_t *reader) {
+    struct gc_reader_job_t *job = NULL;
+    char buf[64];
+
+    if (reader == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&(reader->mutex));
+    job = reader->done_head;
+    if (job) {
+        reader->done_head = job->next;
+        if (reader->done_head == NULL) {
+            reader->done_tail = NULL;
+        }
+    }
+    else {
+        /* Everything signalled has been taken */
+        while (read(reader->fd, buf, sizeof(buf)) > 0) {
+        }
+    }
+    pthread_mutex_unlock(&(reader->mutex));
+    return job;
+}
+
+void gc_reader_release(struct gc_reader_t *reader,
+                       struct gc_reader_job_t *job) {
+    if (reader && job) {
+        --reader->pending;
+        free(job);
+    }
+}
+
+/* Stop the threads once they are done with the lookups in progress.
+ * Lookups not started yet are dropped. */
+int gc_reader_free(struct gc_reader_t *reader) {
+    not_null(reader);
+
+    struct gc_reader_job_t *job = NULL;
+    register size_t i = 0;
+
+    pthread_mutex_lock(&(reader->mutex));
+    reader->stop = 1;
+    pthread_cond_broadcast(&(reader->cond));
+    pthread_mutex_unlock(&(reader->mutex));
+    for (i = 0; i < reader->thread_count; ++i) {
+        pthread_join(reader->threads[i], NULL);
+    }
+
+    while ((job = reader->todo_head) != NULL) {
+        reader->todo_head = job->next;
+        free(job);
+    }
+    while ((job = reader->done_head) != NULL) {
+        reader->done_head = job->next;
+        free(job);
+    }
+    pthread_mutex_destroy(&(reader->mutex));
+    pthread_cond_destroy(&(reader->cond));
+    _close_fds(reader);
+    safefree(reader);
+    return 0;
+}
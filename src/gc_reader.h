@@ -0,0 +1,70 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_READER_H__
+#define __GC_READER_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "gc_db.h"
+
+#define GC_READER_MAX 16        /* Threads at most */
+
+/* A lookup done by a reader thread. The location and the result are
+ * its own, so that the connection it is for may go away meanwhile. */
+struct gc_reader_job_t {
+    struct gc_reader_job_t *next;
+    size_t index;               /* Item and generation it is for */
+    unsigned int gen;
+    int ret;                    /* As of gc_db_read() */
+    struct gc_db_query_t query;
+    const char *wire;           /* Response stored with it, in record */
+    size_t wire_len;
+    char record[GC_DB_RECORD_SIZE];
+    char location[1];
+};
+
+/* Threads doing the database lookups which may wait for the disk. The
+ * event loop learns of finished ones by fd becoming readable. */
+struct gc_reader_t {
+    struct gc_db_t *db;
+    int fd;                     /* Readable when lookups are done */
+    int wr_fd;                  /* Same as fd, unless it is a pipe */
+    size_t thread_count;
+    pthread_t threads[GC_READER_MAX];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;
+    struct gc_reader_job_t *todo_head;
+    struct gc_reader_job_t *todo_tail;
+    struct gc_reader_job_t *done_head;
+    struct gc_reader_job_t *done_tail;
+    size_t pending;             /* Submitted and not taken back */
+};
+
+int gc_reader_init(struct gc_reader_t **reader, struct gc_db_t *db,
+                   size_t threads);
+int gc_reader_submit(struct gc_reader_t *reader, const char *location,
+                     size_t index, unsigned int gen);
+struct gc_reader_job_t *gc_reader_next(struct gc_reader_t *reader);
+void gc_reader_release(struct gc_reader_t *reader,
+                       struct gc_reader_job_t *job);
+int gc_reader_free(struct gc_reader_t *reader);
+
+#endif
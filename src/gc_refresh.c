@@ -0,0 +1,167 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_refresh.h"
+#include "gc_util.h"
+
+#define REFRESH_MAX_INFLIGHT 4
+
+extern int g_is_daemon;
+
+static struct gc_refresh_entry_t *_find(struct gc_refresh_t *refresh,
+                                        const char *location) {
+    unsigned int hash = gc_hash(location);
+    register size_t i = 0;
+
+    for (i = 0; i < refresh->count; ++i) {
+        if (refresh->entries[i].hash == hash
+            && strcmp(refresh->entries[i].location, location) == 0) {
+            return &(refresh->entries[i]);
+        }
+    }
+    return NULL;
+}
+
+int gc_refresh_init(struct gc_refresh_t **refresh) {
+    not_null(refresh);
+
+    *refresh = malloc(sizeof(struct gc_refresh_t));
+    if (*refresh == NULL) {
+        gc_loge("Cannot allocate memory for refresh");
+        return -1;
+    }
+    memset(*refresh, 0, sizeof(struct gc_refresh_t));
+    (*refresh)->max_inflight = REFRESH_MAX_INFLIGHT;
+    return 0;
+}
+
+/* Records from before timestamps were stored have an mtime of 0, and
+ * are stale as soon as a TTL is set. */
+int gc_refresh_is_stale(struct gc_refresh_t *refresh,
+                        const struct gc_db_query_t *query, time_t now) {
+    not_null(refresh);
+    not_null(query);
+
+    unsigned int ttl = query->code == GC_REFRESH_CODE_OK
+        ? refresh->ttl : refresh->fail_ttl;
+
+    return ttl && now - query->mtime >= (time_t) ttl;
+}
+
+/* Schedule a refresh of a stale location, or count one more hit on it
+ * if it is scheduled already. */
+int gc_refresh_add(struct gc_refresh_t *refresh, const char *location,
+                   const struct gc_db_query_t *query) {
+    not_null(refresh);
+    not_null(location);
+    not_null(query);
+
+    struct gc_refresh_entry_t *entry = _find(refresh, location);
+
+    if (entry) {
+        ++entry->hits;
+        return 0;
+    }
+    if (refresh->count >= GC_REFRESH_MAX) {
+        ++refresh->dropped;
+        return -1;
+    }
+    entry = &(refresh->entries[refresh->count]);
+    entry->location = strdup(location);
+    if (entry->location == NULL) {
+        gc_loge("Cannot allocate memory for refresh");
+        return -1;
+    }
+    entry->hash = gc_hash(location);
+    entry->inflight = 0;
+    entry->hits = 1;
+    entry->query = *query;
+    ++refresh->count;
+    return 0;
+}
+
+/* Take the most popular location waiting for a refresh. It stays in
+ * the table until gc_refresh_done(), so hits on it are not scheduled
+ * again meanwhile. */
+int gc_refresh_next(struct gc_refresh_t *refresh, const char **location,
+                    struct gc_db_query_t *query) {
+    not_null(refresh);
+    not_null(location);
+    not_null(query);
+
+    struct gc_refresh_entry_t *best = NULL;
+    register size_t i = 0;
+
+    if (refresh->inflight >= refresh->max_inflight) {
+        return -1;
+    }
+    for (i = 0; i < refresh->count; ++i) {
+        if (!refresh->entries[i].inflight
+            && (!best || refresh->entries[i].hits > best->hits)) {
+            best = &(refresh->entries[i]);
+        }
+    }
+    if (best == NULL) {
+        return -1;
+    }
+    best->inflight = 1;
+    ++refresh->inflight;
+    *location = best->location;
+    *query = best->query;
+    return 0;
+}
+
+/* The refresh of a location is over, successfully or not. */
+void gc_refresh_done(struct gc_refresh_t *refresh, const char *location) {
+    not_null_void(refresh);
+    not_null_void(location);
+
+    struct gc_refresh_entry_t *entry = _find(refresh, location);
+
+    if (entry == NULL) {
+        return;
+    }
+    if (entry->inflight) {
+        --refresh->inflight;
+    }
+    safefree(entry->location);
+    *entry = refresh->entries[--refresh->count];
+}
+
+size_t gc_refresh_pending(struct gc_refresh_t *refresh) {
+    return refresh ? refresh->count - refresh->inflight : 0;
+}
+
+int gc_refresh_free(struct gc_refresh_t *refresh) {
+    not_null(refresh);
+
+    register size_t i = 0;
+
+    for (i = 0; i < refresh->count; ++i) {
+        safefree(refresh->entries[i].location);
+    }
+    safefree(refresh);
+    return 0;
+}
@@ -0,0 +1,61 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_REFRESH_H__
+#define __GC_REFRESH_H__
+
+#include <stddef.h>
+#include <time.h>
+
+#include "gc_db.h"
+
+#define GC_REFRESH_MAX     1024 /* Stale locations waiting for a refresh */
+#define GC_REFRESH_CODE_OK 200  /* Results kept for the success TTL */
+
+struct gc_refresh_entry_t {
+    unsigned int hash;
+    int inflight;               /* Being refreshed upstream */
+    unsigned long hits;         /* Stale hits since it was scheduled */
+    struct gc_db_query_t query; /* The stale result */
+    char *location;
+};
+
+/* Expiry of stored results. A stale result is still served, and its
+ * location is scheduled for a refresh in the background. */
+struct gc_refresh_t {
+    unsigned int ttl;           /* Seconds a success stays fresh, 0: ever */
+    unsigned int fail_ttl;      /* Seconds a failure stays fresh, 0: ever */
+    size_t max_inflight;        /* Refreshes upstream at once */
+    size_t inflight;
+    size_t count;
+    unsigned long dropped;      /* Not scheduled as the table was full */
+    struct gc_refresh_entry_t entries[GC_REFRESH_MAX];
+};
+
+int gc_refresh_init(struct gc_refresh_t **refresh);
+int gc_refresh_is_stale(struct gc_refresh_t *refresh,
+                        const struct gc_db_query_t *query, time_t now);
+int gc_refresh_add(struct gc_refresh_t *refresh, const char *location,
+                   const struct gc_db_query_t *query);
+int gc_refresh_next(struct gc_refresh_t *refresh, const char **location,
+                    struct gc_db_query_t *query);
+void gc_refresh_done(struct gc_refresh_t *refresh, const char *location);
+size_t gc_refresh_pending(struct gc_refresh_t *refresh);
+int gc_refresh_free(struct gc_refresh_t *refresh);
+
+#endif
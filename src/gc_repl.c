@@ -0,0 +1,488 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <config.h>
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define REPL_ZLIB
+#include <zlib.h>
+#endif
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_repl.h"
+#include "gc_stats.h"
+#include "gc_util.h"
+
+#define REPL_POLL_SECS   1      /* Between polls of a replica caught up */
+#define REPL_SCRATCH_SIZE (GC_REPL_BATCH_SIZE + GC_REPL_LINE_MAX)
+#define REPL_CHANGE_FMT  "%.*s\t%d,%d,%.17g,%.17g,%ld\n"
+#define REPL_HEAD_FMT    "%s %lu %llu %llu %lu %lu %lu\n"
+
+#ifdef REPL_ZLIB
+#define REPL_FLAG        'z'    /* Batches may be compressed */
+#else
+#define REPL_FLAG        '-'
+#endif
+
+extern int h_errno;
+extern int g_is_daemon;
+
+/* A batch of changes being put together */
+struct _batch_t {
+    char *buf;
+    size_t len;
+    unsigned long count;
+    const char *after;          /* Location the batch starts after */
+};
+
+int gc_repl_init(struct gc_repl_t **repl) {
+    not_null(repl);
+
+    *repl = malloc(sizeof(struct gc_repl_t));
+    if (*repl == NULL) {
+        gc_loge("Cannot allocate memory for replication");
+        return -1;
+    }
+    memset(*repl, 0, sizeof(struct gc_repl_t));
+    (*repl)->scratch = malloc(REPL_SCRATCH_SIZE);
+    (*repl)->copy_key = strdup("");
+    if ((*repl)->scratch == NULL || (*repl)->copy_key == NULL) {
+        gc_loge("Cannot allocate memory for replication");
+        gc_repl_free(*repl);
+        return -1;
+    }
+    return 0;
+}
+
+/* Keep the last size changes for replicas. */
+int gc_repl_set_log(struct gc_repl_t *repl, size_t size) {
+    not_null(repl);
+
+    repl->log = calloc(size, sizeof(struct gc_repl_change_t));
+    if (repl->log == NULL) {
+        gc_loge("Cannot allocate memory for change log");
+        return -1;
+    }
+    repl->size = size;
+    repl->epoch = ((unsigned long) time(NULL) << 16) ^ getpid();
+    return 0;
+}
+
+/* Follow the primary given as host:port. */
+int gc_repl_set_primary(struct gc_repl_t *repl, const char *name) {
+    not_null(repl);
+    not_null(name);
+
+    struct hostent *host = NULL;
+    char hostname[64];
+    char *colon = NULL;
+
+    snprintf(hostname, sizeof(hostname), "%s", name);
+    colon = strchr(hostname, ':');
+    if (colon == NULL) {
+        gc_loge("Primary '%s' has no port", name);
+        return -1;
+    }
+    *colon = '\0';
+    host = gethostbyname(hostname);
+    if (!host || host->h_addrtype != AF_INET) {
+        gc_loge("Cannot find primary %s: %s", hostname, hstrerror(h_errno));
+        return -1;
+    }
+    memset(&(repl->primary), 0, sizeof(struct sockaddr_in));
+    repl->primary.sin_family = AF_INET;
+    repl->primary.sin_port = htons(atoi(colon + 1));
+    memcpy(&(repl->primary.sin_addr), host->h_addr_list[0],
+           sizeof(in_addr_t));
+    repl->is_replica = 1;
+    repl->copying = 1;
+    return 0;
+}
+
+/* A change which cannot be kept would be missed by the replicas. The
+ * log starts over then, and they copy the store again. */
+void gc_repl_record(struct gc_repl_t *repl, const char *location,
+                    const struct gc_db_query_t *query) {
+    not_null_void(repl);
+    not_null_void(location);
+    not_null_void(query);
+
+    struct gc_repl_change_t *change = NULL;
+    char *copy = NULL;
+
+    if (!repl->size) {
+        return;
+    }
+    copy = strdup(location);
+    if (copy == NULL) {
+        gc_loge("Cannot allocate memory for change. Restarting the log");
+        ++repl->epoch;
+        return;
+    }
+    change = &(repl->log[++repl->seq % repl->size]);
+    safefree(change->location);
+    change->seq = repl->seq;
+    change->location = copy;
+    change->query = *query;
+    gc_stat_set(GC_STAT_REPL_SEQ, repl->seq);
+}
+
+/* Add a change as a line. 1 once the batch is full. */
+static int _append(struct _batch_t *batch, const char *location,
+                   size_t len, const struct gc_db_query_t *query) {
+    if (len + GC_REPL_HEAD_MAX > GC_REPL_LINE_MAX) {
+        return 0;               /* Longer than any query */
+    }
+    batch->len += snprintf(batch->buf + batch->len,
+                           REPL_SCRATCH_SIZE - batch->len, REPL_CHANGE_FMT,
+                           (int) len, location, query->code,
+                           (int) query->accuracy, query->latitude,
+                           query->longitude, (long) query->mtime);
+    ++batch->count;
+    return batch->len >= GC_REPL_BATCH_SIZE;
+}
+
+static int _append_record(void *arg, const char *location, size_t len,
+                          const struct gc_db_query_t *query) {
+    struct _batch_t *batch = arg;
+
+    if (len == strlen(batch->after)
+        && memcmp(location, batch->after, len) == 0) {
+        return 0;
+    }
+    return _append(batch, location, len, query);
+}
+
+/* Answer "@sync <epoch> <seq> <flag>" with the changes after seq, or
+ * "@snapshot <flag> [<location>]" with the records after location.
+ * The answer is a header line, then the changes as lines, compressed
+ * if the flag is 'z'. Its length, or -1 if the command is broken. */
+ssize_t gc_repl_serve(struct gc_repl_t *repl, struct gc_db_t *db,
+                      const char *command, char *buf, size_t buf_size) {
+    not_null(repl);
+    not_null(db);
+    not_null(command);
+    not_null(buf);
+
+    struct _batch_t batch;
+    const char *kind = "log";
+    unsigned long epoch = 0;
+    unsigned long long seq = 0;
+    unsigned long long oldest = 0;
+    char flag = 0;
+    char head[GC_REPL_HEAD_MAX];
+    size_t head_len = 0;
+    size_t z_len = 0;
+    const char *payload = NULL;
+
+    if (!repl->size || buf_size < GC_REPL_RESPONSE_SIZE) {
+        return -1;
+    }
+    memset(&batch, 0, sizeof(struct _batch_t));
+    batch.buf = repl->scratch;
+    batch.after = "";
+
+    if (sscanf(command, "@sync %lu %llu %c", &epoch, &seq, &flag) == 3) {
+        oldest = repl->seq > repl->size ? repl->seq - repl->size + 1 : 1;
+        if (epoch != repl->epoch || seq > repl->seq || seq + 1 < oldest) {
+            kind = "gone";
+        }
+        else {
+            while (seq < repl->seq) {
+                ++seq;
+                if (_append(&batch,
+                            repl->log[seq % repl->size].location,
+                            strlen(repl->log[seq % repl->size].location),
+                            &(repl->log[seq % repl->size].query))) {
+                    break;
+                }
+            }
+        }
+    }
+    else if (sscanf(command, "@snapshot %c", &flag) == 1) {
+        kind = "snapshot";
+        seq = repl->seq;
+        if (strlen(command) > sizeof("@snapshot x")) {
+            batch.after = command + sizeof("@snapshot x");
+        }
+        if (gc_db_scan(db, batch.after, _append_record, &batch) != 0) {
+            return -1;
+        }
+    }
+    else {
+        return -1;
+    }
+
+    payload = batch.buf;
+    z_len = 0;
+#ifdef REPL_ZLIB
+    if (flag == 'z' && batch.len) {
+        uLongf dest_len = buf_size - GC_REPL_HEAD_MAX;
+
+        if (compress2((Bytef *) buf + GC_REPL_HEAD_MAX, &dest_len,
+                      (const Bytef *) batch.buf, batch.len, 1) == Z_OK) {
+            payload = buf + GC_REPL_HEAD_MAX;
+            z_len = dest_len;
+        }
+    }
+#endif
+
+    head_len = snprintf(head, sizeof(head), REPL_HEAD_FMT, kind,
+                        repl->epoch, seq, repl->seq, batch.count,
+                        (unsigned long) batch.len, (unsigned long) z_len);
+    memmove(buf + head_len, payload, z_len ? z_len : batch.len);
+    memcpy(buf, head, head_len);
+
+    ++repl->batches;
+    gc_stat_set(GC_STAT_REPL_BATCHES, repl->batches);
+    return head_len + (z_len ? z_len : batch.len);
+}
+
+/* Whether a replica should poll its primary now. */
+int gc_repl_due(struct gc_repl_t *repl, time_t now) {
+    return repl && repl->is_replica && !repl->inflight
+        && now >= repl->next_poll;
+}
+
+/* The next poll of a replica, as a request line. */
+size_t gc_repl_request(struct gc_repl_t *repl, char *buf, size_t buf_size) {
+    not_null(repl);
+    not_null(buf);
+
+    repl->inflight = 1;
+    if (repl->copying) {
+        return snprintf(buf, buf_size, "@snapshot %c %s\n", REPL_FLAG,
+                        repl->copy_key);
+    }
+    return snprintf(buf, buf_size, "@sync %lu %llu %c\n",
+                    repl->primary_epoch, repl->applied, REPL_FLAG);
+}
+
+static void _start_copy(struct gc_repl_t *repl) {
+    repl->copying = 1;
+    repl->copy_key[0] = '\0';
+    repl->copied = 0;
+}
+
+/* Apply the lines of a batch. The last location is left in last. */
+static int _apply_lines(struct gc_db_t *db, char *buf, size_t len,
+                        unsigned long count, char **last) {
+    struct gc_db_query_t query;
+    char *end = buf + len;
+    char *eol = NULL;
+    char *tab = NULL;
+    int accuracy = 0;
+    long mtime = 0;
+
+    while (count && buf < end) {
+        eol = memchr(buf, '\n', end - buf);
+        tab = memchr(buf, '\t', end - buf);
+        if (eol == NULL || tab == NULL || tab > eol) {
+            gc_loge("Broken change from primary");
+            return -1;
+        }
+        *tab = '\0';
+        *eol = '\0';
+        memset(&query, 0, sizeof(struct gc_db_query_t));
+        if (sscanf(tab + 1, "%d,%d,%lf,%lf,%ld", &(query.code), &accuracy,
+                   &(query.latitude), &(query.longitude), &mtime) != 5) {
+            gc_loge("Broken change from primary");
+            return -1;
+        }
+        query.accuracy = (char) accuracy;
+        query.mtime = (time_t) mtime;
+        if (gc_db_put_wire(db, buf, &query, NULL, 0) != 0) {
+            return -1;
+        }
+        *last = buf;
+        buf = eol + 1;
+        --count;
+    }
+    return count ? -1 : 0;
+}
+
+/* Apply the answer of the primary to the last poll. */
+int gc_repl_apply(struct gc_repl_t *repl, struct gc_db_t *db,
+                  char *buf, size_t len) {
+    not_null(repl);
+    not_null(db);
+    not_null(buf);
+
+    char kind[16];
+    unsigned long epoch = 0;
+    unsigned long long seq = 0;
+    unsigned long long head = 0;
+    unsigned long count = 0;
+    unsigned long raw_len = 0;
+    unsigned long z_len = 0;
+    char *eol = memchr(buf, '\n', len);
+    char *payload = NULL;
+    char *last = NULL;
+    char *copy_key = NULL;
+
+    if (eol == NULL) {
+        gc_repl_failed(repl);
+        return -1;
+    }
+    *eol = '\0';
+    payload = eol + 1;
+    if (sscanf(buf, "%15s %lu %llu %llu %lu %lu %lu", kind, &epoch, &seq,
+               &head, &count, &raw_len, &z_len) != 7
+        || (size_t) (payload - buf) + (z_len ? z_len : raw_len) != len
+        || raw_len > REPL_SCRATCH_SIZE) {
+        gc_loge("Broken batch from primary");
+        gc_repl_failed(repl);
+        return -1;
+    }
+    if (z_len) {
+#ifdef REPL_ZLIB
+        uLongf dest_len = REPL_SCRATCH_SIZE;
+
+        if (uncompress((Bytef *) repl->scratch, &dest_len,
+                       (const Bytef *) payload, z_len) != Z_OK
+            || dest_len != raw_len) {
+            gc_loge("Cannot uncompress batch from primary");
+            gc_repl_failed(repl);
+            return -1;
+        }
+        payload = repl->scratch;
+#else
+        gc_repl_failed(repl);
+        return -1;
+#endif
+    }
+
+    repl->inflight = 0;
+    repl->failing = 0;
+    repl->next_poll = 0;
+    repl->primary_seq = head;
+    ++repl->batches;
+
+    if (strcmp(kind, "gone") == 0) {
+        gc_log("Replica is behind the change log of the primary. "
+               "Copying its store");
+        _start_copy(repl);
+    }
+    else if (strcmp(kind, "snapshot") == 0) {
+        if (!repl->copy_key[0]) {
+            /* Changes from the start of the copy are applied after it */
+            repl->primary_epoch = epoch;
+            repl->applied = seq;
+            if (!repl->behind_since) {
+                repl->behind_since = time(NULL);
+            }
+        }
+        else if (epoch != repl->primary_epoch) {
+            _start_copy(repl);
+            return 0;
+        }
+        if (_apply_lines(db, payload, raw_len, count, &last) != 0) {
+            gc_repl_failed(repl);
+            return -1;
+        }
+        repl->copied += count;
+        if (!count) {
+            gc_log("Copied %lu records from the primary", repl->copied);
+            repl->copying = 0;
+        }
+        else if ((copy_key = strdup(last)) != NULL) {
+            safefree(repl->copy_key);
+            repl->copy_key = copy_key;
+        }
+        else {
+            gc_loge("Cannot allocate memory for replication");
+            gc_repl_failed(repl);
+            return -1;
+        }
+    }
+    else if (epoch != repl->primary_epoch) {
+        _start_copy(repl);
+    }
+    else {
+        if (_apply_lines(db, payload, raw_len, count, &last) != 0) {
+            gc_repl_failed(repl);
+            return -1;
+        }
+        repl->applied = seq;
+        if (repl->applied >= repl->primary_seq) {
+            repl->behind_since = 0;
+            repl->next_poll = time(NULL) + REPL_POLL_SECS;
+        }
+        else if (!repl->behind_since) {
+            repl->behind_since = time(NULL);
+        }
+    }
+    gc_repl_stats(repl);
+    return 0;
+}
+
+/* The poll got no answer. Try again a little later. */
+void gc_repl_failed(struct gc_repl_t *repl) {
+    not_null_void(repl);
+
+    if (!repl->failing) {
+        gc_loge("Cannot replicate from the primary");
+    }
+    repl->failing = 1;
+    repl->inflight = 0;
+    repl->next_poll = time(NULL) + REPL_POLL_SECS;
+    if (!repl->behind_since) {
+        repl->behind_since = time(NULL);
+    }
+}
+
+void gc_repl_stats(struct gc_repl_t *repl) {
+    if (repl == NULL) {
+        return;
+    }
+    gc_stat_set(GC_STAT_REPL_BATCHES, repl->batches);
+    if (!repl->is_replica) {
+        gc_stat_set(GC_STAT_REPL_SEQ, repl->seq);
+        return;
+    }
+    gc_stat_set(GC_STAT_REPL_SEQ, repl->applied);
+    gc_stat_set(GC_STAT_REPL_LAG, repl->primary_seq > repl->applied
+                ? repl->primary_seq - repl->applied : 0);
+    gc_stat_set(GC_STAT_REPL_LAG_SEC, repl->behind_since
+                ? time(NULL) - repl->behind_since : 0);
+}
+
+int gc_repl_free(struct gc_repl_t *repl) {
+    not_null(repl);
+
+    register size_t i = 0;
+
+    for (i = 0; i < repl->size; ++i) {
+        safefree(repl->log[i].location);
+    }
+    safefree(repl->log);
+    safefree(repl->scratch);
+    safefree(repl->copy_key);
+    safefree(repl);
+    return 0;
+}
@@ -0,0 +1,83 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_REPL_H__
+#define __GC_REPL_H__
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "gc_db.h"
+
+#define GC_REPL_BATCH_SIZE 65536 /* Bytes of changes in one batch */
+#define GC_REPL_LINE_MAX   (65536 + 128) /* Longest change, as a line */
+#define GC_REPL_HEAD_MAX   128   /* Longest header of a batch */
+/* Largest answer to a replica, as compression may add a little */
+#define GC_REPL_RESPONSE_SIZE \
+    (GC_REPL_HEAD_MAX + GC_REPL_BATCH_SIZE + GC_REPL_LINE_MAX + 1024)
+
+struct gc_repl_change_t {
+    unsigned long long seq;
+    char *location;
+    struct gc_db_query_t query;
+};
+
+/* Replication of stored results. A primary keeps its recent puts in a
+ * change log, which replicas poll in batches. A replica copies the whole
+ * store first, and again whenever it falls behind what the log keeps. */
+struct gc_repl_t {
+    /* Primary */
+    unsigned long epoch;        /* Tells runs of the log apart */
+    unsigned long long seq;     /* Last change recorded */
+    size_t size;                /* Changes kept, 0 if not a primary */
+    struct gc_repl_change_t *log;
+    char *scratch;              /* Batch before compression */
+    unsigned long batches;      /* Batches served or applied */
+    /* Replica */
+    int is_replica;
+    struct sockaddr_in primary;
+    int inflight;               /* A poll is waiting for the primary */
+    int failing;
+    time_t next_poll;
+    int copying;                /* A snapshot is being copied */
+    char *copy_key;             /* Last location copied, or "" */
+    unsigned long copied;
+    unsigned long primary_epoch;
+    unsigned long long primary_seq; /* Last change of the primary seen */
+    unsigned long long applied; /* Last change of the primary applied */
+    time_t behind_since;        /* 0 if caught up */
+};
+
+int gc_repl_init(struct gc_repl_t **repl);
+int gc_repl_set_log(struct gc_repl_t *repl, size_t size);
+int gc_repl_set_primary(struct gc_repl_t *repl, const char *name);
+void gc_repl_record(struct gc_repl_t *repl, const char *location,
+                    const struct gc_db_query_t *query);
+ssize_t gc_repl_serve(struct gc_repl_t *repl, struct gc_db_t *db,
+                      const char *command, char *buf, size_t buf_size);
+int gc_repl_due(struct gc_repl_t *repl, time_t now);
+size_t gc_repl_request(struct gc_repl_t *repl, char *buf, size_t buf_size);
+int gc_repl_apply(struct gc_repl_t *repl, struct gc_db_t *db,
+                  char *buf, size_t len);
+void gc_repl_failed(struct gc_repl_t *repl);
+void gc_repl_stats(struct gc_repl_t *repl);
+int gc_repl_free(struct gc_repl_t *repl);
+
+#endif
@@ -15,52 +15,452 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#define _GNU_SOURCE             /* struct ucred */
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
+#include "gc_debug.h"
 #include "gc_error.h"
 #include "gc_log.h"
 #include "gc_util.h"
 #include "gc_server.h"
 
+#define UDP_RCVBUF (4 * 1024 * 1024)  /* Asked for, the kernel may cap it */
+#define LISTEN_SPEC_SIZE 256
+#define UNIX_PREFIX "unix:"
+
 extern int g_is_daemon;
 
-int gc_server_setup(int port) {
-    int fd = 0;
-    int reuseaddr_on = 1;
+static int _unix_addr(struct sockaddr_un *s_un, const char *path) {
+    memset(s_un, 0, sizeof(struct sockaddr_un));
+    s_un->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(s_un->sun_path)) {
+        gc_loge("Socket path '%s' is too long", path);
+        return -1;
+    }
+    strcpy(s_un->sun_path, path);
+    return 0;
+}
+
+static int _parse_port(const char *str) {
+    char *end = NULL;
+    long port = strtol(str, &end, 10);
+
+    if (end == str || *end != '\0' || port <= 0 || port > 65535) {
+        return -1;
+    }
+    return (int) port;
+}
+
+static int _parse_inet(struct gc_server_listen_t *lsn, char *host) {
+    struct sockaddr_in *s_in = (struct sockaddr_in *) &(lsn->addr);
+    struct sockaddr_in6 *s_in6 = (struct sockaddr_in6 *) &(lsn->addr);
+    char *colon = strrchr(host, ':');
+    size_t len = 0;
+    int port = 0;
+
+    if (colon == NULL) {
+        port = _parse_port(host);
+        host = "";
+    }
+    else {
+        *colon = '\0';
+        port = _parse_port(colon + 1);
+    }
+    if (port < 0) {
+        return -1;
+    }
+
+    if (host[0] == '[') {
+        len = strlen(host);
+        if (len < 2 || host[len - 1] != ']') {
+            return -1;
+        }
+        host[len - 1] = '\0';
+        s_in6->sin6_family = AF_INET6;
+        s_in6->sin6_port = htons(port);
+        if (inet_pton(AF_INET6, host + 1, &(s_in6->sin6_addr)) != 1) {
+            return -1;
+        }
+        lsn->addr_len = sizeof(struct sockaddr_in6);
+        return 0;
+    }
+    s_in->sin_family = AF_INET;
+    s_in->sin_port = htons(port);
+    if (host[0] == '\0' || strcmp(host, "*") == 0) {
+        s_in->sin_addr.s_addr = INADDR_ANY;
+    }
+    else if (inet_pton(AF_INET, host, &(s_in->sin_addr)) != 1) {
+        return -1;
+    }
+    lsn->addr_len = sizeof(struct sockaddr_in);
+    return 0;
+}
+
+static int _parse_option(struct gc_server_listen_t *lsn, char *opt) {
+    char *eq = strchr(opt, '=');
+    int value = 0;
+
+    if (strcmp(opt, "v6only") == 0) {
+        lsn->v6only = 1;
+        return 0;
+    }
+    if (eq == NULL || (value = atoi(eq + 1)) <= 0) {
+        return -1;
+    }
+    *eq = '\0';
+    if (strcmp(opt, "backlog") == 0) {
+        lsn->backlog = value;
+    }
+    else if (strcmp(opt, "rcvbuf") == 0) {
+        lsn->rcvbuf = value;
+    }
+    else if (strcmp(opt, "sndbuf") == 0) {
+        lsn->sndbuf = value;
+    }
+    else if (strcmp(opt, "fastopen") == 0) {
+        lsn->fastopen = value;
+    }
+    else if (strcmp(opt, "defer") == 0) {
+        lsn->defer_sec = value;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
 
-    fd = socket(PF_INET, SOCK_STREAM, 0);
+/* Parse a listener given as "[addr:]port[,option...]", where addr is an
+ * IPv4 address or an IPv6 one in brackets, or as "unix:path[,option...]".
+ * Options are backlog=N, rcvbuf=bytes, sndbuf=bytes, fastopen=N,
+ * defer=secs and v6only. The backlog is left 0 unless given. */
+int gc_server_parse_listen(struct gc_server_listen_t *lsn, const char *spec) {
+    not_null(lsn);
+    not_null(spec);
+
+    char buf[LISTEN_SPEC_SIZE];
+    char *opt = NULL;
+    char *next = NULL;
+    int ret = 0;
+
+    memset(lsn, 0, sizeof(struct gc_server_listen_t));
+    if (strlen(spec) >= sizeof(buf)) {
+        return -1;
+    }
+    strcpy(buf, spec);
+    if ((next = strchr(buf, ',')) != NULL) {
+        *next++ = '\0';
+    }
+
+    if (strncmp(buf, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+        ret = _unix_addr((struct sockaddr_un *) &(lsn->addr),
+                         buf + strlen(UNIX_PREFIX));
+        lsn->addr_len = sizeof(struct sockaddr_un);
+    }
+    else {
+        ret = _parse_inet(lsn, buf);
+    }
+    while (ret == 0 && next != NULL) {
+        opt = next;
+        if ((next = strchr(opt, ',')) != NULL) {
+            *next++ = '\0';
+        }
+        ret = _parse_option(lsn, opt);
+    }
+    return ret;
+}
+
+/* Tuning which the kernel may not have. The listener works without. */
+static void _tune(int fd, int level, int name, int value, const char *what) {
+    if (value && setsockopt(fd, level, name, &value, sizeof(value)) == -1) {
+        gc_loge("Cannot set %s: %m", what);
+    }
+}
+
+int gc_server_listen(const struct gc_server_listen_t *lsn) {
+    not_null(lsn);
+
+    int family = lsn->addr.ss_family;
+    int fd = -1;
+    int on = 1;
+
+    fd = socket(family, SOCK_STREAM, 0);
     if (fd < 0) {
         gc_loge("Cannot open server socket: %m");
         return -1;
     }
+    if (family != AF_UNIX
+        && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+        gc_loge("Cannot set socket options: %m");
+        close(fd);
+        return -1;
+    }
+    if (family == AF_INET6
+        && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &(lsn->v6only),
+                      sizeof(lsn->v6only)) == -1) {
+        gc_loge("Cannot set IPv6 socket options: %m");
+        close(fd);
+        return -1;
+    }
+    /* Accepted sockets take these over from the listener */
+    _tune(fd, SOL_SOCKET, SO_RCVBUF, lsn->rcvbuf, "receive buffer");
+    _tune(fd, SOL_SOCKET, SO_SNDBUF, lsn->sndbuf, "send buffer");
+    if (gc_set_nonblock(fd) != 0) {
+        gc_loge("Cannot set socket to nonblocking mode: %m");
+        close(fd);
+        return -1;
+    }
+    /* A socket file left by an earlier process is replaced */
+    if (family == AF_UNIX
+        && unlink(((const struct sockaddr_un *) &(lsn->addr))->sun_path) != 0
+        && errno != ENOENT) {
+        gc_loge("Cannot remove socket file: %m");
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (const struct sockaddr *) &(lsn->addr), lsn->addr_len) < 0) {
+        gc_loge("Cannot bind socket: %m");
+        close(fd);
+        return -1;
+    }
+    if (family != AF_UNIX) {
+        _tune(fd, IPPROTO_TCP, TCP_FASTOPEN, lsn->fastopen, "TCP Fast Open");
+        _tune(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, lsn->defer_sec,
+              "deferred accept");
+    }
+    if (listen(fd, lsn->backlog) < 0) {
+        gc_loge("Cannot listen to connections: %m");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Listener on port of all IPv4 addresses */
+int gc_server_setup(int port, int backlog) {
+    struct gc_server_listen_t lsn;
+    struct sockaddr_in *s_in = (struct sockaddr_in *) &(lsn.addr);
 
+    memset(&lsn, 0, sizeof(lsn));
+    s_in->sin_family = AF_INET;
+    s_in->sin_port = htons(port);
+    s_in->sin_addr.s_addr = INADDR_ANY;
+    lsn.addr_len = sizeof(struct sockaddr_in);
+    lsn.backlog = backlog;
+    return gc_server_listen(&lsn);
+}
+
+/* Datagram socket on the same port. Bursts of datagrams wait in the
+ * receive buffer until the loop reads them, so it is made large. */
+int gc_server_setup_udp(int port) {
+    int fd = 0;
+    int rcvbuf = UDP_RCVBUF;
     struct sockaddr_in s_in;
+
+    fd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        gc_loge("Cannot open datagram socket: %m");
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                   sizeof(rcvbuf)) == -1) {
+        gc_loge("Cannot set datagram receive buffer: %m");
+    }
+    if (gc_set_nonblock(fd) != 0) {
+        gc_loge("Cannot set socket to nonblocking mode: %m");
+        close(fd);
+        return -1;
+    }
+
     memset(&s_in, 0, sizeof(s_in));
     s_in.sin_family = AF_INET;
     s_in.sin_port = htons(port);
     s_in.sin_addr.s_addr = INADDR_ANY;
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_on,
-                   sizeof(reuseaddr_on)) == -1) {
-        gc_loge("Cannot set socket options: %m");
+    if (bind(fd, (struct sockaddr *) &s_in, sizeof(s_in)) < 0) {
+        gc_loge("Cannot bind datagram socket: %m");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Socket a restarted process asks for the listener on. A file left
+ * at path by an earlier process is replaced. */
+int gc_server_handoff_setup(const char *path) {
+    not_null(path);
+
+    int fd = -1;
+    int ret = 0;
+    mode_t mask = 0;
+    struct sockaddr_un s_un;
+
+    if (_unix_addr(&s_un, path) != 0) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        gc_loge("Cannot open handoff socket: %m");
+        return -1;
+    }
+    if (unlink(path) != 0 && errno != ENOENT) {
+        gc_loge("Cannot remove '%s': %m", path);
+        close(fd);
+        return -1;
+    }
+    /* The daemon runs under umask(0); only our own user may connect */
+    mask = umask(0077);
+    ret = bind(fd, (struct sockaddr *) &s_un, sizeof(s_un));
+    umask(mask);
+    if (ret < 0 || chmod(path, S_IRUSR | S_IWUSR) != 0
+        || listen(fd, 1) < 0) {
+        gc_loge("Cannot listen on handoff socket '%s': %m", path);
+        close(fd);
         return -1;
     }
     if (gc_set_nonblock(fd) != 0) {
-        gc_loge("Cannot set socket to nonblocking mode: %m");
+        close(fd);
         return -1;
     }
-    if (bind(fd, (struct sockaddr *) &s_in, sizeof(s_in)) < 0) {
-        gc_loge("Cannot bind socket: %m");
+    return fd;
+}
+
+int gc_server_handoff_accept(int fd) {
+    int peer = -1;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    peer = accept(fd, NULL, NULL);
+    if (peer < 0) {
         return -1;
     }
-    if (listen(fd, 20) < 0) {
-        gc_loge("Cannot listen to connections: %m");
+    if (getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        gc_loge("Cannot get handoff peer credentials: %m");
+        close(peer);
+        return -1;
+    }
+    if (cred.uid != geteuid()) {
+        gc_loge("Handoff from uid %lu, pid %ld is refused",
+                (unsigned long) cred.uid, (long) cred.pid);
+        close(peer);
         return -1;
     }
+    return peer;
+}
+
+/* Connect to the process to take over from. -1 when there is none. */
+int gc_server_handoff_connect(const char *path) {
+    not_null(path);
 
+    int fd = -1;
+    struct sockaddr_un s_un;
+
+    if (_unix_addr(&s_un, path) != 0) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        gc_loge("Cannot open handoff socket: %m");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &s_un, sizeof(s_un)) < 0) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            gc_loge("Cannot connect to handoff socket '%s': %m", path);
+        }
+        close(fd);
+        return -1;
+    }
     return fd;
 }
 
+/* Pass fd to the process at the other end of sock. A negative fd
+ * tells it there is none to pass. */
+int gc_server_send_fd(int sock, int fd) {
+    char byte = fd < 0 ? 'N' : 'L';
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg = NULL;
+
+    memset(control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1) {
+        gc_loge("Cannot pass the listener: %m");
+        return -1;
+    }
+    return 0;
+}
+
+/* Wait at most timeout seconds for the fd passed over sock */
+int gc_server_recv_fd(int sock, unsigned int timeout) {
+    int fd = -1;
+    char byte = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg = NULL;
+    struct timeval tv;
+    ssize_t ret = 0;
+
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
+        gc_loge("Cannot set handoff timeout: %m");
+        return -1;
+    }
+
+    memset(control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ret = recvmsg(sock, &msg, 0);
+    if (ret == 0) {
+        return -1;              /* Nothing more is passed */
+    }
+    if (ret != 1) {
+        gc_loge("Cannot receive the listener: %m");
+        return -1;
+    }
+    if (byte == 'N') {
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+        || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        gc_loge("No listener in the handoff message");
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
@@ -18,7 +18,32 @@
 #ifndef __GC_SERVER_H__
 #define __GC_SERVER_H__
 
-int gc_server_setup(int port);
+#include <sys/socket.h>
+
+#define GC_SERVER_LISTEN_MAX 8  /* Listeners of one process */
+
+/* A stream socket to listen on and how it is tuned. A 0 leaves the
+ * setting as the kernel has it. */
+struct gc_server_listen_t {
+    struct sockaddr_storage addr; /* IPv4, IPv6 or Unix domain */
+    socklen_t addr_len;
+    int backlog;
+    int rcvbuf;                 /* Buffer sizes of accepted sockets */
+    int sndbuf;
+    int fastopen;               /* Pending TCP Fast Open requests */
+    int defer_sec;              /* Accept once data is in, or after this */
+    int v6only;                 /* IPv6 only, not dual-stack */
+};
+
+int gc_server_parse_listen(struct gc_server_listen_t *lsn, const char *spec);
+int gc_server_listen(const struct gc_server_listen_t *lsn);
+int gc_server_setup(int port, int backlog);
+int gc_server_setup_udp(int port);
+int gc_server_handoff_setup(const char *path);
+int gc_server_handoff_accept(int fd);
+int gc_server_handoff_connect(const char *path);
+int gc_server_send_fd(int sock, int fd);
+int gc_server_recv_fd(int sock, unsigned int timeout);
 
 #endif
 
@@ -0,0 +1,347 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_shm.h"
+#include "gc_util.h"
+
+#define SHM_MAGIC       "gcshm"
+#define SHM_VERSION     3
+#define SHM_WAYS        8       /* Slots a location may be put in */
+
+/* Start of the segment. Everything the layout depends on is in it and
+ * covered by the checksum, so that a segment made by another build or
+ * with another size is rebuilt instead of being misread. */
+struct gc_shm_header_t {
+    char magic[8];
+    unsigned int version;
+    unsigned int header_size;
+    unsigned int slot_size;
+    unsigned int query_size;    /* Layout of struct gc_db_query_t */
+    unsigned int ways;
+    unsigned int pad;
+    unsigned long long slots_offset;
+    unsigned long long slot_count;
+    unsigned int checksum;      /* Of the fields above */
+};
+
+/* A slot is written under its sequence number, which is odd meanwhile.
+ * Readers copy it out and check that the number has not moved. A slot
+ * left odd by a writer which died is taken over by the next one. The
+ * number shares a word with the pid of the writer, so that both change
+ * with one compare-and-swap and no two processes take a slot over. */
+struct gc_shm_slot_t {
+    unsigned long long seq;     /* Writer pid, then sequence number */
+    unsigned int hash;
+    unsigned int used;          /* When it was last put or hit */
+    unsigned short location_len; /* 0 for an empty slot */
+    unsigned short wire_len;
+    struct gc_db_query_t query;
+    char data[1];               /* Location, then the response bytes */
+};
+
+#define SHM_DATA_SIZE                                                   \
+    (GC_SHM_SLOT_SIZE - offsetof(struct gc_shm_slot_t, data))
+
+#define SHM_SEQ(word)       ((unsigned int) (word))
+#define SHM_WRITER(word)    ((pid_t) ((word) >> 32))
+#define SHM_WORD(seq, pid)                                              \
+    (((unsigned long long) (unsigned int) (pid) << 32) | (unsigned int) (seq))
+
+extern int g_is_daemon;
+
+static unsigned int _checksum(const struct gc_shm_header_t *header) {
+    return gc_hash_len((const char *) header,
+                       offsetof(struct gc_shm_header_t, checksum));
+}
+
+static struct gc_shm_slot_t *_slot(struct gc_shm_t *shm, size_t i) {
+    return (struct gc_shm_slot_t *) (shm->slots + i * GC_SHM_SLOT_SIZE);
+}
+
+static void _make_header(struct gc_shm_header_t *header, size_t slot_count) {
+    memset(header, 0, sizeof(struct gc_shm_header_t));
+    memcpy(header->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+    header->version = SHM_VERSION;
+    header->header_size = sizeof(struct gc_shm_header_t);
+    header->slot_size = GC_SHM_SLOT_SIZE;
+    header->query_size = sizeof(struct gc_db_query_t);
+    header->ways = SHM_WAYS;
+    header->slots_offset = GC_SHM_SLOT_SIZE; /* Slots stay aligned */
+    header->slot_count = slot_count;
+    header->checksum = _checksum(header);
+}
+
+/* Map the segment at fd, or build it when it is new. Returns 1 if an
+ * existing segment does not have the layout wanted. */
+static int _map(struct gc_shm_t *shm, int fd, size_t slot_count) {
+    struct gc_shm_header_t wanted;
+    struct stat st;
+    void *base = NULL;
+
+    _make_header(&wanted, slot_count);
+    shm->map_size = wanted.slots_offset + slot_count * GC_SHM_SLOT_SIZE;
+
+    if (fstat(fd, &st) != 0) {
+        gc_loge("Cannot stat shared memory '%s': %m", shm->name);
+        return -1;
+    }
+    if (st.st_size && (size_t) st.st_size != shm->map_size) {
+        return 1;
+    }
+    if (!st.st_size && ftruncate(fd, shm->map_size) != 0) {
+        gc_loge("Cannot size shared memory '%s': %m", shm->name);
+        return -1;
+    }
+    base = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+    if (base == MAP_FAILED) {
+        gc_loge("Cannot map shared memory '%s': %m", shm->name);
+        return -1;
+    }
+    shm->header = base;
+    if (!st.st_size) {
+        /* New pages are zero, which is an empty slot */
+        memcpy(shm->header, &wanted, sizeof(struct gc_shm_header_t));
+        gc_log("Shared memory '%s' is built for %lu entries", shm->name,
+               (unsigned long) slot_count);
+    }
+    else if (memcmp(shm->header, &wanted,
+                    offsetof(struct gc_shm_header_t, checksum)) != 0
+             || _checksum(shm->header) != shm->header->checksum) {
+        munmap(base, shm->map_size);
+        shm->header = NULL;
+        return 1;
+    }
+    else {
+        gc_log("Shared memory '%s' is attached", shm->name);
+    }
+    shm->slots = (char *) base + shm->header->slots_offset;
+    shm->set_count = slot_count / SHM_WAYS;
+    return 0;
+}
+
+/* Attach to the segment called name, e.g. "/geocache", building it if
+ * there is none or it is not usable. Processes attached to a segment
+ * which is rebuilt keep theirs until they go away. */
+int gc_shm_attach(struct gc_shm_t **shm, const char *name, size_t entries) {
+    not_null(shm);
+    not_null(name);
+
+    size_t sets = 1;
+    int fd = -1;
+    int ret = 0;
+    int tries = 0;
+
+    while (sets * SHM_WAYS < entries) {
+        sets <<= 1;
+    }
+
+    *shm = malloc(sizeof(struct gc_shm_t));
+    if (*shm == NULL) {
+        gc_loge("Cannot allocate memory for shared memory");
+        return -1;
+    }
+    memset(*shm, 0, sizeof(struct gc_shm_t));
+    snprintf((*shm)->name, sizeof((*shm)->name), "%s", name);
+
+    for (tries = 0; tries < 2; ++tries) {
+        fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            gc_loge("Cannot open shared memory '%s': %m", name);
+            safefree(*shm);
+            return -1;
+        }
+        /* One process builds a new segment while the others wait */
+        if (flock(fd, LOCK_EX) != 0) {
+            gc_loge("Cannot lock shared memory '%s': %m", name);
+            ret = -1;
+        }
+        else {
+            ret = _map(*shm, fd, sets * SHM_WAYS);
+        }
+        if (ret == 1) {
+            gc_log("Shared memory '%s' has another layout. Rebuilding",
+                   name);
+            shm_unlink(name);
+        }
+        /* The mapping keeps the file open, and with it the lock */
+        flock(fd, LOCK_UN);
+        close(fd);
+        if (ret != 1) {
+            break;
+        }
+    }
+    if (ret != 0) {
+        gc_loge("Cannot attach shared memory '%s'", name);
+        safefree(*shm);
+        return -1;
+    }
+    return 0;
+}
+
+/* Copy the entry for location out. A slot being written counts as a
+ * miss. */
+int gc_shm_get(struct gc_shm_t *shm, const char *location,
+               struct gc_db_query_t *query,
+               char *wire, size_t wire_size, size_t *wire_len) {
+    not_null(shm);
+    not_null(location);
+    not_null(query);
+
+    size_t location_len = strlen(location);
+    unsigned int hash = gc_hash_len(location, location_len);
+    size_t base = (hash & (shm->set_count - 1)) * SHM_WAYS;
+    struct gc_shm_slot_t *slot = NULL;
+    struct gc_db_query_t found;
+    size_t len = 0;
+    unsigned long long seq = 0;
+    unsigned int now = 0;
+    register size_t i = 0;
+
+    for (i = 0; i < SHM_WAYS; ++i) {
+        slot = _slot(shm, base + i);
+        seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+        if ((SHM_SEQ(seq) & 1) || slot->hash != hash
+            || slot->location_len != location_len
+            || memcmp(slot->data, location, location_len) != 0) {
+            continue;
+        }
+        found = slot->query;
+        len = slot->wire_len;
+        if (location_len + len > SHM_DATA_SIZE || (wire && len > wire_size)) {
+            len = 0;
+        }
+        if (wire && len) {
+            memcpy(wire, slot->data + location_len, len);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) != seq) {
+            return -1;
+        }
+        /* Once a second at most, to keep hits from writing */
+        now = (unsigned int) time(NULL);
+        if (slot->used != now) {
+            slot->used = now;
+        }
+        *query = found;
+        if (wire_len) {
+            *wire_len = len;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/* Whether the process writing under seq has gone away midway. A slot
+ * never written before is not known to be. */
+static int _writer_died(unsigned long long seq) {
+    pid_t pid = SHM_WRITER(seq);
+
+    return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+/* Put an entry in place of the one for the same location, an empty slot
+ * or the one used longest ago. Returns -1 if it does not fit or another
+ * process is writing the slot. */
+int gc_shm_put(struct gc_shm_t *shm, const char *location,
+               const struct gc_db_query_t *query,
+               const char *wire, size_t wire_len) {
+    not_null(shm);
+    not_null(location);
+    not_null(query);
+
+    size_t location_len = strlen(location);
+    unsigned int hash = gc_hash_len(location, location_len);
+    size_t base = (hash & (shm->set_count - 1)) * SHM_WAYS;
+    struct gc_shm_slot_t *slot = NULL;
+    struct gc_shm_slot_t *victim = NULL;
+    unsigned long long seq = 0;
+    unsigned long long taken = 0;
+    pid_t pid = getpid();
+    register size_t i = 0;
+
+    if (!wire) {
+        wire_len = 0;
+    }
+    if (!location_len || location_len + wire_len > SHM_DATA_SIZE) {
+        return -1;
+    }
+    for (i = 0; i < SHM_WAYS; ++i) {
+        slot = _slot(shm, base + i);
+        if (slot->hash == hash && slot->location_len == location_len
+            && memcmp(slot->data, location, location_len) == 0) {
+            victim = slot;
+            break;
+        }
+        if (!victim || (victim->location_len && (!slot->location_len
+                                                 || slot->used
+                                                 < victim->used))) {
+            victim = slot;
+        }
+    }
+
+    /* The number stays odd when a dead writer's slot is taken over */
+    seq = __atomic_load_n(&(victim->seq), __ATOMIC_RELAXED);
+    taken = SHM_WORD(SHM_SEQ(seq) + ((SHM_SEQ(seq) & 1) ? 2 : 1), pid);
+    if (((SHM_SEQ(seq) & 1) && !_writer_died(seq))
+        || !__atomic_compare_exchange_n(&(victim->seq), &seq, taken, 0,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    victim->hash = hash;
+    victim->used = (unsigned int) time(NULL);
+    victim->location_len = location_len;
+    victim->wire_len = wire_len;
+    victim->query = *query;
+    memcpy(victim->data, location, location_len);
+    if (wire_len) {
+        memcpy(victim->data + location_len, wire, wire_len);
+    }
+    __atomic_store_n(&(victim->seq), SHM_WORD(SHM_SEQ(taken) + 1, pid),
+                     __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Detach. The segment is left for the next process. */
+int gc_shm_free(struct gc_shm_t *shm) {
+    not_null(shm);
+
+    if (shm->header && munmap(shm->header, shm->map_size) != 0) {
+        gc_loge("Cannot unmap shared memory '%s': %m", shm->name);
+    }
+    safefree(shm);
+    return 0;
+}
@@ -0,0 +1,51 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_SHM_H__
+#define __GC_SHM_H__
+
+#include <stddef.h>
+
+#include "gc_db.h"
+
+#define GC_SHM_SLOT_SIZE 512    /* Location and response of an entry */
+
+struct gc_shm_header_t;
+
+/* Memory tier in a named shared memory segment. It outlives the process,
+ * so that a restarted one finds the hot locations in it, and may be
+ * shared by several processes on the host. Entries are copied in and
+ * out; nothing in the segment is a pointer. */
+struct gc_shm_t {
+    char name[64];
+    size_t map_size;
+    size_t set_count;           /* Groups of slots a location may use */
+    struct gc_shm_header_t *header;
+    char *slots;
+};
+
+int gc_shm_attach(struct gc_shm_t **shm, const char *name, size_t entries);
+int gc_shm_get(struct gc_shm_t *shm, const char *location,
+               struct gc_db_query_t *query,
+               char *wire, size_t wire_size, size_t *wire_len);
+int gc_shm_put(struct gc_shm_t *shm, const char *location,
+               const struct gc_db_query_t *query,
+               const char *wire, size_t wire_len);
+int gc_shm_free(struct gc_shm_t *shm);
+
+#endif
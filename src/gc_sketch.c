@@ -0,0 +1,146 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_sketch.h"
+#include "gc_util.h"
+
+#define SKETCH_ROWS         4
+#define SKETCH_MAX          255 /* Counters saturate */
+#define SKETCH_DECAY_FACTOR 8   /* Additions per counter between decays */
+
+extern int g_is_daemon;
+
+/* Same mixing as the Bloom filter; rows take h1 + i * h2. */
+static unsigned long long _hash(const char *key, size_t key_len) {
+    register unsigned long long h = 14695981039346656037ULL;
+    register size_t i = 0;
+
+    for (i = 0; i < key_len; ++i) {
+        h ^= (unsigned char) key[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static unsigned char *_counter(struct gc_sketch_t *sketch,
+                               unsigned long long h, size_t row) {
+    unsigned int h1 = (unsigned int) h;
+    unsigned int h2 = (unsigned int) (h >> 32) | 1;
+
+    return &(sketch->counters[row * sketch->width
+                              + ((h1 + row * h2) & (sketch->width - 1))]);
+}
+
+static void _decay(struct gc_sketch_t *sketch) {
+    register size_t i = 0;
+
+    for (i = 0; i < SKETCH_ROWS * sketch->width; ++i) {
+        sketch->counters[i] >>= 1;
+    }
+    sketch->additions = 0;
+}
+
+int gc_sketch_init(struct gc_sketch_t **sketch, size_t width) {
+    not_null(sketch);
+
+    size_t size = 64;
+
+    while (size < width) {
+        size <<= 1;
+    }
+
+    *sketch = malloc(sizeof(struct gc_sketch_t));
+    if (*sketch == NULL) {
+        gc_loge("Cannot allocate memory for sketch");
+        return -1;
+    }
+    (*sketch)->counters = calloc(SKETCH_ROWS * size, 1);
+    if ((*sketch)->counters == NULL) {
+        gc_loge("Cannot allocate memory for sketch counters");
+        safefree(*sketch);
+        return -1;
+    }
+    (*sketch)->width = size;
+    (*sketch)->additions = 0;
+    (*sketch)->decay_at = size * SKETCH_DECAY_FACTOR;
+    return 0;
+}
+
+/* Conservative update: only the smallest counters are raised, which
+ * keeps keys sharing a counter with a popular one from looking popular
+ * themselves. */
+void gc_sketch_add(struct gc_sketch_t *sketch, const char *key,
+                   size_t key_len) {
+    not_null_void(sketch);
+    not_null_void(key);
+
+    unsigned long long h = _hash(key, key_len);
+    unsigned int least = gc_sketch_estimate(sketch, key, key_len);
+    unsigned char *counter = NULL;
+    register size_t i = 0;
+
+    if (least < SKETCH_MAX) {
+        for (i = 0; i < SKETCH_ROWS; ++i) {
+            counter = _counter(sketch, h, i);
+            if (*counter == least) {
+                ++*counter;
+            }
+        }
+    }
+    if (++sketch->additions >= sketch->decay_at) {
+        _decay(sketch);
+    }
+}
+
+unsigned int gc_sketch_estimate(struct gc_sketch_t *sketch, const char *key,
+                                size_t key_len) {
+    unsigned long long h = 0;
+    unsigned int least = SKETCH_MAX;
+    unsigned char *counter = NULL;
+    register size_t i = 0;
+
+    if (sketch == NULL || key == NULL) {
+        return 0;
+    }
+    h = _hash(key, key_len);
+    for (i = 0; i < SKETCH_ROWS; ++i) {
+        counter = _counter(sketch, h, i);
+        if (*counter < least) {
+            least = *counter;
+        }
+    }
+    return least;
+}
+
+int gc_sketch_free(struct gc_sketch_t *sketch) {
+    not_null(sketch);
+
+    safefree(sketch->counters);
+    safefree(sketch);
+    return 0;
+}
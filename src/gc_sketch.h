@@ -0,0 +1,41 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_SKETCH_H__
+#define __GC_SKETCH_H__
+
+#include <stddef.h>
+
+/* Count-min sketch of how often keys are seen. Estimates are never
+ * below the true count since the last decay, and counts are halved
+ * every so many additions, so that old popularity fades. */
+struct gc_sketch_t {
+    size_t width;               /* Counters per row, a power of two */
+    unsigned long additions;    /* Since the last decay */
+    unsigned long decay_at;
+    unsigned char *counters;
+};
+
+int gc_sketch_init(struct gc_sketch_t **sketch, size_t width);
+void gc_sketch_add(struct gc_sketch_t *sketch, const char *key,
+                   size_t key_len);
+unsigned int gc_sketch_estimate(struct gc_sketch_t *sketch, const char *key,
+                                size_t key_len);
+int gc_sketch_free(struct gc_sketch_t *sketch);
+
+#endif
@@ -0,0 +1,158 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_slab.h"
+#include "gc_util.h"
+
+#define SLAB_MIN_SHIFT 6        /* Smallest class is 64 bytes */
+#define SLAB_CLASSES   15       /* Largest class is 1 MB */
+#define SLAB_PAGE_SIZE 65536    /* Buffers are carved from pages */
+
+struct gc_slab_page_t {
+    struct gc_slab_page_t *next;
+    size_t size;                /* Keeps the buffers 16-byte aligned */
+};
+
+struct gc_slab_t {
+    void *free_list[SLAB_CLASSES];
+    struct gc_slab_page_t *pages;
+    size_t in_use;              /* Bytes of buffers handed out */
+    size_t reserved;            /* Bytes of pages */
+};
+
+extern int g_is_daemon;
+
+static int _class_of(size_t size) {
+    int c = 0;
+
+    while (c < SLAB_CLASSES && ((size_t) 1 << (c + SLAB_MIN_SHIFT)) < size) {
+        ++c;
+    }
+    return c;
+}
+
+/* Carve a new page into buffers of class c. */
+static int _refill(struct gc_slab_t *slab, int c) {
+    size_t chunk = (size_t) 1 << (c + SLAB_MIN_SHIFT);
+    size_t page_size = GC_MAX(SLAB_PAGE_SIZE, chunk);
+    struct gc_slab_page_t *page = NULL;
+    char *p = NULL;
+    register size_t i = 0;
+
+    page = malloc(sizeof(struct gc_slab_page_t) + page_size);
+    if (page == NULL) {
+        return -1;
+    }
+    page->size = page_size;
+    page->next = slab->pages;
+    slab->pages = page;
+    slab->reserved += page_size;
+
+    p = (char *) (page + 1);
+    for (i = 0; i + chunk <= page_size; i += chunk) {
+        *(void **) (p + i) = slab->free_list[c];
+        slab->free_list[c] = p + i;
+    }
+    return 0;
+}
+
+int gc_slab_init(struct gc_slab_t **slab) {
+    not_null(slab);
+
+    *slab = malloc(sizeof(struct gc_slab_t));
+    if (*slab == NULL) {
+        gc_loge("Cannot allocate memory for buffer pools");
+        return -1;
+    }
+    memset(*slab, 0, sizeof(struct gc_slab_t));
+    return 0;
+}
+
+/* Get a buffer of at least size bytes. The size of the class, which is
+ * what the buffer has to be put back with, is stored in got_size. */
+void *gc_slab_get(struct gc_slab_t *slab, size_t size, size_t *got_size) {
+    int c = _class_of(size);
+    void *buf = NULL;
+
+    if (c >= SLAB_CLASSES) {
+        return NULL;
+    }
+    if (slab->free_list[c] == NULL && _refill(slab, c) != 0) {
+        return NULL;
+    }
+    buf = slab->free_list[c];
+    slab->free_list[c] = *(void **) buf;
+    *got_size = (size_t) 1 << (c + SLAB_MIN_SHIFT);
+    slab->in_use += *got_size;
+    return buf;
+}
+
+void gc_slab_put(struct gc_slab_t *slab, void *buf, size_t size) {
+    int c = _class_of(size);
+
+    if (buf == NULL || c >= SLAB_CLASSES) {
+        return;
+    }
+    *(void **) buf = slab->free_list[c];
+    slab->free_list[c] = buf;
+    slab->in_use -= (size_t) 1 << (c + SLAB_MIN_SHIFT);
+}
+
+/* Move buf of size bytes, which may be NULL, to a buffer of at least
+ * new_size bytes. The old buffer is put back only on success. */
+void *gc_slab_grow(struct gc_slab_t *slab, void *buf, size_t size,
+                   size_t new_size, size_t *got_size) {
+    void *new_buf = gc_slab_get(slab, new_size, got_size);
+
+    if (new_buf == NULL) {
+        return NULL;
+    }
+    if (buf) {
+        memcpy(new_buf, buf, GC_MIN(size, *got_size));
+        gc_slab_put(slab, buf, size);
+    }
+    return new_buf;
+}
+
+size_t gc_slab_in_use(struct gc_slab_t *slab) {
+    return slab ? slab->in_use : 0;
+}
+
+size_t gc_slab_reserved(struct gc_slab_t *slab) {
+    return slab ? slab->reserved : 0;
+}
+
+int gc_slab_free(struct gc_slab_t *slab) {
+    not_null(slab);
+
+    struct gc_slab_page_t *page = NULL;
+
+    while ((page = slab->pages) != NULL) {
+        slab->pages = page->next;
+        free(page);
+    }
+    safefree(slab);
+    return 0;
+}
@@ -0,0 +1,40 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_SLAB_H__
+#define __GC_SLAB_H__
+
+#include <stddef.h>
+
+/* Size-classed pools of buffers. Sizes are rounded up to a power of two
+ * from 64 bytes to 1 MB. Freed buffers stay in the pool of their class
+ * for reuse. */
+struct gc_slab_t;
+
+int gc_slab_init(struct gc_slab_t **slab);
+void *gc_slab_get(struct gc_slab_t *slab, size_t size, size_t *got_size);
+void gc_slab_put(struct gc_slab_t *slab, void *buf, size_t size);
+void *gc_slab_grow(struct gc_slab_t *slab, void *buf, size_t size,
+                   size_t new_size, size_t *got_size);
+size_t gc_slab_in_use(struct gc_slab_t *slab);
+size_t gc_slab_reserved(struct gc_slab_t *slab);
+int gc_slab_free(struct gc_slab_t *slab);
+
+#endif
+
+
@@ -0,0 +1,103 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "gc_stats.h"
+
+unsigned long g_stats[GC_STAT_COUNT];
+
+static const char *gs_stat_names[GC_STAT_COUNT] = {
+    "requests",
+    "hits",
+    "stale_hits",
+    "misses",
+    "negative_hits",
+    "shm_hits",
+    "frozen_hits",
+    "thread_reads",
+    "udp_requests",
+    "udp_dropped",
+    "http_requests",
+    "http_errors",
+    "upstream_calls",
+    "upstream_errors",
+    "upstream_batches",
+    "batched_misses",
+    "refreshes",
+    "evictions",
+    "compacted_pages",
+    "peer_requests",
+    "peer_fills",
+    "peer_errors",
+    "peer_served",
+    "repl_batches",
+    "busy",
+    "rate_limited",
+    "shed",
+    "deferred",
+    "misses_postponed",
+    "hedges",
+    "hedge_wins",
+    "hedge_delay_msec",
+    "upstream_p99_msec",
+    "upstream_p99_unhedged_msec",
+    "hit_p99_usec",
+    "miss_p99_usec",
+    "connections",
+    "cache_entries",
+    "negative_entries",
+    "db_bytes",
+    "reads_pending",
+    "bloom_skips",
+    "bloom_false_positives",
+    "bloom_fp_ppm",
+    "buffer_bytes",
+    "buffer_pool_bytes",
+    "quota_used",
+    "quota_remaining",
+    "queue_interactive",
+    "queue_bulk",
+    "refresh_pending",
+    "repl_seq",
+    "repl_lag",
+    "repl_lag_sec",
+    "log_dropped"
+};
+
+/* One "name value" line per statistic. Returns the length written. */
+size_t gc_stats_format(char *buf, size_t buf_size) {
+    register size_t i = 0;
+    size_t len = 0;
+    int ret = 0;
+
+    if (!buf || !buf_size) {
+        return 0;
+    }
+    buf[0] = '\0';
+    for (i = 0; i < GC_STAT_COUNT; ++i) {
+        ret = snprintf(buf + len, buf_size - len, "%s %lu\n",
+                       gs_stat_names[i], g_stats[i]);
+        if (ret < 0 || (size_t) ret >= buf_size - len) {
+            break;
+        }
+        len += ret;
+    }
+    return len;
+}
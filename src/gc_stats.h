@@ -0,0 +1,95 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_STATS_H__
+#define __GC_STATS_H__
+
+#include <stddef.h>
+
+/* Counters and gauges reported by the "@stats" command. Keep in sync
+ * with the names in gc_stats.c. */
+enum {
+    GC_STAT_REQUESTS = 0,
+    GC_STAT_HITS,
+    GC_STAT_STALE_HITS,
+    GC_STAT_MISSES,
+    GC_STAT_NEGATIVE_HITS,
+    GC_STAT_SHM_HITS,
+    GC_STAT_FROZEN_HITS,
+    GC_STAT_THREAD_READS,
+    GC_STAT_UDP_REQUESTS,
+    GC_STAT_UDP_DROPPED,
+    GC_STAT_HTTP_REQUESTS,
+    GC_STAT_HTTP_ERRORS,
+    GC_STAT_UPSTREAM_CALLS,
+    GC_STAT_UPSTREAM_ERRORS,
+    GC_STAT_UPSTREAM_BATCHES,
+    GC_STAT_BATCHED_MISSES,
+    GC_STAT_REFRESHES,
+    GC_STAT_EVICTIONS,
+    GC_STAT_COMPACTED_PAGES,
+    GC_STAT_PEER_REQUESTS,
+    GC_STAT_PEER_FILLS,
+    GC_STAT_PEER_ERRORS,
+    GC_STAT_PEER_SERVED,
+    GC_STAT_REPL_BATCHES,
+    GC_STAT_BUSY,
+    GC_STAT_RATE_LIMITED,
+    GC_STAT_SHED,
+    GC_STAT_DEFERRED,
+    GC_STAT_MISSES_POSTPONED,
+    GC_STAT_HEDGES,
+    GC_STAT_HEDGE_WINS,
+    GC_STAT_HEDGE_DELAY_MSEC,
+    GC_STAT_UPSTREAM_P99_MSEC,
+    GC_STAT_UPSTREAM_P99_UNHEDGED_MSEC,
+    GC_STAT_HIT_P99_USEC,
+    GC_STAT_MISS_P99_USEC,
+    GC_STAT_CONNECTIONS,
+    GC_STAT_CACHE_ENTRIES,
+    GC_STAT_NEGATIVE_ENTRIES,
+    GC_STAT_DB_BYTES,
+    GC_STAT_READS_PENDING,
+    GC_STAT_BLOOM_SKIPS,
+    GC_STAT_BLOOM_FALSE_POSITIVES,
+    GC_STAT_BLOOM_FP_PPM,
+    GC_STAT_BUFFER_BYTES,
+    GC_STAT_BUFFER_POOL_BYTES,
+    GC_STAT_QUOTA_USED,
+    GC_STAT_QUOTA_REMAINING,
+    GC_STAT_QUEUE_INTERACTIVE,
+    GC_STAT_QUEUE_BULK,
+    GC_STAT_REFRESH_PENDING,
+    GC_STAT_REPL_SEQ,
+    GC_STAT_REPL_LAG,
+    GC_STAT_REPL_LAG_SEC,
+    GC_STAT_LOG_DROPPED,
+    GC_STAT_COUNT
+};
+
+extern unsigned long g_stats[GC_STAT_COUNT];
+
+#define gc_stat_inc(s) (++g_stats[(s)])
+#define gc_stat_set(s, v) (g_stats[(s)] = (v))
+#define gc_stat_add(s, v) (g_stats[(s)] += (v))
+
+size_t gc_stats_format(char *buf, size_t buf_size);
+
+#endif
+
+
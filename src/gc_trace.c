@@ -0,0 +1,198 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_trace.h"
+#include "gc_util.h"
+
+#define TRACE_EVENT_FMT \
+    "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu," \
+    "\"dur\":%llu,\"pid\":1,\"tid\":%lu}"
+
+extern int g_is_daemon;
+
+int g_trace_on = 0;
+
+/* Names of the spans ending at each stage */
+static const char *gs_span_names[GC_TRACE_STAGE_COUNT] = {
+    "accept",
+    "read request",
+    "lookup",
+    "wait upstream",
+    "send",
+    "upstream",
+    "store",
+    "write"
+};
+
+int gc_trace_init(struct gc_trace_t **trace, unsigned long threshold_usec,
+                  size_t size) {
+    not_null(trace);
+
+    if (!size || size > GC_TRACE_MAX) {
+        return -1;
+    }
+    *trace = malloc(sizeof(struct gc_trace_t));
+    if (*trace == NULL) {
+        gc_loge("Cannot allocate memory for tracing");
+        return -1;
+    }
+    (*trace)->records = calloc(size, sizeof(struct gc_trace_record_t));
+    if ((*trace)->records == NULL) {
+        gc_loge("Cannot allocate memory for tracing");
+        safefree(*trace);
+        return -1;
+    }
+    (*trace)->threshold_usec = threshold_usec;
+    (*trace)->size = size;
+    (*trace)->count = 0;
+    g_trace_on = 1;
+    return 0;
+}
+
+/* A request is done with. Unanswered ones end now. */
+void gc_trace_done(struct gc_trace_t *trace, const unsigned long long *usec,
+                   const char *query) {
+    not_null_void(trace);
+    not_null_void(usec);
+
+    struct gc_trace_record_t *record = NULL;
+    unsigned long long end = usec[GC_TRACE_WRITTEN];
+
+    if (!usec[GC_TRACE_PARSED]) {
+        return;
+    }
+    if (!end) {
+        end = gc_now_usec();
+    }
+    if (end - usec[GC_TRACE_PARSED] < trace->threshold_usec) {
+        return;
+    }
+    record = &(trace->records[trace->count++ % trace->size]);
+    memcpy(record->usec, usec, sizeof(record->usec));
+    snprintf(record->query, GC_TRACE_QUERY_SIZE, "%s", query ? query : "");
+}
+
+/* Copy a query into a JSON string. Queries are checked to be URL-safe,
+ * but may hold backslashes. */
+static void _escape(char *buf, size_t buf_size, const char *query) {
+    size_t len = 0;
+
+    for (; *query && len + 2 < buf_size; ++query) {
+        if (*query == '\\' || *query == '"') {
+            buf[len++] = '\\';
+        }
+        else if ((unsigned char) *query < 0x20) {
+            continue;
+        }
+        buf[len++] = *query;
+    }
+    buf[len] = '\0';
+}
+
+/* One event for the whole of a request, named after its query, and one
+ * for each span between the stages it reached, on a thread of its own. */
+static size_t _dump_record(const struct gc_trace_record_t *record,
+                           unsigned long tid, int first,
+                           char *buf, size_t buf_size) {
+    char name[GC_TRACE_QUERY_SIZE * 2];
+    unsigned long long start = 0;
+    unsigned long long end = record->usec[GC_TRACE_WRITTEN];
+    size_t len = 0;
+    int ret = 0;
+    int i = 0;
+
+    for (i = 0; i < GC_TRACE_STAGE_COUNT; ++i) {
+        if (record->usec[i]) {
+            if (!start) {
+                start = record->usec[i];
+            }
+            end = GC_MAX(end, record->usec[i]);
+        }
+    }
+    _escape(name, sizeof(name), record->query);
+    ret = snprintf(buf, buf_size, TRACE_EVENT_FMT, first ? "" : ",\n",
+                   name, record->usec[GC_TRACE_WRITTEN]
+                   ? "request" : "dropped", start, end - start, tid);
+    if (ret < 0 || (size_t) ret >= buf_size) {
+        return 0;
+    }
+    len = ret;
+
+    for (i = 1; i < GC_TRACE_STAGE_COUNT; ++i) {
+        if (!record->usec[i]) {
+            continue;
+        }
+        if (start < record->usec[i] || i == GC_TRACE_PARSED) {
+            ret = snprintf(buf + len, buf_size - len, TRACE_EVENT_FMT,
+                           ",\n", gs_span_names[i], "stage", start,
+                           record->usec[i] - start, tid);
+            if (ret < 0 || (size_t) ret >= buf_size - len) {
+                return 0;
+            }
+            len += ret;
+        }
+        start = record->usec[i];
+    }
+    return len;
+}
+
+/* The records kept, oldest first, as a Chrome trace-event document.
+ * Returns the length written. */
+size_t gc_trace_dump(struct gc_trace_t *trace, char *buf, size_t buf_size) {
+    not_null(trace);
+    not_null(buf);
+
+    size_t kept = GC_MIN(trace->count, trace->size);
+    size_t first = trace->count - kept;
+    size_t len = 0;
+    size_t ret = 0;
+    size_t i = 0;
+
+    if (buf_size < 64) {
+        return 0;
+    }
+    len = snprintf(buf, buf_size, "{\"traceEvents\":[\n");
+    for (i = 0; i < kept; ++i) {
+        ret = _dump_record(&(trace->records[(first + i) % trace->size]),
+                           first + i, i == 0, buf + len,
+                           buf_size - len - 32);
+        if (!ret) {
+            break;
+        }
+        len += ret;
+    }
+    len += snprintf(buf + len, buf_size - len,
+                    "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return len;
+}
+
+int gc_trace_free(struct gc_trace_t *trace) {
+    not_null(trace);
+
+    g_trace_on = 0;
+    safefree(trace->records);
+    safefree(trace);
+    return 0;
+}
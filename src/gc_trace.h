@@ -0,0 +1,74 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_TRACE_H__
+#define __GC_TRACE_H__
+
+#include <stddef.h>
+
+#include "gc_util.h"
+
+#define GC_TRACE_RECORDS      256  /* Default slow requests kept */
+#define GC_TRACE_MAX          512
+#define GC_TRACE_QUERY_SIZE   64   /* Bytes of the query kept */
+/* Room for the trace events of n records */
+#define GC_TRACE_RESPONSE_SIZE(n) ((n) * 1536 + 64)
+
+/* Stages of a request, in the order they are reached. A request which
+ * is answered from memory skips those of upstream. */
+enum gc_trace_stage_t {
+    GC_TRACE_ACCEPT = 0,        /* Connection ready for the request */
+    GC_TRACE_PARSED,            /* Request line complete */
+    GC_TRACE_LOOKUP,            /* Found in a tier, or missed in all */
+    GC_TRACE_OPEN,              /* Connection to upstream or owner */
+    GC_TRACE_FORWARDED,         /* Request written to it */
+    GC_TRACE_ANSWERED,          /* Its answer read */
+    GC_TRACE_STORED,            /* Result put in the database */
+    GC_TRACE_WRITTEN,           /* Response written to the client */
+    GC_TRACE_STAGE_COUNT
+};
+
+struct gc_trace_record_t {
+    unsigned long long usec[GC_TRACE_STAGE_COUNT]; /* 0 if not reached */
+    char query[GC_TRACE_QUERY_SIZE];
+};
+
+/* Flight recorder of the last requests slower than the threshold from
+ * the complete request line to the written response. Requests dropped
+ * before an answer are kept as well. */
+struct gc_trace_t {
+    unsigned long threshold_usec;
+    size_t size;
+    size_t count;               /* Records taken; the last size are kept */
+    struct gc_trace_record_t *records;
+};
+
+extern int g_trace_on;
+
+/* Time of reaching a stage. Tracing off costs one branch. */
+#define gc_trace_mark(usec)                                             \
+    (g_trace_on ? (void) ((usec) = gc_now_usec()) : (void) 0)
+
+int gc_trace_init(struct gc_trace_t **trace, unsigned long threshold_usec,
+                  size_t size);
+void gc_trace_done(struct gc_trace_t *trace, const unsigned long long *usec,
+                   const char *query);
+size_t gc_trace_dump(struct gc_trace_t *trace, char *buf, size_t buf_size);
+int gc_trace_free(struct gc_trace_t *trace);
+
+#endif
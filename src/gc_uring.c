@@ -0,0 +1,494 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <config.h>
+
+#include "gc_debug.h"
+#include "gc_error.h"
+#include "gc_log.h"
+#include "gc_uring.h"
+#include "gc_util.h"
+
+extern int g_is_daemon;
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_BUF_GROUP 1
+
+/* The rings are driven through the raw system calls, so no library
+ * beyond the kernel headers is needed. */
+struct gc_uring_t {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;      /* Next free SQE, published on enter */
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *br; /* Provided buffer ring */
+    size_t br_size;
+    unsigned int br_entries;
+    unsigned short br_tail;
+    char *bufs;
+    size_t buf_size;
+    struct __kernel_timespec ts;
+};
+
+static int _enter(struct gc_uring_t *ring, unsigned int wait_nr) {
+    unsigned int to_submit = ring->sqe_tail - *(ring->sq_tail);
+    int ret = 0;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                  wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            return 0;
+        }
+        gc_loge("Cannot enter io_uring: %m");
+        return -1;
+    }
+    return ret;
+}
+
+static struct io_uring_sqe *_get_sqe(struct gc_uring_t *ring) {
+    struct io_uring_sqe *sqe = NULL;
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        /* Queue is full. Hand what we have to the kernel first. */
+        if (_enter(ring, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head >= ring->sq_entries) {
+            gc_loge("Submission queue is full");
+            return NULL;
+        }
+    }
+    sqe = &(ring->sqes[ring->sqe_tail & *(ring->sq_mask)]);
+    ++ring->sqe_tail;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+int gc_uring_init(struct gc_uring_t **ring, unsigned int entries) {
+    not_null(ring);
+
+    struct io_uring_params p;
+    struct gc_uring_t *r = NULL;
+    unsigned int *sq_array = NULL;
+    register unsigned int i = 0;
+
+    r = malloc(sizeof(struct gc_uring_t));
+    if (r == NULL) {
+        gc_loge("Cannot allocate memory for io_uring");
+        return -1;
+    }
+    memset(r, 0, sizeof(struct gc_uring_t));
+    r->sq_ring = MAP_FAILED;
+    r->cq_ring = MAP_FAILED;
+    r->sqes = MAP_FAILED;
+    r->br = MAP_FAILED;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        gc_loge("Cannot set up io_uring: %m");
+        safefree(r);
+        return -1;
+    }
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_size = p.cq_off.cqes
+        + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        gc_loge("Cannot map submission ring: %m");
+        gc_uring_free(r);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    }
+    else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd,
+                          IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            gc_loge("Cannot map completion ring: %m");
+            gc_uring_free(r);
+            return -1;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        gc_loge("Cannot map submission entries: %m");
+        gc_uring_free(r);
+        return -1;
+    }
+
+    r->sq_head = (unsigned int *) ((char *) r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned int *) ((char *) r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned int *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *(r->sq_tail);
+    r->cq_head = (unsigned int *) ((char *) r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned int *) ((char *) r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned int *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+
+    /* SQE slots are used in ring order, so the index array is fixed. */
+    sq_array = (unsigned int *) ((char *) r->sq_ring + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; ++i) {
+        sq_array[i] = i;
+    }
+
+    *ring = r;
+    return 0;
+}
+
+int gc_uring_setup_buffers(struct gc_uring_t *ring,
+                           unsigned int count, size_t size) {
+    not_null(ring);
+
+    struct io_uring_buf_reg reg;
+    register unsigned int i = 0;
+
+    /* The kernel wants a power of two. */
+    if (!count || (count & (count - 1)) || count > 32768) {
+        return -1;
+    }
+
+    ring->br_size = count * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring->br == MAP_FAILED) {
+        gc_loge("Cannot map buffer ring: %m");
+        return -1;
+    }
+    ring->bufs = malloc(count * size);
+    if (ring->bufs == NULL) {
+        gc_loge("Cannot allocate memory for io_uring buffers");
+        return -1;
+    }
+    ring->br_entries = count;
+    ring->buf_size = size;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) ring->br;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        gc_loge("Cannot register buffer ring: %m");
+        return -1;
+    }
+
+    ring->br_tail = 0;
+    for (i = 0; i < count; ++i) {
+        gc_uring_put_buffer(ring, i);
+    }
+    return 0;
+}
+
+const char *gc_uring_buffer(struct gc_uring_t *ring, int buffer) {
+    return ring->bufs + (size_t) buffer * ring->buf_size;
+}
+
+void gc_uring_put_buffer(struct gc_uring_t *ring, int buffer) {
+    struct io_uring_buf *b
+        = &(ring->br->bufs[ring->br_tail & (ring->br_entries - 1)]);
+
+    b->addr = (unsigned long) (ring->bufs + (size_t) buffer * ring->buf_size);
+    b->len = ring->buf_size;
+    b->bid = buffer;
+    ++ring->br_tail;
+    __atomic_store_n(&(ring->br->tail), ring->br_tail, __ATOMIC_RELEASE);
+}
+
+int gc_uring_accept(struct gc_uring_t *ring, int fd,
+                    unsigned long long data) {
+    struct io_uring_sqe *sqe = _get_sqe(ring);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = data;
+    return 0;
+}
+
+int gc_uring_recv(struct gc_uring_t *ring, int fd, size_t len,
+                  unsigned long long data) {
+    struct io_uring_sqe *sqe = _get_sqe(ring);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = GC_MIN(len, ring->buf_size);
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = data;
+    return 0;
+}
+
+int gc_uring_send(struct gc_uring_t *ring, int fd, const void *buf,
+                  size_t len, int link, unsigned long long data) {
+    struct io_uring_sqe *sqe = _get_sqe(ring);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data = data;
+    return 0;
+}
+
+int gc_uring_connect(struct gc_uring_t *ring, int fd,
+                     const struct sockaddr *addr, socklen_t addr_len,
+                     int link, unsigned long long data) {
+    struct io_uring_sqe *sqe = _get_sqe(ring);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) addr;
+    sqe->off = addr_len;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data = data;
+    return 0;
+}
+
+/* Cancel the request submitted with target, e.g. a multishot accept.
+ * Its completion comes with -ECANCELED and no more flag. */
+int gc_uring_cancel(struct gc_uring_t *ring, unsigned long long target,
+                    unsigned long long data) {
+    struct io_uring_sqe *sqe = _get_sqe(ring);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = data;
+    return 0;
+}
+
+/* Wait once for fd to become readable. */
+int gc_uring_poll(struct gc_uring_t *ring, int fd, unsigned long long data) {
+    struct io_uring_sqe *sqe = _get_sqe(ring);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = data;
+    return 0;
+}
+
+int gc_uring_timeout(struct gc_uring_t *ring, unsigned int msec,
+                     unsigned long long data) {
+    struct io_uring_sqe *sqe = _get_sqe(ring);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+    ring->ts.tv_sec = msec / 1000;
+    ring->ts.tv_nsec = (msec % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long) &(ring->ts);
+    sqe->len = 1;
+    sqe->user_data = data;
+    return 0;
+}
+
+int gc_uring_wait(struct gc_uring_t *ring) {
+    not_null(ring);
+
+    if (*(ring->cq_head) != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        /* Completions are pending. Only submit. */
+        return _enter(ring, 0);
+    }
+    return _enter(ring, 1);
+}
+
+/* Submit without waiting, while completions taken already are left */
+int gc_uring_submit(struct gc_uring_t *ring) {
+    not_null(ring);
+
+    return _enter(ring, 0);
+}
+
+int gc_uring_next(struct gc_uring_t *ring, struct gc_uring_event_t *ev) {
+    unsigned int head = *(ring->cq_head);
+    struct io_uring_cqe *cqe = NULL;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    cqe = &(ring->cqes[head & *(ring->cq_mask)]);
+    ev->data = cqe->user_data;
+    ev->res = cqe->res;
+    ev->more = (cqe->flags & IORING_CQE_F_MORE) ? 1 : 0;
+    ev->buffer = (cqe->flags & IORING_CQE_F_BUFFER)
+        ? (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int gc_uring_free(struct gc_uring_t *ring) {
+    not_null(ring);
+
+    if (ring->br != MAP_FAILED) {
+        munmap(ring->br, ring->br_size);
+    }
+    safefree(ring->bufs);
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0 && close(ring->fd) != 0) {
+        gc_loge("Cannot close io_uring: %m");
+    }
+    safefree(ring);
+    return 0;
+}
+
+#else /* !HAVE_LINUX_IO_URING_H */
+
+int gc_uring_init(struct gc_uring_t **ring, unsigned int entries) {
+    gc_loge("io_uring is not supported on this system");
+    return -1;
+}
+
+int gc_uring_setup_buffers(struct gc_uring_t *ring,
+                           unsigned int count, size_t size) {
+    return -1;
+}
+
+const char *gc_uring_buffer(struct gc_uring_t *ring, int buffer) {
+    return NULL;
+}
+
+void gc_uring_put_buffer(struct gc_uring_t *ring, int buffer) {
+}
+
+int gc_uring_accept(struct gc_uring_t *ring, int fd,
+                    unsigned long long data) {
+    return -1;
+}
+
+int gc_uring_recv(struct gc_uring_t *ring, int fd, size_t len,
+                  unsigned long long data) {
+    return -1;
+}
+
+int gc_uring_send(struct gc_uring_t *ring, int fd, const void *buf,
+                  size_t len, int link, unsigned long long data) {
+    return -1;
+}
+
+int gc_uring_connect(struct gc_uring_t *ring, int fd,
+                     const struct sockaddr *addr, socklen_t addr_len,
+                     int link, unsigned long long data) {
+    return -1;
+}
+
+int gc_uring_timeout(struct gc_uring_t *ring, unsigned int msec,
+                     unsigned long long data) {
+    return -1;
+}
+
+int gc_uring_cancel(struct gc_uring_t *ring, unsigned long long target,
+                    unsigned long long data) {
+    return -1;
+}
+
+int gc_uring_poll(struct gc_uring_t *ring, int fd, unsigned long long data) {
+    return -1;
+}
+
+int gc_uring_wait(struct gc_uring_t *ring) {
+    return -1;
+}
+
+int gc_uring_submit(struct gc_uring_t *ring) {
+    return -1;
+}
+
+int gc_uring_next(struct gc_uring_t *ring, struct gc_uring_event_t *ev) {
+    return -1;
+}
+
+int gc_uring_free(struct gc_uring_t *ring) {
+    return -1;
+}
+
+#endif
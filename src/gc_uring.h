@@ -0,0 +1,62 @@
+/* Copyright (C) 2007 Yung-chung Lin
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __GC_URING_H__
+#define __GC_URING_H__
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+struct gc_uring_t;
+
+struct gc_uring_event_t {
+    unsigned long long data;    /* user data of the submission */
+    int res;                    /* result, -errno on failure */
+    int more;                   /* a multishot request stays armed */
+    int buffer;                 /* id of the selected buffer or -1 */
+};
+
+int gc_uring_init(struct gc_uring_t **ring, unsigned int entries);
+int gc_uring_setup_buffers(struct gc_uring_t *ring,
+                           unsigned int count, size_t size);
+const char *gc_uring_buffer(struct gc_uring_t *ring, int buffer);
+void gc_uring_put_buffer(struct gc_uring_t *ring, int buffer);
+
+int gc_uring_accept(struct gc_uring_t *ring, int fd,
+                    unsigned long long data);
+int gc_uring_recv(struct gc_uring_t *ring, int fd, size_t len,
+                  unsigned long long data);
+int gc_uring_send(struct gc_uring_t *ring, int fd, const void *buf,
+                  size_t len, int link, unsigned long long data);
+int gc_uring_connect(struct gc_uring_t *ring, int fd,
+                     const struct sockaddr *addr, socklen_t addr_len,
+                     int link, unsigned long long data);
+int gc_uring_timeout(struct gc_uring_t *ring, unsigned int msec,
+                     unsigned long long data);
+int gc_uring_cancel(struct gc_uring_t *ring, unsigned long long target,
+                    unsigned long long data);
+int gc_uring_poll(struct gc_uring_t *ring, int fd, unsigned long long data);
+
+int gc_uring_wait(struct gc_uring_t *ring);
+int gc_uring_submit(struct gc_uring_t *ring);
+int gc_uring_next(struct gc_uring_t *ring, struct gc_uring_event_t *ev);
+int gc_uring_free(struct gc_uring_t *ring);
+
+#endif
+
+
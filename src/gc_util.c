@@ -15,10 +15,13 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -50,6 +53,31 @@ size_t gc_chomp(char *buf, size_t buf_size) {
     return buf_size;
 }
 
+int gc_check_query(const char *buf, size_t buf_size) {
+    static const char safe_char[]
+        = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+        "0123456789\\-_.!~*'()%";
+    const size_t safe_char_len = strlen(safe_char);
+    int is_safe = 0;
+    register size_t i = 0;
+    register size_t j = 0;
+
+    for (i = 0; i < buf_size; ++i) {
+        is_safe = 0;
+        for (j = 0; j < safe_char_len; ++j) {
+            if (safe_char[j] == buf[i]) {
+                is_safe = 1;
+                break;
+            }
+        }
+        if (!is_safe) {
+            gc_loge("Non-safe character %d is received", (int) buf[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 int gc_socket_connect(in_addr_t host, int port) {
     int fd = 0;
     int ret = 0;
@@ -108,6 +136,33 @@ size_t gc_uri_get_escaped_size(char *buf, size_t buf_size) {
     return size;
 }
 
+/* Address of the peer of fd: AF_INET also for an IPv4 client of a
+ * dual-stack IPv6 listener, AF_INET6 for a native IPv6 client and
+ * AF_UNIX for a client of a Unix domain socket. */
+int gc_peer_addr(int fd, struct sockaddr_storage *addr) {
+    not_null(addr);
+
+    struct sockaddr_in6 s_in6;
+    struct sockaddr_in *s_in = (struct sockaddr_in *) addr;
+    socklen_t addr_len = sizeof(struct sockaddr_storage);
+
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    if (getpeername(fd, (struct sockaddr *) addr, &addr_len) != 0) {
+        return -1;
+    }
+    if (addr->ss_family != AF_INET6) {
+        return 0;
+    }
+    memcpy(&s_in6, addr, sizeof(s_in6));
+    if (IN6_IS_ADDR_V4MAPPED(&(s_in6.sin6_addr))) {
+        memset(addr, 0, sizeof(struct sockaddr_storage));
+        s_in->sin_family = AF_INET;
+        s_in->sin_port = s_in6.sin6_port;
+        memcpy(&(s_in->sin_addr), s_in6.sin6_addr.s6_addr + 12, 4);
+    }
+    return 0;
+}
+
 size_t gc_get_path_of(const char *filename, char *buf, size_t buf_size) {
     not_null(filename);
 
@@ -130,3 +185,67 @@ size_t gc_get_path_of(const char *filename, char *buf, size_t buf_size) {
         
     return strlen(buf);
 }
+
+/* Monotonic clock in microseconds */
+unsigned long long gc_now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int _compare(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+#define HASH_BASIS 2166136261U
+#define HASH_PRIME 16777619U
+
+unsigned int gc_hash(const char *key) {
+    register unsigned int h = HASH_BASIS;
+
+    while (*key) {
+        h ^= (unsigned char) *key++;
+        h *= HASH_PRIME;
+    }
+    return h;
+}
+
+/* Same for keys which are one however they are spelt */
+unsigned int gc_hash_lower(const char *key) {
+    register unsigned int h = HASH_BASIS;
+
+    while (*key) {
+        h ^= (unsigned char) tolower((unsigned char) *key++);
+        h *= HASH_PRIME;
+    }
+    return h;
+}
+
+unsigned int gc_hash_len(const char *key, size_t len) {
+    register unsigned int h = HASH_BASIS;
+    register size_t i = 0;
+
+    for (i = 0; i < len; ++i) {
+        h ^= (unsigned char) key[i];
+        h *= HASH_PRIME;
+    }
+    return h;
+}
+
+/* The given percentile of samples, 0 without any */
+unsigned int gc_percentile(const unsigned int *samples, size_t count,
+                           unsigned int *scratch, double percentile) {
+    size_t i = 0;
+
+    if (!count) {
+        return 0;
+    }
+    memcpy(scratch, samples, count * sizeof(unsigned int));
+    qsort(scratch, count, sizeof(unsigned int), _compare);
+    i = (size_t) (percentile / 100 * count);
+    return scratch[GC_MIN(i, count - 1)];
+}
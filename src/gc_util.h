@@ -19,9 +19,11 @@
 #define __GC_UTIL_H__
 
 #include <stddef.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 
 #define GC_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define GC_MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define safefree(p) if (p) {     \
         free(p);                 \
@@ -29,9 +31,20 @@
     }
 
 size_t gc_chomp(char *buf, size_t buf_size);
+/* 1 if every byte of a query is URL-safe, 0 if not */
+int gc_check_query(const char *buf, size_t buf_size);
 int gc_socket_connect(in_addr_t host, int port);
 int gc_set_nonblock(int fd);
+int gc_peer_addr(int fd, struct sockaddr_storage *addr);
 size_t gc_get_path_of(const char *filename, char *buf, size_t buf_size);
+unsigned long long gc_now_usec(void);
+/* FNV-1a of a string, of its lower case or of len bytes */
+unsigned int gc_hash(const char *key);
+unsigned int gc_hash_lower(const char *key);
+unsigned int gc_hash_len(const char *key, size_t len);
+/* scratch holds count samples, which are sorted into it */
+unsigned int gc_percentile(const unsigned int *samples, size_t count,
+                           unsigned int *scratch, double percentile);
 
 #endif
 
@@ -0,0 +1,70 @@
+#!/usr/bin/perl
+
+# A stand-in for the geocoding service, for testing and benchmarking.
+# Answers "GET /maps/geo?q=...&output=csv" requests with a CSV line
+# derived from the query. Queries starting with "bad" get code 602.
+# "GET /maps/geo/batch?q=a|b|...&output=csv" is answered with one such
+# line for each query, in order, after a single delay.
+# --slow pct:secs makes pct percent of the answers that much slower, to
+# give the latency a tail.
+
+use strict;
+use Getopt::Long;
+use IO::Socket;
+use Time::HiRes qw(sleep);
+
+my $port = 8080;
+my $workers = 8;
+my $delay = 0;
+my $slow = '';
+
+GetOptions('port=i'    => \$port,
+           'workers=i' => \$workers,
+           'delay=f'   => \$delay,
+           'slow=s'    => \$slow)
+    or die "usage: $0 [--port 8080] [--workers 8] [--delay secs]"
+    . " [--slow pct:secs]\n";
+my ($slow_pct, $slow_delay) = split /:/, $slow;
+
+my $server = IO::Socket::INET->new(LocalAddr => '127.0.0.1',
+                                   LocalPort => $port,
+                                   Proto     => 'tcp',
+                                   ReuseAddr => 1,
+                                   Listen    => 128)
+    or die "Cannot listen on port $port: $!\n";
+
+sub result {
+    my $query = shift;
+    my $sum = unpack('%32C*', $query);
+    my $code = $query =~ m[\Abad] ? 602 : 200;
+    return sprintf "%d,8,%.6f,%.6f\n", $code, $sum % 90 + 0.5, $sum % 180 + 0.25;
+}
+
+sub answer {
+    my $sock = shift;
+    my $line = <$sock>;
+    return if !defined $line;
+
+    my ($query) = $line =~ m[q=([^&\s]*)];
+    $query = '' if !defined $query;
+    sleep($delay) if $delay > 0;
+    sleep($slow_delay) if $slow_pct && rand(100) < $slow_pct;
+
+    my @queries = $line =~ m[\A\S+\s+/maps/geo/batch\?]
+        ? split(/\|/, $query, -1) : ($query);
+    print {$sock} map { result($_) } @queries;
+}
+
+for (1 .. $workers) {
+    my $pid = fork();
+    die "Cannot fork: $!\n" if !defined $pid;
+    next if $pid;
+    while (my $sock = $server->accept()) {
+        answer($sock);
+        $sock->close();
+    }
+    exit 0;
+}
+
+$SIG{INT} = $SIG{TERM} = sub { kill 'TERM', 0; exit 0 };
+1 while wait() != -1;
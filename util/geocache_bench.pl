@@ -0,0 +1,126 @@
+#!/usr/bin/perl
+
+# Load generator for geocache. Each worker sends queries one connection
+# at a time, the way GeoCache::Client does, and reports throughput and
+# latency percentiles. With --udp, the workers send them in datagrams
+# to the port given to geocache with -y instead, one in flight each, so
+# that the two paths can be compared at the same concurrency.
+
+use strict;
+use Getopt::Long;
+use IO::Socket;
+use Time::HiRes qw(time);
+
+my $host = '127.0.0.1';
+my $port = 1732;
+my $workers = 8;
+my $requests = 2000;
+my $keys = 1000;
+my $prefix = 'benchkey';
+my $udp = 0;
+my $udp_timeout = 1;
+
+GetOptions('host=s'     => \$host,
+           'port=i'     => \$port,
+           'workers=i'  => \$workers,
+           'requests=i' => \$requests,
+           'keys=i'     => \$keys,
+           'prefix=s'   => \$prefix,
+           'udp'        => \$udp)
+    or die "usage: $0 [--host h] [--port p] [--workers n]"
+    . " [--requests n] [--keys n] [--prefix s] [--udp]\n";
+
+# An unanswered datagram counts as an error after $udp_timeout seconds.
+# Late answers to earlier datagrams are skipped by their id.
+sub ask_udp {
+    my ($sock, $id, $query) = @_;
+    my $rin = '';
+    my $reply;
+
+    $sock->send("$id $query") or return;
+    vec($rin, fileno($sock), 1) = 1;
+    while (select(my $rout = $rin, undef, undef, $udp_timeout)) {
+        defined $sock->recv($reply, 4096) or return;
+        next if $reply !~ m[\A(\d+) (.*)\z]s || $1 != $id;
+        return $2;
+    }
+    return;
+}
+
+sub run_worker {
+    my $out = shift;
+    my @lat;
+    my $errors = 0;
+    my $dgram;
+
+    if ($udp) {
+        $dgram = IO::Socket::INET->new(PeerHost => $host, PeerPort => $port,
+                                       Proto => 'udp')
+            or die "Cannot open datagram socket: $!\n";
+    }
+    for my $id (1 .. $requests) {
+        my $query = $prefix . int(rand($keys));
+        my $t0 = time();
+        my $result;
+        if ($udp) {
+            $result = ask_udp($dgram, $id, $query);
+        }
+        else {
+            my $sock = IO::Socket::INET->new(PeerHost => $host,
+                                             PeerPort => $port);
+            if (!$sock) {
+                ++$errors;
+                next;
+            }
+            print {$sock} "$query\n\n";
+            $result = <$sock>;
+            $sock->close();
+        }
+        if (!defined $result || $result !~ m[\A\d+,]) {
+            ++$errors;
+            next;
+        }
+        push @lat, time() - $t0;
+    }
+    print {$out} "E $errors\n";
+    print {$out} "$_\n" for @lat;
+    close $out;
+}
+
+my @readers;
+my $t0 = time();
+for (1 .. $workers) {
+    pipe(my $in, my $out) or die "Cannot create pipe: $!\n";
+    my $pid = fork();
+    die "Cannot fork: $!\n" if !defined $pid;
+    if (!$pid) {
+        close $in;
+        run_worker($out);
+        exit 0;
+    }
+    close $out;
+    push @readers, $in;
+}
+
+my @lat;
+my $errors = 0;
+for my $in (@readers) {
+    while (my $line = <$in>) {
+        if ($line =~ m[\AE (\d+)]) {
+            $errors += $1;
+        }
+        else {
+            chomp $line;
+            push @lat, $line;
+        }
+    }
+}
+1 while wait() != -1;
+my $elapsed = time() - $t0;
+
+@lat = sort { $a <=> $b } @lat;
+my $pct = sub { @lat ? $lat[int($_[0] * $#lat)] * 1e6 : 0 };
+printf "requests: %d  errors: %d  elapsed: %.2fs  qps: %.0f\n",
+    scalar(@lat), $errors, $elapsed, @lat / $elapsed;
+printf "latency (us): p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n",
+    $pct->(0.50), $pct->(0.90), $pct->(0.99), $pct->(1);